@@ -0,0 +1,64 @@
+#ifndef CALENDAR
+#define CALENDAR
+
+#include <stdint.h>
+#include "rtc.h"
+
+/*
+ * Epoch32 is Unix seconds, valid from 1970 to 2106. Epoch64 packs the same
+ * seconds in the upper half and a binary fraction of a second in the lower
+ * half, so it sorts and subtracts like a plain integer.
+ */
+typedef uint32_t CAL_Epoch32;
+typedef uint64_t CAL_Epoch64;
+
+#define CAL_EPOCH64(secs, frac)     ((CAL_Epoch64)(secs) << 32 | (uint32_t)(frac))
+#define CAL_EPOCH64_SECS(e)         ((CAL_Epoch32)((e) >> 32))
+#define CAL_EPOCH64_FRAC(e)         ((uint32_t)(e))
+
+#define CAL_LAST_WEEK   5
+
+// Nth weekday of a month, at an hour of local standard time
+typedef struct {
+    uint8_t month;                      // 1 to 12
+    uint8_t week;                       // 1 to 4, or CAL_LAST_WEEK
+    uint8_t weekday;                    // enum DoW
+    uint8_t hour;
+} CAL_Transition;
+
+typedef struct {
+    int16_t offset;                     // Standard time, minutes east of UTC
+    int16_t dstSave;                    // Minutes added during DST, 0 if the zone has none
+    CAL_Transition start;
+    CAL_Transition end;
+} CAL_Zone;
+
+enum CAL_ZoneId {
+    CAL_ZONE_UTC        = 0,
+    CAL_ZONE_AU_EASTERN = 1,            // Sydney, Melbourne, Canberra, Hobart
+    CAL_ZONE_EU_CENTRAL = 2,
+    CAL_ZONE_US_EASTERN = 3,
+    CAL_ZONE_COUNT
+};
+
+/*
+ * A zone's transitions for the last year looked up. Owned by the caller, so
+ * contexts that convert concurrently each keep their own; zero it to start.
+ */
+typedef struct {
+    const CAL_Zone *zone;
+    uint16_t year;
+    CAL_Epoch32 start;
+    CAL_Epoch32 end;
+} CAL_DstCache;
+
+extern const CAL_Zone CAL_zones[CAL_ZONE_COUNT];
+
+int32_t CAL_daysFromCivil(uint16_t year, uint8_t month, uint8_t date);
+void CAL_civilFromDays(int32_t days, ts *ts);
+uint8_t CAL_isDst(const CAL_Zone *zone, CAL_Epoch32 utc, CAL_DstCache *cache);
+CAL_Epoch32 CAL_toEpoch32(const ts *local, const CAL_Zone *zone);
+CAL_Epoch64 CAL_toEpoch64(const ts *local, const CAL_Zone *zone, uint32_t ticksPerSec);
+void CAL_fromEpoch32(CAL_Epoch32 utc, const CAL_Zone *zone, ts *local, CAL_DstCache *cache);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,10 @@
+#ifndef CRC16
+#define CRC16
+
+#include <stdint.h>
+
+#define CRC16_INIT      0xFFFFU
+
+uint16_t CRC16_update(uint16_t crc, const uint8_t *data, uint16_t size);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,57 @@
+#ifndef EENET
+#define EENET
+
+#include <stdint.h>
+
+/*
+ * EEPROM block access over UDP. A datagram carries a batch of operations
+ * which go to the driver as one EEPROM_submit(), so they run in a single
+ * pass sorted by address: neighbouring reads share a burst and neighbouring
+ * writes share page write cycles. Values are little-endian. Tools/eenet.py
+ * is the host side, keep the two in step.
+ *
+ *   Request   tag u16, then per operation op u8, addr u16, len u16, and for
+ *             EENET_WRITE and EENET_VERIFY len bytes of data
+ *   Response  tag u16, status u8, count u8, then per operation in request
+ *             order status u8, and for an EENET_READ that succeeded len bytes
+ *
+ * A batch with any bad operation, or whose response would not fit in one
+ * datagram, is refused whole before the bus is touched. Refusals carry
+ * count 0.
+ */
+#define EENET_PORT_DEFAULT      5050
+#define EENET_MAX_OPS           32          // Operations per datagram
+#define EENET_OP_HEADER         5           // op, addr, len
+#define EENET_HEADER            4           // Response tag, status, count
+
+typedef enum {
+    EENET_READ          = 1,
+    EENET_WRITE         = 2,
+    EENET_VERIFY        = 3                 // Compares the EEPROM against the data sent
+} EENET_Op;
+
+typedef enum {
+    EENET_OK            = 0,
+    EENET_ERR_LENGTH    = 1,                // Batch malformed, empty or over EENET_MAX_OPS
+    EENET_ERR_RANGE     = 2,                // Unknown op, zero length or past the end of the EEPROM
+    EENET_ERR_SPACE     = 3,                // Response would not fit in a datagram
+    EENET_ERR_BUSY      = 4,                // Another batch is running, send again later
+    EENET_ERR_DEVICE    = 5,                // EEPROM stopped acknowledging
+    EENET_MISMATCH      = 6                 // Operation status only, EENET_VERIFY found a difference
+} EENET_Status;
+
+typedef struct {
+    uint32_t batches;                       // Run and answered
+    uint32_t ops;
+    uint32_t refused;                       // Answered with a batch error
+    uint32_t busy;
+    uint32_t noBuffer;                      // Dropped for want of a reply buffer, the client retries
+    uint32_t mismatches;
+    uint32_t deviceErrors;                  // Operations failed by the driver
+} EENET_Stats;
+
+int EENET_init(uint16_t port);
+void EENET_process(void);
+void EENET_getStats(EENET_Stats *stats);
+
+#endif
\ No newline at end of file
@@ -9,7 +9,52 @@
 #define PAGE_NUM        4096
 #define PAGE_SIZE       1               // Counted in bytes
 
-void EEPROM_write(I2C_TypeDef *i2c, uint16_t page, uint8_t *data, uint8_t size);
-void EEPROM_read(I2C_TypeDef *i2c, uint16_t page, uint8_t *data, uint8_t size);
+#define EEPROM_SIZE         (PAGE_NUM * PAGE_SIZE)
+#define EEPROM_WRITE_PAGE   32          // Bytes the device can buffer in one write cycle
+#define EEPROM_TWR_MAX_MS   10          // Give up ACK polling after this long
+
+typedef enum {
+    EEPROM_IDLE     = 0,                // Never submitted
+    EEPROM_PENDING  = 1,                // Queued, not started yet
+    EEPROM_BUSY     = 2,                // Partly transferred or waiting for the write cycle
+    EEPROM_DONE     = 3,
+    EEPROM_ERROR    = 4                 // Device NACKed, never answered, or stopped acknowledging
+} EEPROM_Status;
+
+typedef enum {
+    EEPROM_OP_READ  = 0,
+    EEPROM_OP_WRITE = 1
+} EEPROM_Op;
+
+typedef struct EEPROM_Request EEPROM_Request;
+typedef void (*EEPROM_Callback)(EEPROM_Request *req);
+
+/*
+ * A request is owned by the caller and doubles as the handle. It must stay
+ * valid, and its buffer untouched, until the status is DONE or ERROR.
+ */
+struct EEPROM_Request {
+    EEPROM_Op op;
+    uint16_t addr;
+    uint8_t *data;
+    uint16_t size;
+    EEPROM_Callback callback;           // Optional, called from EEPROM_process()
+    void *context;                      // Free for the caller's use
+
+    // Owned by the driver
+    volatile EEPROM_Status status;
+    uint16_t done;                      // Bytes transferred so far
+    EEPROM_Request *next;
+};
+
+void EEPROM_init(I2C_TypeDef *i2c);
+int EEPROM_submit(EEPROM_Request **reqs, uint8_t count);
+int EEPROM_submitUrgent(EEPROM_Request *req);
+void EEPROM_process(void);
+EEPROM_Status EEPROM_poll(EEPROM_Request *req);
+EEPROM_Status EEPROM_wait(EEPROM_Request *req);
+int EEPROM_write(uint16_t addr, uint8_t *data, uint16_t size);
+int EEPROM_read(uint16_t addr, uint8_t *data, uint16_t size);
+uint8_t EEPROM_isIdle(void);
 
 #endif
\ No newline at end of file
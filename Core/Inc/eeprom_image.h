@@ -0,0 +1,56 @@
+#ifndef EEPROM_IMAGE
+#define EEPROM_IMAGE
+
+/*
+ * Host-only EEPROM simulator. eeprom_image.c provides the I2C_* functions and
+ * HAL_GetTick() on Linux, with a 24C32 behind them backed by an mmap'd image
+ * file, so eeprom.c and anything built on it runs unmodified against a
+ * persistent image. Build it in place of i2c.c, e.g.
+ *
+ *   gcc -DSTM32F439xx -DUSE_HAL_DRIVER <include dirs> eeprom.c eeprom_image.c app.c
+ *
+ * Time is virtual: bus transfers advance it by the bit time at busHz, and
+ * every HAL_GetTick() call advances it by cpuNsPerPoll, so runs are
+ * deterministic for a given seed.
+ */
+
+#include <stdint.h>
+#include "eeprom.h"
+
+typedef struct {
+    uint32_t busHz;             // SCL frequency
+    uint32_t twrMinUs;          // Write cycle time is drawn uniformly from [min, max]
+    uint32_t twrMaxUs;
+    uint32_t nackPpm;           // Chance of a spurious NACK on an ACK poll, parts per million
+    uint32_t cpuNsPerPoll;      // Virtual time charged to each HAL_GetTick() call
+    uint32_t seed;
+} EEPROM_ImageTiming;
+
+typedef enum {
+    EEPROM_FAIL_NONE    = 0,
+    EEPROM_FAIL_TORN    = 1,    // Power is cut while committing the byte: it and the rest of the page are lost
+    EEPROM_FAIL_BITFLIP = 2,    // The byte is committed with one bit flipped
+    EEPROM_FAIL_STUCK   = 3     // The byte keeps its old value
+} EEPROM_FailKind;
+
+typedef struct {
+    uint64_t timeNs;            // Virtual time since the image was opened
+    uint32_t bytesRead;
+    uint32_t bytesWritten;
+    uint32_t writeCycles;
+    uint32_t probes;
+    uint32_t nacks;
+    uint32_t ignored;           // Transfers sent while the device was busy or unpowered
+} EEPROM_ImageStats;
+
+#define EEPROM_IMAGE_TIMING_DEFAULT { 100000, 1500, 5000, 0, 1000, 1 }
+
+int EEPROM_imageOpen(const char *path, const EEPROM_ImageTiming *timing);
+void EEPROM_imageClose(void);
+uint8_t *EEPROM_imageData(void);
+void EEPROM_imageInjectFailure(uint16_t offset, EEPROM_FailKind kind);
+uint8_t EEPROM_imagePowerLost(void);
+void EEPROM_imagePowerOn(void);
+void EEPROM_imageStats(EEPROM_ImageStats *stats);
+
+#endif
\ No newline at end of file
@@ -4,11 +4,16 @@
 #include <stdint.h>
 #include "stm32f439xx.h"
 
+#define I2C_ADDR_SPINS  200000U         // Status reads before an unanswered address is given up, ~10 ms
+
 void I2C_config(I2C_TypeDef *i2c);
 void I2C_start(I2C_TypeDef *i2c);
-void I2C_sendAddress(I2C_TypeDef *i2c, uint8_t addr);
+uint8_t I2C_sendAddress(I2C_TypeDef *i2c, uint8_t addr);
 void I2C_stop(I2C_TypeDef *i2c);
 void I2C_write(I2C_TypeDef *i2c, uint8_t addr, uint8_t *data, uint8_t size);
 void I2C_read(I2C_TypeDef *i2c, uint8_t addr, uint8_t *buf, uint8_t size);
+uint8_t I2C_probe(I2C_TypeDef *i2c, uint8_t addr);
+uint8_t I2C_requestRead(I2C_TypeDef *i2c, uint8_t addr, uint16_t size);
+uint8_t I2C_readByte(I2C_TypeDef *i2c, uint16_t remaining);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,40 @@
+#ifndef IDLE
+#define IDLE
+
+#include <stdint.h>
+
+#define IDLE_STOP_MIN_TICKS     4       // Shorter idles sleep in WFI, STOP exit costs a clock restart
+#define IDLE_MAX_TICKS          1024    // 16 s, keeps the DWT counter extension and timestamps fed
+#define IDLE_NEVER              UINT32_MAX  // From a *_nextPoll(), only an interrupt brings work
+
+typedef struct {
+    uint64_t runCycles;                 // Core running between IDLE_run() calls
+    uint64_t pollCycles;                // WFI with SysTick running, while the EEPROM is busy
+    uint64_t sleepUs;                   // Tickless WFI
+    uint64_t stopUs;                    // STOP mode
+    uint32_t polls;
+    uint32_t sleeps;
+    uint32_t stops;
+    uint32_t earlyWakes;                // Woken before the deadline by another interrupt
+    uint32_t wakeCycles;                // Last wake-to-work latency, including clock restore
+    uint32_t wakeCyclesMax;
+} IDLE_Stats;
+
+/*
+ * Milliseconds left of a period begun at since, for the *_nextPoll()
+ * queries of modules that poll HAL_GetTick() from the main loop
+ */
+static inline uint32_t IDLE_msLeft(uint32_t now, uint32_t since, uint32_t period) {
+    uint32_t elapsed = now - since;
+    return elapsed >= period ? 0 : period - elapsed;
+}
+
+static inline uint32_t IDLE_min(uint32_t a, uint32_t b) {
+    return a < b ? a : b;
+}
+
+void IDLE_run(void);
+void IDLE_allowStop(uint8_t allow);
+void IDLE_getStats(IDLE_Stats *stats);
+
+#endif
\ No newline at end of file
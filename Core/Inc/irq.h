@@ -0,0 +1,39 @@
+#ifndef IRQ
+#define IRQ
+
+#include <stdint.h>
+
+/*
+ * Interrupt masking for modules that also build on the host. IRQ_lock()
+ * returns the previous PRIMASK and IRQ_unlock() puts it back, so a section
+ * inside a caller's own masked section leaves interrupts masked. Define
+ * IRQ_HOST to build without the core intrinsics; the host has no interrupts
+ * to mask.
+ */
+#ifdef IRQ_HOST
+
+static inline uint32_t IRQ_lock(void) {
+    return 0;
+}
+
+static inline void IRQ_unlock(uint32_t primask) {
+    (void)primask;
+}
+
+#else
+
+#include "stm32f439xx.h"
+
+static inline uint32_t IRQ_lock(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    return primask;
+}
+
+static inline void IRQ_unlock(uint32_t primask) {
+    __set_PRIMASK(primask);
+}
+
+#endif
+
+#endif
\ No newline at end of file
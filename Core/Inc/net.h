@@ -0,0 +1,66 @@
+#ifndef NET
+#define NET
+
+#include <stdint.h>
+#include "netif.h"
+
+#define NET_IP(a, b, c, d)      (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+#define NET_IP_DEFAULT          NET_IP(192, 168, 1, 50)
+#define NET_NETMASK_DEFAULT     NET_IP(255, 255, 255, 0)
+#define NET_GATEWAY_DEFAULT     NET_IP(192, 168, 1, 1)
+
+#define NET_ARP_ENTRIES         8
+#define NET_ARP_TIMEOUT_MS      300000U     // Resolved entries are forgotten after this
+#define NET_ARP_RETRY_MS        1000U
+#define NET_ARP_TRIES           3           // Requests sent before a held datagram is dropped
+#define NET_SOCKETS             4
+#define NET_TTL                 64
+
+#define NET_ETH_HEADER          14
+#define NET_IP_HEADER           20          // Sent without options
+#define NET_UDP_HEADER          8
+#define NET_UDP_OFFSET          (NET_ETH_HEADER + NET_IP_HEADER + NET_UDP_HEADER)
+#define NET_UDP_MAX             1472        // Largest payload that needs no fragmenting
+
+// Addresses and ports in host byte order
+typedef struct {
+    uint32_t ip;
+    uint16_t port;
+} NET_Endpoint;
+
+/*
+ * Receives one datagram for a bound port. data points into the received
+ * frame and is only valid until the handler returns.
+ */
+typedef void (*NET_UdpHandler)(const NET_Endpoint *from, uint16_t port, const uint8_t *data, uint16_t size);
+
+typedef struct {
+    uint32_t arpRequests;               // Sent to resolve an address
+    uint32_t arpReplies;                // Sent in answer to a request for ours
+    uint32_t arpFailed;                 // Datagrams dropped after NET_ARP_TRIES unanswered requests
+    uint32_t arpDisplaced;              // Datagrams dropped because another was queued behind the same lookup
+    uint32_t ipReceived;
+    uint32_t ipDropped;                 // Malformed, or not for this host
+    uint32_t ipFragments;               // Not reassembled, dropped
+    uint32_t ipSent;
+    uint32_t icmpEchoes;                // Echo requests answered
+    uint32_t udpReceived;
+    uint32_t udpNoPort;
+    uint32_t udpSent;
+    uint32_t sendFailed;                // No buffer, or refused by the frame layer
+} NET_Stats;
+
+void NET_init(uint32_t ip, uint32_t netmask, uint32_t gateway);
+uint32_t NET_address(void);
+void NET_input(NETIF_Buffer *frame);
+int NET_udpBind(uint16_t port, NET_UdpHandler handler);
+void NET_udpUnbind(uint16_t port);
+uint8_t *NET_udpAlloc(NETIF_Buffer **buffer);
+int NET_udpSend(NETIF_Buffer *buffer, uint16_t srcPort, const NET_Endpoint *to, uint16_t size);
+int NET_udpSendTo(uint16_t srcPort, const NET_Endpoint *to, const void *data, uint16_t size);
+void NET_process(void);
+uint32_t NET_nextPoll(void);
+void NET_getStats(NET_Stats *stats);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,77 @@
+#ifndef NETIF
+#define NETIF
+
+#include <stdint.h>
+#include "pool.h"
+
+#define NETIF_BUF_SIZE      POOL_BUF_SIZE   // heth.Init.RxBuffLen must fit
+#define NETIF_RX_BUDGET     8           // Frames handed up per NETIF_process()
+#define NETIF_FCS_SIZE      4           // Counted in the DMA frame length, stripped before handing up
+
+#define NETIF_PHY_ADDRESS   0           // LAN8742A on the Nucleo-144
+#define NETIF_LINK_POLL_MS  500
+
+#define NETIF_CLOCK_HZ      50000000U   // PTP clock updates, each adding NETIF_CLOCK_INC_NS
+#define NETIF_CLOCK_INC_NS  20U
+#define NETIF_CLOCK_MAX_PPB 500000      // Furthest NETIF_clockAdjust() moves the rate
+#define NETIF_NS_PER_SEC    1000000000LL
+
+/*
+ * Frames live in pool buffers. length is the frame's bytes without the FCS,
+ * and next chains the buffers of a frame too big for one.
+ */
+typedef POOL_Buffer NETIF_Buffer;
+
+typedef struct {
+    uint32_t rxFrames;
+    uint32_t rxBytes;
+    uint32_t rxErrors;                  // Frames the MAC flagged with an error summary
+    uint32_t rxOversize;                // Frames spanning more than one buffer
+    uint32_t rxNoBuffer;                // Descriptors left empty because the pool ran dry
+    uint32_t rxDropped;                 // Frames received with no handler set
+    uint32_t rxStamped;                 // PTP event frames the MAC timestamped
+    uint32_t txFrames;
+    uint32_t txBytes;
+    uint32_t txBusy;                    // Sends refused with every TX descriptor in use
+    uint32_t txStamped;
+    uint32_t dmaErrors;
+    uint32_t linkChanges;
+    uint8_t linkUp;
+    uint8_t speed100;
+    uint8_t fullDuplex;
+} NETIF_Stats;
+
+/*
+ * Receives one frame in place. The handler owns the buffer's reference from
+ * then on and must drop it with NETIF_free() or pass it on to NETIF_send().
+ * POOL_ref() first keeps the frame after sending it.
+ */
+typedef void (*NETIF_RxHandler)(NETIF_Buffer *frame);
+
+void NETIF_init(NETIF_RxHandler handler);
+void NETIF_setRxHandler(NETIF_RxHandler handler);
+NETIF_Buffer *NETIF_alloc(void);
+void NETIF_free(NETIF_Buffer *buffer);
+int NETIF_send(NETIF_Buffer *buffer, uint16_t length);
+const uint8_t *NETIF_macAddress(void);
+uint8_t NETIF_linkUp(void);
+void NETIF_process(void);
+uint32_t NETIF_nextPoll(void);
+void NETIF_getStats(NETIF_Stats *stats);
+
+/*
+ * The MAC's PTP clock, in nanoseconds on the PTP timescale once a master has
+ * set it. Receive timestamps are taken for PTP Sync messages over UDP/IPv4,
+ * and send timestamps for frames marked with NETIF_stampTx(), at the start
+ * of frame on the wire.
+ */
+int NETIF_clockStart(void);
+int64_t NETIF_clockNow(void);
+void NETIF_clockStep(int64_t ns);
+void NETIF_clockAdjust(int32_t ppb);
+void NETIF_stampTx(NETIF_Buffer *buffer);
+int NETIF_txTimestamp(int64_t *ns);
+int NETIF_rxTimestamp(int64_t *ns);
+void NETIF_passMulticast(uint8_t pass);
+
+#endif
\ No newline at end of file
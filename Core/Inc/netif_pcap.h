@@ -0,0 +1,49 @@
+#ifndef NETIF_PCAP
+#define NETIF_PCAP
+
+/*
+ * Host-only frame layer. netif_pcap.c provides the NETIF_* functions on Linux
+ * over a simulated descriptor ring, so net.c and anything built on it runs
+ * unmodified against captured or scripted traffic. Build it in place of
+ * netif.c, e.g.
+ *
+ *   gcc -DSTM32F439xx -DUSE_HAL_DRIVER <include dirs> net.c pool.c netif_pcap.c app.c
+ *
+ * Frames reach the stack only through the ETH_RX_DESC_CNT RX descriptors,
+ * which take buffers from the same fixed pool and are refilled from
+ * NETIF_process(), so pool exhaustion and ring overruns behave as on the
+ * board. Sent frames get their checksums inserted the way the MAC's offload
+ * engine would, are captured, and are handed to an optional peer which can
+ * inject answers for an in-process loopback.
+ *
+ * HAL_GetTick() is provided as a weak millisecond view of a virtual
+ * nanosecond clock, moved by NETIF_pcapAdvance() and by capture timestamps
+ * during a replay. Linking eeprom_image.c as well replaces it with that
+ * simulator's clock. The PTP clock runs from the virtual clock at a rate off
+ * by NETIF_pcapSetDrift(), and stamps Sync messages as they are injected and
+ * marked frames as they are sent.
+ */
+
+#include <stdint.h>
+#include "netif.h"
+
+// Called with each frame the stack sends, after checksum insertion
+typedef void (*NETIF_PcapPeer)(const uint8_t *frame, uint16_t length);
+
+// Called after each replayed frame, to run the stack's main-loop work
+typedef void (*NETIF_PcapStep)(void);
+
+int NETIF_pcapCapture(const char *path);
+void NETIF_pcapClose(void);
+void NETIF_pcapSetPeer(NETIF_PcapPeer peer);
+void NETIF_pcapSetLink(uint8_t up);
+int NETIF_pcapInject(const uint8_t *frame, uint16_t length);
+int NETIF_pcapReplay(const char *path, NETIF_PcapStep step);
+void NETIF_pcapAdvance(uint32_t ms);
+void NETIF_pcapAdvanceNs(uint32_t ns);
+uint64_t NETIF_pcapTime(void);
+void NETIF_pcapSetDrift(int32_t ppb);
+void NETIF_pcapChecksum(uint8_t *frame, uint16_t length);
+int NETIF_pcapVerify(const uint8_t *frame, uint16_t length);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,46 @@
+#ifndef PERSIST
+#define PERSIST
+
+#include <stdint.h>
+#include "eeprom.h"
+
+/*
+ * Fast persistence tier. Small values live in the RTC backup registers and a
+ * larger area in backup SRAM, both surviving reset and, with VBAT, power
+ * loss. EEPROM only sees a full image periodically and on brown-out.
+ */
+#define PERSIST_SLOTS           18      // 32-bit values in RTC->BKP2R..BKP19R
+#define PERSIST_SRAM_SIZE       256     // Bytes of backup SRAM covered by the image
+#define PERSIST_SPILL_MS        60000   // Longest a change waits for EEPROM
+
+#define PERSIST_IMAGE_SIZE      (4 + PERSIST_SLOTS * 4 + PERSIST_SRAM_SIZE + 2)
+#define PERSIST_IMAGE_SPAN      384     // Page aligned room for one image copy
+#define PERSIST_EEPROM_BASE     (EEPROM_SIZE - 2 * PERSIST_IMAGE_SPAN)
+
+typedef enum {
+    PERSIST_FROM_BACKUP = 0,            // Backup domain was intact
+    PERSIST_FROM_EEPROM = 1,            // Backup domain lost, restored from the last spill
+    PERSIST_BLANK       = 2             // Nothing valid anywhere, starting from zero
+} PERSIST_Source;
+
+typedef struct {
+    PERSIST_Source source;
+    uint32_t sequence;                  // Spill count, also picks the newer EEPROM copy
+    uint32_t writes;                    // Updates absorbed by the backup domain
+    uint32_t spills;
+    uint32_t brownouts;
+    uint32_t spillErrors;
+} PERSIST_Stats;
+
+PERSIST_Source PERSIST_init(void);
+uint32_t PERSIST_get(uint8_t slot);
+void PERSIST_set(uint8_t slot, uint32_t value);
+uint32_t PERSIST_increment(uint8_t slot);
+int PERSIST_read(uint16_t offset, void *data, uint16_t size);
+int PERSIST_write(uint16_t offset, const void *data, uint16_t size);
+void PERSIST_process(void);
+uint32_t PERSIST_nextPoll(void);
+void PERSIST_getStats(PERSIST_Stats *stats);
+void PERSIST_brownoutIrq(void);
+
+#endif
\ No newline at end of file
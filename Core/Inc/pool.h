@@ -0,0 +1,37 @@
+#ifndef POOL
+#define POOL
+
+#include <stdint.h>
+
+#define POOL_BUF_SIZE       1536        // Whole Ethernet frame, a multiple of POOL_ALIGN
+#define POOL_BUF_COUNT      12          // RX descriptors, TX descriptors and frames held by the application
+#define POOL_ALIGN          32          // Cache line, and the largest ETH DMA burst
+
+/*
+ * One packet buffer. data is in the .ethbuf section and never moves. A
+ * buffer goes back to the pool when the last reference is released, so it
+ * can be queued in several places at once without copying.
+ */
+typedef struct POOL_Buffer {
+    uint8_t *data;
+    uint16_t length;                    // Owner's use, bytes of data in use
+    uint16_t refs;
+    struct POOL_Buffer *next;           // Owner's use, e.g. later parts of a frame
+} POOL_Buffer;
+
+typedef struct {
+    uint32_t allocs;
+    uint32_t frees;                     // Buffers returned by their last release
+    uint32_t exhausted;                 // Allocations that found the pool empty
+    uint16_t available;                 // Buffers free now
+    uint16_t low;                       // Fewest ever free
+} POOL_Stats;
+
+void POOL_init(void);
+POOL_Buffer *POOL_alloc(void);
+void POOL_ref(POOL_Buffer *buffer);
+void POOL_release(POOL_Buffer *buffer);
+POOL_Buffer *POOL_fromData(const uint8_t *data);
+void POOL_getStats(POOL_Stats *stats);
+
+#endif
\ No newline at end of file
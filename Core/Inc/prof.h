@@ -0,0 +1,71 @@
+#ifndef PROF
+#define PROF
+
+#include <stdint.h>
+
+/*
+ * Named cycle-count probes. Build with PROFILE defined to enable them,
+ * otherwise PROF_BEGIN/PROF_END expand to nothing. Define PROF_HOST as well
+ * to build against a fake counter on the host.
+ */
+#define PROF_PROBES(X)          \
+    X(I2C_START)                \
+    X(I2C_ADDRESS)              \
+    X(I2C_WRITE)                \
+    X(I2C_READ)                 \
+    X(EEPROM_WRITE)             \
+    X(EEPROM_READ)              \
+    X(EEPROM_SUBMIT)            \
+    X(EEPROM_PROCESS)           \
+    X(RTC_SNAPSHOT)             \
+    X(RTC_GET_TIME)             \
+    X(RTC_SET_TIME)             \
+    X(RTC_SHIFT)                \
+    X(RTC_CALIBRATE)
+
+#define PROF_ENUM(name)         PROF_##name,
+
+typedef enum {
+    PROF_PROBES(PROF_ENUM)
+    PROF_COUNT
+} PROF_Probe;
+
+#define PROF_BUCKETS            33      // Bucket n holds durations in [2^(n-1), 2^n)
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint32_t hist[PROF_BUCKETS];
+} PROF_Stats;
+
+#ifdef PROFILE
+
+#ifdef PROF_HOST
+uint32_t PROF_hostCycles(void);
+void PROF_hostAdvance(uint32_t cycles);
+#define PROF_CYCLES()           PROF_hostCycles()
+#else
+#include "stm32f439xx.h"
+#define PROF_CYCLES()           (DWT->CYCCNT)
+#endif
+
+#define PROF_BEGIN(name)        uint32_t prof_##name = PROF_CYCLES()
+#define PROF_END(name)          PROF_record(PROF_##name, PROF_CYCLES() - prof_##name)
+
+void PROF_init(void);
+void PROF_record(PROF_Probe probe, uint32_t cycles);
+void PROF_reset(void);
+const PROF_Stats *PROF_get(PROF_Probe probe);
+const char *PROF_name(PROF_Probe probe);
+void PROF_dump(void);
+
+#else
+
+#define PROF_BEGIN(name)
+#define PROF_END(name)
+
+#endif
+
+#endif
\ No newline at end of file
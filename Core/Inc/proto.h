@@ -0,0 +1,86 @@
+#ifndef PROTO
+#define PROTO
+
+#include <stdint.h>
+
+/*
+ * Binary frames on USART3, sharing the line with shell text. On the wire a
+ * frame is 0x00, COBS(type, seq, payload, CRC16 big-endian), 0x00. Text
+ * never contains 0x00, so the delimiters tell the two apart. Replies carry
+ * the request type with PROTO_REPLY set and the request's seq.
+ * Tools/proto.py is the host side, keep the two in step.
+ */
+#define PROTO_MAX_PAYLOAD       512
+#define PROTO_MAX_FRAME         (2 + PROTO_MAX_PAYLOAD + 2)
+#define PROTO_REPLY             0x80
+#define PROTO_MAX_IOV           12      // Payload pieces per PROTO_send()
+#define PROTO_TRACE_BATCH       32      // Trace records per frame when the request asks for 0
+#define PROTO_EE_WINDOW         4       // EEPROM requests in flight, more get PROTO_ERR_BUSY
+
+typedef enum {
+    PROTO_PING          = 0x01,         // Echoes the payload
+    PROTO_EE_READ       = 0x02,         // addr u16, len u16 -> addr u16, data
+    PROTO_EE_WRITE      = 0x03,         // addr u16, data -> empty
+    PROTO_TRACE_DRAIN   = 0x04,         // batch u16 -> frames of records, ended by an empty one
+    PROTO_COUNTERS      = 0x05,         // -> sections of id u8, len u8, raw struct
+    PROTO_RTC_GET       = 0x06,         // -> PROTO_Time
+    PROTO_RTC_SET       = 0x07,         // PROTO_Time -> empty
+    PROTO_BAUD          = 0x08,         // baud u32 -> error ppm i32, then the switch
+    PROTO_EE_CRC        = 0x09,         // addr u16, len u16 -> CRC16 u16 of the EEPROM contents
+    PROTO_ERROR         = 0x7F          // Reply only, request type u8, error u8
+} PROTO_Type;
+
+typedef enum {
+    PROTO_ERR_TYPE      = 1,            // Unknown message type
+    PROTO_ERR_LENGTH    = 2,            // Payload the wrong size
+    PROTO_ERR_RANGE     = 3,            // Address or value out of range
+    PROTO_ERR_BUSY      = 4,            // All PROTO_EE_WINDOW slots in use
+    PROTO_ERR_DEVICE    = 5             // EEPROM stopped acknowledging
+} PROTO_Error;
+
+// Counter sections, each the raw little-endian struct
+typedef enum {
+    PROTO_SEC_SERIAL    = 1,            // SERIAL_Stats
+    PROTO_SEC_IDLE      = 2,            // IDLE_Stats
+    PROTO_SEC_PERSIST   = 3,            // PERSIST_Stats
+    PROTO_SEC_TRACE     = 4,            // TRACE_Stats, only with TRACE_ENABLE
+    PROTO_SEC_PROTO     = 5             // PROTO_Stats
+} PROTO_Section;
+
+// UTC, as the RTC keeps it
+typedef struct __attribute__((packed)) {
+    uint16_t year;
+    uint8_t month;
+    uint8_t date;
+    uint8_t hours;
+    uint8_t mins;
+    uint8_t secs;
+    uint8_t day;
+    uint16_t subsecs;
+    uint16_t ticksPerSec;               // PREDIV_S + 1, ignored by PROTO_RTC_SET
+} PROTO_Time;
+
+// One piece of a payload, sent straight from where it lives
+typedef struct {
+    const void *data;
+    uint16_t size;
+} PROTO_Iov;
+
+typedef struct {
+    uint32_t frames;                    // Good frames received
+    uint32_t crcErrors;
+    uint32_t overflows;                 // Frames longer than PROTO_MAX_FRAME, dropped
+    uint32_t sent;
+    uint32_t unsent;                    // Sends refused for want of TX room, retried or dropped by the caller
+} PROTO_Stats;
+
+// Receives text between frames, in the pieces it arrived in
+typedef void (*PROTO_TextHandler)(const uint8_t *data, uint16_t size);
+
+void PROTO_init(PROTO_TextHandler text);
+int PROTO_send(uint8_t type, uint8_t seq, const PROTO_Iov *iov, uint8_t count);
+void PROTO_rx(const uint8_t *data, uint16_t size, uint8_t end);
+void PROTO_process(void);
+void PROTO_getStats(PROTO_Stats *stats);
+
+#endif
\ No newline at end of file
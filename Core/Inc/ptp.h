@@ -0,0 +1,63 @@
+#ifndef PTP
+#define PTP
+
+#include <stdint.h>
+#include "net.h"
+
+/*
+ * IEEE 1588-2008 ordinary clock, slave only, over UDP/IPv4 with the
+ * end-to-end delay mechanism. Follows the best master heard on the domain,
+ * steers the MAC's PTP clock onto it by rate, stepping only for large
+ * offsets, and keeps the RTC on UTC from it.
+ */
+#define PTP_EVENT_PORT          319
+#define PTP_GENERAL_PORT        320
+#define PTP_GROUP               NET_IP(224, 0, 1, 129)
+#define PTP_DOMAIN              0
+
+#define PTP_ANNOUNCE_TIMEOUT_MS 6000U       // Master forgotten after this long without an Announce
+#define PTP_DELAY_REQ_MS        1000U       // Least time between Delay_Req messages
+#define PTP_DELAY_FILTER        3           // Path delay follows 1/2^n of each new sample
+#define PTP_STEP_NS             100000      // Offsets beyond this are stepped rather than slewed
+#define PTP_LOCKED_NS           1000        // Offsets within this count as synchronised
+#define PTP_KP                  70          // Servo gains in percent, per second of offset
+#define PTP_KI                  30
+#define PTP_UTC_OFFSET_DEFAULT  37          // TAI - UTC in seconds, when the master does not say
+
+#define PTP_RTC_PERIOD_MS       16000U      // RTC compared with the PTP clock this often when locked
+#define PTP_RTC_WINDOW          16          // Comparisons between RTC rate corrections
+#define PTP_RTC_SHIFT_TICKS     2           // Smaller errors are left to the rate correction
+
+typedef enum {
+    PTP_LISTENING       = 0,                // No master
+    PTP_UNCALIBRATED    = 1,                // Following a master, not yet within PTP_LOCKED_NS
+    PTP_SLAVE           = 2
+} PTP_State;
+
+typedef struct {
+    PTP_State state;
+    uint8_t master[10];                     // Port identity of the master followed
+    int64_t offset;                         // Last offset from the master, ns, ours minus theirs
+    int64_t delay;                          // Filtered mean path delay, ns
+    int32_t ppb;                            // Rate correction on the PTP clock
+    int16_t utcOffset;                      // TAI - UTC in use, s
+    int32_t rtcPpb;                         // Smooth calibration on the RTC
+    int64_t rtcError;                       // Last RTC comparison, ns, RTC minus UTC
+    uint32_t syncs;
+    uint32_t delayReqs;
+    uint32_t delayResps;
+    uint32_t announces;
+    uint32_t masterChanges;
+    uint32_t timeouts;                      // Masters lost to PTP_ANNOUNCE_TIMEOUT_MS
+    uint32_t steps;
+    uint32_t noStamp;                       // Sync or Delay_Req without a hardware timestamp
+    uint32_t rtcSets;
+    uint32_t rtcShifts;
+} PTP_Stats;
+
+int PTP_init(void);
+void PTP_process(void);
+uint32_t PTP_nextPoll(void);
+void PTP_getStats(PTP_Stats *stats);
+
+#endif
\ No newline at end of file
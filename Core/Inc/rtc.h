@@ -6,6 +6,17 @@
 #define RTC_WRITE_PROTECTION_UNLOCK_1 0xCAU
 #define RTC_WRITE_PROTECTION_UNLOCK_2 0x53U
 
+#define RTC_LSE_HZ          32768U
+#define RTC_WAKEUP_HZ       (RTC_LSE_HZ / 16)  // Wakeup timer clocked from RTCCLK/16
+#define RTC_TICK_NS         125000U     // Coarsest sub-second tick RTC_init() accepts
+#define RTC_EXTI_ALARM      (1U << 17)
+#define RTC_EXTI_WAKEUP     (1U << 22)
+
+enum RTC_Alarm {
+    RTC_ALARM_A = 0,
+    RTC_ALARM_B = 1
+};
+
 enum DoW {
     Monday      = 0,
     Tuesday     = 1,
@@ -16,6 +27,10 @@ enum DoW {
     Sunday      = 6
 };
 
+/*
+ * The calendar keeps UTC, with isDst 0. Local time is for display, through
+ * CAL_fromEpoch32() and CAL_zones.
+ */
 typedef struct ts {
     uint8_t secs;
     uint8_t mins;
@@ -25,11 +40,55 @@ typedef struct ts {
     uint16_t year;
     uint8_t day; 
     uint8_t isDst;
+    uint16_t subsecs;   // Sub-second ticks elapsed, out of PREDIV_S + 1
 
 } ts;
 
+/*
+ * ck_spre = LSE / ((asyncDiv + 1) * (syncDiv + 1)) must be 1 Hz. The
+ * sub-second counter ticks at LSE / (asyncDiv + 1), so a small asyncDiv
+ * gives finer timestamps and a large one draws less current.
+ */
+typedef struct RTC_Prescaler {
+    uint8_t asyncDiv;   // PREDIV_A, 0 to 127
+    uint16_t syncDiv;   // PREDIV_S, 0 to 32767
+} RTC_Prescaler;
+
+// Raw registers latched together by RTC_snapshot()
+typedef struct RTC_Snapshot {
+    uint32_t ssr;
+    uint32_t tr;
+    uint32_t dr;
+} RTC_Snapshot;
+
+/*
+ * Packed time for log records, years 2000 to 2063:
+ * [31:26] year - 2000, [25:22] month, [21:17] date, [16:12] hours, [11:6] mins, [5:0] secs
+ */
+#define RTC_PACKED_YEAR_Pos     26
+#define RTC_PACKED_MONTH_Pos    22
+#define RTC_PACKED_DATE_Pos     17
+#define RTC_PACKED_HOURS_Pos    12
+#define RTC_PACKED_MINS_Pos     6
+#define RTC_PACKED_SECS_Pos     0
+
 void RTC_init(ts *ts);
 void RTC_setTime(ts *ts);
+int RTC_solvePrescaler(uint32_t lseHz, uint32_t maxTickNs, RTC_Prescaler *pre);
+void RTC_setPrescaler(const RTC_Prescaler *pre);
 void RTC_getTime(ts *ts);
+void RTC_shift(int32_t ticks);
+void RTC_calibrate(int32_t ppb);
+void RTC_setWakeup(uint16_t reload);
+void RTC_stopWakeup(void);
+uint8_t RTC_clearWakeup(void);
+void RTC_setAlarm(enum RTC_Alarm alarm, uint8_t hours, uint8_t mins, uint8_t secs);
+void RTC_stopAlarm(enum RTC_Alarm alarm);
+uint8_t RTC_clearAlarms(void);
+void RTC_snapshot(RTC_Snapshot *snap);
+void RTC_decode(const RTC_Snapshot *snap, ts *ts);
+uint32_t RTC_getPacked(void);
+uint64_t RTC_microsOfDay(const RTC_Snapshot *snap);
+void RTC_resync(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,55 @@
+#ifndef SCRUB
+#define SCRUB
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SCRUB_MAX_RECORD    64          // Largest record the scrubber can buffer
+
+typedef enum {
+    SCRUB_REPAIRED_PRIMARY  = 0,        // Primary was bad, rewritten from the mirror
+    SCRUB_REPAIRED_MIRROR   = 1,        // Mirror was bad, rewritten from the primary
+    SCRUB_UNRECOVERABLE     = 2         // No good copy left
+} SCRUB_Event;
+
+/*
+ * The region is an array of fixed-size records. Each record ends in a
+ * big-endian CRC16_update() of the bytes before it. Records that read back as
+ * all 0xFF are treated as unused. If mirror is non-zero, a second copy of the
+ * region starts there and is verified alongside the primary. A blank copy
+ * next to a valid one counts as lost and is rewritten.
+ */
+typedef struct {
+    uint16_t base;
+    uint16_t mirror;
+    uint16_t recordSize;
+    uint16_t recordCount;
+    uint16_t slice;                     // Bytes per read, bounds the delay seen by foreground traffic
+    uint32_t bytesPerSec;               // Read budget
+    void (*report)(uint16_t record, SCRUB_Event event);
+} SCRUB_Config;
+
+typedef struct {
+    uint32_t passes;                    // Completed sweeps of the region
+    uint16_t record;                    // Record currently being checked
+    uint32_t bytesRead;
+    uint32_t crcErrors;
+    uint32_t repaired;
+    uint32_t unrecoverable;
+    uint32_t ioErrors;                  // Repair writes the device never acknowledged
+} SCRUB_Stats;
+
+/*
+ * Only the storage layer that writes records in this layout may start the
+ * scrubber on its region. Raw writes from the shell, PROTO_EE_WRITE and
+ * EENET land anywhere, and a "repair" from a stale mirror would overwrite
+ * them, so main() leaves it off until such a layer exists. SCRUB_process()
+ * does nothing until then.
+ */
+
+int SCRUB_init(const SCRUB_Config *cfg);
+void SCRUB_process(void);
+uint32_t SCRUB_nextPoll(void);
+void SCRUB_getStats(SCRUB_Stats *stats);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,63 @@
+#ifndef SERIAL
+#define SERIAL
+
+#include <stdint.h>
+
+#define SERIAL_TX_SIZE      2048        // Power of two
+#define SERIAL_RX_SIZE      1024        // Power of two, holds input until SERIAL_process() runs
+#define SERIAL_RX_FRAMES    32          // Frames waiting for SERIAL_process(), power of two
+
+#define SERIAL_BAUD_DEFAULT     115200U         // Set by MX_USART3_UART_Init, and where a failed switch returns to
+#define SERIAL_BAUD_TOLERANCE   20000           // Largest rate error accepted, in ppm
+#define SERIAL_BAUD_CONFIRM_MS  1000            // A switch is undone unless a frame arrives within this
+
+// What a write does when the TX ring cannot take all of it
+typedef enum {
+    SERIAL_DROP         = 0,            // Keep what fits, discard the rest
+    SERIAL_BLOCK        = 1,            // Wait for the DMA to free space, drops from interrupts
+    SERIAL_OVERWRITE    = 2             // Discard queued output not yet sending, keep the newest
+} SERIAL_Policy;
+
+typedef struct {
+    uint32_t written;                   // Bytes accepted into the ring
+    uint32_t dropped;
+    uint32_t overwritten;
+    uint32_t blocked;                   // Writes that had to wait for space
+    uint32_t transfers;                 // DMA segments started
+    uint32_t dmaErrors;
+    uint16_t highWater;                 // Most bytes ever queued
+
+    uint32_t received;
+    uint32_t frames;                    // Bursts ended by an idle line
+    uint32_t rxOverruns;                // Bytes overwritten by the DMA before being read
+    uint32_t frameOverruns;             // Idle lines with the frame queue full, merged into the next frame
+    uint32_t lineErrors;                // Framing, noise or overrun flags seen by the USART
+} SERIAL_Stats;
+
+/*
+ * Receives one idle-line delimited frame straight from the RX ring. A frame
+ * crossing the end of the ring arrives in two calls, end is set on the last.
+ */
+typedef void (*SERIAL_RxHandler)(const uint8_t *data, uint16_t size, uint8_t end);
+
+void SERIAL_init(SERIAL_Policy policy);
+void SERIAL_setPolicy(SERIAL_Policy policy);
+uint16_t SERIAL_write(const uint8_t *data, uint16_t size);
+uint16_t SERIAL_offer(const uint8_t *data, uint16_t size);
+uint16_t SERIAL_txFree(void);
+void SERIAL_flush(void);
+void SERIAL_getStats(SERIAL_Stats *stats);
+uint16_t SERIAL_computeBrr(uint32_t pclk, uint32_t baud, uint8_t over8, int32_t *errorPpm);
+int SERIAL_checkBaud(uint32_t baud, int32_t *errorPpm);
+int SERIAL_setBaud(uint32_t baud, int32_t *errorPpm);
+uint32_t SERIAL_getBaud(void);
+int SERIAL_proposeBaud(uint32_t baud, int32_t *errorPpm);
+void SERIAL_setRxHandler(SERIAL_RxHandler handler);
+void SERIAL_process(void);
+uint32_t SERIAL_nextPoll(void);
+uint16_t SERIAL_read(uint8_t *data, uint16_t size);
+void SERIAL_txDmaIrq(void);
+void SERIAL_rxDmaIrq(void);
+void SERIAL_usartIrq(void);
+
+#endif
\ No newline at end of file
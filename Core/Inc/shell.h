@@ -0,0 +1,25 @@
+#ifndef SHELL
+#define SHELL
+
+#include <stdint.h>
+
+/*
+ * Command shell on the text side of USART3, fed by PROTO's text handler.
+ * Commands that touch the bus or print a lot run a step per SHELL_process()
+ * and wait for room in the TX ring, so the main loop is never held up.
+ */
+#define SHELL_LINE_SIZE     96          // Longest command line, including the terminator
+#define SHELL_MAX_ARGS      8
+#define SHELL_OUT_SIZE      128         // Longest single SHELL_printf()
+#define SHELL_PROMPT        "> "
+#define SHELL_EE_CHUNK      256         // EEPROM bytes per request for ee read and ee bench
+#define SHELL_SCAN_BATCH    8           // I2C addresses probed per SHELL_process()
+#define SHELL_WAIT_TOP      8           // Poll sites listed by prof
+
+void SHELL_init(void);
+void SHELL_input(const uint8_t *data, uint16_t size);
+void SHELL_process(void);
+uint32_t SHELL_nextPoll(void);
+void SHELL_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#endif
\ No newline at end of file
@@ -218,6 +218,7 @@
 #define ETH_TX_BUF_SIZE                ETH_MAX_PACKET_SIZE /* buffer size for transmit              */
 #define ETH_RXBUFNB                    4U       /* 4 Rx buffers of size ETH_RX_BUF_SIZE  */
 #define ETH_TXBUFNB                    4U       /* 4 Tx buffers of size ETH_TX_BUF_SIZE  */
+#define HAL_ETH_USE_PTP                          /* Timestamping and the PTP clock, see netif.c */
 
 /* Section 2: PHY configuration section */
 
@@ -56,7 +56,13 @@ void DebugMon_Handler(void);
 void PendSV_Handler(void);
 void SysTick_Handler(void);
 /* USER CODE BEGIN EFP */
-
+void RTC_WKUP_IRQHandler(void);
+void RTC_Alarm_IRQHandler(void);
+void PVD_IRQHandler(void);
+void DMA1_Stream3_IRQHandler(void);
+void DMA1_Stream1_IRQHandler(void);
+void USART3_IRQHandler(void);
+void ETH_IRQHandler(void);
 /* USER CODE END EFP */
 
 #ifdef __cplusplus
@@ -0,0 +1,42 @@
+#ifndef SWTIMER
+#define SWTIMER
+
+#include <stdint.h>
+#include "rtc.h"
+
+#define TIMER_HZ            64                  // Wheel tick rate, driven by the RTC wakeup timer
+#define TIMER_LEVEL_BITS    6
+#define TIMER_SLOTS         (1U << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS        4                   // Covers 2^24 ticks, about 3 days at 64 Hz
+#define TIMER_NEVER         UINT32_MAX
+
+#define TIMER_MS(ms)        (((uint32_t)(ms) * TIMER_HZ + 999) / 1000)
+
+typedef struct Timer Timer;
+
+struct Timer {
+    Timer *next;
+    Timer **pprev;                      // Link pointing at this timer, NULL when stopped
+    uint8_t level;
+    uint8_t slot;
+    uint32_t expires;                   // Absolute tick
+    uint32_t period;                    // Reload in ticks, 0 for one-shot
+    void (*callback)(Timer *timer);
+    void *context;                      // Free for the caller's use
+};
+
+void TIMER_init(void);
+void TIMER_start(Timer *timer, uint32_t ticks, uint32_t period);
+void TIMER_stop(Timer *timer);
+uint8_t TIMER_isActive(const Timer *timer);
+uint32_t TIMER_now(void);
+uint32_t TIMER_nextExpiry(void);
+void TIMER_advance(uint32_t ticks);
+void TIMER_process(void);
+void TIMER_suspend(uint32_t ticks);
+void TIMER_resume(uint32_t elapsed);
+void TIMER_setAlarm(enum RTC_Alarm alarm, const ts *at, void (*callback)(void));
+void TIMER_wakeupIrq(void);
+void TIMER_alarmIrq(void);
+
+#endif
\ No newline at end of file
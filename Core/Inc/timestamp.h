@@ -0,0 +1,27 @@
+#ifndef TIMESTAMP
+#define TIMESTAMP
+
+#include <stdint.h>
+#include "stm32f439xx.h"
+
+#define TIMESTAMP_SLEW_MAX_PPM  500             // Largest rate change used to pull the phase in
+#define TIMESTAMP_STEP_US       1000000         // Errors above this are stepped, not slewed
+#define TIMESTAMP_HZ_TOLERANCE  (SystemCoreClock / 100)     // Reject rate estimates off by more than 1%
+
+typedef struct {
+    uint32_t hz;                        // Core clock measured against the RTC
+    int32_t error;                      // Phase error at the last sample (us, RTC minus us clock)
+    uint32_t samples;
+    uint32_t rejects;                   // Samples thrown away as implausible
+    uint32_t steps;
+} TIMESTAMP_Stats;
+
+void TIMESTAMP_init(void);
+uint64_t TIMESTAMP_cycles(void);
+uint64_t TIMESTAMP_us(void);
+void TIMESTAMP_discipline(void);
+void TIMESTAMP_rebase(void);
+void TIMESTAMP_addStopped(uint64_t us);
+void TIMESTAMP_getStats(TIMESTAMP_Stats *stats);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,85 @@
+#ifndef TRACE
+#define TRACE
+
+#include <stdint.h>
+
+/*
+ * Binary event trace. Build with TRACE_ENABLE defined to record events into
+ * a ring in CCMRAM, otherwise the TRACE_* macros expand to nothing.
+ * Tools/trace_decode.py reads this list to name events, keep it in order.
+ */
+#define TRACE_EVENTS(X)         \
+    X(MAIN_LOOP)                \
+    X(IDLE)                     \
+    X(EEPROM_PAGE)              \
+    X(EEPROM_BURST)             \
+    X(EEPROM_ACK_POLL)          \
+    X(RTC_WAKEUP_IRQ)           \
+    X(RTC_ALARM_IRQ)            \
+    X(TIMER_CALLBACK)           \
+    X(PERSIST_SPILL)            \
+    X(PVD_IRQ)
+
+#define TRACE_ENUM(name)        TRACE_##name,
+
+typedef enum {
+    TRACE_EVENTS(TRACE_ENUM)
+    TRACE_EVENT_COUNT,
+    TRACE_SYNC = 0xFF           // Inserted by the host, never stored in the ring
+} TRACE_Event;
+
+typedef enum {
+    TRACE_PH_BEGIN      = 'B',
+    TRACE_PH_END        = 'E',
+    TRACE_PH_INSTANT    = 'i',
+    TRACE_PH_COUNTER    = 'C'
+} TRACE_Phase;
+
+#define TRACE_RECORDS           2048    // Power of two, 32 KB of CCMRAM
+#define TRACE_SYNC_MAGIC        0x31435254U     // "TRC1" little-endian
+
+/*
+ * Sent little-endian in this layout, in PROTO_TRACE_DRAIN frames.
+ * Tools/proto.py opens the file it saves with a TRACE_SYNC record, arg0 =
+ * TRACE_SYNC_MAGIC and arg1 = core clock in Hz, so a decoder can find
+ * record boundaries.
+ */
+typedef struct {
+    uint32_t cycles;            // DWT->CYCCNT when recorded
+    uint8_t event;
+    uint8_t context;            // Active exception number, 0 in thread mode
+    uint8_t phase;
+    uint8_t lap;                // Commit tag, ring lap the record was written in
+    uint32_t arg0;
+    uint32_t arg1;
+} TRACE_Record;
+
+typedef struct {
+    uint32_t recorded;
+    uint32_t dropped;           // Ring was full
+    uint32_t drained;
+} TRACE_Stats;
+
+#ifdef TRACE_ENABLE
+
+#define TRACE_BEGIN(name, a, b)     TRACE_record(TRACE_##name, TRACE_PH_BEGIN, (a), (b))
+#define TRACE_END(name, a, b)       TRACE_record(TRACE_##name, TRACE_PH_END, (a), (b))
+#define TRACE_INSTANT(name, a, b)   TRACE_record(TRACE_##name, TRACE_PH_INSTANT, (a), (b))
+#define TRACE_COUNTER(name, value)  TRACE_record(TRACE_##name, TRACE_PH_COUNTER, (value), 0)
+
+void TRACE_init(void);
+void TRACE_record(TRACE_Event event, TRACE_Phase phase, uint32_t arg0, uint32_t arg1);
+uint16_t TRACE_take(const TRACE_Record **records, uint16_t max);
+void TRACE_release(uint16_t count);
+void TRACE_getStats(TRACE_Stats *stats);
+
+#else
+
+#define TRACE_BEGIN(name, a, b)
+#define TRACE_END(name, a, b)
+#define TRACE_INSTANT(name, a, b)
+#define TRACE_COUNTER(name, value)
+
+#endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,83 @@
+#ifndef WAIT
+#define WAIT
+
+#include <stdint.h>
+#include "prof.h"
+
+/*
+ * Hardware poll loops, one ID per call site. With PROFILE defined each
+ * WAIT_WHILE() records how often it spun and for how many cycles, otherwise
+ * it is a plain while loop.
+ */
+#define WAIT_SITES(X)           \
+    X(I2C_START_SB)             \
+    X(I2C_ADDRESS_ADDR)         \
+    X(I2C_WRITE_TXE)            \
+    X(I2C_WRITE_BTF)            \
+    X(I2C_READ1_ADDR)           \
+    X(I2C_READ1_RXNE)           \
+    X(I2C_READ_RXNE)            \
+    X(I2C_READ_RXNE_PENULT)     \
+    X(I2C_READ_RXNE_LAST)       \
+    X(I2C_PROBE_ACK)            \
+    X(I2C_REQUEST_ADDR)         \
+    X(I2C_READBYTE_RXNE)        \
+    X(RTC_INIT_LSERDY)          \
+    X(RTC_INIT_INITF)           \
+    X(RTC_INIT_EXIT)            \
+    X(RTC_SETTIME_INITF)        \
+    X(RTC_SETTIME_RSF)          \
+    X(RTC_PRESCALER_INITF)      \
+    X(RTC_PRESCALER_RSF)        \
+    X(RTC_SHIFT_SHPF)           \
+    X(RTC_CALIBRATE_RECALPF)    \
+    X(RTC_WAKEUP_WUTWF)         \
+    X(RTC_ALARM_WF)             \
+    X(RTC_SNAPSHOT_RSF)         \
+    X(RTC_RESYNC_RSF)           \
+    X(PERSIST_BRR)              \
+    X(SERIAL_DMA_DISABLE)       \
+    X(SERIAL_TX_SPACE)          \
+    X(SERIAL_FLUSH)             \
+    X(NETIF_CLOCK_TSSTI)        \
+    X(NETIF_CLOCK_TSSTU)        \
+    X(NETIF_CLOCK_TSARU)
+
+#define WAIT_ENUM(name)         WAIT_##name,
+
+typedef enum {
+    WAIT_SITES(WAIT_ENUM)
+    WAIT_COUNT
+} WAIT_Site;
+
+typedef struct {
+    uint32_t calls;
+    uint32_t maxCycles;
+    uint64_t spins;                     // Times the condition was re-read
+    uint64_t cycles;
+} WAIT_Stats;
+
+#ifdef PROFILE
+
+#define WAIT_WHILE(site, cond)                                      \
+    do {                                                            \
+        uint32_t wait_start = PROF_CYCLES();                        \
+        uint32_t wait_spins = 0;                                    \
+        while (cond) {                                              \
+            wait_spins++;                                           \
+        }                                                           \
+        WAIT_record(WAIT_##site, wait_spins, PROF_CYCLES() - wait_start); \
+    } while (0)
+
+void WAIT_record(WAIT_Site site, uint32_t spins, uint32_t cycles);
+void WAIT_reset(void);
+const WAIT_Stats *WAIT_get(WAIT_Site site);
+void WAIT_dump(uint8_t top);
+
+#else
+
+#define WAIT_WHILE(site, cond)  while (cond)
+
+#endif
+
+#endif
\ No newline at end of file
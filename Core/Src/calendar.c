@@ -0,0 +1,181 @@
+/***********************************************************************************
+ * @file        calendar.c                                                         *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  RTC                                                                *
+ * @brief       Conversions between the ts struct and Unix epoch seconds, with     *
+ *              table-driven daylight saving rules.                                *
+ ***********************************************************************************/
+
+#include <stddef.h>
+
+#include "calendar.h"
+
+#define SECS_PER_DAY    86400
+
+/*
+ * Current rules only (AU since 2008, US since 2007). Transition hours are in
+ * local standard time, so the DST end hour is one less than the wall clock
+ * shows on the day.
+ */
+const CAL_Zone CAL_zones[CAL_ZONE_COUNT] = {
+    [CAL_ZONE_UTC]        = { 0,    0,  { 0, 0, 0, 0 },                  { 0, 0, 0, 0 } },
+    [CAL_ZONE_AU_EASTERN] = { 600,  60, { 10, 1, Sunday, 2 },            { 4, 1, Sunday, 2 } },
+    [CAL_ZONE_EU_CENTRAL] = { 60,   60, { 3, CAL_LAST_WEEK, Sunday, 2 }, { 10, CAL_LAST_WEEK, Sunday, 2 } },
+    [CAL_ZONE_US_EASTERN] = { -300, 60, { 3, 2, Sunday, 2 },             { 11, 1, Sunday, 1 } },
+};
+
+static const uint8_t daysInMonth[13] = { 0, 31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+/**
+ * @brief  Days since 1970-01-01 for a date from 1970 onwards. Uses the
+ *         March-based year so leap days fall at the end, which needs no
+ *         month table and only divisions by constants.
+ *
+ * @param  year  Full year
+ * @param  month 1 to 12
+ * @param  date  Day of month
+ *
+ * @return Days since the epoch
+ **/
+int32_t CAL_daysFromCivil(uint16_t year, uint8_t month, uint8_t date) {
+    uint32_t y = year - (month <= 2);
+    uint32_t era = y / 400;
+    uint32_t yoe = y - era * 400;                                   // 0 to 399
+    uint32_t mp = (month + 9) % 12;                                 // March is 0
+    uint32_t doy = (153 * mp + 2) / 5 + date - 1;                   // 0 to 365
+    uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;           // 0 to 146096
+
+    return (int32_t)(era * 146097 + doe) - 719468;
+}
+
+/**
+ * @brief  Date and weekday for a day count from CAL_daysFromCivil()
+ *
+ * @param  days Days since 1970-01-01, not negative
+ * @param  ts   Date, month, year and day are filled in
+ *
+ * @return @c NULL
+ **/
+void CAL_civilFromDays(int32_t days, ts *ts) {
+    uint32_t z = (uint32_t)days + 719468;
+    uint32_t era = z / 146097;
+    uint32_t doe = z - era * 146097;
+    uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    uint32_t mp = (5 * doy + 2) / 153;
+    uint32_t month = (mp + 2) % 12 + 1;
+
+    ts->date = doy - (153 * mp + 2) / 5 + 1;
+    ts->month = month;
+    ts->year = yoe + era * 400 + (month <= 2);
+    ts->day = ((uint32_t)days + 3) % 7;         // 1970-01-01 was a Thursday
+}
+
+// Day of month a transition falls on in a given year
+static uint8_t CAL_transitionDate(const CAL_Transition *t, uint16_t year) {
+    int32_t first = CAL_daysFromCivil(year, t->month, 1);
+    uint8_t firstDay = ((uint32_t)first + 3) % 7;
+    uint8_t date = 1 + (t->weekday + 7 - firstDay) % 7 + 7 * (t->week - 1);
+
+    uint8_t last = daysInMonth[t->month];
+    if (t->month == 2 && (year % 4 != 0 || (year % 100 == 0 && year % 400 != 0))) {
+        last = 28;
+    }
+    return date > last ? date - 7 : date;       // CAL_LAST_WEEK can overshoot by one week
+}
+
+static CAL_Epoch32 CAL_transitionUtc(const CAL_Zone *zone, const CAL_Transition *t, uint16_t year) {
+    int32_t days = CAL_daysFromCivil(year, t->month, CAL_transitionDate(t, year));
+    return (CAL_Epoch32)((int64_t)days * SECS_PER_DAY + t->hour * 3600 - zone->offset * 60);
+}
+
+/**
+ * @brief  Checks whether daylight saving is in effect. With a cache, repeated
+ *         calls in the same zone and year cost two compares.
+ *
+ * @param  zone  Zone rules, see CAL_zones
+ * @param  utc   Time to check
+ * @param  cache Transitions kept between calls, or NULL to work them out each time
+ *
+ * @return 1 during DST, 0 otherwise
+ **/
+uint8_t CAL_isDst(const CAL_Zone *zone, CAL_Epoch32 utc, CAL_DstCache *cache) {
+    CAL_DstCache local;
+
+    if (zone->dstSave == 0) {
+        return 0;
+    }
+
+    ts date;
+    CAL_civilFromDays(utc / SECS_PER_DAY, &date);
+
+    if (cache == NULL) {
+        cache = &local;
+        cache->zone = NULL;
+    }
+    if (zone != cache->zone || date.year != cache->year) {
+        cache->start = CAL_transitionUtc(zone, &zone->start, date.year);
+        cache->end = CAL_transitionUtc(zone, &zone->end, date.year);
+        cache->zone = zone;
+        cache->year = date.year;
+    }
+
+    // Southern hemisphere zones start DST late in the year and end it early in the next
+    if (cache->start < cache->end) {
+        return utc >= cache->start && utc < cache->end;
+    }
+    return utc >= cache->start || utc < cache->end;
+}
+
+/**
+ * @brief  Converts local time to Unix seconds. isDst in the struct is used to
+ *         resolve the repeated hour when DST ends.
+ *
+ * @param  local Local time
+ * @param  zone  Zone rules, see CAL_zones
+ *
+ * @return Unix seconds
+ **/
+CAL_Epoch32 CAL_toEpoch32(const ts *local, const CAL_Zone *zone) {
+    int32_t days = CAL_daysFromCivil(local->year, local->month, local->date);
+    int32_t offset = zone->offset + (local->isDst ? zone->dstSave : 0);
+
+    return (CAL_Epoch32)((int64_t)days * SECS_PER_DAY + local->hours * 3600 + local->mins * 60 + local->secs - offset * 60);
+}
+
+/**
+ * @brief  Converts local time to packed seconds and fraction
+ *
+ * @param  local       Local time, including subsecs
+ * @param  zone        Zone rules, see CAL_zones
+ * @param  ticksPerSec Sub-second ticks per second (PREDIV_S + 1)
+ *
+ * @return Packed epoch
+ **/
+CAL_Epoch64 CAL_toEpoch64(const ts *local, const CAL_Zone *zone, uint32_t ticksPerSec) {
+    uint32_t frac = (uint32_t)(((uint64_t)local->subsecs << 32) / ticksPerSec);
+    return CAL_EPOCH64(CAL_toEpoch32(local, zone), frac);
+}
+
+/**
+ * @brief  Converts Unix seconds to local time, setting isDst from the zone rules
+ *
+ * @param  utc   Unix seconds
+ * @param  zone  Zone rules, see CAL_zones
+ * @param  local Filled in by this function, subsecs is set to 0
+ * @param  cache DST transitions kept between calls, or NULL, see CAL_isDst()
+ *
+ * @return @c NULL
+ **/
+void CAL_fromEpoch32(CAL_Epoch32 utc, const CAL_Zone *zone, ts *local, CAL_DstCache *cache) {
+    uint8_t dst = CAL_isDst(zone, utc, cache);
+    uint32_t t = utc + (zone->offset + (dst ? zone->dstSave : 0)) * 60;
+    uint32_t secs = t % SECS_PER_DAY;
+
+    CAL_civilFromDays(t / SECS_PER_DAY, local);
+    local->hours = secs / 3600;
+    local->mins = secs / 60 % 60;
+    local->secs = secs % 60;
+    local->isDst = dst;
+    local->subsecs = 0;
+}
\ No newline at end of file
@@ -0,0 +1,241 @@
+/***********************************************************************************
+ * @file        eenet.c                                                            *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  ETH                                                                *
+ * @brief       EEPROM block service on UDP. Each datagram's batch of reads,       *
+ *              writes and verifies is queued with the driver in one submit and    *
+ *              answered in one datagram. Reads land straight in the reply         *
+ *              buffer, which is taken when the batch starts.                      *
+ ***********************************************************************************/
+
+#include <string.h>
+
+#include "eenet.h"
+#include "eeprom.h"
+#include "net.h"
+
+typedef struct {
+    EEPROM_Request req;
+    uint8_t op;
+    uint16_t status;                    // Offset of the operation's status byte in the reply
+    const uint8_t *expect;              // EENET_VERIFY data sent by the client
+} EENET_Slot;
+
+/*
+ * Write data as sent, and verify data each followed by room for its
+ * read-back. The data in a request is under NET_UDP_MAX, so even a batch of
+ * verifies fits.
+ */
+static uint8_t staging[2 * NET_UDP_MAX];
+
+static struct {
+    uint16_t port;
+    uint8_t active;                     // Batch queued with the driver
+    uint8_t pending;                    // Operations the driver has not finished
+    uint8_t failed;
+    NET_Endpoint client;
+    NETIF_Buffer *reply;
+    uint8_t *payload;
+    uint16_t size;                      // Reply bytes
+    EENET_Slot slots[EENET_MAX_OPS];
+    EENET_Stats stats;
+} eenet;
+
+static uint16_t EENET_u16(const uint8_t *data) {
+    return (uint16_t)(data[0] | data[1] << 8);
+}
+
+static void EENET_refuse(const NET_Endpoint *from, uint16_t tag, EENET_Status status) {
+    uint8_t reply[EENET_HEADER] = { (uint8_t)tag, (uint8_t)(tag >> 8), status, 0 };
+
+    if (status == EENET_ERR_BUSY) {
+        eenet.stats.busy++;
+    }
+    else {
+        eenet.stats.refused++;
+    }
+    NET_udpSendTo(eenet.port, from, reply, sizeof(reply));
+}
+
+// Called by the driver from EEPROM_process() as each operation finishes
+static void EENET_done(EEPROM_Request *req) {
+    EENET_Slot *slot = req->context;
+    uint8_t status = EENET_OK;
+
+    if (req->status == EEPROM_ERROR) {
+        status = EENET_ERR_DEVICE;
+        eenet.failed = 1;
+        eenet.stats.deviceErrors++;
+    }
+    else if (slot->op == EENET_VERIFY && memcmp(req->data, slot->expect, req->size) != 0) {
+        status = EENET_MISMATCH;
+        eenet.stats.mismatches++;
+    }
+
+    eenet.payload[slot->status] = status;
+    eenet.pending--;
+}
+
+/*
+ * Checks the whole batch first, so a bad operation refuses it before any
+ * other reaches the bus.
+ */
+static EENET_Status EENET_check(const uint8_t *data, uint16_t size, uint8_t *count, uint16_t *reply) {
+    uint16_t at = 0;
+
+    *count = 0;
+    *reply = EENET_HEADER;
+    while (at < size) {
+        if (size - at < EENET_OP_HEADER || *count == EENET_MAX_OPS) {
+            return EENET_ERR_LENGTH;
+        }
+
+        uint8_t op = data[at];
+        uint16_t addr = EENET_u16(&data[at + 1]);
+        uint16_t len = EENET_u16(&data[at + 3]);
+        at += EENET_OP_HEADER;
+
+        if (op < EENET_READ || op > EENET_VERIFY || len == 0 || (uint32_t)addr + len > EEPROM_SIZE) {
+            return EENET_ERR_RANGE;
+        }
+        if (op != EENET_READ) {
+            if (size - at < len) {
+                return EENET_ERR_LENGTH;
+            }
+            at += len;
+        }
+
+        *reply += 1 + (op == EENET_READ ? len : 0);
+        if (*reply > NET_UDP_MAX) {
+            return EENET_ERR_SPACE;
+        }
+        (*count)++;
+    }
+
+    return *count == 0 ? EENET_ERR_LENGTH : EENET_OK;
+}
+
+static void EENET_receive(const NET_Endpoint *from, uint16_t port, const uint8_t *data, uint16_t size) {
+    if (size < 2) {
+        eenet.stats.refused++;          // No tag to answer with
+        return;
+    }
+    uint16_t tag = EENET_u16(data);
+    data += 2;
+    size -= 2;
+
+    if (eenet.active) {
+        EENET_refuse(from, tag, EENET_ERR_BUSY);
+        return;
+    }
+
+    uint8_t count;
+    uint16_t replySize;
+    EENET_Status status = EENET_check(data, size, &count, &replySize);
+    if (status != EENET_OK) {
+        EENET_refuse(from, tag, status);
+        return;
+    }
+
+    eenet.payload = NET_udpAlloc(&eenet.reply);
+    if (eenet.payload == NULL) {
+        eenet.stats.noBuffer++;
+        return;
+    }
+
+    eenet.payload[0] = (uint8_t)tag;
+    eenet.payload[1] = (uint8_t)(tag >> 8);
+    eenet.payload[2] = EENET_OK;
+    eenet.payload[3] = count;
+
+    EEPROM_Request *batch[EENET_MAX_OPS];
+    uint16_t at = 0;
+    uint16_t out = EENET_HEADER;
+    uint8_t *stage = staging;
+
+    for (uint8_t i = 0; i < count; i++) {
+        EENET_Slot *slot = &eenet.slots[i];
+        uint8_t op = data[at];
+        uint16_t addr = EENET_u16(&data[at + 1]);
+        uint16_t len = EENET_u16(&data[at + 3]);
+        at += EENET_OP_HEADER;
+
+        slot->op = op;
+        slot->status = out++;
+        slot->req = (EEPROM_Request){ .op = op == EENET_WRITE ? EEPROM_OP_WRITE : EEPROM_OP_READ, .addr = addr,
+                                      .size = len, .callback = EENET_done, .context = slot };
+
+        if (op == EENET_READ) {
+            slot->req.data = &eenet.payload[out];
+            out += len;
+        }
+        else {
+            memcpy(stage, &data[at], len);
+            at += len;
+            if (op == EENET_VERIFY) {
+                slot->expect = stage;
+                stage += len;
+            }
+            slot->req.data = stage;
+            stage += len;
+        }
+        batch[i] = &slot->req;
+    }
+
+    if (EEPROM_submit(batch, count) != 0) {
+        NETIF_free(eenet.reply);
+        EENET_refuse(from, tag, EENET_ERR_RANGE);
+        return;
+    }
+
+    eenet.client = *from;
+    eenet.pending = count;
+    eenet.failed = 0;
+    eenet.size = replySize;
+    eenet.active = 1;
+    eenet.stats.ops += count;
+}
+
+/**
+ * @brief  Binds the service to a UDP port. NET_init() must already have
+ *         been called, and EEPROM_process() must run in the main loop.
+ *
+ * @param  port Local port, EENET_PORT_DEFAULT unless the fleet says otherwise
+ *
+ * @return 0 on success, -1 if the port is taken or no socket is free
+ **/
+int EENET_init(uint16_t port) {
+    memset(&eenet, 0, sizeof(eenet));
+    eenet.port = port;
+    return NET_udpBind(port, EENET_receive);
+}
+
+/**
+ * @brief  Sends the reply once every operation in the running batch has
+ *         finished. Call from the main loop.
+ *
+ * @return @c NULL
+ **/
+void EENET_process(void) {
+    if (!eenet.active || eenet.pending > 0) {
+        return;
+    }
+
+    if (eenet.failed) {
+        eenet.payload[2] = EENET_ERR_DEVICE;
+    }
+    eenet.active = 0;
+    eenet.stats.batches++;
+    NET_udpSend(eenet.reply, eenet.port, &eenet.client, eenet.size);
+}
+
+/**
+ * @brief  Copies out the service counters
+ *
+ * @param  stats Filled in
+ *
+ * @return @c NULL
+ **/
+void EENET_getStats(EENET_Stats *stats) {
+    *stats = eenet.stats;
+}
\ No newline at end of file
@@ -8,46 +8,423 @@
 
 #include "eeprom.h"
 #include "i2c.h"
+#include "prof.h"
+#include "trace.h"
+#include "stm32f4xx_hal.h"      // HAL_GetTick
+
+#define EEPROM_ADDR_W       (EEPROM_ADDRESS << 1)
+#define EEPROM_ADDR_R       (EEPROM_ADDR_W | 1)
+#define EEPROM_READ_BURST   64          // Max bytes read per EEPROM_process() call
+
+static struct {
+    I2C_TypeDef *i2c;
+    EEPROM_Request *head;
+    EEPROM_Request *tail;
+    EEPROM_Request *lastWritten;        // Last request touched by the page in its write cycle
+    uint8_t writeCycle;                 // Device is busy committing a page
+    uint32_t writeStart;
+    uint32_t lastProbe;
+} eeprom;
 
 /**
- * @brief  Writes up to 32 bytes of data to the EEPROM device
+ * @brief  Binds the asynchronous driver to an I2C interface. I2C_config()
+ *         must already have been called on it.
  *
- * @param  page Start page
- * @param  data Data to be written
- * @param  size Number of bytes to be written, up to 32
+ * @param  i2c Pointer to the I2C_TypeDef struct representing the I2C interface.
  *
  * @return @c NULL
  **/
-void EEPROM_write(I2C_TypeDef *i2c, uint16_t page, uint8_t *data, uint8_t size) {
+void EEPROM_init(I2C_TypeDef *i2c) {
+    eeprom.i2c = i2c;
+    eeprom.head = NULL;
+    eeprom.tail = NULL;
+    eeprom.lastWritten = NULL;
+    eeprom.writeCycle = 0;
+}
+
+static uint8_t EEPROM_overlaps(EEPROM_Request *a, EEPROM_Request *b) {
+    return a->addr < b->addr + b->size && b->addr < a->addr + a->size;
+}
+
+// True if b picks up exactly where a ends, so both fit in one bus transaction
+static uint8_t EEPROM_continues(EEPROM_Request *a, EEPROM_Request *b) {
+    return b != NULL && b->op == a->op && b->addr == a->addr + a->size;
+}
+
+/**
+ * @brief  Queues a batch of requests. The batch is sorted by address so that
+ *         neighbouring requests can be merged into single transfers, but a
+ *         request is never moved past one it overlaps, so ordering between
+ *         reads and writes of the same bytes is kept.
+ *
+ * @param  reqs  Array of requests, reordered in place
+ * @param  count Number of requests in the array
+ *
+ * @return 0 on success, -1 if any request is invalid (nothing is queued then)
+ **/
+int EEPROM_submit(EEPROM_Request **reqs, uint8_t count) {
+
+    for (int i = 0; i < count; i++) {
+        EEPROM_Request *req = reqs[i];
+        if (req == NULL || req->size == 0 || (uint32_t)req->addr + req->size > EEPROM_SIZE) {
+            return -1;
+        }
+    }
+
+    PROF_BEGIN(EEPROM_SUBMIT);
+
+    // Insertion sort, stopping at the first overlapping request
+    for (int i = 1; i < count; i++) {
+        EEPROM_Request *req = reqs[i];
+        int j = i;
+        while (j > 0 && reqs[j - 1]->addr > req->addr && !EEPROM_overlaps(reqs[j - 1], req)) {
+            reqs[j] = reqs[j - 1];
+            j--;
+        }
+        reqs[j] = req;
+    }
+
+    for (int i = 0; i < count; i++) {
+        EEPROM_Request *req = reqs[i];
+        req->status = EEPROM_PENDING;
+        req->done = 0;
+        req->next = NULL;
+
+        if (eeprom.tail == NULL) {
+            eeprom.head = req;
+        }
+        else {
+            eeprom.tail->next = req;
+        }
+        eeprom.tail = req;
+    }
+
+    PROF_END(EEPROM_SUBMIT);
+    return 0;
+}
+
+// Takes a request that has not started yet back out of the queue
+static void EEPROM_unlink(EEPROM_Request *req) {
+    EEPROM_Request *prev = NULL;
+
+    for (EEPROM_Request *r = eeprom.head; r != NULL; prev = r, r = r->next) {
+        if (r != req) {
+            continue;
+        }
+        if (prev == NULL) {
+            eeprom.head = r->next;
+        }
+        else {
+            prev->next = r->next;
+        }
+        if (eeprom.tail == r) {
+            eeprom.tail = prev;
+        }
+        return;
+    }
+}
+
+/**
+ * @brief  Queues one request ahead of every request not yet started, for a
+ *         write that cannot wait behind the queue. A transfer already under
+ *         way, or a page in its write cycle, still finishes first. Calling
+ *         it on a request that is queued but not started moves it up. The
+ *         request must not overlap any it overtakes.
+ *
+ * @param  req Request to queue
+ *
+ * @return 0 on success, -1 if the request is invalid or already started
+ **/
+int EEPROM_submitUrgent(EEPROM_Request *req) {
+    if (req == NULL || req->size == 0 || (uint32_t)req->addr + req->size > EEPROM_SIZE ||
+        req->status == EEPROM_BUSY) {
+        return -1;
+    }
+    if (req->status == EEPROM_PENDING) {
+        EEPROM_unlink(req);
+    }
+
+    // Requests with bytes on the bus keep their place at the head
+    EEPROM_Request *prev = NULL;
+    EEPROM_Request *next = eeprom.head;
+    while (next != NULL && next->done > 0) {
+        prev = next;
+        next = next->next;
+    }
+
+    req->status = EEPROM_PENDING;
+    req->done = 0;
+    req->next = next;
+    if (prev == NULL) {
+        eeprom.head = req;
+    }
+    else {
+        prev->next = req;
+    }
+    if (next == NULL) {
+        eeprom.tail = req;
+    }
+    return 0;
+}
+
+// Completes every fully transferred request at the head of the queue
+static void EEPROM_retire(void) {
+    while (eeprom.head != NULL && eeprom.head->done == eeprom.head->size) {
+        EEPROM_Request *req = eeprom.head;
+        eeprom.head = req->next;
+        if (eeprom.head == NULL) {
+            eeprom.tail = NULL;
+        }
+
+        req->status = EEPROM_DONE;
+        if (req->callback) {
+            req->callback(req);
+        }
+    }
+}
+
+/*
+ * Fails requests from the head up to and including last: those with bytes in
+ * a page that never got committed, or the one whose transfer was NACKed.
+ */
+static void EEPROM_fail(EEPROM_Request *last) {
+    EEPROM_Request *req;
+
+    do {
+        req = eeprom.head;
+        eeprom.head = req->next;
+        if (eeprom.head == NULL) {
+            eeprom.tail = NULL;
+        }
+
+        req->status = EEPROM_ERROR;
+        if (req->callback) {
+            req->callback(req);
+        }
+    } while (req != last && eeprom.head != NULL);
+}
+
+// Writes as much as fits in the current device page, spanning contiguous requests
+static void EEPROM_writePage(void) {
+    I2C_TypeDef *i2c = eeprom.i2c;
+    EEPROM_Request *req = eeprom.head;
+
+    uint16_t page = req->addr + req->done;
+    uint16_t room = EEPROM_WRITE_PAGE - (page % EEPROM_WRITE_PAGE);
+    TRACE_BEGIN(EEPROM_PAGE, page, room);
 
-    // Begin transfer
     I2C_start(i2c);
-    I2C_sendAddress(i2c, EEPROM_ADDRESS);   // Last bit is left as 0 to set write mode.
+    if (!I2C_sendAddress(i2c, EEPROM_ADDR_W)) {
+        TRACE_END(EEPROM_PAGE, page, room);
+        EEPROM_fail(req);
+        return;
+    }
 
-    // Send address of memory location within the EEPROM device
     uint8_t addr[2];
     addr[0] = page >> 8;    // Higher byte
     addr[1] = page;         // Lower byte
-    I2C_write(i2c, EEPROM_ADDRESS, addr, 2);
+    I2C_write(i2c, EEPROM_ADDR_W, addr, 2);
+
+    while (room > 0) {
+        uint16_t n = req->size - req->done;
+        if (n > room) {
+            n = room;
+        }
 
-    // Send the data we want to write
-    I2C_write(i2c, EEPROM_ADDRESS, data, size);
+        I2C_write(i2c, EEPROM_ADDR_W, req->data + req->done, n);
+        req->done += n;
+        req->status = EEPROM_BUSY;
+        room -= n;
+        eeprom.lastWritten = req;
+
+        if (req->done < req->size || !EEPROM_continues(req, req->next)) {
+            break;
+        }
+        req = req->next;
+    }
 
     I2C_stop(i2c);
+    TRACE_END(EEPROM_PAGE, page, room);
+
+    // The device ignores its address until the page is committed
+    eeprom.writeCycle = 1;
+    eeprom.writeStart = HAL_GetTick();
+    eeprom.lastProbe = eeprom.writeStart;
 }
 
-void EEPROM_read(I2C_TypeDef *i2c, uint16_t page, uint8_t *data, uint8_t size) {
+// Reads up to EEPROM_READ_BURST bytes in one transfer, spanning contiguous requests
+static void EEPROM_readBurst(void) {
+    I2C_TypeDef *i2c = eeprom.i2c;
+    EEPROM_Request *req = eeprom.head;
+
+    uint16_t total = 0;
+    for (EEPROM_Request *r = req; r != NULL; r = r->next) {
+        total += r->size - r->done;
+        if (total >= EEPROM_READ_BURST) {
+            total = EEPROM_READ_BURST;
+            break;
+        }
+        if (!EEPROM_continues(r, r->next)) {
+            break;
+        }
+    }
 
-    // Begin transfer
+    uint16_t page = req->addr + req->done;
+    TRACE_BEGIN(EEPROM_BURST, page, total);
+
+    // Dummy write to load the address, then a repeated start to read
     I2C_start(i2c);
-    I2C_sendAddress(i2c, EEPROM_ADDRESS | 1);  // Make sure LSB is 1 for read
+    if (!I2C_sendAddress(i2c, EEPROM_ADDR_W)) {
+        TRACE_END(EEPROM_BURST, page, total);
+        EEPROM_fail(req);
+        return;
+    }
 
-    // Send address of memory location within the EEPROM device
     uint8_t addr[2];
     addr[0] = page >> 8;    // Higher byte
     addr[1] = page;         // Lower byte
+    I2C_write(i2c, EEPROM_ADDR_W, addr, 2);
 
-    I2C_read(i2c, EEPROM_ADDRESS, data, size);
+    I2C_start(i2c);
+    if (!I2C_requestRead(i2c, EEPROM_ADDR_R, total)) {
+        TRACE_END(EEPROM_BURST, page, total);
+        EEPROM_fail(req);
+        return;
+    }
 
-    I2C_stop(i2c);  // Don't know if this is needed, test without it
+    for (uint16_t remaining = total; remaining > 0; remaining--) {
+        req->status = EEPROM_BUSY;
+        req->data[req->done++] = I2C_readByte(i2c, remaining);
+        if (req->done == req->size) {
+            req = req->next;
+        }
+    }
+
+    TRACE_END(EEPROM_BURST, page, total);
+    EEPROM_retire();
+}
+
+/**
+ * @brief  Advances the queue by at most one bus transfer. Call this from the
+ *         main loop; it returns straight away while the device is busy with
+ *         a write cycle, ACK polling it at most once per millisecond.
+ *
+ * @return @c NULL
+ **/
+void EEPROM_process(void) {
+
+    if (eeprom.writeCycle) {
+        uint32_t now = HAL_GetTick();
+        if (now == eeprom.lastProbe) {
+            return;
+        }
+        eeprom.lastProbe = now;
+
+        uint8_t ack = I2C_probe(eeprom.i2c, EEPROM_ADDR_W);
+        TRACE_INSTANT(EEPROM_ACK_POLL, ack, now - eeprom.writeStart);
+
+        if (ack) {
+            eeprom.writeCycle = 0;
+            EEPROM_retire();
+        }
+        else if (now - eeprom.writeStart > EEPROM_TWR_MAX_MS) {
+            eeprom.writeCycle = 0;
+            EEPROM_fail(eeprom.lastWritten);
+        }
+        return;
+    }
+
+    if (eeprom.head == NULL) {
+        return;
+    }
+
+    // Only transfers are profiled, idle and ACK polling passes would swamp them
+    PROF_BEGIN(EEPROM_PROCESS);
+    if (eeprom.head->op == EEPROM_OP_WRITE) {
+        EEPROM_writePage();
+    }
+    else {
+        EEPROM_readBurst();
+    }
+    PROF_END(EEPROM_PROCESS);
+}
+
+/**
+ * @brief  Returns the state of a request without doing any work
+ *
+ * @param  req Request handle
+ *
+ * @return Current status
+ **/
+EEPROM_Status EEPROM_poll(EEPROM_Request *req) {
+    return req->status;
+}
+
+/**
+ * @brief  Drives the queue until a request has finished
+ *
+ * @param  req Request handle
+ *
+ * @return EEPROM_DONE or EEPROM_ERROR, or EEPROM_IDLE if it was never submitted
+ **/
+EEPROM_Status EEPROM_wait(EEPROM_Request *req) {
+    while (req->status == EEPROM_PENDING || req->status == EEPROM_BUSY) {
+        EEPROM_process();
+    }
+    return req->status;
+}
+
+// One request through the queue, driven until it finishes
+static int EEPROM_transfer(EEPROM_Op op, uint16_t addr, uint8_t *data, uint16_t size) {
+    EEPROM_Request req = { .op = op, .addr = addr, .data = data, .size = size };
+    EEPROM_Request *batch[1] = { &req };
+
+    if (EEPROM_submit(batch, 1) != 0) {
+        return -1;
+    }
+    return EEPROM_wait(&req) == EEPROM_DONE ? 0 : -1;
+}
+
+/**
+ * @brief  Writes bytes and waits until the device has committed them, behind
+ *         anything already queued. For callers with nothing else to do
+ *         meanwhile; not for use from a request callback.
+ *
+ * @param  addr Byte address in the device
+ * @param  data Data to be written
+ * @param  size Number of bytes, pages are split as needed
+ *
+ * @return 0 on success, -1 if the range is invalid or the device NACKed or timed out
+ **/
+int EEPROM_write(uint16_t addr, uint8_t *data, uint16_t size) {
+    PROF_BEGIN(EEPROM_WRITE);
+    int result = EEPROM_transfer(EEPROM_OP_WRITE, addr, data, size);
+    PROF_END(EEPROM_WRITE);
+    return result;
+}
+
+/**
+ * @brief  Reads bytes, waiting for them behind anything already queued. Not
+ *         for use from a request callback.
+ *
+ * @param  addr Byte address in the device
+ * @param  data Filled in by this function
+ * @param  size Number of bytes
+ *
+ * @return 0 on success, -1 if the range is invalid or the device NACKed
+ **/
+int EEPROM_read(uint16_t addr, uint8_t *data, uint16_t size) {
+    PROF_BEGIN(EEPROM_READ);
+    int result = EEPROM_transfer(EEPROM_OP_READ, addr, data, size);
+    PROF_END(EEPROM_READ);
+    return result;
+}
+
+/**
+ * @brief  Checks whether the driver has nothing queued and no write cycle running
+ *
+ * @return 1 if idle, 0 otherwise
+ **/
+uint8_t EEPROM_isIdle(void) {
+    return eeprom.head == NULL && !eeprom.writeCycle;
 }
\ No newline at end of file
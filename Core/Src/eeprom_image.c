@@ -0,0 +1,359 @@
+/***********************************************************************************
+ * @file        eeprom_image.c                                                     *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  EEPROM                                                             *
+ * @brief       Host-side 24C32 simulator backed by an mmap'd image file, with a   *
+ *              configurable timing model and failure injection.                   *
+ ***********************************************************************************/
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "eeprom_image.h"
+#include "i2c.h"
+#include "prof.h"
+
+#define IMAGE_CPU_MHZ   168             // Rate of the fake cycle counter seen by PROF probes
+
+#define IMAGE_BITS_PER_BYTE 9           // 8 data bits plus ACK
+
+typedef enum {
+    DEV_IDLE,
+    DEV_ADDRESS,                        // START seen, waiting for the address byte
+    DEV_POINTER_HI,
+    DEV_POINTER_LO,
+    DEV_WRITE,
+    DEV_READ
+} DeviceState;
+
+static struct {
+    int fd;
+    uint8_t *mem;
+    EEPROM_ImageTiming timing;
+    EEPROM_ImageStats stats;
+    uint32_t rng;
+
+    DeviceState state;
+    uint8_t selected;                   // Device ACKed its address in this transfer
+    uint16_t pointer;
+    uint64_t busyUntil;
+    uint8_t powerLost;
+
+    // Page latch, committed on STOP in the order the bytes arrived
+    uint8_t latch[EEPROM_WRITE_PAGE];
+    uint16_t latchAddr[EEPROM_WRITE_PAGE];
+    uint8_t latched;
+
+    uint16_t failOffset;
+    EEPROM_FailKind failKind;
+} image;
+
+static uint32_t IMAGE_random(void) {
+    // xorshift32
+    uint32_t x = image.rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    image.rng = x;
+    return x;
+}
+
+// Moves virtual time on, and the profiling counter with it
+static void IMAGE_elapse(uint64_t ns) {
+    image.stats.timeNs += ns;
+#if defined(PROFILE) && defined(PROF_HOST)
+    PROF_hostAdvance((uint32_t)(ns * IMAGE_CPU_MHZ / 1000));
+#endif
+}
+
+static void IMAGE_clock(uint32_t bits) {
+    IMAGE_elapse((uint64_t)bits * 1000000000u / image.timing.busHz);
+}
+
+static uint8_t IMAGE_available(void) {
+    return !image.powerLost && image.stats.timeNs >= image.busyUntil;
+}
+
+/**
+ * @brief  Opens or creates an image file. A new file is filled with 0xFF,
+ *         like a blank device.
+ *
+ * @param  path   Image file path
+ * @param  timing Timing model, or NULL for EEPROM_IMAGE_TIMING_DEFAULT
+ *
+ * @return 0 on success, -1 on failure
+ **/
+int EEPROM_imageOpen(const char *path, const EEPROM_ImageTiming *timing) {
+    static const EEPROM_ImageTiming defaults = EEPROM_IMAGE_TIMING_DEFAULT;
+
+    memset(&image, 0, sizeof(image));
+    image.timing = timing ? *timing : defaults;
+    image.rng = image.timing.seed ? image.timing.seed : 1;
+
+    image.fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (image.fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(image.fd, &st) < 0 || ftruncate(image.fd, EEPROM_SIZE) < 0) {
+        close(image.fd);
+        return -1;
+    }
+
+    image.mem = mmap(NULL, EEPROM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, image.fd, 0);
+    if (image.mem == MAP_FAILED) {
+        close(image.fd);
+        image.mem = NULL;
+        return -1;
+    }
+
+    if (st.st_size == 0) {
+        memset(image.mem, 0xFF, EEPROM_SIZE);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief  Flushes and unmaps the image
+ *
+ * @return @c NULL
+ **/
+void EEPROM_imageClose(void) {
+    if (image.mem != NULL) {
+        msync(image.mem, EEPROM_SIZE, MS_SYNC);
+        munmap(image.mem, EEPROM_SIZE);
+        close(image.fd);
+        image.mem = NULL;
+    }
+}
+
+/**
+ * @brief  Direct access to the image, e.g. to corrupt it or check it after a run
+ *
+ * @return Pointer to EEPROM_SIZE bytes
+ **/
+uint8_t *EEPROM_imageData(void) {
+    return image.mem;
+}
+
+/**
+ * @brief  Arms a one-shot failure for the next write cycle that commits the
+ *         byte at an offset
+ *
+ * @param  offset Byte offset in the device
+ * @param  kind   What goes wrong
+ *
+ * @return @c NULL
+ **/
+void EEPROM_imageInjectFailure(uint16_t offset, EEPROM_FailKind kind) {
+    image.failOffset = offset;
+    image.failKind = kind;
+}
+
+/**
+ * @brief  Checks whether an injected EEPROM_FAIL_TORN has cut the power. The
+ *         device ignores the bus until EEPROM_imagePowerOn().
+ *
+ * @return 1 if the device is unpowered
+ **/
+uint8_t EEPROM_imagePowerLost(void) {
+    return image.powerLost;
+}
+
+/**
+ * @brief  Powers the device back up, dropping any transfer in progress
+ *
+ * @return @c NULL
+ **/
+void EEPROM_imagePowerOn(void) {
+    image.powerLost = 0;
+    image.busyUntil = 0;
+    image.state = DEV_IDLE;
+    image.latched = 0;
+}
+
+/**
+ * @brief  Copies out the counters and virtual time
+ *
+ * @param  stats Filled in by this function
+ *
+ * @return @c NULL
+ **/
+void EEPROM_imageStats(EEPROM_ImageStats *stats) {
+    *stats = image.stats;
+}
+
+// Commits the page latch and starts the write cycle
+static void IMAGE_commit(void) {
+    for (int i = 0; i < image.latched; i++) {
+        uint16_t addr = image.latchAddr[i];
+        uint8_t value = image.latch[i];
+
+        if (image.failKind != EEPROM_FAIL_NONE && addr == image.failOffset) {
+            EEPROM_FailKind kind = image.failKind;
+            image.failKind = EEPROM_FAIL_NONE;
+
+            if (kind == EEPROM_FAIL_TORN) {
+                image.powerLost = 1;
+                break;
+            }
+            if (kind == EEPROM_FAIL_STUCK) {
+                continue;
+            }
+            value ^= 1u << (IMAGE_random() & 7);
+        }
+
+        image.mem[addr] = value;
+    }
+
+    image.stats.bytesWritten += image.latched;
+    image.stats.writeCycles++;
+    image.latched = 0;
+
+    uint32_t span = image.timing.twrMaxUs - image.timing.twrMinUs;
+    uint32_t twr = image.timing.twrMinUs + (span ? IMAGE_random() % (span + 1) : 0);
+    image.busyUntil = image.stats.timeNs + (uint64_t)twr * 1000u;
+}
+
+static uint8_t IMAGE_address(uint8_t addr) {
+    IMAGE_clock(IMAGE_BITS_PER_BYTE);
+
+    // NACKed, the driver stops the bus and fails the request
+    image.selected = (addr >> 1) == EEPROM_ADDRESS && IMAGE_available();
+    if (!image.selected) {
+        image.stats.ignored++;
+        image.state = DEV_IDLE;
+        return 0;
+    }
+
+    if (addr & 1) {
+        image.state = DEV_READ;
+    }
+    else {
+        image.state = DEV_POINTER_HI;
+        image.latched = 0;
+    }
+    return 1;
+}
+
+static uint8_t IMAGE_readByte(void) {
+    IMAGE_clock(IMAGE_BITS_PER_BYTE);
+
+    if (!image.selected || image.state != DEV_READ) {
+        return 0xFF;                    // Nobody drives SDA, the pull-ups win
+    }
+
+    uint8_t byte = image.mem[image.pointer];
+    image.pointer = (image.pointer + 1) % EEPROM_SIZE;
+    image.stats.bytesRead++;
+    return byte;
+}
+
+void I2C_config(I2C_TypeDef *i2c) {
+}
+
+void I2C_start(I2C_TypeDef *i2c) {
+    IMAGE_clock(1);
+
+    // A repeated start after only the pointer is a dummy write, nothing is committed
+    image.state = DEV_ADDRESS;
+    image.latched = 0;
+}
+
+uint8_t I2C_sendAddress(I2C_TypeDef *i2c, uint8_t addr) {
+    return IMAGE_address(addr);
+}
+
+void I2C_stop(I2C_TypeDef *i2c) {
+    IMAGE_clock(1);
+
+    if (image.selected && image.state == DEV_WRITE && image.latched > 0) {
+        IMAGE_commit();
+    }
+    image.state = DEV_IDLE;
+    image.selected = 0;
+}
+
+void I2C_write(I2C_TypeDef *i2c, uint8_t addr, uint8_t *data, uint8_t size) {
+    for (int i = 0; i < size; i++) {
+        IMAGE_clock(IMAGE_BITS_PER_BYTE);
+        if (!image.selected) {
+            continue;
+        }
+
+        switch (image.state) {
+        case DEV_POINTER_HI:
+            image.pointer = (uint16_t)(data[i] << 8) % EEPROM_SIZE;
+            image.state = DEV_POINTER_LO;
+            break;
+        case DEV_POINTER_LO:
+            image.pointer = (image.pointer | data[i]) % EEPROM_SIZE;
+            image.state = DEV_WRITE;
+            break;
+        case DEV_WRITE: {
+            // The address counter wraps within the page, overwriting the latch
+            uint16_t page = image.pointer - image.pointer % EEPROM_WRITE_PAGE;
+            if (image.latched < EEPROM_WRITE_PAGE) {
+                image.latchAddr[image.latched] = image.pointer;
+                image.latch[image.latched++] = data[i];
+            }
+            else {
+                for (int j = 0; j < EEPROM_WRITE_PAGE; j++) {
+                    if (image.latchAddr[j] == image.pointer) {
+                        image.latch[j] = data[i];
+                    }
+                }
+            }
+            image.pointer = page + (image.pointer + 1) % EEPROM_WRITE_PAGE;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+void I2C_read(I2C_TypeDef *i2c, uint8_t addr, uint8_t *buf, uint8_t size) {
+    for (int i = 0; i < size; i++) {
+        buf[i] = IMAGE_readByte();
+    }
+}
+
+uint8_t I2C_probe(I2C_TypeDef *i2c, uint8_t addr) {
+    IMAGE_clock(IMAGE_BITS_PER_BYTE + 2);
+    image.stats.probes++;
+
+    uint8_t acked = (addr >> 1) == EEPROM_ADDRESS && IMAGE_available();
+    if (acked && image.timing.nackPpm && IMAGE_random() % 1000000u < image.timing.nackPpm) {
+        acked = 0;
+    }
+    if (!acked) {
+        image.stats.nacks++;
+    }
+
+    image.state = DEV_IDLE;
+    image.selected = 0;
+    return acked;
+}
+
+uint8_t I2C_requestRead(I2C_TypeDef *i2c, uint8_t addr, uint16_t size) {
+    return IMAGE_address(addr);
+}
+
+uint8_t I2C_readByte(I2C_TypeDef *i2c, uint16_t remaining) {
+    uint8_t byte = IMAGE_readByte();
+    if (remaining <= 1) {
+        I2C_stop(i2c);
+    }
+    return byte;
+}
+
+uint32_t HAL_GetTick(void) {
+    IMAGE_elapse(image.timing.cpuNsPerPoll);
+    return (uint32_t)(image.stats.timeNs / 1000000u);
+}
\ No newline at end of file
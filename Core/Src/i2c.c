@@ -7,6 +7,8 @@
  ***********************************************************************************/
 
 #include "i2c.h"
+#include "prof.h"
+#include "wait.h"
 
 /**
  * @brief  Initialises I2C
@@ -52,23 +54,48 @@ void I2C_config(I2C_TypeDef *i2c) {
  * @return @c NULL
  **/
 void I2C_start(I2C_TypeDef *i2c) {
+    PROF_BEGIN(I2C_START);
     i2c->CR1 |= I2C_CR1_ACK;                // Enable ACK
     i2c->CR1 |= I2C_CR1_START;              // Set START bit
-    while (!(i2c->SR1 & I2C_SR1_SB));       // Wait for the SB bit to be set
+    WAIT_WHILE(I2C_START_SB, !(i2c->SR1 & I2C_SR1_SB));       // Wait for the SB bit to be set
+    PROF_END(I2C_START);
+}
+
+/*
+ * Settles an address phase once ADDR or AF is up, or I2C_ADDR_SPINS ran out.
+ * Without an ACK the NACK flag is cleared and the transfer stopped, so the
+ * caller can fail its request instead of spinning for ever.
+ */
+static uint8_t I2C_addressAcked(I2C_TypeDef *i2c) {
+    if (i2c->SR1 & I2C_SR1_ADDR) {
+        return 1;
+    }
+
+    i2c->SR1 &= ~I2C_SR1_AF;            // Clear the NACK flag
+    I2C_stop(i2c);
+    return 0;
 }
 
 /**
  * @brief  Sets the 7-bit address of the slave
  *
  * @param  i2c  Pointer to the I2C_TypeDef struct representing the I2C interface.
- * @param  addr 7-bit address
+ * @param  addr Address byte, including the R/W bit
  *  
- * @return @c NULL
+ * @return 1 if the slave acknowledged, 0 if it NACKed or never answered (the bus is stopped then)
  **/
-void I2C_sendAddress(I2C_TypeDef *i2c, uint8_t addr) {
+uint8_t I2C_sendAddress(I2C_TypeDef *i2c, uint8_t addr) {
+    PROF_BEGIN(I2C_ADDRESS);
+    uint32_t spins = I2C_ADDR_SPINS;
     i2c->DR = addr;
-    while (!(i2c->SR1 & I2C_SR1_ADDR));         // Wait for ADDR bit to be set
-    (void)(i2c->SR1 | i2c->SR2);        // Read status registers to clear ADDR
+    WAIT_WHILE(I2C_ADDRESS_ADDR, !(i2c->SR1 & (I2C_SR1_ADDR | I2C_SR1_AF)) && --spins > 0);  // Wait for ACK or NACK
+
+    uint8_t acked = I2C_addressAcked(i2c);
+    if (acked) {
+        (void)(i2c->SR1 | i2c->SR2);    // Read status registers to clear ADDR
+    }
+    PROF_END(I2C_ADDRESS);
+    return acked;
 }
 
 /**
@@ -93,14 +120,15 @@ void I2C_stop(I2C_TypeDef *i2c) {
  * @return @c NULL
  **/
 void I2C_write(I2C_TypeDef *i2c, uint8_t addr, uint8_t *data, uint8_t size) {
+    PROF_BEGIN(I2C_WRITE);
 
     for (int i = 0; i < size; i++) {
-        while (!(i2c->SR1 & I2C_SR1_TXE));    // Wait for TxE bit to be set (data register empty)
+        WAIT_WHILE(I2C_WRITE_TXE, !(i2c->SR1 & I2C_SR1_TXE));    // Wait for TxE bit to be set (data register empty)
         i2c->DR = data[i];
-        size--;
     }
 
-    while (!(i2c->SR1 & I2C_SR1_BTF));        // Wait for BTF to be set (byte transfer finished)
+    WAIT_WHILE(I2C_WRITE_BTF, !(i2c->SR1 & I2C_SR1_BTF));        // Wait for BTF to be set (byte transfer finished)
+    PROF_END(I2C_WRITE);
 }
 
 /**
@@ -114,31 +142,32 @@ void I2C_write(I2C_TypeDef *i2c, uint8_t addr, uint8_t *data, uint8_t size) {
  * @return @c NULL
  **/
 void I2C_read(I2C_TypeDef *i2c, uint8_t addr, uint8_t *buf, uint8_t size) {
+    PROF_BEGIN(I2C_READ);
 
     if (size == 1) {
         i2c->DR = addr;
-        while (!(i2c->SR1 & I2C_SR1_ADDR));             // Wait for ADDR bit to be set
+        WAIT_WHILE(I2C_READ1_ADDR, !(i2c->SR1 & I2C_SR1_ADDR));             // Wait for ADDR bit to be set
 
         i2c->CR1 &= ~(I2C_CR1_ACK);                     // Disable ACK
         i2c->CR1 |= I2C_CR1_POS;                        // Set POS bit
         
         i2c->CR1 |= I2C_CR1_STOP;                       // STOP
 
-        while (!(i2c->SR1 & I2C_SR1_RXNE));             // Wait until RxNE is set (data register not empty)
+        WAIT_WHILE(I2C_READ1_RXNE, !(i2c->SR1 & I2C_SR1_RXNE));             // Wait until RxNE is set (data register not empty)
         buf[0] = i2c->DR;
     }
     else {
         uint8_t remaining = size;
 
         while (remaining > 2) {
-            while (!(i2c->SR1 & I2C_SR1_RXNE));         // Wait until RxNE is set (data register not empty)
+            WAIT_WHILE(I2C_READ_RXNE, !(i2c->SR1 & I2C_SR1_RXNE));         // Wait until RxNE is set (data register not empty)
             buf[size - remaining] = i2c->DR;
             i2c->CR1 |= I2C_CR1_ACK;                    // Enable ACK (to acknowledge data has been received)
             remaining--;
         }
 
         // Read second last byte
-        while (!(i2c->SR1 & I2C_SR1_RXNE));             // Wait until RxNE is set (data register not empty)
+        WAIT_WHILE(I2C_READ_RXNE_PENULT, !(i2c->SR1 & I2C_SR1_RXNE));             // Wait until RxNE is set (data register not empty)
         buf[size - remaining] = i2c->DR;
 
         i2c->CR1 &= ~I2C_CR1_ACK;                       // Disable ACK
@@ -147,7 +176,82 @@ void I2C_read(I2C_TypeDef *i2c, uint8_t addr, uint8_t *buf, uint8_t size) {
         remaining--;
 
         // Read last byte
-        while (!(i2c->SR1 & I2C_SR1_RXNE));             // Wait until RxNE is set (data register not empty)
+        WAIT_WHILE(I2C_READ_RXNE_LAST, !(i2c->SR1 & I2C_SR1_RXNE));             // Wait until RxNE is set (data register not empty)
         buf[size - remaining] = i2c->DR;
     }
+    PROF_END(I2C_READ);
+}
+
+/**
+ * @brief  Checks whether a slave acknowledges its address. Used for ACK polling
+ *         while an EEPROM is busy with an internal write cycle.
+ *
+ * @param  i2c  Pointer to the I2C_TypeDef struct representing the I2C interface.
+ * @param  addr Address byte, including the R/W bit
+ *
+ * @return 1 if the slave acknowledged, 0 otherwise
+ **/
+uint8_t I2C_probe(I2C_TypeDef *i2c, uint8_t addr) {
+    I2C_start(i2c);
+    i2c->DR = addr;
+
+    WAIT_WHILE(I2C_PROBE_ACK, !(i2c->SR1 & (I2C_SR1_ADDR | I2C_SR1_AF)));     // Wait for either ACK or NACK
+
+    uint8_t acked = (i2c->SR1 & I2C_SR1_ADDR) != 0;
+    (void)(i2c->SR1 | i2c->SR2);        // Clear ADDR if it was set
+    i2c->SR1 &= ~I2C_SR1_AF;            // Clear the NACK flag
+
+    I2C_stop(i2c);
+    return acked;
+}
+
+/**
+ * @brief  Sends a read address. A single byte transfer has to be NACKed and
+ *         stopped before ADDR is cleared, so the total size is needed here.
+ *
+ * @param  i2c  Pointer to the I2C_TypeDef struct representing the I2C interface.
+ * @param  addr Address byte, with the LSB set for read
+ * @param  size Total number of bytes that will be read in this transfer
+ *
+ * @return 1 if the slave acknowledged, 0 if it NACKed or never answered (the bus is stopped then)
+ **/
+uint8_t I2C_requestRead(I2C_TypeDef *i2c, uint8_t addr, uint16_t size) {
+    uint32_t spins = I2C_ADDR_SPINS;
+    i2c->DR = addr;
+    WAIT_WHILE(I2C_REQUEST_ADDR, !(i2c->SR1 & (I2C_SR1_ADDR | I2C_SR1_AF)) && --spins > 0);  // Wait for ACK or NACK
+
+    if (!I2C_addressAcked(i2c)) {
+        return 0;
+    }
+
+    if (size == 1) {
+        i2c->CR1 &= ~I2C_CR1_ACK;                   // Disable ACK before clearing ADDR
+        (void)(i2c->SR1 | i2c->SR2);                // Clear ADDR
+        I2C_stop(i2c);
+    }
+    else {
+        (void)(i2c->SR1 | i2c->SR2);                // Clear ADDR
+    }
+    return 1;
+}
+
+/**
+ * @brief  Reads the next byte of a transfer started with I2C_requestRead().
+ *         Lets a single transfer be spread over several buffers.
+ *
+ * @param  i2c       Pointer to the I2C_TypeDef struct representing the I2C interface.
+ * @param  remaining Bytes left in the transfer, including this one
+ *
+ * @return The received byte
+ **/
+uint8_t I2C_readByte(I2C_TypeDef *i2c, uint16_t remaining) {
+    WAIT_WHILE(I2C_READBYTE_RXNE, !(i2c->SR1 & I2C_SR1_RXNE));             // Wait until RxNE is set (data register not empty)
+    uint8_t byte = i2c->DR;
+
+    if (remaining == 2) {
+        i2c->CR1 &= ~I2C_CR1_ACK;                   // NACK the last byte
+        I2C_stop(i2c);
+    }
+
+    return byte;
 }
\ No newline at end of file
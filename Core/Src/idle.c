@@ -0,0 +1,177 @@
+/***********************************************************************************
+ * @file        idle.c                                                             *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  RTC                                                                *
+ * @brief       Tickless idle. Sleeps until the next timer deadline in WFI or      *
+ *              STOP mode with the RTC wakeup timer, and compensates the HAL tick  *
+ *              and timer wheel for the time spent asleep.                         *
+ ***********************************************************************************/
+
+#include "idle.h"
+#include "main.h"
+#include "rtc.h"
+#include "swtimer.h"
+#include "eeprom.h"
+#include "timestamp.h"
+#include "serial.h"
+#include "netif.h"
+#include "net.h"
+#include "ptp.h"
+#include "persist.h"
+#include "shell.h"
+#include "scrub.h"
+
+#define IDLE_US_PER_TICK    (1000000U / TIMER_HZ)
+#define IDLE_US_PER_DAY     86400000000ULL
+
+void SystemClock_Config(void);
+
+// Main loop modules that poll HAL_GetTick() or pick up interrupt work
+static uint32_t (*const idlePolls[])(void) = {
+    SERIAL_nextPoll, NETIF_nextPoll, NET_nextPoll, PTP_nextPoll, PERSIST_nextPoll, SHELL_nextPoll, SCRUB_nextPoll
+};
+
+static struct {
+    IDLE_Stats stats;
+    uint64_t lastExit;
+    uint32_t tickRemainder;             // us not yet credited to the wheel
+    uint32_t msRemainder;               // us not yet credited to the HAL tick
+    uint8_t stopDenied;
+} idle;
+
+// Credits sleep time to the wheel and HAL tick, carrying fractions over
+static uint32_t IDLE_credit(uint64_t us) {
+    uint64_t tickUs = us + idle.tickRemainder;
+    uint64_t msUs = us + idle.msRemainder;
+
+    idle.tickRemainder = tickUs % IDLE_US_PER_TICK;
+    idle.msRemainder = msUs % 1000;
+    uwTick += (uint32_t)(msUs / 1000);
+
+    return (uint32_t)(tickUs / IDLE_US_PER_TICK);
+}
+
+// Soonest any polled module needs the main loop, in ms
+static uint32_t IDLE_nextPoll(void) {
+    uint32_t next = IDLE_NEVER;
+    for (uint32_t i = 0; i < sizeof(idlePolls) / sizeof(idlePolls[0]) && next > 0; i++) {
+        next = IDLE_min(next, idlePolls[i]());
+    }
+    return next;
+}
+
+/**
+ * @brief  Sleeps until there is work to do. Call at the end of every main
+ *         loop pass, in place of HAL_Delay(). While the EEPROM is busy, or a
+ *         module polls again within a wheel tick, the core only waits for
+ *         the next interrupt, SysTick included. Otherwise SysTick is stopped
+ *         and the RTC wakeup timer is set for the nearer of the next timer
+ *         and module deadlines, using STOP mode for longer sleeps. Interrupts
+ *         stay masked from the checks to the sleep, so one that brings work
+ *         in between still wakes the core, and its handler runs after.
+ *
+ * @return @c NULL
+ **/
+void IDLE_run(void) {
+    uint64_t start = TIMESTAMP_cycles();
+    idle.stats.runCycles += start - idle.lastExit;
+
+    __disable_irq();
+    uint32_t ticks = TIMER_nextExpiry();
+    uint32_t ms = ticks == 0 ? 0 : IDLE_nextPoll();
+    uint32_t pollTicks = ms == IDLE_NEVER ? TIMER_NEVER : (uint32_t)((uint64_t)ms * TIMER_HZ / 1000);
+
+    if (ms == 0) {
+        // Wheel is behind or a module has work, nothing to sleep for
+        __enable_irq();
+    }
+    else if (!EEPROM_isIdle() || pollTicks == 0) {
+        __WFI();
+        __enable_irq();
+        idle.stats.polls++;
+        idle.stats.pollCycles += TIMESTAMP_cycles() - start;
+    }
+    else {
+        if (ticks > pollTicks) {
+            ticks = pollTicks;
+        }
+        if (ticks > IDLE_MAX_TICKS) {
+            ticks = IDLE_MAX_TICKS;
+        }
+        uint8_t stop = ticks >= IDLE_STOP_MIN_TICKS && !idle.stopDenied;
+
+        RTC_Snapshot before, after;
+        RTC_snapshot(&before);
+        TIMER_suspend(ticks);
+        HAL_SuspendTick();
+
+        if (stop) {
+            HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
+        }
+        else {
+            __WFI();
+        }
+        uint64_t woke = TIMESTAMP_cycles();
+
+        // SysTick first, the clock switch times out on HAL_GetTick()
+        HAL_ResumeTick();
+        __enable_irq();
+        if (stop) {
+            SystemClock_Config();       // STOP leaves the core on HSI
+            RTC_resync();
+        }
+
+        RTC_snapshot(&after);
+        uint64_t from = RTC_microsOfDay(&before);
+        uint64_t to = RTC_microsOfDay(&after);
+        uint64_t slept = to >= from ? to - from : to + IDLE_US_PER_DAY - from;
+
+        uint32_t elapsed = IDLE_credit(slept);
+        TIMER_resume(elapsed);
+
+        if (stop) {
+            TIMESTAMP_addStopped(slept);
+            idle.stats.stops++;
+            idle.stats.stopUs += slept;
+        }
+        else {
+            idle.stats.sleeps++;
+            idle.stats.sleepUs += slept;
+        }
+        if (elapsed < ticks) {
+            idle.stats.earlyWakes++;
+        }
+
+        // Measured from the first instruction after wakeup
+        idle.stats.wakeCycles = (uint32_t)(TIMESTAMP_cycles() - woke);
+        if (idle.stats.wakeCycles > idle.stats.wakeCyclesMax) {
+            idle.stats.wakeCyclesMax = idle.stats.wakeCycles;
+        }
+    }
+
+    idle.lastExit = TIMESTAMP_cycles();
+}
+
+/**
+ * @brief  Allows or denies STOP mode. Peripherals that must keep running
+ *         while the core idles, such as a UART receiving, need it denied.
+ *         Tickless WFI sleep is still used either way.
+ *
+ * @param  allow 1 to allow STOP mode, 0 to deny it
+ *
+ * @return @c NULL
+ **/
+void IDLE_allowStop(uint8_t allow) {
+    idle.stopDenied = !allow;
+}
+
+/**
+ * @brief  Copies out the residency counters
+ *
+ * @param  stats Filled in by this function
+ *
+ * @return @c NULL
+ **/
+void IDLE_getStats(IDLE_Stats *stats) {
+    *stats = idle.stats;
+}
\ No newline at end of file
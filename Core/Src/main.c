@@ -24,6 +24,21 @@
 #include "i2c.h"
 #include "eeprom.h"
 #include "rtc.h"
+#include "calendar.h"
+#include "scrub.h"
+#include "timestamp.h"
+#include "swtimer.h"
+#include "idle.h"
+#include "persist.h"
+#include "prof.h"
+#include "trace.h"
+#include "serial.h"
+#include "proto.h"
+#include "shell.h"
+#include "netif.h"
+#include "net.h"
+#include "eenet.h"
+#include "ptp.h"
 
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
@@ -60,6 +75,8 @@ UART_HandleTypeDef huart3;
 PCD_HandleTypeDef hpcd_USB_OTG_FS;
 
 /* USER CODE BEGIN PV */
+static Timer heartbeat;
+static volatile uint8_t beat;
 
 /* USER CODE END PV */
 
@@ -75,6 +92,10 @@ static void MX_USB_OTG_FS_PCD_Init(void);
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
+static void heartbeatCallback(Timer *timer) {
+  beat = 1;
+}
+
 
 /* USER CODE END 0 */
 
@@ -111,17 +132,14 @@ int main(void)
   MX_USART3_UART_Init();
   MX_USB_OTG_FS_PCD_Init();
   /* USER CODE BEGIN 2 */
+  SERIAL_init(SERIAL_DROP);
+  IDLE_allowStop(0);      // USART3 cannot receive in STOP mode
+  PROTO_init(SHELL_input);
+  SERIAL_setRxHandler(PROTO_rx);
 
   //HAL_GPIO_TogglePin(GPIOB, GPIO_PIN_7);
 
-  // uint8_t data[4] = { 0, 1, 1, 0};
-
-  // I2C_TypeDef *i2c = I2C1;
-  // I2C_config(i2c);
-
-  // EEPROM_write(i2c, 1, data, 4);
-  // data[1] = 3;
-  // EEPROM_read(i2c, 1, data, 4);
+  // The RTC keeps UTC, as PTP steers it. The start time is given in Sydney and converted.
   ts time;
   time.secs = 0;
   time.mins = 44;
@@ -131,7 +149,28 @@ int main(void)
   time.year = 2025;
   time.day = Friday;
   time.isDst = 1;
+  time.subsecs = 0;
+  CAL_fromEpoch32(CAL_toEpoch32(&time, &CAL_zones[CAL_ZONE_AU_EASTERN]), &CAL_zones[CAL_ZONE_UTC], &time, NULL);
   RTC_init(&time);
+  RTC_setTime(&time);
+  I2C_config(I2C1);
+  EEPROM_init(I2C1);
+  PERSIST_init();
+  TIMESTAMP_init();
+#ifdef PROFILE
+  PROF_init();
+#endif
+#ifdef TRACE_ENABLE
+  TRACE_init();
+#endif
+  TIMER_init();
+  heartbeat.callback = heartbeatCallback;
+  TIMER_start(&heartbeat, TIMER_MS(500), TIMER_MS(500));
+  SHELL_init();
+  NETIF_init(NULL);
+  NET_init(NET_IP_DEFAULT, NET_NETMASK_DEFAULT, NET_GATEWAY_DEFAULT);
+  EENET_init(EENET_PORT_DEFAULT);
+  PTP_init();
   /* USER CODE END 2 */
 
   /* Infinite loop */
@@ -139,9 +178,27 @@ int main(void)
   //uint8_t seconds = time.secs;
   while (1)
   {
-    RTC_setTime(&time);
-    RTC_getTime(&time);
-    HAL_Delay(500);
+    TRACE_BEGIN(MAIN_LOOP, 0, 0);
+    TIMER_process();
+    if (beat) {
+      beat = 0;
+      RTC_getTime(&time);
+      TIMESTAMP_discipline();
+    }
+    EEPROM_process();
+    SCRUB_process();
+    PERSIST_process();
+    SERIAL_process();
+    PROTO_process();
+    SHELL_process();
+    NETIF_process();
+    NET_process();
+    EENET_process();
+    PTP_process();
+    TRACE_END(MAIN_LOOP, 0, 0);
+    TRACE_BEGIN(IDLE, 0, 0);
+    IDLE_run();
+    TRACE_END(IDLE, 0, 0);
     if (1) {
       //HAL_GPIO_TogglePin(GPIOB, GPIO_PIN_7);
       //seconds = time.secs;
@@ -374,6 +431,17 @@ static void MX_GPIO_Init(void)
 
 /* USER CODE BEGIN 4 */
 
+/**
+  * @brief  Sends single characters through the USART3 DMA ring
+  * @retval The character written
+  */
+int __io_putchar(int ch)
+{
+  uint8_t c = (uint8_t)ch;
+  SERIAL_write(&c, 1);
+  return ch;
+}
+
 /* USER CODE END 4 */
 
 /**
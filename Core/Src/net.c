@@ -0,0 +1,599 @@
+/***********************************************************************************
+ * @file        net.c                                                              *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  ETH                                                                *
+ * @brief       Minimal ARP, IPv4, ICMP echo and UDP over the raw frame layer.     *
+ *              Sockets and the ARP cache are static tables and nothing is         *
+ *              allocated beyond frame buffers. Checksums are left zero on send    *
+ *              for the MAC to insert, and checked by the MAC on receive.          *
+ ***********************************************************************************/
+
+#include <stddef.h>
+#include <string.h>
+
+#include "net.h"
+#include "idle.h"
+#include "stm32f4xx_hal.h"      // HAL_GetTick
+
+#define NET_TYPE_IP         0x0800U
+#define NET_TYPE_ARP        0x0806U
+
+#define NET_ARP_REQUEST     1U
+#define NET_ARP_REPLY       2U
+#define NET_ARP_SIZE        28U         // Ethernet and IPv4 ARP packet
+
+#define NET_PROTO_ICMP      1U
+#define NET_PROTO_UDP       17U
+#define NET_ICMP_ECHO_REPLY 0U
+#define NET_ICMP_ECHO       8U
+
+#define NET_IP_DF           0x4000U
+#define NET_IP_FRAGMENT     0x3FFFU     // More fragments flag and offset
+#define NET_BROADCAST       0xFFFFFFFFU
+
+// Offsets into a frame
+#define NET_ETH_DST         0
+#define NET_ETH_SRC         6
+#define NET_ETH_TYPE        12
+#define NET_IP_START        NET_ETH_HEADER
+#define NET_UDP_START       (NET_IP_START + NET_IP_HEADER)
+
+typedef enum {
+    NET_ARP_FREE        = 0,
+    NET_ARP_PENDING     = 1,            // Request sent, may hold one datagram
+    NET_ARP_RESOLVED    = 2
+} NET_ArpState;
+
+typedef struct {
+    uint32_t ip;
+    uint8_t mac[6];
+    NET_ArpState state;
+    uint8_t tries;
+    uint32_t at;                        // Resolved, or last request sent
+    NETIF_Buffer *held;                 // Frame waiting for the address
+    uint16_t heldLength;
+} NET_ArpEntry;
+
+typedef struct {
+    uint16_t port;                      // 0 when free
+    NET_UdpHandler handler;
+} NET_Socket;
+
+static struct {
+    uint32_t ip;
+    uint32_t netmask;
+    uint32_t gateway;
+    uint16_t ipId;
+    uint8_t linkUp;                     // Last seen, to announce on link up
+    NET_ArpEntry arp[NET_ARP_ENTRIES];
+    NET_Socket sockets[NET_SOCKETS];
+    NET_Stats stats;
+} net;
+
+static const uint8_t broadcastMac[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+// Frame fields are big-endian, and IP headers are only 2-byte aligned
+static uint16_t NET_get16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t NET_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void NET_put16(uint8_t *p, uint16_t value) {
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)value;
+}
+
+static void NET_put32(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+static uint8_t NET_isBroadcast(uint32_t ip) {
+    return ip == NET_BROADCAST || (net.netmask != NET_BROADCAST && ip == (net.ip | ~net.netmask));
+}
+
+static uint8_t NET_isMulticast(uint32_t ip) {
+    return (ip >> 28) == 0xEU;
+}
+
+static void NET_ethHeader(uint8_t *frame, const uint8_t *dst, uint16_t type) {
+    memcpy(&frame[NET_ETH_DST], dst, 6);
+    memcpy(&frame[NET_ETH_SRC], NETIF_macAddress(), 6);
+    NET_put16(&frame[NET_ETH_TYPE], type);
+}
+
+static void NET_send(NETIF_Buffer *buffer, uint16_t length) {
+    if (NETIF_send(buffer, length) != 0) {
+        net.stats.sendFailed++;
+    }
+}
+
+/*
+ * ARP
+ */
+static NET_ArpEntry *NET_arpFind(uint32_t ip) {
+    for (uint8_t i = 0; i < NET_ARP_ENTRIES; i++) {
+        if (net.arp[i].state != NET_ARP_FREE && net.arp[i].ip == ip) {
+            return &net.arp[i];
+        }
+    }
+    return NULL;
+}
+
+static void NET_arpForget(NET_ArpEntry *entry) {
+    if (entry->held != NULL) {
+        NETIF_free(entry->held);
+    }
+    memset(entry, 0, sizeof(*entry));
+}
+
+// A free entry, or else the one used longest ago
+static NET_ArpEntry *NET_arpClaim(uint32_t ip) {
+    NET_ArpEntry *oldest = &net.arp[0];
+    for (uint8_t i = 0; i < NET_ARP_ENTRIES; i++) {
+        if (net.arp[i].state == NET_ARP_FREE) {
+            oldest = &net.arp[i];
+            break;
+        }
+        if ((int32_t)(net.arp[i].at - oldest->at) < 0) {
+            oldest = &net.arp[i];
+        }
+    }
+    if (oldest->held != NULL) {
+        net.stats.arpDisplaced++;
+    }
+    NET_arpForget(oldest);
+    oldest->ip = ip;
+    return oldest;
+}
+
+static void NET_arpPacket(uint16_t op, const uint8_t *mac, uint32_t ip) {
+    NETIF_Buffer *buffer = NETIF_alloc();
+    if (buffer == NULL) {
+        net.stats.sendFailed++;
+        return;
+    }
+
+    uint8_t *frame = buffer->data;
+    NET_ethHeader(frame, op == NET_ARP_REQUEST ? broadcastMac : mac, NET_TYPE_ARP);
+
+    uint8_t *arp = &frame[NET_ETH_HEADER];
+    NET_put16(&arp[0], 1);                      // Ethernet
+    NET_put16(&arp[2], NET_TYPE_IP);
+    arp[4] = 6;
+    arp[5] = 4;
+    NET_put16(&arp[6], op);
+    memcpy(&arp[8], NETIF_macAddress(), 6);
+    NET_put32(&arp[14], net.ip);
+    memset(&arp[18], 0, 6);
+    if (op == NET_ARP_REPLY) {
+        memcpy(&arp[18], mac, 6);
+    }
+    NET_put32(&arp[24], ip);
+
+    NET_send(buffer, NET_ETH_HEADER + NET_ARP_SIZE);
+}
+
+static void NET_arpResolved(NET_ArpEntry *entry, const uint8_t *mac) {
+    memcpy(entry->mac, mac, 6);
+    entry->state = NET_ARP_RESOLVED;
+    entry->at = HAL_GetTick();
+
+    if (entry->held != NULL) {
+        NETIF_Buffer *held = entry->held;
+        entry->held = NULL;
+        memcpy(&held->data[NET_ETH_DST], mac, 6);
+        NET_send(held, entry->heldLength);
+    }
+}
+
+static void NET_arpInput(NETIF_Buffer *frame) {
+    const uint8_t *arp = &frame->data[NET_ETH_HEADER];
+    if (frame->length < NET_ETH_HEADER + NET_ARP_SIZE || NET_get16(&arp[0]) != 1
+            || NET_get16(&arp[2]) != NET_TYPE_IP || arp[4] != 6 || arp[5] != 4) {
+        NETIF_free(frame);
+        return;
+    }
+
+    uint16_t op = NET_get16(&arp[6]);
+    uint32_t senderIp = NET_get32(&arp[14]);
+    uint32_t targetIp = NET_get32(&arp[24]);
+    uint8_t senderMac[6];
+    memcpy(senderMac, &arp[8], 6);
+    NETIF_free(frame);
+
+    if (senderIp == 0 || net.ip == 0) {
+        return;                                 // Probes, and nothing to answer with yet
+    }
+
+    // RFC 826: refresh a known sender, and learn one that is asking for us
+    NET_ArpEntry *entry = NET_arpFind(senderIp);
+    if (entry == NULL && targetIp == net.ip) {
+        entry = NET_arpClaim(senderIp);
+    }
+    if (entry != NULL) {
+        NET_arpResolved(entry, senderMac);
+    }
+
+    if (op == NET_ARP_REQUEST && targetIp == net.ip) {
+        net.stats.arpReplies++;
+        NET_arpPacket(NET_ARP_REPLY, senderMac, senderIp);
+    }
+}
+
+/*
+ * Fills in the Ethernet header of an IPv4 frame and sends it, or holds it
+ * until the next hop answers an ARP request. Takes the buffer either way.
+ */
+static void NET_ipOutput(NETIF_Buffer *buffer, uint32_t dst, uint16_t length) {
+    uint8_t *frame = buffer->data;
+    net.stats.ipSent++;
+
+    if (NET_isBroadcast(dst)) {
+        NET_ethHeader(frame, broadcastMac, NET_TYPE_IP);
+        NET_send(buffer, length);
+        return;
+    }
+    if (NET_isMulticast(dst)) {
+        const uint8_t mac[6] = { 0x01, 0x00, 0x5E, (uint8_t)((dst >> 16) & 0x7FU), (uint8_t)(dst >> 8), (uint8_t)dst };
+        NET_ethHeader(frame, mac, NET_TYPE_IP);
+        NET_send(buffer, length);
+        return;
+    }
+
+    uint32_t hop = ((dst ^ net.ip) & net.netmask) == 0 ? dst : net.gateway;
+    NET_ArpEntry *entry = NET_arpFind(hop);
+    if (entry != NULL && entry->state == NET_ARP_RESOLVED) {
+        NET_ethHeader(frame, entry->mac, NET_TYPE_IP);
+        NET_send(buffer, length);
+        return;
+    }
+
+    // Destination MAC is filled in on resolution
+    NET_ethHeader(frame, broadcastMac, NET_TYPE_IP);
+    if (entry == NULL) {
+        entry = NET_arpClaim(hop);
+        entry->state = NET_ARP_PENDING;
+        entry->tries = 1;
+        entry->at = HAL_GetTick();
+        net.stats.arpRequests++;
+        NET_arpPacket(NET_ARP_REQUEST, NULL, hop);
+    }
+    if (entry->held != NULL) {
+        net.stats.arpDisplaced++;
+        NETIF_free(entry->held);
+    }
+    entry->held = buffer;
+    entry->heldLength = length;
+}
+
+/*
+ * IPv4
+ */
+static void NET_ipHeader(uint8_t *ip, uint8_t proto, uint32_t dst, uint16_t payload) {
+    ip[0] = 0x45;                               // Version 4, no options
+    ip[1] = 0;
+    NET_put16(&ip[2], NET_IP_HEADER + payload);
+    NET_put16(&ip[4], net.ipId++);
+    NET_put16(&ip[6], NET_IP_DF);
+    ip[8] = NET_TTL;
+    ip[9] = proto;
+    NET_put16(&ip[10], 0);                      // Inserted by the MAC
+    NET_put32(&ip[12], net.ip);
+    NET_put32(&ip[16], dst);
+}
+
+// Answers in the request's own buffer, straight back to the MAC it came from
+static void NET_icmpEcho(NETIF_Buffer *frame, uint8_t *ip, uint16_t headerLength, uint16_t total) {
+    uint8_t *icmp = ip + headerLength;
+    uint32_t src = NET_get32(&ip[12]);
+
+    memcpy(&frame->data[NET_ETH_DST], &frame->data[NET_ETH_SRC], 6);
+    memcpy(&frame->data[NET_ETH_SRC], NETIF_macAddress(), 6);
+
+    NET_put32(&ip[16], src);
+    NET_put32(&ip[12], net.ip);
+    ip[8] = NET_TTL;
+    NET_put16(&ip[10], 0);
+    icmp[0] = NET_ICMP_ECHO_REPLY;
+    NET_put16(&icmp[2], 0);
+
+    net.stats.icmpEchoes++;
+    net.stats.ipSent++;
+    NET_send(frame, (uint16_t)(NET_ETH_HEADER + total));
+}
+
+static void NET_udpInput(const uint8_t *ip, const uint8_t *udp, uint16_t size) {
+    if (size < NET_UDP_HEADER || NET_get16(&udp[4]) < NET_UDP_HEADER || NET_get16(&udp[4]) > size) {
+        net.stats.ipDropped++;
+        return;
+    }
+    net.stats.udpReceived++;
+
+    uint16_t port = NET_get16(&udp[2]);
+    for (uint8_t i = 0; i < NET_SOCKETS; i++) {
+        if (net.sockets[i].port == port) {
+            NET_Endpoint from = { .ip = NET_get32(&ip[12]), .port = NET_get16(&udp[0]) };
+            net.sockets[i].handler(&from, port, &udp[NET_UDP_HEADER], NET_get16(&udp[4]) - NET_UDP_HEADER);
+            return;
+        }
+    }
+    net.stats.udpNoPort++;
+}
+
+static void NET_ipInput(NETIF_Buffer *frame) {
+    uint8_t *ip = &frame->data[NET_IP_START];
+    uint16_t available = frame->length - NET_ETH_HEADER;
+
+    if (frame->length < NET_ETH_HEADER + NET_IP_HEADER || (ip[0] >> 4) != 4) {
+        net.stats.ipDropped++;
+        NETIF_free(frame);
+        return;
+    }
+
+    uint16_t headerLength = (uint16_t)((ip[0] & 0x0FU) * 4U);
+    uint16_t total = NET_get16(&ip[2]);
+    uint32_t dst = NET_get32(&ip[16]);
+    if (headerLength < NET_IP_HEADER || total < headerLength || total > available
+            || (dst != net.ip && !NET_isBroadcast(dst) && !NET_isMulticast(dst))) {
+        net.stats.ipDropped++;
+        NETIF_free(frame);
+        return;
+    }
+    if (NET_get16(&ip[6]) & NET_IP_FRAGMENT) {
+        net.stats.ipFragments++;
+        NETIF_free(frame);
+        return;
+    }
+    net.stats.ipReceived++;
+
+    uint8_t *payload = ip + headerLength;
+    uint16_t size = total - headerLength;
+    if (ip[9] == NET_PROTO_ICMP && dst == net.ip && size >= 8 && payload[0] == NET_ICMP_ECHO) {
+        NET_icmpEcho(frame, ip, headerLength, total);
+        return;
+    }
+    if (ip[9] == NET_PROTO_UDP) {
+        NET_udpInput(ip, payload, size);
+    }
+    NETIF_free(frame);
+}
+
+/**
+ * @brief  Sets the host address and takes over received frames from the
+ *         frame layer. NETIF_init() must already have run.
+ *
+ * @param  ip      Host address
+ * @param  netmask Subnet mask, on-link destinations are ARPed directly
+ * @param  gateway Next hop for everything else
+ *
+ * @return @c NULL
+ **/
+void NET_init(uint32_t ip, uint32_t netmask, uint32_t gateway) {
+    memset(&net, 0, sizeof(net));
+    net.ip = ip;
+    net.netmask = netmask;
+    net.gateway = gateway;
+    NETIF_setRxHandler(NET_input);
+}
+
+/**
+ * @brief  Gets the host address
+ *
+ * @return Address in host byte order
+ **/
+uint32_t NET_address(void) {
+    return net.ip;
+}
+
+/**
+ * @brief  Frame layer receive handler. Answers ARP and echo requests and
+ *         hands UDP datagrams to their socket. Takes the buffer.
+ *
+ * @param  frame Received frame, FCS stripped
+ *
+ * @return @c NULL
+ **/
+void NET_input(NETIF_Buffer *frame) {
+    if (frame->length < NET_ETH_HEADER) {
+        NETIF_free(frame);
+        return;
+    }
+
+    uint16_t type = NET_get16(&frame->data[NET_ETH_TYPE]);
+    if (type == NET_TYPE_ARP) {
+        NET_arpInput(frame);
+    } else if (type == NET_TYPE_IP) {
+        NET_ipInput(frame);
+    } else {
+        NETIF_free(frame);
+    }
+}
+
+/**
+ * @brief  Delivers datagrams for a local port to a handler
+ *
+ * @param  port    Local port
+ * @param  handler Called from NETIF_process() for each datagram
+ *
+ * @return 0 on success, -1 if the port is taken or the table is full
+ **/
+int NET_udpBind(uint16_t port, NET_UdpHandler handler) {
+    NET_Socket *slot = NULL;
+    for (uint8_t i = 0; i < NET_SOCKETS; i++) {
+        if (net.sockets[i].port == port) {
+            return -1;
+        }
+        if (net.sockets[i].port == 0 && slot == NULL) {
+            slot = &net.sockets[i];
+        }
+    }
+    if (port == 0 || handler == NULL || slot == NULL) {
+        return -1;
+    }
+    slot->port = port;
+    slot->handler = handler;
+    return 0;
+}
+
+/**
+ * @brief  Stops delivering datagrams for a local port
+ *
+ * @param  port Local port
+ *
+ * @return @c NULL
+ **/
+void NET_udpUnbind(uint16_t port) {
+    for (uint8_t i = 0; i < NET_SOCKETS; i++) {
+        if (net.sockets[i].port == port) {
+            net.sockets[i].port = 0;
+            net.sockets[i].handler = NULL;
+        }
+    }
+}
+
+/**
+ * @brief  Takes a frame buffer to build a datagram in, for NET_udpSend()
+ *
+ * @param  buffer Filled in with the frame buffer
+ *
+ * @return Where the payload goes, room for NET_UDP_MAX bytes, or NULL if
+ *         the pool is empty
+ **/
+uint8_t *NET_udpAlloc(NETIF_Buffer **buffer) {
+    *buffer = NETIF_alloc();
+    if (*buffer == NULL) {
+        net.stats.sendFailed++;
+        return NULL;
+    }
+    return (*buffer)->data + NET_UDP_OFFSET;
+}
+
+/**
+ * @brief  Sends a datagram built in place by NET_udpAlloc(). Takes the
+ *         buffer, even on failure.
+ *
+ * @param  buffer  From NET_udpAlloc()
+ * @param  srcPort Local port
+ * @param  to      Destination, may be broadcast or multicast
+ * @param  size    Payload bytes
+ *
+ * @return 0 if sent or waiting on ARP, -1 if too big
+ **/
+int NET_udpSend(NETIF_Buffer *buffer, uint16_t srcPort, const NET_Endpoint *to, uint16_t size) {
+    if (size > NET_UDP_MAX) {
+        net.stats.sendFailed++;
+        NETIF_free(buffer);
+        return -1;
+    }
+
+    uint8_t *udp = &buffer->data[NET_UDP_START];
+    NET_put16(&udp[0], srcPort);
+    NET_put16(&udp[2], to->port);
+    NET_put16(&udp[4], (uint16_t)(NET_UDP_HEADER + size));
+    NET_put16(&udp[6], 0);                      // Inserted by the MAC
+
+    NET_ipHeader(&buffer->data[NET_IP_START], NET_PROTO_UDP, to->ip, (uint16_t)(NET_UDP_HEADER + size));
+    net.stats.udpSent++;
+    NET_ipOutput(buffer, to->ip, (uint16_t)(NET_UDP_OFFSET + size));
+    return 0;
+}
+
+/**
+ * @brief  Copies a payload into a new datagram and sends it
+ *
+ * @param  srcPort Local port
+ * @param  to      Destination
+ * @param  data    Payload
+ * @param  size    Payload bytes, up to NET_UDP_MAX
+ *
+ * @return 0 if sent or waiting on ARP, -1 if too big or out of buffers
+ **/
+int NET_udpSendTo(uint16_t srcPort, const NET_Endpoint *to, const void *data, uint16_t size) {
+    if (size > NET_UDP_MAX) {
+        net.stats.sendFailed++;
+        return -1;
+    }
+    NETIF_Buffer *buffer;
+    uint8_t *payload = NET_udpAlloc(&buffer);
+    if (payload == NULL) {
+        return -1;
+    }
+    memcpy(payload, data, size);
+    return NET_udpSend(buffer, srcPort, to, size);
+}
+
+/**
+ * @brief  Retries and expires ARP lookups, ages the cache and announces the
+ *         address when the link comes up. Call from the main loop.
+ *
+ * @return @c NULL
+ **/
+void NET_process(void) {
+    uint32_t now = HAL_GetTick();
+
+    uint8_t up = NETIF_linkUp();
+    if (up && !net.linkUp && net.ip != 0) {
+        NET_arpPacket(NET_ARP_REQUEST, NULL, net.ip);   // Gratuitous, refreshes neighbours' caches
+    }
+    net.linkUp = up;
+
+    for (uint8_t i = 0; i < NET_ARP_ENTRIES; i++) {
+        NET_ArpEntry *entry = &net.arp[i];
+        if (entry->state == NET_ARP_RESOLVED && now - entry->at >= NET_ARP_TIMEOUT_MS) {
+            NET_arpForget(entry);
+        } else if (entry->state == NET_ARP_PENDING && now - entry->at >= NET_ARP_RETRY_MS) {
+            if (entry->tries >= NET_ARP_TRIES) {
+                if (entry->held != NULL) {
+                    net.stats.arpFailed++;
+                }
+                NET_arpForget(entry);
+            } else {
+                entry->tries++;
+                entry->at = now;
+                net.stats.arpRequests++;
+                NET_arpPacket(NET_ARP_REQUEST, NULL, entry->ip);
+            }
+        }
+    }
+}
+
+/**
+ * @brief  Says when NET_process() next has an ARP retry, expiry or
+ *         announcement to make
+ *
+ * @return Milliseconds until then, 0 if now, IDLE_NEVER if nothing is timed
+ **/
+uint32_t NET_nextPoll(void) {
+    uint32_t now = HAL_GetTick();
+    uint32_t next = IDLE_NEVER;
+
+    if (NETIF_linkUp() != net.linkUp) {
+        return 0;
+    }
+    for (uint8_t i = 0; i < NET_ARP_ENTRIES; i++) {
+        const NET_ArpEntry *entry = &net.arp[i];
+        if (entry->state == NET_ARP_RESOLVED) {
+            next = IDLE_min(next, IDLE_msLeft(now, entry->at, NET_ARP_TIMEOUT_MS));
+        } else if (entry->state == NET_ARP_PENDING) {
+            next = IDLE_min(next, IDLE_msLeft(now, entry->at, NET_ARP_RETRY_MS));
+        }
+    }
+    return next;
+}
+
+/**
+ * @brief  Copies out the protocol counters
+ *
+ * @param  stats Filled in
+ *
+ * @return @c NULL
+ **/
+void NET_getStats(NET_Stats *stats) {
+    *stats = net.stats;
+}
\ No newline at end of file
@@ -0,0 +1,645 @@
+/***********************************************************************************
+ * @file        netif.c                                                            *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  ETH                                                                *
+ * @brief       Raw frame I/O on the HAL ETH descriptors. The DMA receives into    *
+ *              and transmits from a fixed pool of buffers handed over by the HAL  *
+ *              callbacks, so frames are never copied on either side. Watches the  *
+ *              PHY over MDIO without blocking and follows its speed and duplex.   *
+ *              Runs the MAC's PTP clock and hands out its frame timestamps.       *
+ ***********************************************************************************/
+
+#include <stddef.h>
+#include <string.h>
+
+#include "netif.h"
+#include "idle.h"
+#include "wait.h"
+#include "stm32f4xx_hal.h"      // HAL_ETH_*, HAL_GetTick
+
+#define NETIF_PHY_SCSR          31U             // LAN8742A special control/status register
+#define NETIF_SCSR_AUTODONE     (1U << 12)
+#define NETIF_SCSR_100M         (1U << 3)
+#define NETIF_SCSR_FULL         (1U << 4)
+
+// Enhanced RX descriptors reuse the IPv4 header checksum error bit once timestamping is on,
+// the header error moves to the extended status in RDES4, valid when ESA is set
+#define NETIF_RDES0_TSV         ETH_DMARXDESC_IPV4HCE
+#define NETIF_RDES0_ESA         ETH_DMARXDESC_MAMPCE
+
+extern ETH_HandleTypeDef heth;
+extern ETH_TxPacketConfig TxConfig;
+
+typedef enum {
+    NETIF_LINK_IDLE     = 0,
+    NETIF_LINK_BSR      = 1,            // Waiting for the basic status register
+    NETIF_LINK_SCSR     = 2             // Waiting for the negotiated speed and duplex
+} NETIF_LinkState;
+
+static struct {
+    NETIF_RxHandler handler;
+    NETIF_Stats stats;
+    volatile uint8_t pending;           // DMA interrupt since the last NETIF_process()
+} netif;
+
+static struct {
+    NETIF_LinkState state;
+    uint32_t polledAt;
+} link;
+
+static struct {
+    uint8_t running;
+    uint32_t addend;                    // NETIF_CLOCK_HZ updates a second at the nominal rate
+    NETIF_Buffer *stampNext;            // Frame NETIF_send() has the MAC timestamp
+    uint8_t txReady;
+    int64_t txStamp;
+    uint8_t rxValid;                    // Frame being handed up was timestamped
+    int64_t rxStamp;
+} ptpClock;
+
+_Static_assert(ETH_RX_BUF_SIZE <= NETIF_BUF_SIZE, "A received frame must fit in one pool buffer");
+
+// Starts an MDIO read, keeping the MDC clock range HAL_ETH_Init() chose
+static void NETIF_mdioRead(uint32_t reg) {
+    uint32_t miiar = ETH->MACMIIAR & ETH_MACMIIAR_CR;
+    miiar |= (NETIF_PHY_ADDRESS << ETH_MACMIIAR_PA_Pos) & ETH_MACMIIAR_PA;
+    miiar |= (reg << ETH_MACMIIAR_MR_Pos) & ETH_MACMIIAR_MR;
+    ETH->MACMIIAR = miiar | ETH_MACMIIAR_MB;
+}
+
+static void NETIF_linkChanged(uint8_t up, uint8_t speed100, uint8_t fullDuplex) {
+    NETIF_Stats *stats = &netif.stats;
+    if (up == stats->linkUp && (!up || (speed100 == stats->speed100 && fullDuplex == stats->fullDuplex))) {
+        return;
+    }
+
+    stats->linkChanges++;
+    stats->linkUp = up;
+    stats->speed100 = speed100;
+    stats->fullDuplex = fullDuplex;
+
+    if (heth.gState == HAL_ETH_STATE_STARTED) {
+        HAL_ETH_Stop_IT(&heth);
+    }
+    if (!up) {
+        return;
+    }
+
+    // The MAC only takes a new speed and duplex while stopped
+    ETH_MACConfigTypeDef mac;
+    HAL_ETH_GetMACConfig(&heth, &mac);
+    mac.Speed = speed100 ? ETH_SPEED_100M : ETH_SPEED_10M;
+    mac.DuplexMode = fullDuplex ? ETH_FULLDUPLEX_MODE : ETH_HALFDUPLEX_MODE;
+    HAL_ETH_SetMACConfig(&heth, &mac);
+    HAL_ETH_Start_IT(&heth);
+}
+
+/*
+ * One step of the link poll. Reads the basic status register every
+ * NETIF_LINK_POLL_MS, and the negotiated mode once the link is up, picking
+ * up each MDIO result on a later call instead of spinning for it.
+ */
+static void NETIF_pollLink(void) {
+    uint32_t now = HAL_GetTick();
+
+    if (link.state == NETIF_LINK_IDLE) {
+        if (now - link.polledAt >= NETIF_LINK_POLL_MS) {
+            link.polledAt = now;
+            NETIF_mdioRead(PHY_BSR);
+            link.state = NETIF_LINK_BSR;
+        }
+        return;
+    }
+
+    if (ETH->MACMIIAR & ETH_MACMIIAR_MB) {
+        if (now - link.polledAt >= NETIF_LINK_POLL_MS) {
+            link.state = NETIF_LINK_IDLE;       // PHY not answering, try again next poll
+        }
+        return;
+    }
+
+    uint32_t value = ETH->MACMIIDR & 0xFFFFU;
+    if (link.state == NETIF_LINK_BSR) {
+        if (value & PHY_LINKED_STATUS) {
+            NETIF_mdioRead(NETIF_PHY_SCSR);
+            link.state = NETIF_LINK_SCSR;
+        } else {
+            link.state = NETIF_LINK_IDLE;
+            NETIF_linkChanged(0, 0, 0);
+        }
+        return;
+    }
+
+    link.state = NETIF_LINK_IDLE;
+    if (value & NETIF_SCSR_AUTODONE) {
+        NETIF_linkChanged(1, (value & NETIF_SCSR_100M) != 0, (value & NETIF_SCSR_FULL) != 0);
+    }
+}
+
+// Timestamps from the PTP registers and descriptors, subseconds in ns with digital rollover
+static int64_t NETIF_stampNs(uint32_t secs, uint32_t subsecs) {
+    return (int64_t)secs * NETIF_NS_PER_SEC + (subsecs & ETH_PTPTSLR_STSS);
+}
+
+/*
+ * RDES4 of the frame HAL_ETH_ReadData() returns next. The HAL keeps only the
+ * last descriptor's RDES0 and gives the descriptor straight back to the DMA,
+ * so this walks the same descriptors first, while the CPU still owns them.
+ */
+static uint32_t NETIF_rxExtStatus(void) {
+    uint32_t index = heth.RxDescList.RxDescIdx;
+    uint32_t count = ETH_RX_DESC_CNT - heth.RxDescList.RxBuildDescCnt;
+    uint8_t started = heth.RxDescList.pRxStart != NULL;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const ETH_DMADescTypeDef *desc = (const ETH_DMADescTypeDef *)heth.RxDescList.RxDesc[index];
+        uint32_t status = desc->DESC0;
+        if (status & ETH_DMARXDESC_OWN) {
+            break;
+        }
+        started |= (status & ETH_DMARXDESC_FS) != 0;
+        if (started && (status & ETH_DMARXDESC_LS)) {
+            return (status & NETIF_RDES0_ESA) ? desc->DESC4 : 0;
+        }
+        index = (index + 1) % ETH_RX_DESC_CNT;
+    }
+    return 0;
+}
+
+// Hands one frame from HAL_ETH_ReadData() to the application, or drops it
+static void NETIF_receive(NETIF_Buffer *frame, uint32_t extStatus) {
+    NETIF_Stats *stats = &netif.stats;
+    uint32_t error = 0;
+    HAL_ETH_GetRxDataErrorCode(&heth, &error);
+
+    ptpClock.rxValid = 0;
+    if (ptpClock.running) {
+        error &= ~NETIF_RDES0_TSV;
+        if (extStatus & ETH_DMAPTPRXDESC_IPHE) {
+            error |= ETH_DMARXDESC_IPV4HCE;
+        }
+        if (heth.RxDescList.pRxLastRxDesc & NETIF_RDES0_TSV) {
+            ETH_TimeStampTypeDef stamp;
+            HAL_ETH_PTP_GetRxTimestamp(&heth, &stamp);
+            ptpClock.rxStamp = NETIF_stampNs(stamp.TimeStampHigh, stamp.TimeStampLow);
+            ptpClock.rxValid = 1;
+        }
+    }
+
+    if (frame->next != NULL || error != 0 || frame->length <= NETIF_FCS_SIZE) {
+        if (frame->next != NULL) {
+            stats->rxOversize++;
+        } else {
+            stats->rxErrors++;
+        }
+        while (frame != NULL) {
+            NETIF_Buffer *next = frame->next;
+            NETIF_free(frame);
+            frame = next;
+        }
+        return;
+    }
+
+    frame->length -= NETIF_FCS_SIZE;
+    stats->rxFrames++;
+    stats->rxBytes += frame->length;
+    stats->rxStamped += ptpClock.rxValid;
+
+    if (netif.handler == NULL) {
+        stats->rxDropped++;
+        NETIF_free(frame);
+    } else {
+        netif.handler(frame);
+    }
+    ptpClock.rxValid = 0;
+}
+
+/**
+ * @brief  Fills the buffer pool and enables the ETH interrupt. MX_ETH_Init() must
+ *         already have run. Reception starts from NETIF_process() once the
+ *         PHY reports a link.
+ *
+ * @param  handler Receives each good frame, may be NULL to drop them
+ *
+ * @return @c NULL
+ **/
+void NETIF_init(NETIF_RxHandler handler) {
+    memset(&netif, 0, sizeof(netif));
+    POOL_init();
+    netif.handler = handler;
+    ptpClock.stampNext = NULL;          // The clock itself keeps running
+    ptpClock.txReady = 0;
+
+    link.state = NETIF_LINK_IDLE;
+    link.polledAt = HAL_GetTick() - NETIF_LINK_POLL_MS;     // First poll on the first NETIF_process()
+
+    NVIC_EnableIRQ(ETH_IRQn);
+}
+
+/**
+ * @brief  Replaces the function frames are handed to
+ *
+ * @param  handler Receives each good frame, NULL to drop them
+ *
+ * @return @c NULL
+ **/
+void NETIF_setRxHandler(NETIF_RxHandler handler) {
+    netif.handler = handler;
+}
+
+/**
+ * @brief  Takes a buffer from the pool to build a frame in
+ *
+ * @return The buffer, or NULL if the pool is empty
+ **/
+NETIF_Buffer *NETIF_alloc(void) {
+    return POOL_alloc();
+}
+
+/**
+ * @brief  Drops a reference to a buffer, which goes back to the pool with
+ *         the last one
+ *
+ * @param  buffer From NETIF_alloc() or a receive handler
+ *
+ * @return @c NULL
+ **/
+void NETIF_free(NETIF_Buffer *buffer) {
+    POOL_release(buffer);
+}
+
+/**
+ * @brief  Queues a frame on the TX descriptors straight from its buffer.
+ *         Takes the caller's reference, dropped once the DMA has sent the
+ *         frame or at once if it cannot be queued.
+ *         The MAC pads short frames, appends the FCS and fills in IPv4,
+ *         UDP, TCP and ICMP checksums.
+ *
+ * @param  buffer Frame to send, from NETIF_alloc() or a receive handler
+ * @param  length Frame bytes from the destination MAC, without the FCS
+ *
+ * @return 0 if queued, -1 if the link is down or every descriptor is busy
+ **/
+int NETIF_send(NETIF_Buffer *buffer, uint16_t length) {
+    uint8_t stamp = buffer == ptpClock.stampNext;
+    if (stamp) {
+        ptpClock.stampNext = NULL;
+    }
+
+    if (heth.gState != HAL_ETH_STATE_STARTED || length == 0 || length > NETIF_BUF_SIZE) {
+        NETIF_free(buffer);
+        return -1;
+    }
+
+    // Frees whatever the DMA has finished with, so descriptors are available
+    HAL_ETH_ReleaseTxPacket(&heth);
+
+    // The HAL sets TTSE on request but never clears it, and descriptors go round the ring
+    ETH_DMADescTypeDef *desc = (ETH_DMADescTypeDef *)heth.TxDescList.TxDesc[heth.TxDescList.CurTxDesc];
+    if ((desc->DESC0 & ETH_DMATXDESC_OWN) == 0) {
+        if (stamp && ptpClock.running) {
+            HAL_ETH_PTP_InsertTxTimestamp(&heth);
+        } else {
+            desc->DESC0 &= ~ETH_DMATXDESC_TTSE;
+        }
+    }
+
+    ETH_BufferTypeDef segment = { .buffer = buffer->data, .len = length, .next = NULL };
+    buffer->length = length;
+    TxConfig.Length = length;
+    TxConfig.TxBuffer = &segment;
+    TxConfig.pData = buffer;
+
+    if (HAL_ETH_Transmit_IT(&heth, &TxConfig) != HAL_OK) {
+        netif.stats.txBusy++;
+        NETIF_free(buffer);
+        return -1;
+    }
+
+    netif.stats.txFrames++;
+    netif.stats.txBytes += length;
+    return 0;
+}
+
+/**
+ * @brief  Gets the address MX_ETH_Init() gave the MAC
+ *
+ * @return Six bytes, first octet first
+ **/
+const uint8_t *NETIF_macAddress(void) {
+    return heth.Init.MACAddr;
+}
+
+/**
+ * @brief  Says whether frames can be sent and received
+ *
+ * @return 1 if the PHY has a link and the DMA is running
+ **/
+uint8_t NETIF_linkUp(void) {
+    return netif.stats.linkUp && heth.gState == HAL_ETH_STATE_STARTED;
+}
+
+/**
+ * @brief  Follows the PHY link, frees sent frames and hands received frames
+ *         to the handler, up to NETIF_RX_BUDGET at a time. Call from the
+ *         main loop. The ETH interrupt only wakes the loop.
+ *
+ * @return @c NULL
+ **/
+void NETIF_process(void) {
+    NETIF_pollLink();
+    netif.pending = 0;
+
+    if (heth.gState != HAL_ETH_STATE_STARTED) {
+        return;
+    }
+
+    HAL_ETH_ReleaseTxPacket(&heth);
+
+    // Also refills descriptors left empty when the pool ran dry
+    uint8_t i;
+    for (i = 0; i < NETIF_RX_BUDGET; i++) {
+        void *frame = NULL;
+        uint32_t extStatus = ptpClock.running ? NETIF_rxExtStatus() : 0;
+        if (HAL_ETH_ReadData(&heth, &frame) != HAL_OK) {
+            break;
+        }
+        NETIF_receive((NETIF_Buffer *)frame, extStatus);
+    }
+    if (i == NETIF_RX_BUDGET) {
+        netif.pending = 1;              // More may be waiting
+    }
+}
+
+/**
+ * @brief  Says when NETIF_process() next has work. Call with interrupts
+ *         masked, so a frame arriving after the check still wakes the core.
+ *
+ * @return Milliseconds until then, 0 if now
+ **/
+uint32_t NETIF_nextPoll(void) {
+    if (netif.pending) {
+        return 0;
+    }
+    if (link.state != NETIF_LINK_IDLE) {
+        return 1;                       // MDIO read in flight, picked up on the next SysTick
+    }
+    return IDLE_msLeft(HAL_GetTick(), link.polledAt, NETIF_LINK_POLL_MS);
+}
+
+/**
+ * @brief  Copies out the frame and link counters
+ *
+ * @param  stats Filled in
+ *
+ * @return @c NULL
+ **/
+void NETIF_getStats(NETIF_Stats *stats) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    *stats = netif.stats;
+    __set_PRIMASK(primask);
+}
+
+/**
+ * @brief  Starts the MAC's PTP clock from zero with fine correction, and
+ *         timestamping of PTP Sync messages received over UDP/IPv4.
+ *         MX_ETH_Init() must already have run.
+ *
+ * @return 0 on success, -1 if HCLK is too slow to drive the clock
+ **/
+int NETIF_clockStart(void) {
+    uint64_t addend = ((uint64_t)NETIF_CLOCK_HZ << 32) / HAL_RCC_GetHCLKFreq();
+    if (addend > UINT32_MAX) {
+        return -1;
+    }
+
+    ETH_PTP_ConfigTypeDef config = {
+        .Timestamp = ENABLE,
+        .TimestampUpdateMode = ENABLE,          // Fine correction through the addend
+        .TimestampUpdate = ENABLE,
+        .TimestampAddendUpdate = ENABLE,
+        .TimestampRolloverMode = ENABLE,        // Subseconds count ns rather than 2^-31 s
+        .TimestampV2 = ENABLE,
+        .TimestampIPv4 = ENABLE,
+        .TimestampEvent = ENABLE,               // As an ordinary clock's slave, Sync only
+        .TimestampAddend = (uint32_t)addend,
+        .TimestampSubsecondInc = NETIF_CLOCK_INC_NS
+    };
+    if (HAL_ETH_PTP_SetConfig(&heth, &config) != HAL_OK) {
+        return -1;
+    }
+    WAIT_WHILE(NETIF_CLOCK_TSSTI, ETH->PTPTSCR & (ETH_PTPTSCR_TSSTI | ETH_PTPTSCR_TSSTU));
+
+    ptpClock.addend = (uint32_t)addend;
+    ptpClock.running = 1;
+    return 0;
+}
+
+/**
+ * @brief  Reads the PTP clock
+ *
+ * @return Nanoseconds, 0 onwards from NETIF_clockStart() until stepped
+ **/
+int64_t NETIF_clockNow(void) {
+    uint32_t secs;
+    uint32_t subsecs;
+    do {
+        secs = ETH->PTPTSHR;
+        subsecs = ETH->PTPTSLR;
+    } while (secs != ETH->PTPTSHR);             // Seconds rolled over between the reads
+    return NETIF_stampNs(secs, subsecs);
+}
+
+/**
+ * @brief  Moves the PTP clock by an offset without stopping it.
+ *         HAL_ETH_PTP_AddTimeOffset() is not used: it also rewrites the
+ *         addend, and encodes negative offsets as the later MACs want
+ *         rather than with the sign bit this one takes.
+ *
+ * @param  ns Nanoseconds to add, negative to go back
+ *
+ * @return @c NULL
+ **/
+void NETIF_clockStep(int64_t ns) {
+    if (!ptpClock.running || ns == 0) {
+        return;
+    }
+    uint64_t size = ns < 0 ? (uint64_t)-ns : (uint64_t)ns;
+    ETH->PTPTSHUR = (uint32_t)(size / NETIF_NS_PER_SEC);
+    ETH->PTPTSLUR = (ns < 0 ? ETH_PTPTSLUR_TSUPNS : 0U) | (uint32_t)(size % NETIF_NS_PER_SEC);
+    ETH->PTPTSCR |= ETH_PTPTSCR_TSSTU;
+    WAIT_WHILE(NETIF_CLOCK_TSSTU, ETH->PTPTSCR & ETH_PTPTSCR_TSSTU);
+}
+
+/**
+ * @brief  Sets the PTP clock's rate against the nominal one
+ *
+ * @param  ppb Parts per billion, positive to run faster. Clamped to
+ *             NETIF_CLOCK_MAX_PPB.
+ *
+ * @return @c NULL
+ **/
+void NETIF_clockAdjust(int32_t ppb) {
+    if (!ptpClock.running) {
+        return;
+    }
+    if (ppb > NETIF_CLOCK_MAX_PPB) {
+        ppb = NETIF_CLOCK_MAX_PPB;
+    }
+    if (ppb < -NETIF_CLOCK_MAX_PPB) {
+        ppb = -NETIF_CLOCK_MAX_PPB;
+    }
+    ETH->PTPTSAR = (uint32_t)(ptpClock.addend + (int64_t)ptpClock.addend * ppb / NETIF_NS_PER_SEC);
+    ETH->PTPTSCR |= ETH_PTPTSCR_TSARU;
+    WAIT_WHILE(NETIF_CLOCK_TSARU, ETH->PTPTSCR & ETH_PTPTSCR_TSARU);
+}
+
+/**
+ * @brief  Has the MAC timestamp a frame as it goes out, for
+ *         NETIF_txTimestamp(). Call before passing the buffer to
+ *         NETIF_send(), directly or through NET. One frame at a time.
+ *
+ * @param  buffer Frame about to be sent
+ *
+ * @return @c NULL
+ **/
+void NETIF_stampTx(NETIF_Buffer *buffer) {
+    ptpClock.stampNext = buffer;
+    ptpClock.txReady = 0;
+}
+
+/**
+ * @brief  Collects the send timestamp of the frame marked with
+ *         NETIF_stampTx(), once the DMA has finished with it
+ *
+ * @param  ns Filled in with the PTP clock time the frame left
+ *
+ * @return 0 once, when the timestamp is ready, otherwise -1
+ **/
+int NETIF_txTimestamp(int64_t *ns) {
+    if (!ptpClock.txReady) {
+        return -1;
+    }
+    ptpClock.txReady = 0;
+    *ns = ptpClock.txStamp;
+    return 0;
+}
+
+/**
+ * @brief  Gets the receive timestamp of the frame being handed up. Only
+ *         valid from within the receive handler.
+ *
+ * @param  ns Filled in with the PTP clock time the frame arrived
+ *
+ * @return 0 if the MAC timestamped the frame, -1 if not
+ **/
+int NETIF_rxTimestamp(int64_t *ns) {
+    if (!ptpClock.rxValid) {
+        return -1;
+    }
+    *ns = ptpClock.rxStamp;
+    return 0;
+}
+
+/**
+ * @brief  Lets every multicast frame past the MAC's address filter. The
+ *         hash filter would narrow it to joined groups, but NET already
+ *         drops datagrams for ports nobody has bound.
+ *
+ * @param  pass 1 to receive multicast, 0 for our address and broadcast only
+ *
+ * @return @c NULL
+ **/
+void NETIF_passMulticast(uint8_t pass) {
+    ETH_MACFilterConfigTypeDef filter;
+    HAL_ETH_GetMACFilterConfig(&heth, &filter);
+    filter.PassAllMulticast = pass ? ENABLE : DISABLE;
+    HAL_ETH_SetMACFilterConfig(&heth, &filter);
+}
+
+/*
+ * The HAL hooks below override the driver's weak callbacks. The
+ * HAL_ETH_Register*Callback() functions are compiled either way, but with
+ * USE_HAL_ETH_REGISTER_CALLBACKS at 0 every call site in the driver calls
+ * the weak function directly and never the pointer they would set, so
+ * registering a hook would have no effect.
+ */
+
+/**
+ * @brief  HAL hook giving the next empty RX descriptor a pool buffer. Leaving
+ *         buff NULL makes the HAL retry from the next HAL_ETH_ReadData().
+ **/
+void HAL_ETH_RxAllocateCallback(uint8_t **buff) {
+    NETIF_Buffer *buffer = NETIF_alloc();
+    if (buffer == NULL) {
+        netif.stats.rxNoBuffer++;
+        *buff = NULL;
+        return;
+    }
+    *buff = buffer->data;
+}
+
+/**
+ * @brief  HAL hook for each filled RX buffer, chaining the buffers of one
+ *         frame. Length is the frame length so far, FCS included.
+ **/
+void HAL_ETH_RxLinkCallback(void **pStart, void **pEnd, uint8_t *buff, uint16_t Length) {
+    NETIF_Buffer *buffer = POOL_fromData(buff);
+    buffer->length = Length;
+    buffer->next = NULL;
+
+    if (*pStart == NULL) {
+        *pStart = buffer;
+    } else {
+        ((NETIF_Buffer *)*pEnd)->next = buffer;
+    }
+    *pEnd = buffer;
+}
+
+/**
+ * @brief  HAL hook for a frame the DMA has finished sending. buff is the
+ *         pData NETIF_send() queued it with.
+ **/
+void HAL_ETH_TxFreeCallback(uint32_t *buff) {
+    NETIF_free((NETIF_Buffer *)buff);
+}
+
+/**
+ * @brief  HAL hook for a sent frame the MAC timestamped, just before
+ *         HAL_ETH_TxFreeCallback(). Only the NETIF_stampTx() frame asks.
+ **/
+void HAL_ETH_TxPtpCallback(uint32_t *buff, ETH_TimeStampTypeDef *timestamp) {
+    (void)buff;
+    ptpClock.txStamp = NETIF_stampNs(timestamp->TimeStampHigh, timestamp->TimeStampLow);
+    ptpClock.txReady = 1;
+    netif.stats.txStamped++;
+}
+
+/**
+ * @brief  HAL hook for the receive interrupt. Frames are read in
+ *         NETIF_process(), this only keeps the core awake for it.
+ **/
+void HAL_ETH_RxCpltCallback(ETH_HandleTypeDef *handle) {
+    (void)handle;
+    netif.pending = 1;
+}
+
+/**
+ * @brief  HAL hook for the transmit interrupt. Sent frames and their
+ *         timestamps are collected in NETIF_process().
+ **/
+void HAL_ETH_TxCpltCallback(ETH_HandleTypeDef *handle) {
+    (void)handle;
+    netif.pending = 1;
+}
+
+/**
+ * @brief  HAL hook for abnormal DMA interrupts, counted. RX buffer
+ *         unavailable is one, and clears as NETIF_process() refills.
+ **/
+void HAL_ETH_ErrorCallback(ETH_HandleTypeDef *handle) {
+    (void)handle;
+    netif.stats.dmaErrors++;
+    netif.pending = 1;
+}
\ No newline at end of file
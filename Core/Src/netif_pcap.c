@@ -0,0 +1,671 @@
+/***********************************************************************************
+ * @file        netif_pcap.c                                                       *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  ETH                                                                *
+ * @brief       Host-side frame layer over a simulated descriptor ring, fed from   *
+ *              pcap files or an in-process peer, with the MAC's address filter,   *
+ *              checksum offload and PTP clock emulated and all traffic captured.  *
+ ***********************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "netif_pcap.h"
+#include "idle.h"
+#include "stm32f4xx_hal.h"      // ETH_RX_DESC_CNT, ETH_TX_DESC_CNT
+
+#define PCAP_MAGIC_US       0xA1B2C3D4U
+#define PCAP_MAGIC_NS       0xA1B23C4DU
+#define PCAP_LINK_ETHERNET  1U
+#define PCAP_SNAPLEN        65535U
+
+#define PCAP_ETH_HEADER     14U
+#define PCAP_PROTO_ICMP     1U
+#define PCAP_PROTO_TCP      6U
+#define PCAP_PROTO_UDP      17U
+#define PCAP_PTP_EVENT_PORT 319U
+
+typedef struct {
+    uint32_t magic;
+    uint16_t major;
+    uint16_t minor;
+    int32_t zone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} PcapFileHeader;
+
+typedef struct {
+    uint32_t sec;
+    uint32_t frac;                      // Microseconds, or nanoseconds for PCAP_MAGIC_NS
+    uint32_t captured;
+    uint32_t original;
+} PcapRecord;
+
+// What the DMA and the application each hold of an RX descriptor
+typedef enum {
+    PCAP_DESC_EMPTY     = 0,            // No buffer, refilled from NETIF_process()
+    PCAP_DESC_OWNED     = 1,            // Buffer waiting for a frame
+    PCAP_DESC_READY     = 2             // Frame waiting for NETIF_process()
+} PcapDescState;
+
+static const uint8_t macAddress[6] = { 0x00, 0x80, 0xE1, 0x00, 0x00, 0x00 };   // As MX_ETH_Init()
+
+static struct {
+    NETIF_RxHandler handler;
+    NETIF_Stats stats;
+
+    PcapDescState rxState[ETH_RX_DESC_CNT];
+    NETIF_Buffer *rxDesc[ETH_RX_DESC_CNT];
+    uint8_t rxHead;                     // Next descriptor the "DMA" fills
+    uint8_t rxTail;                     // Next descriptor handed up
+    NETIF_Buffer *txDesc[ETH_TX_DESC_CNT];
+    uint8_t txHead;
+    uint8_t txTail;
+    uint8_t txUsed;
+
+    int64_t rxStamp[ETH_RX_DESC_CNT];
+    uint8_t rxStamped[ETH_RX_DESC_CNT];
+    uint8_t txStamp[ETH_TX_DESC_CNT];   // Frame asked for a send timestamp
+    uint8_t passMulticast;
+
+    NETIF_PcapPeer peer;
+    FILE *capture;
+    uint64_t nowNs;
+} sim;
+
+/*
+ * The PTP clock runs on from base at the board oscillator's rate, which is
+ * off by drift, corrected by ppb. It counts in NETIF_CLOCK_INC_NS steps as
+ * the MAC's does.
+ */
+static struct {
+    uint8_t running;
+    int64_t base;
+    uint64_t at;                        // Virtual time base was taken at
+    int32_t ppb;
+    int32_t drift;
+    NETIF_Buffer *stampNext;
+    uint8_t txReady;
+    int64_t txStamp;
+    uint8_t rxValid;
+    int64_t rxStamp;
+} ptpClock;
+
+__attribute__((weak)) uint32_t HAL_GetTick(void) {
+    return (uint32_t)(sim.nowNs / 1000000U);
+}
+
+static uint16_t PCAP_get16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static void PCAP_put16(uint8_t *p, uint16_t value) {
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)value;
+}
+
+static uint32_t PCAP_sum(const uint8_t *p, uint32_t size, uint32_t sum) {
+    for (uint32_t i = 0; i + 1 < size; i += 2) {
+        sum += PCAP_get16(&p[i]);
+    }
+    if (size & 1U) {
+        sum += (uint32_t)p[size - 1] << 8;
+    }
+    return sum;
+}
+
+static uint16_t PCAP_fold(uint32_t sum) {
+    while (sum >> 16) {
+        sum = (sum & 0xFFFFU) + (sum >> 16);
+    }
+    return (uint16_t)~sum;
+}
+
+/*
+ * Finds the IPv4 header and transport segment of a frame, NULL for anything
+ * the MAC's checksum engine would pass over: non-IPv4, truncated, fragments.
+ */
+static uint8_t *PCAP_segment(const uint8_t *frame, uint16_t length, uint16_t *headerLength, uint16_t *segment) {
+    if (length < PCAP_ETH_HEADER + 20U || PCAP_get16(&frame[12]) != 0x0800U || (frame[PCAP_ETH_HEADER] >> 4) != 4) {
+        return NULL;
+    }
+    uint8_t *ip = (uint8_t *)&frame[PCAP_ETH_HEADER];
+    uint16_t ihl = (uint16_t)((ip[0] & 0x0FU) * 4U);
+    uint16_t total = PCAP_get16(&ip[2]);
+    if (ihl < 20U || total < ihl || total > length - PCAP_ETH_HEADER) {
+        return NULL;
+    }
+    *headerLength = ihl;
+    *segment = (PCAP_get16(&ip[6]) & 0x3FFFU) == 0 ? (uint16_t)(total - ihl) : 0;
+    return ip;
+}
+
+// Checksum over a transport segment, with the pseudo-header for TCP and UDP
+static uint16_t PCAP_transportSum(const uint8_t *ip, const uint8_t *l4, uint16_t size) {
+    uint32_t sum = 0;
+    if (ip[9] != PCAP_PROTO_ICMP) {
+        sum = PCAP_sum(&ip[12], 8, 0) + ip[9] + size;
+    }
+    return PCAP_fold(PCAP_sum(l4, size, sum));
+}
+
+static int16_t PCAP_checksumField(uint8_t proto, uint16_t size) {
+    if (proto == PCAP_PROTO_UDP && size >= 8) {
+        return 6;
+    }
+    if (proto == PCAP_PROTO_TCP && size >= 20) {
+        return 16;
+    }
+    if (proto == PCAP_PROTO_ICMP && size >= 4) {
+        return 2;
+    }
+    return -1;
+}
+
+static int64_t PCAP_clockExact(void) {
+    int64_t elapsed = (int64_t)(sim.nowNs - ptpClock.at);
+    return ptpClock.base + elapsed + elapsed * (ptpClock.drift + ptpClock.ppb) / NETIF_NS_PER_SEC;
+}
+
+static int64_t PCAP_clockRead(void) {
+    int64_t ns = PCAP_clockExact();
+    return ns - ns % NETIF_CLOCK_INC_NS;
+}
+
+// Before the rate changes, so time already run keeps the old one
+static void PCAP_clockRebase(void) {
+    ptpClock.base = PCAP_clockExact();
+    ptpClock.at = sim.nowNs;
+}
+
+// What NETIF_clockStart() has the MAC timestamp: PTP Sync over UDP/IPv4
+static uint8_t PCAP_isSync(const uint8_t *frame, uint16_t length) {
+    uint16_t headerLength;
+    uint16_t segment;
+    const uint8_t *ip = PCAP_segment(frame, length, &headerLength, &segment);
+    if (ip == NULL || ip[9] != PCAP_PROTO_UDP || segment < 8U + 2U) {
+        return 0;
+    }
+    const uint8_t *udp = ip + headerLength;
+    return PCAP_get16(&udp[2]) == PCAP_PTP_EVENT_PORT && (udp[8] & 0x0FU) == 0 && (udp[9] & 0x0FU) == 2;
+}
+
+static void PCAP_record(const uint8_t *frame, uint16_t length) {
+    if (sim.capture == NULL) {
+        return;
+    }
+    uint32_t now = HAL_GetTick();
+    PcapRecord record = { now / 1000U, (now % 1000U) * 1000U, length, length };
+    fwrite(&record, sizeof(record), 1, sim.capture);
+    fwrite(frame, 1, length, sim.capture);
+}
+
+// The MAC's perfect filter: our address and broadcast, and multicast if passed
+static uint8_t PCAP_accepted(const uint8_t *frame) {
+    static const uint8_t broadcast[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    return memcmp(frame, macAddress, 6) == 0 || memcmp(frame, broadcast, 6) == 0
+        || (sim.passMulticast && (frame[0] & 1U));
+}
+
+// HAL_ETH_ReadData()'s descriptor refill, in ring order
+static void PCAP_refill(void) {
+    for (uint8_t i = 0; i < ETH_RX_DESC_CNT; i++) {
+        uint8_t index = (uint8_t)((sim.rxHead + i) % ETH_RX_DESC_CNT);
+        if (sim.rxState[index] != PCAP_DESC_EMPTY) {
+            continue;
+        }
+        NETIF_Buffer *buffer = NETIF_alloc();
+        if (buffer == NULL) {
+            sim.stats.rxNoBuffer++;
+            return;
+        }
+        sim.rxDesc[index] = buffer;
+        sim.rxState[index] = PCAP_DESC_OWNED;
+    }
+}
+
+// HAL_ETH_ReleaseTxPacket(): each queued frame goes out, in order
+static void PCAP_transmit(void) {
+    while (sim.txUsed > 0) {
+        NETIF_Buffer *buffer = sim.txDesc[sim.txTail];
+        if (sim.txStamp[sim.txTail]) {
+            ptpClock.txStamp = PCAP_clockRead();
+            ptpClock.txReady = 1;
+            sim.stats.txStamped++;
+        }
+        sim.txDesc[sim.txTail] = NULL;
+        sim.txTail = (uint8_t)((sim.txTail + 1) % ETH_TX_DESC_CNT);
+        sim.txUsed--;
+
+        NETIF_pcapChecksum(buffer->data, buffer->length);
+        PCAP_record(buffer->data, buffer->length);
+        if (sim.peer != NULL) {
+            sim.peer(buffer->data, buffer->length);
+        }
+        NETIF_free(buffer);
+    }
+}
+
+void NETIF_init(NETIF_RxHandler handler) {
+    // The capture, peer, clocks and MAC filter outlive a restart of the stack
+    NETIF_PcapPeer peer = sim.peer;
+    FILE *capture = sim.capture;
+    uint64_t nowNs = sim.nowNs;
+    uint8_t passMulticast = sim.passMulticast;
+    memset(&sim, 0, sizeof(sim));
+    sim.peer = peer;
+    sim.capture = capture;
+    sim.nowNs = nowNs;
+    sim.passMulticast = passMulticast;
+    ptpClock.stampNext = NULL;
+    ptpClock.txReady = 0;
+
+    POOL_init();
+    sim.handler = handler;
+    sim.stats.linkUp = 1;
+    sim.stats.speed100 = 1;
+    sim.stats.fullDuplex = 1;
+    PCAP_refill();
+}
+
+void NETIF_setRxHandler(NETIF_RxHandler handler) {
+    sim.handler = handler;
+}
+
+NETIF_Buffer *NETIF_alloc(void) {
+    return POOL_alloc();
+}
+
+void NETIF_free(NETIF_Buffer *buffer) {
+    POOL_release(buffer);
+}
+
+int NETIF_send(NETIF_Buffer *buffer, uint16_t length) {
+    uint8_t stamp = buffer == ptpClock.stampNext;
+    if (stamp) {
+        ptpClock.stampNext = NULL;
+    }
+
+    if (!sim.stats.linkUp || length == 0 || length > NETIF_BUF_SIZE) {
+        NETIF_free(buffer);
+        return -1;
+    }
+    if (sim.txUsed == ETH_TX_DESC_CNT) {
+        sim.stats.txBusy++;
+        NETIF_free(buffer);
+        return -1;
+    }
+
+    buffer->length = length;
+    sim.txDesc[sim.txHead] = buffer;
+    sim.txStamp[sim.txHead] = stamp && ptpClock.running;
+    sim.txHead = (uint8_t)((sim.txHead + 1) % ETH_TX_DESC_CNT);
+    sim.txUsed++;
+    sim.stats.txFrames++;
+    sim.stats.txBytes += length;
+    return 0;
+}
+
+const uint8_t *NETIF_macAddress(void) {
+    return macAddress;
+}
+
+uint8_t NETIF_linkUp(void) {
+    return sim.stats.linkUp;
+}
+
+void NETIF_process(void) {
+    PCAP_transmit();
+
+    for (uint8_t i = 0; i < NETIF_RX_BUDGET && sim.rxState[sim.rxTail] == PCAP_DESC_READY; i++) {
+        NETIF_Buffer *frame = sim.rxDesc[sim.rxTail];
+        ptpClock.rxValid = sim.rxStamped[sim.rxTail];
+        ptpClock.rxStamp = sim.rxStamp[sim.rxTail];
+        sim.rxDesc[sim.rxTail] = NULL;
+        sim.rxState[sim.rxTail] = PCAP_DESC_EMPTY;
+        sim.rxTail = (uint8_t)((sim.rxTail + 1) % ETH_RX_DESC_CNT);
+
+        sim.stats.rxFrames++;
+        sim.stats.rxBytes += frame->length;
+        sim.stats.rxStamped += ptpClock.rxValid;
+        if (sim.handler == NULL) {
+            sim.stats.rxDropped++;
+            NETIF_free(frame);
+        } else {
+            sim.handler(frame);
+        }
+        ptpClock.rxValid = 0;
+    }
+    PCAP_refill();
+}
+
+uint32_t NETIF_nextPoll(void) {
+    return sim.rxState[sim.rxTail] == PCAP_DESC_READY || sim.txUsed ? 0 : IDLE_NEVER;
+}
+
+void NETIF_getStats(NETIF_Stats *stats) {
+    *stats = sim.stats;
+}
+
+int NETIF_clockStart(void) {
+    ptpClock.running = 1;
+    ptpClock.base = 0;
+    ptpClock.at = sim.nowNs;
+    ptpClock.ppb = 0;
+    return 0;
+}
+
+int64_t NETIF_clockNow(void) {
+    return PCAP_clockRead();
+}
+
+void NETIF_clockStep(int64_t ns) {
+    if (!ptpClock.running) {
+        return;
+    }
+    PCAP_clockRebase();
+    ptpClock.base += ns;
+}
+
+void NETIF_clockAdjust(int32_t ppb) {
+    if (!ptpClock.running) {
+        return;
+    }
+    if (ppb > NETIF_CLOCK_MAX_PPB) {
+        ppb = NETIF_CLOCK_MAX_PPB;
+    }
+    if (ppb < -NETIF_CLOCK_MAX_PPB) {
+        ppb = -NETIF_CLOCK_MAX_PPB;
+    }
+    PCAP_clockRebase();
+    ptpClock.ppb = ppb;
+}
+
+void NETIF_stampTx(NETIF_Buffer *buffer) {
+    ptpClock.stampNext = buffer;
+    ptpClock.txReady = 0;
+}
+
+int NETIF_txTimestamp(int64_t *ns) {
+    if (!ptpClock.txReady) {
+        return -1;
+    }
+    ptpClock.txReady = 0;
+    *ns = ptpClock.txStamp;
+    return 0;
+}
+
+int NETIF_rxTimestamp(int64_t *ns) {
+    if (!ptpClock.rxValid) {
+        return -1;
+    }
+    *ns = ptpClock.rxStamp;
+    return 0;
+}
+
+void NETIF_passMulticast(uint8_t pass) {
+    sim.passMulticast = pass;
+}
+
+/**
+ * @brief  Starts capturing every frame received and sent
+ *
+ * @param  path pcap file to create
+ *
+ * @return 0 on success, -1 if the file cannot be created
+ **/
+int NETIF_pcapCapture(const char *path) {
+    NETIF_pcapClose();
+    sim.capture = fopen(path, "wb");
+    if (sim.capture == NULL) {
+        return -1;
+    }
+    PcapFileHeader header = { PCAP_MAGIC_US, 2, 4, 0, 0, PCAP_SNAPLEN, PCAP_LINK_ETHERNET };
+    fwrite(&header, sizeof(header), 1, sim.capture);
+    return 0;
+}
+
+/**
+ * @brief  Finishes the capture file
+ *
+ * @return @c NULL
+ **/
+void NETIF_pcapClose(void) {
+    if (sim.capture != NULL) {
+        fclose(sim.capture);
+        sim.capture = NULL;
+    }
+}
+
+/**
+ * @brief  Sets the function each sent frame is handed to, for an in-process
+ *         loopback. The peer may call NETIF_pcapInject() to answer.
+ *
+ * @param  peer Called from NETIF_process(), NULL for none
+ *
+ * @return @c NULL
+ **/
+void NETIF_pcapSetPeer(NETIF_PcapPeer peer) {
+    sim.peer = peer;
+}
+
+/**
+ * @brief  Plugs or unplugs the cable. Sends fail while the link is down.
+ *
+ * @param  up 1 for a 100 Mbit full-duplex link
+ *
+ * @return @c NULL
+ **/
+void NETIF_pcapSetLink(uint8_t up) {
+    if (up != sim.stats.linkUp) {
+        sim.stats.linkChanges++;
+    }
+    sim.stats.linkUp = up;
+}
+
+/**
+ * @brief  Receives a frame as the MAC would: filtered on the destination
+ *         address, dropped on a bad IPv4 or transport checksum, and written
+ *         into the next RX descriptor if it has a buffer. PTP Sync messages
+ *         are timestamped with the PTP clock at the current virtual time.
+ *
+ * @param  frame  Frame from the destination MAC, without the FCS
+ * @param  length Frame bytes
+ *
+ * @return 0 if queued for NETIF_process(), -1 if filtered, bad, too big, or
+ *         the ring had no buffer for it
+ **/
+int NETIF_pcapInject(const uint8_t *frame, uint16_t length) {
+    if (!sim.stats.linkUp || length < PCAP_ETH_HEADER || !PCAP_accepted(frame)) {
+        return -1;
+    }
+    if (length > ETH_RX_BUF_SIZE - NETIF_FCS_SIZE) {
+        sim.stats.rxOversize++;
+        return -1;
+    }
+    if (NETIF_pcapVerify(frame, length) != 0) {
+        sim.stats.rxErrors++;
+        return -1;
+    }
+    if (sim.rxState[sim.rxHead] != PCAP_DESC_OWNED) {
+        sim.stats.dmaErrors++;                  // RX buffer unavailable, the frame is lost
+        return -1;
+    }
+
+    NETIF_Buffer *buffer = sim.rxDesc[sim.rxHead];
+    memcpy(buffer->data, frame, length);
+    buffer->length = length;
+    sim.rxStamped[sim.rxHead] = ptpClock.running && PCAP_isSync(frame, length);
+    sim.rxStamp[sim.rxHead] = PCAP_clockRead();
+    sim.rxState[sim.rxHead] = PCAP_DESC_READY;
+    sim.rxHead = (uint8_t)((sim.rxHead + 1) % ETH_RX_DESC_CNT);
+    PCAP_record(frame, length);
+    return 0;
+}
+
+/**
+ * @brief  Feeds a capture through NETIF_pcapInject(), moving the virtual
+ *         clock with its timestamps and running step after every frame.
+ *         Only frames addressed to the MAC get through.
+ *
+ * @param  path pcap file, Ethernet link type, micro or nanosecond stamps
+ * @param  step Main-loop work to run after each frame, at least NETIF_process()
+ *
+ * @return Frames accepted, or -1 if the file cannot be read
+ **/
+int NETIF_pcapReplay(const char *path, NETIF_PcapStep step) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+
+    PcapFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.linktype != PCAP_LINK_ETHERNET
+            || (header.magic != PCAP_MAGIC_US && header.magic != PCAP_MAGIC_NS)) {
+        fclose(file);
+        return -1;
+    }
+    uint32_t nsPerFrac = header.magic == PCAP_MAGIC_NS ? 1U : 1000U;
+
+    static uint8_t frame[PCAP_SNAPLEN];
+    PcapRecord record;
+    uint64_t firstNs = 0;
+    uint64_t startNs = sim.nowNs;
+    uint8_t first = 1;
+    int accepted = 0;
+
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.captured > PCAP_SNAPLEN || fread(frame, 1, record.captured, file) != record.captured) {
+            break;
+        }
+        uint64_t ns = (uint64_t)record.sec * NETIF_NS_PER_SEC + (uint64_t)record.frac * nsPerFrac;
+        if (first) {
+            firstNs = ns;
+            first = 0;
+        }
+        if (ns >= firstNs && startNs + (ns - firstNs) > sim.nowNs) {
+            sim.nowNs = startNs + (ns - firstNs);
+        }
+
+        // Captures taken with the FCS keep it, the MAC would have stripped it
+        uint16_t length = (uint16_t)(record.captured < record.original ? record.captured : record.original);
+        if (NETIF_pcapInject(frame, length) == 0) {
+            accepted++;
+        }
+        if (step != NULL) {
+            step();
+        }
+    }
+
+    fclose(file);
+    return accepted;
+}
+
+/**
+ * @brief  Moves the virtual clock behind HAL_GetTick() on
+ *
+ * @param  ms Milliseconds
+ *
+ * @return @c NULL
+ **/
+void NETIF_pcapAdvance(uint32_t ms) {
+    sim.nowNs += (uint64_t)ms * 1000000U;
+}
+
+/**
+ * @brief  Moves the virtual clock on by less than a tick, to place frames
+ *         between milliseconds for the PTP clock
+ *
+ * @param  ns Nanoseconds
+ *
+ * @return @c NULL
+ **/
+void NETIF_pcapAdvanceNs(uint32_t ns) {
+    sim.nowNs += ns;
+}
+
+/**
+ * @brief  Gets the virtual clock, the true time a scripted PTP master
+ *         measures against
+ *
+ * @return Nanoseconds since the program started
+ **/
+uint64_t NETIF_pcapTime(void) {
+    return sim.nowNs;
+}
+
+/**
+ * @brief  Sets how far the board's oscillator is off, which the PTP clock
+ *         runs at until corrected by NETIF_clockAdjust()
+ *
+ * @param  ppb Parts per billion, positive for a fast oscillator
+ *
+ * @return @c NULL
+ **/
+void NETIF_pcapSetDrift(int32_t ppb) {
+    PCAP_clockRebase();
+    ptpClock.drift = ppb;
+}
+
+/**
+ * @brief  Fills in the IPv4 header checksum and the UDP, TCP or ICMP
+ *         checksum of a frame, as ETH_CHECKSUM_IPHDR_PAYLOAD_INSERT_PHDR_CALC
+ *         has the MAC do for everything sent. Fragments keep their
+ *         transport checksum.
+ *
+ * @param  frame  Frame from the destination MAC
+ * @param  length Frame bytes
+ *
+ * @return @c NULL
+ **/
+void NETIF_pcapChecksum(uint8_t *frame, uint16_t length) {
+    uint16_t headerLength;
+    uint16_t segment;
+    uint8_t *ip = PCAP_segment(frame, length, &headerLength, &segment);
+    if (ip == NULL) {
+        return;
+    }
+
+    PCAP_put16(&ip[10], 0);
+    PCAP_put16(&ip[10], PCAP_fold(PCAP_sum(ip, headerLength, 0)));
+
+    int16_t field = PCAP_checksumField(ip[9], segment);
+    if (field < 0) {
+        return;
+    }
+    uint8_t *l4 = ip + headerLength;
+    PCAP_put16(&l4[field], 0);
+    uint16_t sum = PCAP_transportSum(ip, l4, segment);
+    if (sum == 0 && ip[9] == PCAP_PROTO_UDP) {
+        sum = 0xFFFFU;                          // Zero means no checksum
+    }
+    PCAP_put16(&l4[field], sum);
+}
+
+/**
+ * @brief  Checks a frame's IPv4 and transport checksums the way the MAC's
+ *         receive offload does. A UDP checksum of zero is not checked.
+ *
+ * @param  frame  Frame from the destination MAC
+ * @param  length Frame bytes
+ *
+ * @return 0 if good or not IPv4, -1 for a bad header, -2 for a bad payload
+ **/
+int NETIF_pcapVerify(const uint8_t *frame, uint16_t length) {
+    uint16_t headerLength;
+    uint16_t segment;
+    const uint8_t *ip = PCAP_segment(frame, length, &headerLength, &segment);
+    if (ip == NULL) {
+        return 0;
+    }
+    if (PCAP_fold(PCAP_sum(ip, headerLength, 0)) != 0) {
+        return -1;
+    }
+
+    int16_t field = PCAP_checksumField(ip[9], segment);
+    if (field < 0 || (ip[9] == PCAP_PROTO_UDP && PCAP_get16(&ip[headerLength + field]) == 0)) {
+        return 0;
+    }
+    return PCAP_transportSum(ip, ip + headerLength, segment) == 0 ? 0 : -2;
+}
\ No newline at end of file
@@ -0,0 +1,447 @@
+/***********************************************************************************
+ * @file        persist.c                                                          *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  RTC                                                                *
+ * @brief       Persistence tier in the RTC backup registers and backup SRAM.      *
+ *              Both are checksummed, written freely, and spilled to EEPROM as a   *
+ *              sequenced image every PERSIST_SPILL_MS or on a PVD brown-out.      *
+ ***********************************************************************************/
+
+#include <string.h>
+
+#include "persist.h"
+#include "crc.h"
+#include "wait.h"
+#include "trace.h"
+#include "idle.h"
+#include "stm32f4xx_hal.h"      // HAL_GetTick
+
+#define PERSIST_MAGIC       0x5E51U
+#define PERSIST_PVD_LEVEL   PWR_CR_PLS_LEV7     // ~2.9 V, leaves the most hold-up time
+#define PERSIST_EXTI_PVD    EXTI_IMR_MR16
+
+/*
+ * Backup register layout
+ * BKP0R        magic << 16 | CRC16 of BKP1R..BKP19R
+ * BKP1R        spill sequence
+ * BKP2R..      slots
+ */
+#define BKP                 ((volatile uint32_t *)&RTC->BKP0R)
+#define BKP_HEADER          0
+#define BKP_SEQUENCE        1
+#define BKP_SLOT            2
+
+typedef struct {
+    uint16_t magic;
+    uint16_t crc;
+    uint8_t data[PERSIST_SRAM_SIZE];
+} PERSIST_Sram;
+
+#define SRAM                ((PERSIST_Sram *)BKPSRAM_BASE)
+
+static struct {
+    PERSIST_Stats stats;
+    volatile uint8_t dirty;             // Backup domain differs from the last spill
+    volatile uint8_t brownout;
+    uint8_t inFlight;
+    uint32_t lastSpill;
+
+    EEPROM_Request req;
+    uint8_t image[PERSIST_IMAGE_SIZE];
+} persist;
+
+static uint16_t PERSIST_bkpCrc(void) {
+    uint32_t words[PERSIST_SLOTS + 1];
+
+    for (uint32_t i = 0; i < PERSIST_SLOTS + 1; i++) {
+        words[i] = BKP[BKP_SEQUENCE + i];
+    }
+    return CRC16_update(CRC16_INIT, (const uint8_t *)words, sizeof(words));
+}
+
+static void PERSIST_sealBkp(void) {
+    BKP[BKP_HEADER] = PERSIST_MAGIC << 16 | PERSIST_bkpCrc();
+}
+
+static uint8_t PERSIST_bkpValid(void) {
+    uint32_t header = BKP[BKP_HEADER];
+    return header >> 16 == PERSIST_MAGIC && (uint16_t)header == PERSIST_bkpCrc();
+}
+
+static void PERSIST_sealSram(void) {
+    SRAM->magic = PERSIST_MAGIC;
+    SRAM->crc = CRC16_update(CRC16_INIT, SRAM->data, PERSIST_SRAM_SIZE);
+}
+
+static uint8_t PERSIST_sramValid(void) {
+    return SRAM->magic == PERSIST_MAGIC &&
+           SRAM->crc == CRC16_update(CRC16_INIT, SRAM->data, PERSIST_SRAM_SIZE);
+}
+
+static uint8_t PERSIST_imageValid(const uint8_t *image) {
+    uint16_t crc = CRC16_update(CRC16_INIT, image, PERSIST_IMAGE_SIZE - 2);
+    return image[PERSIST_IMAGE_SIZE - 2] == (uint8_t)(crc >> 8) &&
+           image[PERSIST_IMAGE_SIZE - 1] == (uint8_t)crc;
+}
+
+static uint32_t PERSIST_imageSequence(const uint8_t *image) {
+    uint32_t seq;
+    memcpy(&seq, image, sizeof(seq));
+    return seq;
+}
+
+static uint16_t PERSIST_imageAddr(uint32_t seq) {
+    return PERSIST_EEPROM_BASE + (seq & 1) * PERSIST_IMAGE_SPAN;
+}
+
+// Blocking read of one EEPROM copy, only used at start-up
+static uint8_t PERSIST_loadImage(uint16_t addr, uint8_t *image) {
+    EEPROM_Request req = { .op = EEPROM_OP_READ, .addr = addr, .data = image, .size = PERSIST_IMAGE_SIZE };
+    EEPROM_Request *batch[] = { &req };
+
+    if (EEPROM_submit(batch, 1) != 0 || EEPROM_wait(&req) != EEPROM_DONE) {
+        return 0;
+    }
+    return PERSIST_imageValid(image);
+}
+
+/*
+ * Snapshots the backup domain into persist.image under the next sequence.
+ * The sequence itself only moves once the image is on EEPROM, so a failed
+ * spill is retried into the same copy and never overwrites the last good one.
+ */
+static void PERSIST_buildImage(void) {
+    uint8_t *p = persist.image;
+    uint32_t seq = persist.stats.sequence + 1;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    persist.dirty = 0;
+
+    memcpy(p, &seq, sizeof(seq));
+    p += sizeof(seq);
+    for (uint32_t i = 0; i < PERSIST_SLOTS; i++) {
+        uint32_t value = BKP[BKP_SLOT + i];
+        memcpy(p, &value, sizeof(value));
+        p += sizeof(value);
+    }
+    memcpy(p, SRAM->data, PERSIST_SRAM_SIZE);
+    p += PERSIST_SRAM_SIZE;
+
+    __set_PRIMASK(primask);
+
+    uint16_t crc = CRC16_update(CRC16_INIT, persist.image, PERSIST_IMAGE_SIZE - 2);
+    p[0] = crc >> 8;
+    p[1] = crc;
+}
+
+// The spilled image is on EEPROM, so the next spill goes to the other copy
+static void PERSIST_commit(void) {
+    uint32_t seq = PERSIST_imageSequence(persist.image);
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    persist.stats.sequence = seq;
+    BKP[BKP_SEQUENCE] = seq;
+    PERSIST_sealBkp();
+
+    __set_PRIMASK(primask);
+}
+
+/**
+ * @brief  Powers the backup domain and checks both tiers. A tier whose
+ *         checksum fails is restored from the newer EEPROM copy, or cleared
+ *         if neither copy is valid. Also arms the PVD brown-out interrupt.
+ *         Call after EEPROM_init(), before anything else touches the tier.
+ *
+ * @return Where the contents came from
+ **/
+PERSIST_Source PERSIST_init(void) {
+    memset(&persist, 0, sizeof(persist));
+
+    RCC->APB1ENR |= RCC_APB1ENR_PWREN;
+    PWR->CR |= PWR_CR_DBP;
+
+    // Backup SRAM only keeps its contents on VBAT with the regulator on
+    RCC->AHB1ENR |= RCC_AHB1ENR_BKPSRAMEN;
+    PWR->CSR |= PWR_CSR_BRE;
+    WAIT_WHILE(PERSIST_BRR, (PWR->CSR & PWR_CSR_BRR) == 0);
+
+    uint8_t bkpValid = PERSIST_bkpValid();
+    uint8_t sramValid = PERSIST_sramValid();
+    persist.stats.source = PERSIST_FROM_BACKUP;
+
+    if (!bkpValid || !sramValid) {
+        uint8_t other[PERSIST_IMAGE_SIZE];
+        const uint8_t *image = NULL;
+
+        uint8_t validA = PERSIST_loadImage(PERSIST_imageAddr(0), persist.image);
+        uint8_t validB = PERSIST_loadImage(PERSIST_imageAddr(1), other);
+
+        if (validA && validB) {
+            int32_t age = (int32_t)(PERSIST_imageSequence(other) - PERSIST_imageSequence(persist.image));
+            image = age > 0 ? other : persist.image;
+        }
+        else if (validA || validB) {
+            image = validA ? persist.image : other;
+        }
+
+        if (image != NULL) {
+            const uint8_t *p = image + sizeof(uint32_t);
+            persist.stats.source = PERSIST_FROM_EEPROM;
+
+            if (!bkpValid) {
+                for (uint32_t i = 0; i < PERSIST_SLOTS; i++) {
+                    uint32_t value;
+                    memcpy(&value, p + i * sizeof(value), sizeof(value));
+                    BKP[BKP_SLOT + i] = value;
+                }
+                BKP[BKP_SEQUENCE] = PERSIST_imageSequence(image);
+            }
+            if (!sramValid) {
+                memcpy(SRAM->data, p + PERSIST_SLOTS * sizeof(uint32_t), PERSIST_SRAM_SIZE);
+            }
+        }
+        else {
+            if (!bkpValid) {
+                for (uint32_t i = BKP_SEQUENCE; i < BKP_SLOT + PERSIST_SLOTS; i++) {
+                    BKP[i] = 0;
+                }
+            }
+            if (!sramValid) {
+                memset(SRAM->data, 0, PERSIST_SRAM_SIZE);
+            }
+            if (!bkpValid && !sramValid) {
+                persist.stats.source = PERSIST_BLANK;
+            }
+        }
+
+        PERSIST_sealBkp();
+        PERSIST_sealSram();
+    }
+
+    persist.stats.sequence = BKP[BKP_SEQUENCE];
+    persist.lastSpill = HAL_GetTick();
+
+    // PVD output rises as VDD falls through the threshold
+    PWR->CR = (PWR->CR & ~PWR_CR_PLS) | PERSIST_PVD_LEVEL | PWR_CR_PVDE;
+    EXTI->IMR |= PERSIST_EXTI_PVD;
+    EXTI->RTSR |= PERSIST_EXTI_PVD;
+    NVIC_EnableIRQ(PVD_IRQn);
+
+    return persist.stats.source;
+}
+
+/**
+ * @brief  Reads a slot
+ *
+ * @param  slot Index below PERSIST_SLOTS
+ *
+ * @return Stored value, 0 for an invalid slot
+ **/
+uint32_t PERSIST_get(uint8_t slot) {
+    if (slot >= PERSIST_SLOTS) {
+        return 0;
+    }
+    return BKP[BKP_SLOT + slot];
+}
+
+/**
+ * @brief  Writes a slot. Costs no EEPROM wear, the change reaches EEPROM with
+ *         the next spill. Safe to call from interrupts.
+ *
+ * @param  slot  Index below PERSIST_SLOTS
+ * @param  value Value to store
+ *
+ * @return @c NULL
+ **/
+void PERSIST_set(uint8_t slot, uint32_t value) {
+    if (slot >= PERSIST_SLOTS) {
+        return;
+    }
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    if (BKP[BKP_SLOT + slot] != value) {
+        BKP[BKP_SLOT + slot] = value;
+        PERSIST_sealBkp();
+        persist.dirty = 1;
+        persist.stats.writes++;
+    }
+
+    __set_PRIMASK(primask);
+}
+
+/**
+ * @brief  Adds one to a slot, for counters
+ *
+ * @param  slot Index below PERSIST_SLOTS
+ *
+ * @return New value
+ **/
+uint32_t PERSIST_increment(uint8_t slot) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    uint32_t value = PERSIST_get(slot) + 1;
+    PERSIST_set(slot, value);
+
+    __set_PRIMASK(primask);
+    return value;
+}
+
+/**
+ * @brief  Copies bytes out of the backup SRAM area
+ *
+ * @param  offset Start within the area
+ * @param  data   Destination
+ * @param  size   Number of bytes
+ *
+ * @return 0 on success, -1 if the range is outside the area
+ **/
+int PERSIST_read(uint16_t offset, void *data, uint16_t size) {
+    if ((uint32_t)offset + size > PERSIST_SRAM_SIZE) {
+        return -1;
+    }
+    memcpy(data, SRAM->data + offset, size);
+    return 0;
+}
+
+/**
+ * @brief  Writes bytes into the backup SRAM area and updates its checksum
+ *
+ * @param  offset Start within the area
+ * @param  data   Source
+ * @param  size   Number of bytes
+ *
+ * @return 0 on success, -1 if the range is outside the area
+ **/
+int PERSIST_write(uint16_t offset, const void *data, uint16_t size) {
+    if ((uint32_t)offset + size > PERSIST_SRAM_SIZE) {
+        return -1;
+    }
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    memcpy(SRAM->data + offset, data, size);
+    PERSIST_sealSram();
+    persist.dirty = 1;
+    persist.stats.writes++;
+
+    __set_PRIMASK(primask);
+    return 0;
+}
+
+/**
+ * @brief  Spills the tier to EEPROM when it has changed, at most every
+ *         PERSIST_SPILL_MS while the EEPROM is otherwise idle, or straight
+ *         away and ahead of queued requests after a brown-out warning.
+ *         Copies alternate so a spill torn by power loss leaves the previous
+ *         one intact, and a failed spill is retried into the same copy. Call
+ *         from the main loop.
+ *
+ * @return @c NULL
+ **/
+void PERSIST_process(void) {
+    if (persist.inFlight) {
+        if (persist.brownout && persist.req.status == EEPROM_PENDING) {
+            EEPROM_submitUrgent(&persist.req);  // The spill already queued goes first
+        }
+
+        EEPROM_Status status = EEPROM_poll(&persist.req);
+        if (status != EEPROM_DONE && status != EEPROM_ERROR) {
+            return;
+        }
+        persist.inFlight = 0;
+        if (status == EEPROM_DONE) {
+            PERSIST_commit();
+        }
+        else {
+            persist.stats.spillErrors++;
+            persist.dirty = 1;
+        }
+    }
+
+    if (!persist.dirty) {
+        persist.brownout = 0;           // Nothing to save, a later change waits its turn
+        return;
+    }
+
+    uint32_t now = HAL_GetTick();
+    if (!persist.brownout && (now - persist.lastSpill < PERSIST_SPILL_MS || !EEPROM_isIdle())) {
+        return;
+    }
+    uint8_t urgent = persist.brownout;
+    persist.brownout = 0;
+    persist.lastSpill = now;
+
+    PERSIST_buildImage();
+    uint32_t seq = PERSIST_imageSequence(persist.image);
+    TRACE_INSTANT(PERSIST_SPILL, seq, persist.stats.brownouts);
+
+    EEPROM_Request *batch[] = { &persist.req };
+    persist.req.op = EEPROM_OP_WRITE;
+    persist.req.addr = PERSIST_imageAddr(seq);
+    persist.req.data = persist.image;
+    persist.req.size = PERSIST_IMAGE_SIZE;
+    persist.req.callback = NULL;
+
+    // Hold-up time is short after a brown-out, so that spill overtakes queued requests
+    int queued = urgent ? EEPROM_submitUrgent(&persist.req) : EEPROM_submit(batch, 1);
+    if (queued == 0) {
+        persist.inFlight = 1;
+        persist.stats.spills++;
+    }
+    else {
+        persist.stats.spillErrors++;
+        persist.dirty = 1;
+    }
+}
+
+/**
+ * @brief  Says when PERSIST_process() next has a spill to start or finish.
+ *         Call with interrupts masked, so a brown-out after the check still
+ *         wakes the core. While a spill is queued, or one is due behind
+ *         other requests, the EEPROM is busy and IDLE_run() keeps the loop
+ *         turning until it is idle again.
+ *
+ * @return Milliseconds until then, 0 if now, IDLE_NEVER while clean or waiting on the EEPROM
+ **/
+uint32_t PERSIST_nextPoll(void) {
+    if (persist.inFlight) {
+        EEPROM_Status status = EEPROM_poll(&persist.req);
+        return (status == EEPROM_DONE || status == EEPROM_ERROR) ? 0 : IDLE_NEVER;
+    }
+    if (!persist.dirty) {
+        return IDLE_NEVER;
+    }
+    if (persist.brownout) {
+        return 0;
+    }
+
+    uint32_t left = IDLE_msLeft(HAL_GetTick(), persist.lastSpill, PERSIST_SPILL_MS);
+    return left == 0 && !EEPROM_isIdle() ? IDLE_NEVER : left;
+}
+
+/**
+ * @brief  Copies out the tier counters
+ *
+ * @param  stats Filled in by this function
+ *
+ * @return @c NULL
+ **/
+void PERSIST_getStats(PERSIST_Stats *stats) {
+    *stats = persist.stats;
+}
+
+// Called from PVD_IRQHandler
+void PERSIST_brownoutIrq(void) {
+    EXTI->PR = PERSIST_EXTI_PVD;
+    TRACE_INSTANT(PVD_IRQ, 0, 0);
+    persist.brownout = 1;
+    persist.stats.brownouts++;
+}
\ No newline at end of file
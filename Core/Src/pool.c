@@ -0,0 +1,162 @@
+/***********************************************************************************
+ * @file        pool.c                                                             *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  ETH                                                                *
+ * @brief       Fixed-size packet buffer pool with reference counts. Allocation    *
+ *              and release are O(1) and lock-free, a tagged free stack swapped    *
+ *              with LDREX/STREX, so interrupts and thread mode can share it       *
+ *              without masking. Buffer memory is placed in .ethbuf, which the     *
+ *              linker script keeps in DMA-reachable SRAM.                         *
+ ***********************************************************************************/
+
+#include <stddef.h>
+
+#include "pool.h"
+
+#define POOL_NONE           0xFFFFU     // Empty stack
+#define POOL_TAG            0x10000U    // Head is (tag << 16) | index, the tag stops ABA
+
+_Static_assert(POOL_BUF_SIZE % POOL_ALIGN == 0, "Buffers must stay aligned back to back");
+_Static_assert(POOL_BUF_COUNT < POOL_NONE, "Buffer index must fit the stack head");
+
+__attribute__((section(".ethbuf"), aligned(POOL_ALIGN))) static uint8_t poolData[POOL_BUF_COUNT][POOL_BUF_SIZE];
+
+static POOL_Buffer buffers[POOL_BUF_COUNT];
+static uint16_t links[POOL_BUF_COUNT];  // Next free buffer below each one
+
+static struct {
+    uint32_t head;
+    uint32_t available;
+    uint32_t low;
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t exhausted;
+} pool;
+
+static void POOL_push(uint16_t index) {
+    uint32_t head = __atomic_load_n(&pool.head, __ATOMIC_RELAXED);
+    uint32_t next;
+    do {
+        __atomic_store_n(&links[index], (uint16_t)head, __ATOMIC_RELAXED);
+        next = ((head + POOL_TAG) & ~0xFFFFU) | index;
+    } while (!__atomic_compare_exchange_n(&pool.head, &head, next, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * A stale link read after another context popped the same head is harmless:
+ * the pop bumped the tag, so the exchange fails and the loop reads again.
+ */
+static uint16_t POOL_pop(void) {
+    uint32_t head = __atomic_load_n(&pool.head, __ATOMIC_ACQUIRE);
+    uint32_t next;
+    do {
+        uint16_t index = (uint16_t)head;
+        if (index == POOL_NONE) {
+            return POOL_NONE;
+        }
+        next = ((head + POOL_TAG) & ~0xFFFFU) | __atomic_load_n(&links[index], __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&pool.head, &head, next, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    return (uint16_t)head;
+}
+
+/**
+ * @brief  Puts every buffer in the pool. Nothing may hold a buffer, and
+ *         nothing may allocate until it returns.
+ *
+ * @return @c NULL
+ **/
+void POOL_init(void) {
+    pool.head = POOL_NONE;
+    for (uint16_t i = 0; i < POOL_BUF_COUNT; i++) {
+        buffers[i].data = poolData[i];
+        buffers[i].length = 0;
+        buffers[i].refs = 0;
+        buffers[i].next = NULL;
+        POOL_push(i);
+    }
+    pool.available = POOL_BUF_COUNT;
+    pool.low = POOL_BUF_COUNT;
+    pool.allocs = 0;
+    pool.frees = 0;
+    pool.exhausted = 0;
+}
+
+/**
+ * @brief  Takes a buffer holding one reference. Safe from interrupts.
+ *
+ * @return The buffer, or NULL if the pool is empty
+ **/
+POOL_Buffer *POOL_alloc(void) {
+    uint16_t index = POOL_pop();
+    if (index == POOL_NONE) {
+        __atomic_fetch_add(&pool.exhausted, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    uint32_t available = __atomic_sub_fetch(&pool.available, 1, __ATOMIC_RELAXED);
+    uint32_t low = __atomic_load_n(&pool.low, __ATOMIC_RELAXED);
+    while (available < low
+            && !__atomic_compare_exchange_n(&pool.low, &low, available, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    __atomic_fetch_add(&pool.allocs, 1, __ATOMIC_RELAXED);
+
+    POOL_Buffer *buffer = &buffers[index];
+    buffer->length = 0;
+    buffer->next = NULL;
+    __atomic_store_n(&buffer->refs, 1, __ATOMIC_RELAXED);
+    return buffer;
+}
+
+/**
+ * @brief  Adds a reference, for handing a buffer to one more owner
+ *
+ * @param  buffer Buffer the caller already holds a reference to
+ *
+ * @return @c NULL
+ **/
+void POOL_ref(POOL_Buffer *buffer) {
+    __atomic_fetch_add(&buffer->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief  Drops a reference, returning the buffer to the pool with the last
+ *         one. Safe from interrupts.
+ *
+ * @param  buffer Buffer the caller holds a reference to
+ *
+ * @return @c NULL
+ **/
+void POOL_release(POOL_Buffer *buffer) {
+    if (__atomic_sub_fetch(&buffer->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    __atomic_fetch_add(&pool.frees, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pool.available, 1, __ATOMIC_RELAXED);
+    POOL_push((uint16_t)(buffer - buffers));
+}
+
+/**
+ * @brief  Finds the buffer a data pointer belongs to
+ *
+ * @param  data Start of a buffer's data, as given to the DMA
+ *
+ * @return The buffer
+ **/
+POOL_Buffer *POOL_fromData(const uint8_t *data) {
+    return &buffers[(uint32_t)(data - poolData[0]) / POOL_BUF_SIZE];
+}
+
+/**
+ * @brief  Copies out the allocation and exhaustion counters
+ *
+ * @param  stats Filled in
+ *
+ * @return @c NULL
+ **/
+void POOL_getStats(POOL_Stats *stats) {
+    stats->allocs = __atomic_load_n(&pool.allocs, __ATOMIC_RELAXED);
+    stats->frees = __atomic_load_n(&pool.frees, __ATOMIC_RELAXED);
+    stats->exhausted = __atomic_load_n(&pool.exhausted, __ATOMIC_RELAXED);
+    stats->available = (uint16_t)__atomic_load_n(&pool.available, __ATOMIC_RELAXED);
+    stats->low = (uint16_t)__atomic_load_n(&pool.low, __ATOMIC_RELAXED);
+}
\ No newline at end of file
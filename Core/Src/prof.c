@@ -0,0 +1,155 @@
+/***********************************************************************************
+ * @file        prof.c                                                             *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  PROF                                                               *
+ * @brief       Cycle-count probes. Keeps min/max/mean and a log2 histogram per    *
+ *              probe and prints the table with printf, which goes to USART3.      *
+ ***********************************************************************************/
+
+#include "prof.h"
+
+#ifdef PROFILE
+
+#include <stdio.h>
+#include <string.h>
+
+#define PROF_NAME(name)     #name,
+
+static const char *const names[PROF_COUNT] = {
+    PROF_PROBES(PROF_NAME)
+};
+
+static PROF_Stats table[PROF_COUNT];
+
+#ifdef PROF_HOST
+
+static uint32_t fakeCycles;
+
+uint32_t PROF_hostCycles(void) {
+    return fakeCycles;
+}
+
+// Moves the fake counter on, for tests driving probes with known durations
+void PROF_hostAdvance(uint32_t cycles) {
+    fakeCycles += cycles;
+}
+
+#define PROF_LOCK()         do { } while (0)
+#define PROF_UNLOCK()       do { } while (0)
+
+#else
+
+#define PROF_LOCK()         uint32_t primask = __get_PRIMASK(); __disable_irq()
+#define PROF_UNLOCK()       __set_PRIMASK(primask)
+
+#endif
+
+static uint32_t PROF_bucket(uint32_t cycles) {
+    return cycles == 0 ? 0 : 32 - __builtin_clz(cycles);
+}
+
+/**
+ * @brief  Clears the table and starts the cycle counter, if TIMESTAMP_init()
+ *         has not already
+ *
+ * @return @c NULL
+ **/
+void PROF_init(void) {
+#ifndef PROF_HOST
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+    PROF_reset();
+}
+
+/**
+ * @brief  Adds one measurement to a probe. Called by PROF_END().
+ *
+ * @param  probe  Probe the measurement belongs to
+ * @param  cycles Duration in core cycles
+ *
+ * @return @c NULL
+ **/
+void PROF_record(PROF_Probe probe, uint32_t cycles) {
+    PROF_Stats *stats = &table[probe];
+    PROF_LOCK();
+
+    if (stats->count == 0 || cycles < stats->min) {
+        stats->min = cycles;
+    }
+    if (cycles > stats->max) {
+        stats->max = cycles;
+    }
+    stats->count++;
+    stats->total += cycles;
+    stats->hist[PROF_bucket(cycles)]++;
+
+    PROF_UNLOCK();
+}
+
+/**
+ * @brief  Clears every probe
+ *
+ * @return @c NULL
+ **/
+void PROF_reset(void) {
+    PROF_LOCK();
+    memset(table, 0, sizeof(table));
+    PROF_UNLOCK();
+}
+
+/**
+ * @brief  Gives read access to one probe's accumulated stats
+ *
+ * @param  probe Probe to look up
+ *
+ * @return Pointer into the table
+ **/
+const PROF_Stats *PROF_get(PROF_Probe probe) {
+    return &table[probe];
+}
+
+/**
+ * @brief  Looks up a probe's name
+ *
+ * @param  probe Probe to look up
+ *
+ * @return Name as written in PROF_PROBES
+ **/
+const char *PROF_name(PROF_Probe probe) {
+    return names[probe];
+}
+
+/**
+ * @brief  Prints one line per probe that has fired: count, min, mean and max
+ *         in cycles, then the non-empty histogram buckets as
+ *         upper-bound-exponent:count pairs
+ *
+ * @return @c NULL
+ **/
+void PROF_dump(void) {
+    printf("probe count min mean max | log2 histogram\r\n");
+
+    for (uint32_t i = 0; i < PROF_COUNT; i++) {
+        PROF_Stats stats;
+
+        PROF_LOCK();
+        stats = table[i];
+        PROF_UNLOCK();
+
+        if (stats.count == 0) {
+            continue;
+        }
+
+        printf("%s %lu %lu %lu %lu |", names[i], (unsigned long)stats.count, (unsigned long)stats.min,
+               (unsigned long)(stats.total / stats.count), (unsigned long)stats.max);
+        for (uint32_t b = 0; b < PROF_BUCKETS; b++) {
+            if (stats.hist[b] != 0) {
+                printf(" %lu:%lu", (unsigned long)b, (unsigned long)stats.hist[b]);
+            }
+        }
+        printf("\r\n");
+    }
+}
+
+#endif
\ No newline at end of file
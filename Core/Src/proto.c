@@ -0,0 +1,600 @@
+/***********************************************************************************
+ * @file        proto.c                                                            *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  USART                                                              *
+ * @brief       COBS framed binary protocol on USART3. Frames are encoded on the   *
+ *              way into the TX ring straight from the caller's buffers, so        *
+ *              EEPROM data and trace records go out without a staging copy.       *
+ *              Received frames are split from shell text by their delimiters.     *
+ ***********************************************************************************/
+
+#include <string.h>
+
+#include "proto.h"
+#include "serial.h"
+#include "crc.h"
+#include "eeprom.h"
+#include "rtc.h"
+#include "timestamp.h"
+#include "idle.h"
+#include "persist.h"
+#include "trace.h"
+#include "stm32f439xx.h"
+
+#define PROTO_COBS_MAX(n)   ((n) + (n) / 254 + 1)           // Longest encoding of n bytes
+#define PROTO_RX_SIZE       PROTO_COBS_MAX(PROTO_MAX_FRAME)
+#define PROTO_HEADER        2                               // type, seq
+#define PROTO_TRAILER       2                               // CRC16
+
+typedef enum {
+    PROTO_STATE_TEXT    = 0,
+    PROTO_STATE_FRAME   = 1
+} PROTO_State;
+
+// Walks a payload spread over several buffers
+typedef struct {
+    const PROTO_Iov *iov;
+    uint8_t count;
+    uint8_t index;
+    uint16_t offset;
+} PROTO_Cursor;
+
+// Encoded bytes collect here, then decode in place
+static uint8_t rxBuf[PROTO_RX_SIZE];
+
+static struct {
+    PROTO_State state;
+    uint16_t length;                    // Bytes in rxBuf
+    uint8_t overflow;                   // Frame too long, drop it at the delimiter
+    PROTO_TextHandler text;
+    PROTO_Stats stats;
+} proto;
+
+/*
+ * EEPROM requests in flight, replied to from PROTO_process(). Several let
+ * the host pipeline, so the next request crosses the link while the
+ * driver works on this one. A CRC request reuses its slot chunk by chunk.
+ */
+typedef struct {
+    EEPROM_Request req;
+    uint8_t type;
+    uint8_t seq;
+    uint8_t active;
+    uint16_t crc;                       // PROTO_EE_CRC running value
+    uint16_t left;                      // PROTO_EE_CRC bytes after this chunk
+    uint8_t folded;                     // PROTO_EE_CRC chunk added to crc, in case the reply is retried
+    uint8_t data[PROTO_MAX_PAYLOAD];
+} PROTO_EeSlot;
+
+static PROTO_EeSlot slots[PROTO_EE_WINDOW];
+
+// Trace records sent from PROTO_process() while the TX ring has room
+static struct {
+    uint16_t batch;                     // Records per frame
+    uint16_t left;                      // Records still allowed in this drain
+    uint8_t seq;
+    uint8_t active;
+} stream;
+
+static uint16_t PROTO_u16(const uint8_t *data) {
+    return (uint16_t)(data[0] | data[1] << 8);
+}
+
+// Counts the non-zero bytes ahead of the cursor, up to limit, without moving it
+static uint16_t PROTO_scan(const PROTO_Cursor *cur, uint16_t limit, uint8_t *zero) {
+    uint8_t index = cur->index;
+    uint16_t offset = cur->offset;
+    uint16_t n = 0;
+
+    *zero = 0;
+    while (n < limit && index < cur->count) {
+        if (offset >= cur->iov[index].size) {
+            index++;
+            offset = 0;
+            continue;
+        }
+        if (((const uint8_t *)cur->iov[index].data)[offset] == 0) {
+            *zero = 1;
+            break;
+        }
+        n++;
+        offset++;
+    }
+    return n;
+}
+
+// Sends n bytes from the cursor, a whole run of each buffer per write
+static void PROTO_emit(PROTO_Cursor *cur, uint16_t n) {
+    while (n > 0) {
+        const PROTO_Iov *seg = &cur->iov[cur->index];
+        uint16_t len = seg->size - cur->offset;
+        if (len > n) {
+            len = n;
+        }
+
+        SERIAL_write((const uint8_t *)seg->data + cur->offset, len);
+        cur->offset += len;
+        n -= len;
+        if (cur->offset >= seg->size) {
+            cur->index++;
+            cur->offset = 0;
+        }
+    }
+}
+
+// Steps over the zero that ended a block
+static void PROTO_skip(PROTO_Cursor *cur) {
+    while (cur->offset >= cur->iov[cur->index].size) {
+        cur->index++;
+        cur->offset = 0;
+    }
+    cur->offset++;
+}
+
+/**
+ * @brief  Encodes and queues one frame. The payload is read twice, once for
+ *         the CRC and once while encoding, and never copied anywhere but the
+ *         TX ring. Nothing is queued unless the whole frame fits.
+ *
+ * @param  type  Message type, with PROTO_REPLY set for replies
+ * @param  seq   Sequence number, replies echo the request's
+ * @param  iov   Payload pieces, may be NULL if count is 0
+ * @param  count Number of pieces, up to PROTO_MAX_IOV
+ *
+ * @return 0 on success, -1 if too long or the TX ring is short of room
+ **/
+int PROTO_send(uint8_t type, uint8_t seq, const PROTO_Iov *iov, uint8_t count) {
+    static const uint8_t delimiter = 0;
+    PROTO_Iov segs[PROTO_MAX_IOV + 2];
+    uint8_t header[PROTO_HEADER] = { type, seq };
+    uint8_t trailer[PROTO_TRAILER];
+    uint32_t size = PROTO_HEADER + PROTO_TRAILER;
+
+    if (count > PROTO_MAX_IOV) {
+        return -1;
+    }
+
+    uint16_t crc = CRC16_update(CRC16_INIT, header, PROTO_HEADER);
+    segs[0] = (PROTO_Iov){ header, PROTO_HEADER };
+    for (uint8_t i = 0; i < count; i++) {
+        crc = CRC16_update(crc, iov[i].data, iov[i].size);
+        size += iov[i].size;
+        segs[i + 1] = iov[i];
+    }
+    trailer[0] = (uint8_t)(crc >> 8);
+    trailer[1] = (uint8_t)crc;
+    segs[count + 1] = (PROTO_Iov){ trailer, PROTO_TRAILER };
+
+    if (size > PROTO_MAX_FRAME) {
+        return -1;
+    }
+    if (SERIAL_txFree() < PROTO_COBS_MAX(size) + 2) {
+        proto.stats.unsent++;
+        return -1;
+    }
+
+    PROTO_Cursor cur = { .iov = segs, .count = count + 2 };
+    SERIAL_write(&delimiter, 1);
+    for (;;) {
+        uint8_t zero;
+        uint16_t n = PROTO_scan(&cur, 254, &zero);
+        uint8_t code = (uint8_t)(n + 1);
+
+        SERIAL_write(&code, 1);
+        PROTO_emit(&cur, n);
+        if (zero) {
+            PROTO_skip(&cur);
+        }
+        else if (n < 254) {
+            break;                      // End of the frame
+        }
+    }
+    SERIAL_write(&delimiter, 1);
+
+    proto.stats.sent++;
+    return 0;
+}
+
+static void PROTO_error(uint8_t type, uint8_t seq, PROTO_Error error) {
+    uint8_t payload[2] = { type, error };
+    PROTO_Iov iov = { payload, sizeof(payload) };
+    PROTO_send(PROTO_ERROR | PROTO_REPLY, seq, &iov, 1);
+}
+
+static PROTO_EeSlot *PROTO_eeSlot(void) {
+    for (uint8_t i = 0; i < PROTO_EE_WINDOW; i++) {
+        if (!slots[i].active) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+static int PROTO_eeSubmit(PROTO_EeSlot *slot, EEPROM_Op op, uint16_t addr, uint16_t size) {
+    EEPROM_Request *batch[] = { &slot->req };
+
+    slot->req = (EEPROM_Request){ .op = op, .addr = addr, .data = slot->data, .size = size };
+    return EEPROM_submit(batch, 1);
+}
+
+static void PROTO_ee(uint8_t type, uint8_t seq, const uint8_t *payload, uint16_t size) {
+    PROTO_EeSlot *slot = PROTO_eeSlot();
+    uint16_t addr, len, chunk;
+
+    if (slot == NULL) {
+        PROTO_error(type, seq, PROTO_ERR_BUSY);
+        return;
+    }
+    if ((type != PROTO_EE_WRITE && size != 4) || (type == PROTO_EE_WRITE && size < 3)) {
+        PROTO_error(type, seq, PROTO_ERR_LENGTH);
+        return;
+    }
+
+    addr = PROTO_u16(payload);
+    len = type == PROTO_EE_WRITE ? size - 2 : PROTO_u16(payload + 2);
+    if (len == 0 || (type != PROTO_EE_CRC && len > PROTO_MAX_PAYLOAD - 2) || (uint32_t)addr + len > EEPROM_SIZE) {
+        PROTO_error(type, seq, PROTO_ERR_RANGE);
+        return;
+    }
+
+    chunk = len;
+    if (type == PROTO_EE_WRITE) {
+        memcpy(slot->data, payload + 2, len);
+    }
+    else if (type == PROTO_EE_CRC) {
+        chunk = len < PROTO_MAX_PAYLOAD ? len : PROTO_MAX_PAYLOAD;
+        slot->crc = CRC16_INIT;
+        slot->left = len - chunk;
+        slot->folded = 0;
+    }
+
+    if (PROTO_eeSubmit(slot, type == PROTO_EE_WRITE ? EEPROM_OP_WRITE : EEPROM_OP_READ, addr, chunk) != 0) {
+        PROTO_error(type, seq, PROTO_ERR_RANGE);
+        return;
+    }
+    slot->type = type;
+    slot->seq = seq;
+    slot->active = 1;
+}
+
+// Replies to a finished request, or starts the next CRC chunk
+static void PROTO_eeDone(PROTO_EeSlot *slot) {
+    uint8_t addr[2] = { (uint8_t)slot->req.addr, (uint8_t)(slot->req.addr >> 8) };
+    PROTO_Iov iov[] = { { addr, sizeof(addr) }, { slot->data, slot->req.size } };
+    uint8_t count = 0;
+
+    if (slot->type == PROTO_EE_CRC) {
+        if (!slot->folded) {
+            slot->crc = CRC16_update(slot->crc, slot->data, slot->req.size);
+            slot->folded = 1;
+        }
+        if (slot->left > 0) {
+            uint16_t chunk = slot->left < PROTO_MAX_PAYLOAD ? slot->left : PROTO_MAX_PAYLOAD;
+            slot->left -= chunk;
+            slot->folded = 0;
+            if (PROTO_eeSubmit(slot, EEPROM_OP_READ, slot->req.addr + slot->req.size, chunk) != 0) {
+                PROTO_error(slot->type, slot->seq, PROTO_ERR_RANGE);
+                slot->active = 0;
+            }
+            return;
+        }
+        addr[0] = (uint8_t)slot->crc;
+        addr[1] = (uint8_t)(slot->crc >> 8);
+        count = 1;
+    }
+    else if (slot->type == PROTO_EE_READ) {
+        count = 2;
+    }
+
+    if (PROTO_send(slot->type | PROTO_REPLY, slot->seq, iov, count) == 0) {
+        slot->active = 0;               // Otherwise try again once the TX ring drains
+    }
+}
+
+static void PROTO_counters(uint8_t seq) {
+    SERIAL_Stats serial;
+    IDLE_Stats idle;
+    PERSIST_Stats persist;
+    PROTO_Stats own = proto.stats;
+
+    SERIAL_getStats(&serial);
+    IDLE_getStats(&idle);
+    PERSIST_getStats(&persist);
+#ifdef TRACE_ENABLE
+    TRACE_Stats trace;
+    TRACE_getStats(&trace);
+#endif
+
+    const uint8_t heads[][2] = {
+        { PROTO_SEC_SERIAL, sizeof(serial) },
+        { PROTO_SEC_IDLE, sizeof(idle) },
+        { PROTO_SEC_PERSIST, sizeof(persist) },
+        { PROTO_SEC_PROTO, sizeof(own) },
+#ifdef TRACE_ENABLE
+        { PROTO_SEC_TRACE, sizeof(trace) }
+#endif
+    };
+    const PROTO_Iov iov[] = {
+        { heads[0], 2 }, { &serial, sizeof(serial) },
+        { heads[1], 2 }, { &idle, sizeof(idle) },
+        { heads[2], 2 }, { &persist, sizeof(persist) },
+        { heads[3], 2 }, { &own, sizeof(own) },
+#ifdef TRACE_ENABLE
+        { heads[4], 2 }, { &trace, sizeof(trace) }
+#endif
+    };
+    PROTO_send(PROTO_COUNTERS | PROTO_REPLY, seq, iov, sizeof(iov) / sizeof(iov[0]));
+}
+
+static void PROTO_rtcGet(uint8_t seq) {
+    ts now;
+    RTC_getTime(&now);
+
+    PROTO_Time time = {
+        .year = now.year, .month = now.month, .date = now.date,
+        .hours = now.hours, .mins = now.mins, .secs = now.secs,
+        .day = now.day, .subsecs = now.subsecs,
+        .ticksPerSec = (uint16_t)(((RTC->PRER & RTC_PRER_PREDIV_S) >> RTC_PRER_PREDIV_S_Pos) + 1)
+    };
+    PROTO_Iov iov = { &time, sizeof(time) };
+    PROTO_send(PROTO_RTC_GET | PROTO_REPLY, seq, &iov, 1);
+}
+
+static void PROTO_rtcSet(uint8_t seq, const uint8_t *payload) {
+    PROTO_Time time;
+    memcpy(&time, payload, sizeof(time));
+
+    if (time.year < 2000 || time.year > 2099 || time.month < 1 || time.month > 12 ||
+        time.date < 1 || time.date > 31 || time.hours > 23 || time.mins > 59 ||
+        time.secs > 59 || time.day > Sunday) {
+        PROTO_error(PROTO_RTC_SET, seq, PROTO_ERR_RANGE);
+        return;
+    }
+
+    ts now = {
+        .secs = time.secs, .mins = time.mins, .hours = time.hours,
+        .date = time.date, .month = time.month, .year = time.year,
+        .day = time.day, .isDst = 0
+    };
+    RTC_setTime(&now);
+    TIMESTAMP_rebase();
+    PROTO_send(PROTO_RTC_SET | PROTO_REPLY, seq, NULL, 0);
+}
+
+static void PROTO_baud(uint8_t seq, const uint8_t *payload) {
+    uint32_t baud = (uint32_t)PROTO_u16(payload) | (uint32_t)PROTO_u16(payload + 2) << 16;
+    int32_t errorPpm;
+
+    if (SERIAL_checkBaud(baud, &errorPpm) != 0) {
+        PROTO_error(PROTO_BAUD, seq, PROTO_ERR_RANGE);
+        return;
+    }
+
+    // Reply at the old rate, the switch waits for it to go out
+    PROTO_Iov iov = { &errorPpm, sizeof(errorPpm) };
+    PROTO_send(PROTO_BAUD | PROTO_REPLY, seq, &iov, 1);
+    SERIAL_proposeBaud(baud, NULL);
+}
+
+#ifdef TRACE_ENABLE
+static void PROTO_traceDrain(uint8_t seq, const uint8_t *payload) {
+    uint16_t batch = PROTO_u16(payload);
+
+    if (batch == 0 || batch > PROTO_MAX_PAYLOAD / sizeof(TRACE_Record)) {
+        batch = PROTO_TRACE_BATCH;
+    }
+    stream.batch = batch;
+    stream.left = TRACE_RECORDS;        // Bounded, the main loop traces itself
+    stream.seq = seq;
+    stream.active = 1;
+}
+#endif
+
+static void PROTO_dispatch(uint8_t type, uint8_t seq, const uint8_t *payload, uint16_t size) {
+    switch (type) {
+        case PROTO_PING: {
+            PROTO_Iov iov = { payload, size };
+            PROTO_send(PROTO_PING | PROTO_REPLY, seq, &iov, 1);
+            break;
+        }
+
+        case PROTO_EE_READ:
+        case PROTO_EE_WRITE:
+        case PROTO_EE_CRC:
+            PROTO_ee(type, seq, payload, size);
+            break;
+
+#ifdef TRACE_ENABLE
+        case PROTO_TRACE_DRAIN:
+            if (size != 2) {
+                PROTO_error(type, seq, PROTO_ERR_LENGTH);
+                break;
+            }
+            PROTO_traceDrain(seq, payload);
+            break;
+#endif
+
+        case PROTO_COUNTERS:
+            PROTO_counters(seq);
+            break;
+
+        case PROTO_RTC_GET:
+            PROTO_rtcGet(seq);
+            break;
+
+        case PROTO_RTC_SET:
+            if (size != sizeof(PROTO_Time)) {
+                PROTO_error(type, seq, PROTO_ERR_LENGTH);
+                break;
+            }
+            PROTO_rtcSet(seq, payload);
+            break;
+
+        case PROTO_BAUD:
+            if (size != 4) {
+                PROTO_error(type, seq, PROTO_ERR_LENGTH);
+                break;
+            }
+            PROTO_baud(seq, payload);
+            break;
+
+        default:
+            PROTO_error(type, seq, PROTO_ERR_TYPE);
+            break;
+    }
+}
+
+// Decodes COBS in place, returning the decoded length or -1 if malformed
+static int32_t PROTO_decode(uint8_t *buf, uint16_t size) {
+    uint16_t in = 0, out = 0;
+
+    while (in < size) {
+        uint8_t code = buf[in++];
+        if ((uint32_t)in + code - 1 > size) {
+            return -1;
+        }
+        for (uint8_t i = 1; i < code; i++) {
+            buf[out++] = buf[in++];
+        }
+        if (code != 0xFF && in < size) {
+            buf[out++] = 0;
+        }
+    }
+    return out;
+}
+
+static void PROTO_frame(uint8_t *buf, uint16_t size) {
+    int32_t len = PROTO_decode(buf, size);
+
+    if (len < PROTO_HEADER + PROTO_TRAILER ||
+        CRC16_update(CRC16_INIT, buf, (uint16_t)(len - PROTO_TRAILER)) != (buf[len - 2] << 8 | buf[len - 1])) {
+        proto.stats.crcErrors++;
+        return;
+    }
+
+    proto.stats.frames++;
+    PROTO_dispatch(buf[0], buf[1], &buf[PROTO_HEADER], (uint16_t)(len - PROTO_HEADER - PROTO_TRAILER));
+}
+
+/**
+ * @brief  Sets up the protocol. Hook PROTO_rx() to SERIAL_setRxHandler().
+ *
+ * @param  text Receives input outside frames, may be NULL to discard it
+ *
+ * @return @c NULL
+ **/
+void PROTO_init(PROTO_TextHandler text) {
+    memset(&proto, 0, sizeof(proto));
+    memset(slots, 0, sizeof(slots));
+    memset(&stream, 0, sizeof(stream));
+    proto.text = text;
+}
+
+/**
+ * @brief  Splits received bytes into text and frames, handling each frame
+ *         as its closing delimiter arrives. Both may span several calls.
+ *
+ * @param  data Received bytes
+ * @param  size Number of bytes
+ * @param  end  Set at an idle line, unused as frames may straddle one
+ *
+ * @return @c NULL
+ **/
+void PROTO_rx(const uint8_t *data, uint16_t size, uint8_t end) {
+    (void)end;
+
+    while (size > 0) {
+        const uint8_t *zero = memchr(data, 0, size);
+        uint16_t len = zero != NULL ? (uint16_t)(zero - data) : size;
+
+        if (proto.state == PROTO_STATE_TEXT) {
+            if (len > 0 && proto.text != NULL) {
+                proto.text(data, len);
+            }
+        }
+        else if (proto.length + len > PROTO_RX_SIZE) {
+            proto.overflow = 1;
+        }
+        else {
+            memcpy(&rxBuf[proto.length], data, len);
+            proto.length += len;
+        }
+
+        if (zero == NULL) {
+            return;
+        }
+        data += len + 1;
+        size -= len + 1;
+
+        if (proto.state == PROTO_STATE_TEXT) {
+            proto.state = PROTO_STATE_FRAME;
+        }
+        else if (proto.length == 0 && !proto.overflow) {
+            continue;                   // Back to back delimiters, a frame starts here
+        }
+        else {
+            if (proto.overflow) {
+                proto.stats.overflows++;
+            }
+            else {
+                PROTO_frame(rxBuf, proto.length);
+            }
+            proto.state = PROTO_STATE_TEXT;
+        }
+        proto.length = 0;
+        proto.overflow = 0;
+    }
+}
+
+/**
+ * @brief  Sends replies that had to wait, for EEPROM requests and trace
+ *         drains. Call from the main loop.
+ *
+ * @return @c NULL
+ **/
+void PROTO_process(void) {
+    for (uint8_t i = 0; i < PROTO_EE_WINDOW; i++) {
+        PROTO_EeSlot *slot = &slots[i];
+        if (!slot->active) {
+            continue;
+        }
+
+        EEPROM_Status status = EEPROM_poll(&slot->req);
+        if (status == EEPROM_ERROR) {
+            PROTO_error(slot->type, slot->seq, PROTO_ERR_DEVICE);
+            slot->active = 0;
+        }
+        else if (status == EEPROM_DONE) {
+            PROTO_eeDone(slot);
+        }
+    }
+
+#ifdef TRACE_ENABLE
+    while (stream.active) {
+        const TRACE_Record *records;
+        uint16_t n = TRACE_take(&records, stream.batch < stream.left ? stream.batch : stream.left);
+        PROTO_Iov iov = { records, (uint16_t)(n * sizeof(TRACE_Record)) };
+
+        // Straight from the ring, the records stay put until released
+        if (PROTO_send(PROTO_TRACE_DRAIN | PROTO_REPLY, stream.seq, &iov, 1) != 0) {
+            break;
+        }
+        TRACE_release(n);
+        stream.left -= n;
+        if (n == 0) {
+            stream.active = 0;          // The empty frame ends the drain
+        }
+    }
+#endif
+}
+
+/**
+ * @brief  Copies out the protocol counters
+ *
+ * @param  stats Filled in
+ *
+ * @return @c NULL
+ **/
+void PROTO_getStats(PROTO_Stats *stats) {
+    *stats = proto.stats;
+}
\ No newline at end of file
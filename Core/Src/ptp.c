@@ -0,0 +1,526 @@
+/***********************************************************************************
+ * @file        ptp.c                                                              *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  ETH                                                                *
+ * @brief       IEEE 1588 slave over UDP/IPv4 on the MAC's hardware timestamps.    *
+ *              A PI servo steers the PTP clock's rate onto the master's, and the  *
+ *              RTC is shifted and smooth-calibrated to keep it on UTC.            *
+ ***********************************************************************************/
+
+#include <string.h>
+
+#include "ptp.h"
+#include "netif.h"
+#include "rtc.h"
+#include "calendar.h"
+#include "timestamp.h"
+#include "idle.h"
+#include "stm32f4xx_hal.h"      // HAL_GetTick
+
+#define PTP_VERSION         2U
+#define PTP_SYNC            0x0U
+#define PTP_DELAY_REQ       0x1U
+#define PTP_FOLLOW_UP       0x8U
+#define PTP_DELAY_RESP      0x9U
+#define PTP_ANNOUNCE        0xBU
+
+#define PTP_HEADER          34U
+#define PTP_SYNC_SIZE       44U         // Also Delay_Req and Follow_Up
+#define PTP_DELAY_RESP_SIZE 54U
+#define PTP_ANNOUNCE_SIZE   64U
+#define PTP_PORT_IDENTITY   10U         // Clock identity and port number
+
+// Header fields
+#define PTP_TYPE            0
+#define PTP_VERSION_FIELD   1
+#define PTP_LENGTH          2
+#define PTP_DOMAIN_FIELD    4
+#define PTP_FLAGS           6
+#define PTP_CORRECTION      8
+#define PTP_SOURCE          20
+#define PTP_SEQUENCE        30
+#define PTP_CONTROL         32
+#define PTP_INTERVAL        33
+#define PTP_TIMESTAMP       34
+#define PTP_REQUESTER       44          // Delay_Resp requestingPortIdentity
+#define PTP_UTC_OFFSET      44          // Announce currentUtcOffset
+#define PTP_GRANDMASTER     47          // Announce priority1 to grandmasterIdentity
+#define PTP_GRANDMASTER_SIZE 14U
+
+#define PTP_TWO_STEP        0x0200U     // flagField
+#define PTP_UTC_VALID       0x0004U
+#define PTP_TIMESCALE       0x0008U
+
+#define PTP_CONTROL_DELAY_REQ 1U
+#define PTP_INTERVAL_NONE   0x7FU
+
+#define PTP_RTC_MAX_PPB     487000      // Smooth calibration range
+
+typedef enum {
+    PTP_SERVO_START     = 0,            // No sample yet, offsets of a second or more are stepped
+    PTP_SERVO_RATE      = 1,            // One sample, the next gives the rate error
+    PTP_SERVO_LOCKED    = 2
+} PTP_Servo;
+
+static struct {
+    uint8_t identity[PTP_PORT_IDENTITY];
+    uint8_t grandmaster[PTP_GRANDMASTER_SIZE];  // Master's best master fields, compared as one
+    uint8_t ptpTimescale;               // Master is on TAI, so the RTC can follow it
+    uint32_t announceAt;
+
+    uint8_t syncWaiting;                // Two-step Sync seen, Follow_Up to come
+    uint16_t syncSequence;
+    int64_t syncReceived;
+    int64_t syncCorrection;
+    uint8_t pathValid;
+    int64_t masterToSlave;              // t2 - t1 of the last Sync
+
+    uint8_t delayPending;               // Delay_Req sent, timestamp and answer to come
+    uint8_t delayStamped;
+    uint8_t delayAnswered;
+    uint8_t delayValid;
+    uint16_t delaySequence;
+    uint32_t delaySentAt;
+    int64_t delaySent;                  // t3
+    int64_t delayReceived;              // t4
+
+    PTP_Servo servo;
+    int64_t servoOffset;
+    int64_t servoAt;                    // Sync receive time of the last sample
+    int32_t integral;
+
+    uint8_t rtcValid;                   // Reference taken for the RTC rate
+    uint8_t rtcCount;
+    uint32_t rtcAt;
+    int64_t rtcRefError;
+    int64_t rtcRefAt;
+    int64_t rtcShifted;                 // Shifts applied since the reference, ns
+
+    PTP_Stats stats;
+} ptp;
+
+static uint16_t PTP_get16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t PTP_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void PTP_put16(uint8_t *p, uint16_t value) {
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)value;
+}
+
+// 48-bit seconds and 32-bit nanoseconds
+static int64_t PTP_timestamp(const uint8_t *p) {
+    uint64_t secs = (uint64_t)PTP_get16(p) << 32 | PTP_get32(&p[2]);
+    return (int64_t)secs * NETIF_NS_PER_SEC + PTP_get32(&p[6]);
+}
+
+// correctionField is ns scaled by 2^16
+static int64_t PTP_correction(const uint8_t *msg) {
+    uint64_t scaled = (uint64_t)PTP_get32(&msg[PTP_CORRECTION]) << 32 | PTP_get32(&msg[PTP_CORRECTION + 4]);
+    return (int64_t)scaled / 65536;
+}
+
+static int32_t PTP_clamp(int64_t ppb, int32_t limit) {
+    if (ppb > limit) {
+        return limit;
+    }
+    if (ppb < -limit) {
+        return -limit;
+    }
+    return (int32_t)ppb;
+}
+
+// Forgets everything measured against the master, keeping the clock's rate
+static void PTP_restart(void) {
+    ptp.syncWaiting = 0;
+    ptp.pathValid = 0;
+    ptp.delayPending = 0;
+    ptp.delayValid = 0;
+    ptp.servo = PTP_SERVO_START;
+    ptp.rtcValid = 0;
+    ptp.rtcAt = HAL_GetTick() - PTP_RTC_PERIOD_MS;
+}
+
+// Timestamps from before a step cannot be paired with those after it
+static void PTP_step(int64_t ns) {
+    NETIF_clockStep(ns);
+    ptp.stats.steps++;
+    ptp.syncWaiting = 0;
+    ptp.pathValid = 0;
+    ptp.delayPending = 0;
+    ptp.rtcValid = 0;
+    ptp.stats.state = PTP_UNCALIBRATED;
+}
+
+/*
+ * Two samples without a step between them give the rate error, which is
+ * taken out at once along with any offset over PTP_STEP_NS, then a PI loop
+ * holds the offset at zero. An offset of n ns over one second between
+ * samples asks for n ppb.
+ */
+static void PTP_servo(int64_t offset, int64_t at) {
+    int64_t size = offset < 0 ? -offset : offset;
+    int64_t elapsed = at - ptp.servoAt;
+    ptp.stats.offset = offset;
+
+    if (ptp.servo == PTP_SERVO_START || elapsed <= 0) {
+        if (size >= NETIF_NS_PER_SEC) {
+            PTP_step(-offset);
+            return;
+        }
+        ptp.servoOffset = offset;
+        ptp.servoAt = at;
+        ptp.servo = PTP_SERVO_RATE;
+        return;
+    }
+
+    if (ptp.servo == PTP_SERVO_RATE) {
+        int64_t change = offset - ptp.servoOffset;
+        if (change > NETIF_NS_PER_SEC || change < -NETIF_NS_PER_SEC) {
+            ptp.servo = PTP_SERVO_START;
+            return;
+        }
+        ptp.integral = PTP_clamp(ptp.stats.ppb - change * NETIF_NS_PER_SEC / elapsed, NETIF_CLOCK_MAX_PPB);
+        ptp.stats.ppb = ptp.integral;
+        NETIF_clockAdjust(ptp.stats.ppb);
+        ptp.servo = PTP_SERVO_LOCKED;
+    }
+    else if (size <= PTP_STEP_NS) {
+        int64_t rate = offset * NETIF_NS_PER_SEC / elapsed;
+        ptp.integral = PTP_clamp(ptp.integral - rate * PTP_KI / 100, NETIF_CLOCK_MAX_PPB);
+        ptp.stats.ppb = PTP_clamp(ptp.integral - rate * PTP_KP / 100, NETIF_CLOCK_MAX_PPB);
+        NETIF_clockAdjust(ptp.stats.ppb);
+        ptp.stats.state = size <= PTP_LOCKED_NS ? PTP_SLAVE : PTP_UNCALIBRATED;
+    }
+
+    if (size > PTP_STEP_NS) {
+        PTP_step(-offset);
+        ptp.servoAt = at - offset;          // On the clock as stepped
+        return;
+    }
+    ptp.servoAt = at;
+}
+
+static void PTP_delayRequest(void) {
+    ptp.delaySentAt = HAL_GetTick();
+
+    NETIF_Buffer *buffer;
+    uint8_t *msg = NET_udpAlloc(&buffer);
+    if (msg == NULL) {
+        return;
+    }
+
+    // originTimestamp may be left zero, t3 comes from the MAC
+    memset(msg, 0, PTP_SYNC_SIZE);
+    msg[PTP_TYPE] = PTP_DELAY_REQ;
+    msg[PTP_VERSION_FIELD] = PTP_VERSION;
+    PTP_put16(&msg[PTP_LENGTH], PTP_SYNC_SIZE);
+    msg[PTP_DOMAIN_FIELD] = PTP_DOMAIN;
+    memcpy(&msg[PTP_SOURCE], ptp.identity, PTP_PORT_IDENTITY);
+    PTP_put16(&msg[PTP_SEQUENCE], ++ptp.delaySequence);
+    msg[PTP_CONTROL] = PTP_CONTROL_DELAY_REQ;
+    msg[PTP_INTERVAL] = PTP_INTERVAL_NONE;
+
+    ptp.delayPending = 1;
+    ptp.delayStamped = 0;
+    ptp.delayAnswered = 0;
+    ptp.stats.delayReqs++;
+
+    NET_Endpoint to = { .ip = PTP_GROUP, .port = PTP_EVENT_PORT };
+    NETIF_stampTx(buffer);
+    NET_udpSend(buffer, PTP_EVENT_PORT, &to, PTP_SYNC_SIZE);
+}
+
+// A Sync's origin time t1, with its receive time t2
+static void PTP_sample(int64_t t1, int64_t t2) {
+    ptp.masterToSlave = t2 - t1;
+    ptp.pathValid = 1;
+
+    if (ptp.delayValid) {
+        PTP_servo(ptp.masterToSlave - ptp.stats.delay, t2);
+    }
+    if (!ptp.delayPending && HAL_GetTick() - ptp.delaySentAt >= PTP_DELAY_REQ_MS) {
+        PTP_delayRequest();
+    }
+}
+
+// Pairs the last Sync with a completed Delay_Req for the mean path delay
+static void PTP_delayDone(void) {
+    if (!ptp.delayStamped && NETIF_txTimestamp(&ptp.delaySent) == 0) {
+        ptp.delayStamped = 1;
+    }
+
+    if (!ptp.delayStamped || !ptp.delayAnswered || !ptp.pathValid) {
+        if (HAL_GetTick() - ptp.delaySentAt >= PTP_DELAY_REQ_MS) {
+            ptp.delayPending = 0;           // Lost, the next Sync sends another
+            if (!ptp.delayStamped) {
+                ptp.stats.noStamp++;
+            }
+        }
+        return;
+    }
+
+    ptp.delayPending = 0;
+    int64_t sample = (ptp.masterToSlave + (ptp.delayReceived - ptp.delaySent)) / 2;
+    if (sample < 0) {
+        return;
+    }
+    if (!ptp.delayValid) {
+        ptp.stats.delay = sample;
+        ptp.delayValid = 1;
+    } else {
+        ptp.stats.delay += (sample - ptp.stats.delay) / (1 << PTP_DELAY_FILTER);
+    }
+}
+
+/*
+ * A simplified best master choice: the grandmaster fields of each Announce
+ * are compared as they sit in the message, priority1 first, lowest wins.
+ */
+static void PTP_announce(const uint8_t *msg, uint16_t size) {
+    if (size < PTP_ANNOUNCE_SIZE) {
+        return;
+    }
+    ptp.stats.announces++;
+
+    const uint8_t *source = &msg[PTP_SOURCE];
+    const uint8_t *grandmaster = &msg[PTP_GRANDMASTER];
+    uint8_t following = ptp.stats.state != PTP_LISTENING;
+
+    if (!following || memcmp(source, ptp.stats.master, PTP_PORT_IDENTITY) != 0) {
+        if (following && memcmp(grandmaster, ptp.grandmaster, PTP_GRANDMASTER_SIZE) >= 0) {
+            return;
+        }
+        memcpy(ptp.stats.master, source, PTP_PORT_IDENTITY);
+        ptp.stats.masterChanges++;
+        ptp.stats.state = PTP_UNCALIBRATED;
+        PTP_restart();
+    }
+
+    memcpy(ptp.grandmaster, grandmaster, PTP_GRANDMASTER_SIZE);
+    ptp.announceAt = HAL_GetTick();
+
+    uint16_t flags = PTP_get16(&msg[PTP_FLAGS]);
+    ptp.ptpTimescale = (flags & PTP_TIMESCALE) != 0;
+    if (!ptp.ptpTimescale) {
+        ptp.stats.utcOffset = 0;
+    } else if (flags & PTP_UTC_VALID) {
+        ptp.stats.utcOffset = (int16_t)PTP_get16(&msg[PTP_UTC_OFFSET]);
+    } else {
+        ptp.stats.utcOffset = PTP_UTC_OFFSET_DEFAULT;
+    }
+}
+
+static void PTP_receive(const NET_Endpoint *from, uint16_t port, const uint8_t *data, uint16_t size) {
+    if (size < PTP_HEADER || (data[PTP_VERSION_FIELD] & 0x0FU) != PTP_VERSION || data[PTP_DOMAIN_FIELD] != PTP_DOMAIN
+            || PTP_get16(&data[PTP_LENGTH]) > size) {
+        return;
+    }
+    size = PTP_get16(&data[PTP_LENGTH]);
+
+    uint8_t type = data[PTP_TYPE] & 0x0FU;
+    if (type == PTP_ANNOUNCE) {
+        PTP_announce(data, size);
+        return;
+    }
+    if (ptp.stats.state == PTP_LISTENING || memcmp(&data[PTP_SOURCE], ptp.stats.master, PTP_PORT_IDENTITY) != 0) {
+        return;
+    }
+
+    uint16_t sequence = PTP_get16(&data[PTP_SEQUENCE]);
+    int64_t correction = PTP_correction(data);
+
+    if (type == PTP_SYNC && size >= PTP_SYNC_SIZE) {
+        int64_t received;
+        if (NETIF_rxTimestamp(&received) != 0) {
+            ptp.stats.noStamp++;
+            return;
+        }
+        ptp.stats.syncs++;
+        if (PTP_get16(&data[PTP_FLAGS]) & PTP_TWO_STEP) {
+            ptp.syncWaiting = 1;
+            ptp.syncSequence = sequence;
+            ptp.syncReceived = received;
+            ptp.syncCorrection = correction;
+        } else {
+            ptp.syncWaiting = 0;
+            PTP_sample(PTP_timestamp(&data[PTP_TIMESTAMP]) + correction, received);
+        }
+    }
+    else if (type == PTP_FOLLOW_UP && size >= PTP_SYNC_SIZE) {
+        if (ptp.syncWaiting && sequence == ptp.syncSequence) {
+            ptp.syncWaiting = 0;
+            PTP_sample(PTP_timestamp(&data[PTP_TIMESTAMP]) + ptp.syncCorrection + correction, ptp.syncReceived);
+        }
+    }
+    else if (type == PTP_DELAY_RESP && size >= PTP_DELAY_RESP_SIZE) {
+        if (ptp.delayPending && sequence == ptp.delaySequence
+                && memcmp(&data[PTP_REQUESTER], ptp.identity, PTP_PORT_IDENTITY) == 0) {
+            ptp.delayReceived = PTP_timestamp(&data[PTP_TIMESTAMP]) - correction;
+            ptp.delayAnswered = 1;
+            ptp.stats.delayResps++;
+        }
+    }
+}
+
+/*
+ * Compares the RTC with the PTP clock on UTC. Errors of a second or more
+ * set the calendar, smaller ones are shifted out in whole sub-second ticks,
+ * and every PTP_RTC_WINDOW comparisons the drift since the last correction
+ * goes into the smooth calibration.
+ */
+static void PTP_steerRtc(void) {
+    int64_t ticksPerSec = ((RTC->PRER & RTC_PRER_PREDIV_S) >> RTC_PRER_PREDIV_S_Pos) + 1;
+
+    RTC_Snapshot snap;
+    RTC_snapshot(&snap);
+    int64_t now = NETIF_clockNow();
+
+    ts time = { 0 };
+    RTC_decode(&snap, &time);
+    CAL_Epoch64 rtc = CAL_toEpoch64(&time, &CAL_zones[CAL_ZONE_UTC], (uint32_t)ticksPerSec);
+
+    // The RTC is anywhere within the tick it shows, so take the middle
+    int64_t rtcNs = (int64_t)CAL_EPOCH64_SECS(rtc) * NETIF_NS_PER_SEC
+                  + (int64_t)(((uint64_t)CAL_EPOCH64_FRAC(rtc) * NETIF_NS_PER_SEC) >> 32)
+                  + NETIF_NS_PER_SEC / ticksPerSec / 2;
+    int64_t utc = now - (int64_t)ptp.stats.utcOffset * NETIF_NS_PER_SEC;
+    int64_t error = rtcNs - utc;
+    ptp.stats.rtcError = error;
+
+    if (error >= NETIF_NS_PER_SEC || error <= -NETIF_NS_PER_SEC) {
+        CAL_fromEpoch32((CAL_Epoch32)(utc / NETIF_NS_PER_SEC), &CAL_zones[CAL_ZONE_UTC], &time, NULL);
+        time.subsecs = (uint16_t)(utc % NETIF_NS_PER_SEC * ticksPerSec / NETIF_NS_PER_SEC);
+        RTC_setTime(&time);
+        TIMESTAMP_rebase();
+        ptp.stats.rtcSets++;
+        ptp.rtcValid = 0;
+        return;
+    }
+
+    if (!ptp.rtcValid) {
+        ptp.rtcValid = 1;
+        ptp.rtcCount = 0;
+        ptp.rtcRefError = error;
+        ptp.rtcRefAt = now;
+        ptp.rtcShifted = 0;
+    }
+    else if (++ptp.rtcCount >= PTP_RTC_WINDOW) {
+        int64_t drift = (error - ptp.rtcRefError - ptp.rtcShifted) * NETIF_NS_PER_SEC / (now - ptp.rtcRefAt);
+        ptp.stats.rtcPpb = PTP_clamp(ptp.stats.rtcPpb - drift, PTP_RTC_MAX_PPB);
+        RTC_calibrate(ptp.stats.rtcPpb);
+        ptp.rtcCount = 0;
+        ptp.rtcRefError = error;
+        ptp.rtcRefAt = now;
+        ptp.rtcShifted = 0;
+    }
+
+    int64_t scaled = error * ticksPerSec;
+    int32_t ticks = (int32_t)((scaled + (scaled < 0 ? -NETIF_NS_PER_SEC : NETIF_NS_PER_SEC) / 2) / NETIF_NS_PER_SEC);
+    if (ticks >= PTP_RTC_SHIFT_TICKS || ticks <= -PTP_RTC_SHIFT_TICKS) {
+        RTC_shift(-ticks);
+        TIMESTAMP_rebase();
+        ptp.rtcShifted -= (int64_t)ticks * NETIF_NS_PER_SEC / ticksPerSec;
+        ptp.stats.rtcShifts++;
+    }
+}
+
+/**
+ * @brief  Starts the PTP clock, opens the multicast filter and binds the
+ *         event and general ports. NET_init() must already have been
+ *         called, and NETIF_process() and NET_process() must run in the
+ *         main loop.
+ *
+ * @return 0 on success, -1 if the clock cannot run or a port is taken
+ **/
+int PTP_init(void) {
+    memset(&ptp, 0, sizeof(ptp));
+
+    // EUI-64 clock identity from the MAC address, port 1
+    const uint8_t *mac = NETIF_macAddress();
+    const uint8_t identity[PTP_PORT_IDENTITY] = { mac[0], mac[1], mac[2], 0xFF, 0xFE, mac[3], mac[4], mac[5], 0, 1 };
+    memcpy(ptp.identity, identity, sizeof(identity));
+    ptp.stats.utcOffset = PTP_UTC_OFFSET_DEFAULT;
+
+    // Carry on from any calibration the backup domain kept across a reset
+    uint32_t calr = RTC->CALR;
+    int32_t pulses = ((calr & RTC_CALR_CALP) ? 512 : 0) - (int32_t)((calr & RTC_CALR_CALM) >> RTC_CALR_CALM_Pos);
+    ptp.stats.rtcPpb = (int32_t)((int64_t)pulses * NETIF_NS_PER_SEC / (1 << 20));
+
+    PTP_restart();
+    ptp.delaySentAt = HAL_GetTick() - PTP_DELAY_REQ_MS;
+
+    if (NETIF_clockStart() != 0) {
+        return -1;
+    }
+    NETIF_passMulticast(1);
+    if (NET_udpBind(PTP_EVENT_PORT, PTP_receive) != 0 || NET_udpBind(PTP_GENERAL_PORT, PTP_receive) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief  Completes path delay measurements, drops a master that has gone
+ *         quiet and keeps the RTC in step once locked. Call from the main
+ *         loop.
+ *
+ * @return @c NULL
+ **/
+void PTP_process(void) {
+    uint32_t now = HAL_GetTick();
+
+    if (ptp.delayPending) {
+        PTP_delayDone();
+    }
+
+    if (ptp.stats.state != PTP_LISTENING && now - ptp.announceAt >= PTP_ANNOUNCE_TIMEOUT_MS) {
+        ptp.stats.state = PTP_LISTENING;        // The clock holds its last rate
+        ptp.stats.timeouts++;
+        PTP_restart();
+        return;
+    }
+
+    if (ptp.stats.state == PTP_SLAVE && ptp.ptpTimescale && now - ptp.rtcAt >= PTP_RTC_PERIOD_MS) {
+        ptp.rtcAt = now;
+        PTP_steerRtc();
+    }
+}
+
+/**
+ * @brief  Says when PTP_process() next has a lost Delay_Req, a master
+ *         timeout or an RTC update to deal with. Messages arrive through
+ *         NETIF_process(), which keeps the core awake for them.
+ *
+ * @return Milliseconds until then, IDLE_NEVER while listening
+ **/
+uint32_t PTP_nextPoll(void) {
+    uint32_t now = HAL_GetTick();
+    uint32_t next = IDLE_NEVER;
+
+    if (ptp.delayPending) {
+        next = IDLE_msLeft(now, ptp.delaySentAt, PTP_DELAY_REQ_MS);
+    }
+    if (ptp.stats.state != PTP_LISTENING) {
+        next = IDLE_min(next, IDLE_msLeft(now, ptp.announceAt, PTP_ANNOUNCE_TIMEOUT_MS));
+    }
+    if (ptp.stats.state == PTP_SLAVE && ptp.ptpTimescale) {
+        next = IDLE_min(next, IDLE_msLeft(now, ptp.rtcAt, PTP_RTC_PERIOD_MS));
+    }
+    return next;
+}
+
+/**
+ * @brief  Copies out the port state, servo values and counters
+ *
+ * @param  stats Filled in
+ *
+ * @return @c NULL
+ **/
+void PTP_getStats(PTP_Stats *stats) {
+    *stats = ptp.stats;
+}
\ No newline at end of file
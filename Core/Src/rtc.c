@@ -6,6 +6,44 @@
  ***********************************************************************************/
 
 #include "rtc.h"
+#include "prof.h"
+#include "wait.h"
+
+/**
+ * @brief  Finds the prescaler pair for a 1 Hz calendar clock with the lowest
+ *         power whose sub-second tick is no coarser than asked for
+ *
+ * @param  lseHz     RTCCLK frequency
+ * @param  maxTickNs Coarsest acceptable sub-second tick, in ns. Anything finer
+ *                   than the clock allows, such as 0, gets the finest tick.
+ * @param  pre       Filled in by this function
+ *
+ * @return 0 on success, -1 if no exact 1 Hz division exists
+ **/
+int RTC_solvePrescaler(uint32_t lseHz, uint32_t maxTickNs, RTC_Prescaler *pre) {
+    int found = -1;
+
+    // ck_apre gets slower, and cheaper, as the async divider grows
+    for (uint32_t a = 1; a <= 128; a++) {
+        if (lseHz % a != 0 || lseHz / a > 32768) {
+            continue;
+        }
+        if (found == 0 && (uint64_t)a * 1000000000U > (uint64_t)maxTickNs * lseHz) {
+            break;
+        }
+        pre->asyncDiv = (uint8_t)(a - 1);
+        pre->syncDiv = (uint16_t)(lseHz / a - 1);
+        found = 0;
+    }
+    return found;
+}
+
+// Only call in initialisation mode. Sync prescaler first, then async, as the manual asks.
+static void RTC_writePrescaler(const RTC_Prescaler *pre) {
+    RTC->PRER = (uint32_t)pre->syncDiv << RTC_PRER_PREDIV_S_Pos;
+    RTC->PRER = (uint32_t)pre->syncDiv << RTC_PRER_PREDIV_S_Pos |
+                (uint32_t)pre->asyncDiv << RTC_PRER_PREDIV_A_Pos;
+}
 
 void RTC_init(ts *ts) {
 
@@ -25,7 +63,7 @@ void RTC_init(ts *ts) {
 
     // Enable LSE and wait for it to be ready
     RCC->BDCR |= RCC_BDCR_LSEON;
-    while ((RCC->BDCR & RCC_BDCR_LSERDY) == 0);
+    WAIT_WHILE(RTC_INIT_LSERDY, (RCC->BDCR & RCC_BDCR_LSERDY) == 0);
 
     // Set RTC source to LSE
     RCC->BDCR |= RCC_BDCR_RTCSEL_0;
@@ -53,11 +91,15 @@ void RTC_init(ts *ts) {
 
     // Enter initialisation mode
     RTC->ISR |= RTC_ISR_INIT;
-    while ((RTC->ISR & RTC_ISR_INITF) == 0);
+    WAIT_WHILE(RTC_INIT_INITF, (RTC->ISR & RTC_ISR_INITF) == 0);
 
     // Set sync prescaler then async prescaler (manual specifically says in this order)
-    RTC->PRER |= 256 << RTC_PRER_PREDIV_S_Pos;
-    RTC->PRER |= 128 << RTC_PRER_PREDIV_A_Pos;
+    RTC_Prescaler pre;
+    if (RTC_solvePrescaler(RTC_LSE_HZ, RTC_TICK_NS, &pre) != 0) {
+        pre.asyncDiv = 127;
+        pre.syncDiv = 255;
+    }
+    RTC_writePrescaler(&pre);
 
     // Load initial time and date values in the shadow registers and configure time mode (12h or 24h)
     RTC->CR &= ~RTC_CR_FMT;     // Set to 24h format (0 is the reset value anyway, but doing this just in case)
@@ -67,7 +109,7 @@ void RTC_init(ts *ts) {
     RTC->ISR &= ~RTC_ISR_INIT;
 
     // Wait for synchronisation
-    while((RTC->ISR &RTC_ISR_INITF)==RTC_ISR_INITF);
+    WAIT_WHILE(RTC_INIT_EXIT, (RTC->ISR &RTC_ISR_INITF)==RTC_ISR_INITF);
 
     // Enable write protection
     RTC->WPR = 1;   // Can be any value other than the keys
@@ -76,62 +118,431 @@ void RTC_init(ts *ts) {
     PWR->CR &= ~PWR_CR_DBP;
 }
 
+#define RTC_TR_MASK     (RTC_TR_PM | RTC_TR_HT | RTC_TR_HU | RTC_TR_MNT | RTC_TR_MNU | RTC_TR_ST | RTC_TR_SU)
+#define RTC_DR_MASK     (RTC_DR_YT | RTC_DR_YU | RTC_DR_WDU | RTC_DR_MT | RTC_DR_MU | RTC_DR_DT | RTC_DR_DU)
+
+// Flags are cleared by writing 0, so write 1 everywhere else to avoid losing new events. INIT is kept.
+#define RTC_CLEAR_FLAGS(flags)  (RTC->ISR = (uint32_t)~((flags) | RTC_ISR_INIT) | (RTC->ISR & RTC_ISR_INIT))
+
+static uint32_t binToBcd(uint32_t value) {
+    return (value / 10) << 4 | value % 10;
+}
+
+static uint32_t RTC_encodeTime(const ts *ts) {
+    return binToBcd(ts->hours) << RTC_TR_HU_Pos
+         | binToBcd(ts->mins) << RTC_TR_MNU_Pos
+         | binToBcd(ts->secs) << RTC_TR_SU_Pos;
+}
+
+static uint32_t RTC_encodeDate(const ts *ts) {
+    return binToBcd(ts->year - 2000) << RTC_DR_YU_Pos
+         | (uint32_t)(ts->day + 1) << RTC_DR_WDU_Pos     // RTC counts Monday as 1
+         | binToBcd(ts->month) << RTC_DR_MU_Pos
+         | binToBcd(ts->date) << RTC_DR_DU_Pos;
+}
+
+static uint32_t RTC_getPrediv(void) {
+    return (RTC->PRER & RTC_PRER_PREDIV_S) >> RTC_PRER_PREDIV_S_Pos;
+}
+
+static void RTC_unlock(void) {
+    PWR->CR |= PWR_CR_DBP;
+    RTC->WPR = RTC_WRITE_PROTECTION_UNLOCK_1;
+    RTC->WPR = RTC_WRITE_PROTECTION_UNLOCK_2;
+}
+
+static void RTC_lock(void) {
+    RTC->WPR = 0xFF;
+}
+
+/**
+ * @brief  Sets the calendar. Nothing is written if the RTC already shows this
+ *         second. If the request is less than a second away on the same
+ *         date, the running clock is shifted by the sub-second difference
+ *         instead of being stopped. Otherwise TR and DR are each written
+ *         once in initialisation mode.
+ *
+ * @param  ts Time and date to set, including subsecs
+ *
+ * @return @c NULL
+ **/
 void RTC_setTime(ts *ts) {
+    PROF_BEGIN(RTC_SET_TIME);
+    uint32_t tr = RTC_encodeTime(ts);
+    uint32_t dr = RTC_encodeDate(ts);
+
+    RTC_Snapshot snap;
+    RTC_snapshot(&snap);
+
+    if ((snap.dr & RTC_DR_MASK) == dr) {
+        if ((snap.tr & RTC_TR_MASK) == tr) {
+            PROF_END(RTC_SET_TIME);
+            return;
+        }
+
+        // Distance to the requested time in sub-second ticks
+        struct ts now;
+        RTC_decode(&snap, &now);
+        int32_t ticksPerSec = RTC_getPrediv() + 1;
+        int32_t secs = (ts->hours - now.hours) * 3600 + (ts->mins - now.mins) * 60 + (ts->secs - now.secs);
+        int32_t delta = secs * ticksPerSec + ts->subsecs - now.subsecs;
+
+        if (delta > -ticksPerSec && delta < ticksPerSec) {
+            RTC_shift(delta);
+            PROF_END(RTC_SET_TIME);
+            return;
+        }
+    }
+
+    RTC_unlock();
 
-    /*Enable Backup access to config RTC*/
-	PWR->CR |=PWR_CR_DBP;
+    // Enter initialisation mode
+    RTC->ISR |= RTC_ISR_INIT;
+    WAIT_WHILE(RTC_SETTIME_INITF, (RTC->ISR & RTC_ISR_INITF) == 0);
 
-	/*Disable RTC registers write protection*/
-	RTC->WPR = 0xCAU;
-	RTC->WPR = 0x53U;
+    RTC->TR = tr;
+    RTC->DR = dr;
 
+    // Exit initialisation mode and clear RSF in the same write, then wait for the shadow registers
+    RTC->ISR = (uint32_t)~(RTC_ISR_INIT | RTC_ISR_RSF);
+    WAIT_WHILE(RTC_SETTIME_RSF, (RTC->ISR & RTC_ISR_RSF) == 0);
 
-	/*Start init mode*/
-	RTC->ISR |= RTC_ISR_INIT;
+    RTC_lock();
+    PROF_END(RTC_SET_TIME);
+}
 
-	/*Wait until Initializing mode is active*/
-	while((RTC->ISR & RTC_ISR_INITF)!=RTC_ISR_INITF);
+/**
+ * @brief  Reprograms the prescalers of a running RTC. The calendar keeps its
+ *         seconds, only the current sub-second and the resolution change.
+ *
+ * @param  pre Pair from RTC_solvePrescaler()
+ *
+ * @return @c NULL
+ **/
+void RTC_setPrescaler(const RTC_Prescaler *pre) {
+    uint32_t prer = (uint32_t)pre->syncDiv << RTC_PRER_PREDIV_S_Pos |
+                    (uint32_t)pre->asyncDiv << RTC_PRER_PREDIV_A_Pos;
 
-    uint8_t ht = ts->hours / 10;
-    uint8_t hu = ts->hours % 10;
-    uint8_t mnt = ts->mins / 10;
-    uint8_t mnu = ts->mins % 10;
-    uint8_t st = ts->secs / 10;
-    uint8_t su = ts->secs % 10;
+    if ((RTC->PRER & (RTC_PRER_PREDIV_S | RTC_PRER_PREDIV_A)) == prer) {
+        return;
+    }
 
-    RTC->TR = 0;
-    RTC->TR |= ht << RTC_TR_HT_Pos;
-    RTC->TR |= hu << RTC_TR_HU_Pos;
-    RTC->TR |= mnt << RTC_TR_MNT_Pos;
-    RTC->TR |= mnu << RTC_TR_MNU_Pos;
-    RTC->TR |= st << RTC_TR_ST_Pos;
-    RTC->TR |= su << RTC_TR_SU_Pos;
+    RTC_unlock();
 
-    RTC->DR = 100;
+    RTC->ISR |= RTC_ISR_INIT;
+    WAIT_WHILE(RTC_PRESCALER_INITF, (RTC->ISR & RTC_ISR_INITF) == 0);
 
-    /*Exit the initialization mode*/
-	RTC->ISR&=~RTC_ISR_INIT;
+    RTC_writePrescaler(pre);
 
-	/*Wait for synchro*/
-	while((RTC->ISR &RTC_ISR_INITF)==RTC_ISR_INITF);
+    RTC->ISR = (uint32_t)~(RTC_ISR_INIT | RTC_ISR_RSF);
+    WAIT_WHILE(RTC_PRESCALER_RSF, (RTC->ISR & RTC_ISR_RSF) == 0);
 
-	/*Enable RTC registers write protection*/
-	RTC->WPR = 0xFF;
+    RTC_lock();
+}
+
+/**
+ * @brief  Moves the running clock by less than a second without stopping it
+ *
+ * @param  ticks Sub-second ticks to move by, positive to advance. Must be
+ *               smaller in magnitude than PREDIV_S + 1.
+ *
+ * @return @c NULL
+ **/
+void RTC_shift(int32_t ticks) {
+    int32_t ticksPerSec = RTC_getPrediv() + 1;
+
+    if (ticks == 0 || ticks >= ticksPerSec || ticks <= -ticksPerSec) {
+        return;
+    }
+
+    PROF_BEGIN(RTC_SHIFT);
+    RTC_unlock();
+    WAIT_WHILE(RTC_SHIFT_SHPF, RTC->ISR & RTC_ISR_SHPF);    // Wait for any previous shift to finish
+
+    if (ticks > 0) {
+        // Jump a whole second ahead, then take back what wasn't asked for
+        RTC->SHIFTR = RTC_SHIFTR_ADD1S | (uint32_t)(ticksPerSec - ticks) << RTC_SHIFTR_SUBFS_Pos;
+    }
+    else {
+        RTC->SHIFTR = (uint32_t)(-ticks) << RTC_SHIFTR_SUBFS_Pos;
+    }
+
+    RTC_lock();
+    PROF_END(RTC_SHIFT);
+}
+
+/**
+ * @brief  Trims the RTC rate with smooth calibration, in steps of about
+ *         0.954 ppm over a 32 s cycle
+ *
+ * @param  ppb Rate correction in parts per billion, positive to speed up.
+ *             Clamped to roughly -487 to +488 ppm.
+ *
+ * @return @c NULL
+ **/
+void RTC_calibrate(int32_t ppb) {
+    // Net pulses to insert per 2^20 RTCCLK cycles
+    int32_t pulses = (int32_t)(((int64_t)ppb << 20) / 1000000000);
+    uint32_t calp = pulses > 0;
+    int32_t calm = (int32_t)calp * 512 - pulses;
+
+    if (calm < 0) {
+        calm = 0;
+    }
+    if (calm > 511) {
+        calm = 511;
+    }
+
+    // CALP is ignored with PREDIV_A below 3
+    if (calp && (RTC->PRER & RTC_PRER_PREDIV_A) >> RTC_PRER_PREDIV_A_Pos < 3) {
+        calp = 0;
+        calm = 0;
+    }
+
+    PROF_BEGIN(RTC_CALIBRATE);
+    RTC_unlock();
+    WAIT_WHILE(RTC_CALIBRATE_RECALPF, RTC->ISR & RTC_ISR_RECALPF);     // Wait for any previous calibration to load
+
+    RTC->CALR = (calp ? RTC_CALR_CALP : 0) | (uint32_t)calm << RTC_CALR_CALM_Pos;
+
+    RTC_lock();
+    PROF_END(RTC_CALIBRATE);
+}
+
+/**
+ * @brief  Starts the periodic wakeup timer with its interrupt routed through
+ *         EXTI line 22, so it also wakes the core from STOP mode
+ *
+ * @param  reload Period is reload + 1 cycles of RTC_WAKEUP_HZ
+ *
+ * @return @c NULL
+ **/
+void RTC_setWakeup(uint16_t reload) {
+    RTC_unlock();
+
+    // The reload register is only writable with the timer stopped
+    RTC->CR &= ~(RTC_CR_WUTE | RTC_CR_WUTIE);
+    WAIT_WHILE(RTC_WAKEUP_WUTWF, (RTC->ISR & RTC_ISR_WUTWF) == 0);
+
+    RTC->WUTR = reload;
+    RTC->CR &= ~RTC_CR_WUCKSEL;         // RTCCLK / 16
+    RTC_CLEAR_FLAGS(RTC_ISR_WUTF);
+    RTC->CR |= RTC_CR_WUTIE | RTC_CR_WUTE;
+
+    RTC_lock();
+
+    EXTI->IMR |= RTC_EXTI_WAKEUP;
+    EXTI->RTSR |= RTC_EXTI_WAKEUP;
+    NVIC_EnableIRQ(RTC_WKUP_IRQn);
+}
+
+/**
+ * @brief  Stops the wakeup timer
+ *
+ * @return @c NULL
+ **/
+void RTC_stopWakeup(void) {
+    RTC_unlock();
+    RTC->CR &= ~(RTC_CR_WUTE | RTC_CR_WUTIE);
+    RTC_lock();
+}
+
+/**
+ * @brief  Acknowledges a wakeup timer interrupt
+ *
+ * @return 1 if the wakeup flag was set
+ **/
+uint8_t RTC_clearWakeup(void) {
+    uint8_t fired = (RTC->ISR & RTC_ISR_WUTF) != 0;
+
+    RTC_CLEAR_FLAGS(RTC_ISR_WUTF);
+    EXTI->PR = RTC_EXTI_WAKEUP;
+    return fired;
+}
+
+/**
+ * @brief  Arms an alarm for a time of day, repeating daily, with its interrupt
+ *         routed through EXTI line 17
+ *
+ * @param  alarm RTC_ALARM_A or RTC_ALARM_B
+ * @param  hours Hour of day, 24h
+ * @param  mins  Minutes
+ * @param  secs  Seconds
+ *
+ * @return @c NULL
+ **/
+void RTC_setAlarm(enum RTC_Alarm alarm, uint8_t hours, uint8_t mins, uint8_t secs) {
+    uint32_t enable = alarm == RTC_ALARM_A ? RTC_CR_ALRAE : RTC_CR_ALRBE;
+    uint32_t irq = alarm == RTC_ALARM_A ? RTC_CR_ALRAIE : RTC_CR_ALRBIE;
+    uint32_t writable = alarm == RTC_ALARM_A ? RTC_ISR_ALRAWF : RTC_ISR_ALRBWF;
+
+    // Date/weekday is masked, so it matches every day
+    uint32_t value = RTC_ALRMAR_MSK4
+                   | binToBcd(hours) << RTC_ALRMAR_HU_Pos
+                   | binToBcd(mins) << RTC_ALRMAR_MNU_Pos
+                   | binToBcd(secs) << RTC_ALRMAR_SU_Pos;
+
+    RTC_unlock();
+
+    RTC->CR &= ~(enable | irq);
+    WAIT_WHILE(RTC_ALARM_WF, (RTC->ISR & writable) == 0);
+
+    if (alarm == RTC_ALARM_A) {
+        RTC->ALRMAR = value;
+    }
+    else {
+        RTC->ALRMBR = value;
+    }
+    RTC->CR |= enable | irq;
+
+    RTC_lock();
+
+    EXTI->IMR |= RTC_EXTI_ALARM;
+    EXTI->RTSR |= RTC_EXTI_ALARM;
+    NVIC_EnableIRQ(RTC_Alarm_IRQn);
+}
+
+/**
+ * @brief  Disarms an alarm
+ *
+ * @param  alarm RTC_ALARM_A or RTC_ALARM_B
+ *
+ * @return @c NULL
+ **/
+void RTC_stopAlarm(enum RTC_Alarm alarm) {
+    RTC_unlock();
+    RTC->CR &= alarm == RTC_ALARM_A ? ~(RTC_CR_ALRAE | RTC_CR_ALRAIE) : ~(RTC_CR_ALRBE | RTC_CR_ALRBIE);
+    RTC_lock();
+}
+
+/**
+ * @brief  Acknowledges alarm interrupts
+ *
+ * @return Bit 0 set if alarm A fired, bit 1 if alarm B fired
+ **/
+uint8_t RTC_clearAlarms(void) {
+    uint32_t isr = RTC->ISR;
+    uint8_t fired = ((isr & RTC_ISR_ALRAF) ? 1 << RTC_ALARM_A : 0)
+                  | ((isr & RTC_ISR_ALRBF) ? 1 << RTC_ALARM_B : 0);
+
+    RTC_CLEAR_FLAGS(RTC_ISR_ALRAF | RTC_ISR_ALRBF);
+    EXTI->PR = RTC_EXTI_ALARM;
+    return fired;
+}
+
+// BCD byte to binary, for the valid range 0x00 to 0x99
+#define BCD_ROW(t) t##0, t##1, t##2, t##3, t##4, t##5, t##6, t##7, t##8, t##9, 0, 0, 0, 0, 0, 0
+static const uint8_t bcdToBin[0xA0] = {
+    BCD_ROW(), BCD_ROW(1), BCD_ROW(2), BCD_ROW(3), BCD_ROW(4),
+    BCD_ROW(5), BCD_ROW(6), BCD_ROW(7), BCD_ROW(8), BCD_ROW(9)
+};
+
+/**
+ * @brief  Latches SSR, TR and DR as one coherent reading. Reading SSR locks
+ *         the TR and DR shadow registers until DR is read, so a second
+ *         rollover between the reads can't tear the result. With shadow
+ *         registers bypassed, TR is re-read and the snapshot retried if it
+ *         moved.
+ *
+ * @param  snap Filled in by this function
+ *
+ * @return @c NULL
+ **/
+void RTC_snapshot(RTC_Snapshot *snap) {
+    PROF_BEGIN(RTC_SNAPSHOT);
+
+    // Only clear after initialisation or wakeup, normally a single read
+    WAIT_WHILE(RTC_SNAPSHOT_RSF, (RTC->ISR & RTC_ISR_RSF) == 0);
+
+    do {
+        snap->ssr = RTC->SSR;
+        snap->tr = RTC->TR;
+        snap->dr = RTC->DR;
+    } while ((RTC->CR & RTC_CR_BYPSHAD) && snap->tr != RTC->TR);
+    PROF_END(RTC_SNAPSHOT);
+}
+
+/**
+ * @brief  Decodes a snapshot into the full time and date
+ *
+ * @param  snap Registers from RTC_snapshot()
+ * @param  ts   Filled in by this function, apart from isDst
+ *
+ * @return @c NULL
+ **/
+void RTC_decode(const RTC_Snapshot *snap, ts *ts) {
+    uint32_t tr = snap->tr;
+    uint32_t dr = snap->dr;
+    uint32_t prediv = (RTC->PRER & RTC_PRER_PREDIV_S) >> RTC_PRER_PREDIV_S_Pos;
+
+    ts->secs = bcdToBin[tr & (RTC_TR_ST | RTC_TR_SU)];
+    ts->mins = bcdToBin[(tr & (RTC_TR_MNT | RTC_TR_MNU)) >> RTC_TR_MNU_Pos];
+    ts->hours = bcdToBin[(tr & (RTC_TR_HT | RTC_TR_HU)) >> RTC_TR_HU_Pos];
+
+    ts->date = bcdToBin[dr & (RTC_DR_DT | RTC_DR_DU)];
+    ts->month = bcdToBin[(dr & (RTC_DR_MT | RTC_DR_MU)) >> RTC_DR_MU_Pos];
+    ts->year = 2000 + bcdToBin[(dr & (RTC_DR_YT | RTC_DR_YU)) >> RTC_DR_YU_Pos];
+    ts->day = ((dr & RTC_DR_WDU) >> RTC_DR_WDU_Pos) - 1;   // RTC counts Monday as 1
+
+    // SSR counts down, and can briefly exceed PREDIV_S after a shift
+    ts->subsecs = snap->ssr > prediv ? 0 : prediv - snap->ssr;
 }
 
 void RTC_getTime(ts *ts) {
-    while ((RTC->ISR & RTC_ISR_RSF) == 0);
+    PROF_BEGIN(RTC_GET_TIME);
+    RTC_Snapshot snap;
+    RTC_snapshot(&snap);
+    RTC_decode(&snap, ts);
+    PROF_END(RTC_GET_TIME);
+}
 
-    uint8_t ht = (RTC->TR & RTC_TR_HT) >> RTC_TR_HT_Pos;
-    uint8_t hu = (RTC->TR & RTC_TR_HU) >> RTC_TR_HU_Pos;
-    uint8_t mnt = (RTC->TR & RTC_TR_MNT) >> RTC_TR_MNT_Pos;
-    uint8_t mnu = (RTC->TR & RTC_TR_MNU) >> RTC_TR_MNU_Pos;
-    uint8_t st = (RTC->TR & RTC_TR_ST) >> RTC_TR_ST_Pos;
-    uint8_t su = (RTC->TR & RTC_TR_SU) >> RTC_TR_SU_Pos;
+/**
+ * @brief  Reads the time packed into 32 bits for log records, see the
+ *         RTC_PACKED_* positions in rtc.h
+ *
+ * @return Packed time
+ **/
+uint32_t RTC_getPacked(void) {
+    RTC_Snapshot snap;
+    RTC_snapshot(&snap);
+
+    uint32_t tr = snap.tr;
+    uint32_t dr = snap.dr;
+
+    return (uint32_t)bcdToBin[(dr & (RTC_DR_YT | RTC_DR_YU)) >> RTC_DR_YU_Pos] << RTC_PACKED_YEAR_Pos
+         | (uint32_t)bcdToBin[(dr & (RTC_DR_MT | RTC_DR_MU)) >> RTC_DR_MU_Pos] << RTC_PACKED_MONTH_Pos
+         | (uint32_t)bcdToBin[dr & (RTC_DR_DT | RTC_DR_DU)] << RTC_PACKED_DATE_Pos
+         | (uint32_t)bcdToBin[(tr & (RTC_TR_HT | RTC_TR_HU)) >> RTC_TR_HU_Pos] << RTC_PACKED_HOURS_Pos
+         | (uint32_t)bcdToBin[(tr & (RTC_TR_MNT | RTC_TR_MNU)) >> RTC_TR_MNU_Pos] << RTC_PACKED_MINS_Pos
+         | (uint32_t)bcdToBin[tr & (RTC_TR_ST | RTC_TR_SU)] << RTC_PACKED_SECS_Pos;
+}
 
-    ts->hours = ht * 10 + hu;
-    ts->mins = mnt * 10 + mnu;
-    ts->secs = st * 10 + su;
+/**
+ * @brief  Time of day of a snapshot in microseconds, with sub-second resolution
+ *
+ * @param  snap Registers from RTC_snapshot()
+ *
+ * @return Microseconds since midnight
+ **/
+uint64_t RTC_microsOfDay(const RTC_Snapshot *snap) {
+    struct ts now;
+    RTC_decode(snap, &now);
+    uint32_t prediv = RTC_getPrediv();
+
+    return (now.hours * 3600u + now.mins * 60u + now.secs) * 1000000ULL
+         + (uint64_t)now.subsecs * 1000000u / (prediv + 1);
+}
 
-    (void)(RTC->DR);
+/**
+ * @brief  Forces the shadow registers to resynchronise. Needed after waking
+ *         from STOP, before the calendar can be trusted.
+ *
+ * @return @c NULL
+ **/
+void RTC_resync(void) {
+    RTC_unlock();
+    RTC_CLEAR_FLAGS(RTC_ISR_RSF);
+    RTC_lock();
+
+    WAIT_WHILE(RTC_RESYNC_RSF, (RTC->ISR & RTC_ISR_RSF) == 0);
 }
\ No newline at end of file
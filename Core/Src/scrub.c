@@ -0,0 +1,275 @@
+/***********************************************************************************
+ * @file        scrub.c                                                            *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  EEPROM                                                             *
+ * @brief       Background EEPROM scrubber. Walks the record region in small       *
+ *              slices while the EEPROM queue is idle, checks record CRCs and      *
+ *              repairs from the mirror copy, within a bytes-per-second budget.    *
+ ***********************************************************************************/
+
+#include <string.h>
+
+#include "scrub.h"
+#include "eeprom.h"
+#include "crc.h"
+#include "idle.h"
+#include "stm32f4xx_hal.h"      // HAL_GetTick
+
+typedef enum {
+    SCRUB_OFF,
+    SCRUB_READ_PRIMARY,
+    SCRUB_READ_MIRROR,
+    SCRUB_REPAIR
+} SCRUB_Phase;
+
+static struct {
+    SCRUB_Config cfg;
+    SCRUB_Stats stats;
+    SCRUB_Phase phase;
+
+    EEPROM_Request req;
+    uint8_t inFlight;
+    uint16_t pos;                       // Bytes of the current copy read so far
+
+    int32_t credit;                     // Budget in milli-bytes, negative after a repair overdraws it
+    uint32_t lastTick;
+
+    uint8_t primary[SCRUB_MAX_RECORD];
+    uint8_t mirror[SCRUB_MAX_RECORD];
+} scrub;
+
+/**
+ * @brief  Configures the scrubber and starts from the first record
+ *
+ * @param  cfg Region layout, budget and report callback
+ *
+ * @return 0 on success, -1 if the layout is invalid
+ **/
+int SCRUB_init(const SCRUB_Config *cfg) {
+    uint32_t span = (uint32_t)cfg->recordSize * cfg->recordCount;
+
+    if (cfg->recordSize < 3 || cfg->recordSize > SCRUB_MAX_RECORD || cfg->recordCount == 0 ||
+        cfg->slice == 0 || cfg->slice > cfg->recordSize || cfg->bytesPerSec == 0 ||
+        cfg->base + span > EEPROM_SIZE || (cfg->mirror && cfg->mirror + span > EEPROM_SIZE)) {
+        return -1;
+    }
+
+    memset(&scrub, 0, sizeof(scrub));
+    scrub.cfg = *cfg;
+    scrub.phase = SCRUB_READ_PRIMARY;
+    scrub.lastTick = HAL_GetTick();
+    return 0;
+}
+
+// Bytes the next read takes, up to the end of the record
+static uint16_t SCRUB_sliceSize(void) {
+    uint16_t size = scrub.cfg.recordSize - scrub.pos;
+    return size > scrub.cfg.slice ? scrub.cfg.slice : size;
+}
+
+static uint8_t SCRUB_isBlank(const uint8_t *rec, uint16_t size) {
+    for (uint16_t i = 0; i < size; i++) {
+        if (rec[i] != 0xFF) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint8_t SCRUB_isValid(const uint8_t *rec, uint16_t size) {
+    uint16_t crc = CRC16_update(CRC16_INIT, rec, size - 2);
+    return rec[size - 2] == (uint8_t)(crc >> 8) && rec[size - 1] == (uint8_t)crc;
+}
+
+static void SCRUB_submit(EEPROM_Op op, uint16_t addr, uint8_t *data, uint16_t size) {
+    EEPROM_Request *batch[] = { &scrub.req };
+
+    scrub.req.op = op;
+    scrub.req.addr = addr;
+    scrub.req.data = data;
+    scrub.req.size = size;
+    scrub.req.callback = NULL;
+
+    if (EEPROM_submit(batch, 1) == 0) {
+        scrub.inFlight = 1;
+        scrub.credit -= (int32_t)size * 1000;     // Repairs may overdraw, reads wait until it is paid back
+    }
+}
+
+static void SCRUB_nextRecord(void) {
+    scrub.pos = 0;
+    scrub.phase = SCRUB_READ_PRIMARY;
+
+    if (++scrub.stats.record == scrub.cfg.recordCount) {
+        scrub.stats.record = 0;
+        scrub.stats.passes++;
+    }
+}
+
+// Both copies are in, decide whether anything needs rewriting
+static void SCRUB_verify(void) {
+    uint16_t size = scrub.cfg.recordSize;
+    uint16_t offset = scrub.stats.record * size;
+    uint8_t hasMirror = scrub.cfg.mirror != 0;
+
+    uint8_t blankP = SCRUB_isBlank(scrub.primary, size);
+    uint8_t blankM = !hasMirror || SCRUB_isBlank(scrub.mirror, size);
+    uint8_t okP = !blankP && SCRUB_isValid(scrub.primary, size);
+    uint8_t okM = !blankM && SCRUB_isValid(scrub.mirror, size);
+
+    // Unused, or intact with nothing to compare against
+    if ((blankP && blankM) || (okP && (okM || !hasMirror))) {
+        SCRUB_nextRecord();
+        return;
+    }
+
+    if ((!blankP && !okP) || (!blankM && !okM)) {
+        scrub.stats.crcErrors++;
+    }
+
+    if (!okP && okM) {
+        if (scrub.cfg.report) {
+            scrub.cfg.report(scrub.stats.record, SCRUB_REPAIRED_PRIMARY);
+        }
+        scrub.phase = SCRUB_REPAIR;
+        SCRUB_submit(EEPROM_OP_WRITE, scrub.cfg.base + offset, scrub.mirror, size);
+    }
+    else if (okP) {
+        if (scrub.cfg.report) {
+            scrub.cfg.report(scrub.stats.record, SCRUB_REPAIRED_MIRROR);
+        }
+        scrub.phase = SCRUB_REPAIR;
+        SCRUB_submit(EEPROM_OP_WRITE, scrub.cfg.mirror + offset, scrub.primary, size);
+    }
+    else {
+        scrub.stats.unrecoverable++;
+        if (scrub.cfg.report) {
+            scrub.cfg.report(scrub.stats.record, SCRUB_UNRECOVERABLE);
+        }
+        SCRUB_nextRecord();
+    }
+}
+
+// Handles the request that just finished
+static void SCRUB_complete(void) {
+    scrub.inFlight = 0;
+
+    if (scrub.phase == SCRUB_REPAIR) {
+        if (scrub.req.status == EEPROM_DONE) {
+            scrub.stats.repaired++;
+        }
+        else {
+            scrub.stats.ioErrors++;
+        }
+        SCRUB_nextRecord();
+        return;
+    }
+
+    scrub.stats.bytesRead += scrub.req.size;
+    scrub.pos += scrub.req.size;
+
+    if (scrub.pos < scrub.cfg.recordSize) {
+        return;
+    }
+
+    if (scrub.phase == SCRUB_READ_PRIMARY && scrub.cfg.mirror) {
+        scrub.phase = SCRUB_READ_MIRROR;
+        scrub.pos = 0;
+    }
+    else {
+        SCRUB_verify();
+    }
+}
+
+/**
+ * @brief  Runs one scrub step. Call this from the main loop after
+ *         EEPROM_process(). Nothing is queued unless the EEPROM queue is empty
+ *         and the budget covers a whole slice, so foreground requests wait
+ *         behind at most one slice.
+ *
+ * @return @c NULL
+ **/
+void SCRUB_process(void) {
+    if (scrub.phase == SCRUB_OFF) {
+        return;
+    }
+
+    uint32_t now = HAL_GetTick();
+    int32_t cap = (int32_t)scrub.cfg.recordSize * 2000;     // Don't save up more than two records
+
+    // Clamped to the time a full budget takes to earn first, so the product cannot overflow
+    uint32_t elapsed = now - scrub.lastTick;
+    uint32_t fill = (uint32_t)(cap - scrub.credit) / scrub.cfg.bytesPerSec + 1;
+    if (elapsed > fill) {
+        elapsed = fill;
+    }
+    scrub.credit += (int32_t)(elapsed * scrub.cfg.bytesPerSec);
+    if (scrub.credit > cap) {
+        scrub.credit = cap;
+    }
+    scrub.lastTick = now;
+
+    if (scrub.inFlight) {
+        EEPROM_Status status = EEPROM_poll(&scrub.req);
+        if (status == EEPROM_PENDING || status == EEPROM_BUSY) {
+            return;
+        }
+        SCRUB_complete();
+        if (scrub.inFlight) {
+            return;                     // Started a repair
+        }
+    }
+
+    if (!EEPROM_isIdle()) {
+        return;
+    }
+
+    uint16_t size = SCRUB_sliceSize();
+    if (scrub.credit < (int32_t)size * 1000) {
+        return;
+    }
+
+    uint16_t offset = scrub.stats.record * scrub.cfg.recordSize + scrub.pos;
+    if (scrub.phase == SCRUB_READ_PRIMARY) {
+        SCRUB_submit(EEPROM_OP_READ, scrub.cfg.base + offset, scrub.primary + scrub.pos, size);
+    }
+    else {
+        SCRUB_submit(EEPROM_OP_READ, scrub.cfg.mirror + offset, scrub.mirror + scrub.pos, size);
+    }
+}
+
+/**
+ * @brief  Says when SCRUB_process() next has a finished read to check or
+ *         can afford the next slice. While a read is queued the EEPROM is
+ *         busy, and IDLE_run() keeps the loop turning until it completes.
+ *
+ * @return Milliseconds until then, 0 if now, IDLE_NEVER while off or waiting on the EEPROM
+ **/
+uint32_t SCRUB_nextPoll(void) {
+    if (scrub.phase == SCRUB_OFF) {
+        return IDLE_NEVER;
+    }
+    if (scrub.inFlight) {
+        EEPROM_Status status = EEPROM_poll(&scrub.req);
+        return (status == EEPROM_PENDING || status == EEPROM_BUSY) ? IDLE_NEVER : 0;
+    }
+
+    // Milli-bytes still to earn, at bytesPerSec of them a millisecond
+    uint32_t elapsed = HAL_GetTick() - scrub.lastTick;
+    int64_t owed = (int64_t)SCRUB_sliceSize() * 1000 - scrub.credit - (int64_t)elapsed * scrub.cfg.bytesPerSec;
+    if (owed <= 0) {
+        return 0;
+    }
+    return (uint32_t)((owed + scrub.cfg.bytesPerSec - 1) / scrub.cfg.bytesPerSec);
+}
+
+/**
+ * @brief  Copies out the progress and error counters
+ *
+ * @param  stats Filled in by this function
+ *
+ * @return @c NULL
+ **/
+void SCRUB_getStats(SCRUB_Stats *stats) {
+    *stats = scrub.stats;
+}
\ No newline at end of file
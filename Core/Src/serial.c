@@ -0,0 +1,654 @@
+/***********************************************************************************
+ * @file        serial.c                                                           *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  USART                                                              *
+ * @brief       Non-blocking USART3. Transmit copies into a byte ring that DMA1    *
+ *              Stream 3 sends in contiguous segments, chained from each           *
+ *              transfer-complete interrupt. Receive runs DMA1 Stream 1 circular   *
+ *              into a ring and uses the idle-line interrupt to mark frames.       *
+ *              Backs _write and _read.                                            *
+ ***********************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "serial.h"
+#include "idle.h"
+#include "wait.h"
+#include "stm32f439xx.h"
+#include "system_stm32f4xx.h"   // SystemCoreClock, APBPrescTable
+#include "stm32f4xx_hal.h"      // HAL_GetTick
+
+#define SERIAL_TX_MASK      (SERIAL_TX_SIZE - 1)
+#define SERIAL_TX_STREAM    DMA1_Stream3
+#define SERIAL_TX_CHANNEL   (4U << DMA_SxCR_CHSEL_Pos)
+#define SERIAL_TX_FLAGS     (DMA_LISR_TCIF3 | DMA_LISR_HTIF3 | DMA_LISR_TEIF3 | DMA_LISR_DMEIF3 | DMA_LISR_FEIF3)
+
+#define SERIAL_RX_MASK      (SERIAL_RX_SIZE - 1)
+#define SERIAL_RX_STREAM    DMA1_Stream1
+#define SERIAL_RX_CHANNEL   (4U << DMA_SxCR_CHSEL_Pos)
+#define SERIAL_RX_FLAGS     (DMA_LISR_TCIF1 | DMA_LISR_HTIF1 | DMA_LISR_TEIF1 | DMA_LISR_DMEIF1 | DMA_LISR_FEIF1)
+
+// In SRAM, the DMA cannot reach CCMRAM
+static uint8_t txRing[SERIAL_TX_SIZE];
+static uint8_t rxRing[SERIAL_RX_SIZE];
+
+/*
+ * Writers reserve room with interrupts masked, then copy with them enabled,
+ * so a long write never holds interrupts off. A writer that preempts
+ * another reserves after it, and since interrupts nest, the outermost writer
+ * finishes last and hands everything reserved to the DMA by moving head.
+ * tail only moves in the DMA interrupt.
+ */
+static struct {
+    volatile uint32_t reserved;         // Next byte to hand a writer
+    volatile uint32_t head;             // End of the bytes the DMA may send
+    volatile uint32_t tail;             // First byte the DMA still owns
+    uint8_t writers;                    // Copies in progress, nested
+    volatile uint16_t sending;          // Length of the segment in flight, 0 when idle
+    SERIAL_Policy policy;
+    SERIAL_Stats stats;
+} tx;
+
+/*
+ * The DMA writes the RX ring on its own. head counts bytes received, worked
+ * out from NDTR in the interrupts, and frame ends are queued on idle lines.
+ */
+static struct {
+    volatile uint32_t head;             // Bytes written by the DMA so far
+    uint32_t tail;                      // Bytes consumed
+    uint32_t ends[SERIAL_RX_FRAMES];    // head at each idle line
+    volatile uint32_t endHead;
+    uint32_t endTail;
+    uint32_t lastEnd;                   // head at the last idle line, interrupt only
+    SERIAL_RxHandler handler;
+} rx;
+
+static struct {
+    uint32_t baud;
+    uint32_t fallback;                  // Rate to return to if a proposed one is not confirmed
+    uint32_t proposedAt;
+    uint32_t framesAt;                  // Frame count when the switch was made
+    uint8_t proposed;
+} link = { .baud = SERIAL_BAUD_DEFAULT };
+
+// Starts the next contiguous segment. Interrupts must be masked.
+static void SERIAL_startTx(void) {
+    uint32_t pending = tx.head - tx.tail;
+    if (tx.sending != 0 || pending == 0) {
+        return;
+    }
+
+    uint32_t start = tx.tail & SERIAL_TX_MASK;
+    uint32_t len = SERIAL_TX_SIZE - start;      // Stop at the end of the ring, the next segment wraps
+    if (len > pending) {
+        len = pending;
+    }
+
+    DMA1->LIFCR = SERIAL_TX_FLAGS;
+    SERIAL_TX_STREAM->M0AR = (uint32_t)&txRing[start];
+    SERIAL_TX_STREAM->NDTR = len;
+    SERIAL_TX_STREAM->CR |= DMA_SxCR_EN;
+
+    tx.sending = len;
+    tx.stats.transfers++;
+}
+
+/**
+ * @brief  Takes over USART3 transmit from the HAL. MX_USART3_UART_Init()
+ *         must already have configured the baud rate and pins.
+ *
+ * @param  policy What writes do when the ring is full
+ *
+ * @return @c NULL
+ **/
+void SERIAL_init(SERIAL_Policy policy) {
+    memset(&tx, 0, sizeof(tx));
+    tx.policy = policy;
+
+    // The ring is stdout's buffer, so newlib doesn't malloc one on the first printf
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN;
+
+    SERIAL_TX_STREAM->CR &= ~DMA_SxCR_EN;
+    WAIT_WHILE(SERIAL_DMA_DISABLE, SERIAL_TX_STREAM->CR & DMA_SxCR_EN);
+
+    // Byte to peripheral, memory increment, direct mode, interrupts on complete and error
+    SERIAL_TX_STREAM->CR = SERIAL_TX_CHANNEL | DMA_SxCR_DIR_0 | DMA_SxCR_MINC | DMA_SxCR_TCIE | DMA_SxCR_TEIE;
+    SERIAL_TX_STREAM->PAR = (uint32_t)&USART3->DR;
+    SERIAL_TX_STREAM->FCR = 0;
+
+    USART3->CR3 |= USART_CR3_DMAT;
+    NVIC_EnableIRQ(DMA1_Stream3_IRQn);
+
+    memset(&rx, 0, sizeof(rx));
+
+    SERIAL_RX_STREAM->CR &= ~DMA_SxCR_EN;
+    WAIT_WHILE(SERIAL_DMA_DISABLE, SERIAL_RX_STREAM->CR & DMA_SxCR_EN);
+
+    // Peripheral to byte ring, circular, interrupts at half and full so head never falls a lap behind
+    DMA1->LIFCR = SERIAL_RX_FLAGS;
+    SERIAL_RX_STREAM->CR = SERIAL_RX_CHANNEL | DMA_SxCR_MINC | DMA_SxCR_CIRC | DMA_SxCR_HTIE | DMA_SxCR_TCIE;
+    SERIAL_RX_STREAM->PAR = (uint32_t)&USART3->DR;
+    SERIAL_RX_STREAM->M0AR = (uint32_t)rxRing;
+    SERIAL_RX_STREAM->NDTR = SERIAL_RX_SIZE;
+    SERIAL_RX_STREAM->FCR = 0;
+    SERIAL_RX_STREAM->CR |= DMA_SxCR_EN;
+
+    // Reading SR then DR clears anything pending from before DMA took over
+    (void)(USART3->SR | USART3->DR);
+    USART3->CR3 |= USART_CR3_DMAR;
+    USART3->CR1 |= USART_CR1_IDLEIE;
+
+    NVIC_EnableIRQ(DMA1_Stream1_IRQn);
+    NVIC_EnableIRQ(USART3_IRQn);
+}
+
+/**
+ * @brief  Changes what writes do when the ring is full
+ *
+ * @param  policy New policy
+ *
+ * @return @c NULL
+ **/
+void SERIAL_setPolicy(SERIAL_Policy policy) {
+    tx.policy = policy;
+}
+
+// Claims room for size bytes. Interrupts must be masked.
+static uint32_t SERIAL_reserve(uint16_t size) {
+    uint32_t at = tx.reserved;
+    tx.reserved += size;
+    tx.writers++;
+
+    uint32_t queued = tx.reserved - tx.tail;
+    if (queued > tx.stats.highWater) {
+        tx.stats.highWater = (uint16_t)queued;
+    }
+    return at;
+}
+
+// Copies into a reservation, then kicks the DMA once no other copy is in progress
+static void SERIAL_fill(uint32_t at, const uint8_t *data, uint16_t size) {
+    uint32_t start = at & SERIAL_TX_MASK;
+    uint32_t first = SERIAL_TX_SIZE - start;
+    if (first > size) {
+        first = size;
+    }
+
+    memcpy(&txRing[start], data, first);
+    memcpy(txRing, data + first, size - first);
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    tx.stats.written += size;
+    if (--tx.writers == 0) {
+        tx.head = tx.reserved;
+        SERIAL_startTx();
+    }
+
+    __set_PRIMASK(primask);
+}
+
+/**
+ * @brief  Queues bytes for transmission, applying the policy if they don't
+ *         all fit
+ *
+ * @param  data Bytes to send
+ * @param  size Number of bytes
+ *
+ * @return Bytes queued
+ **/
+uint16_t SERIAL_write(const uint8_t *data, uint16_t size) {
+    uint16_t queued = 0;
+    uint8_t waited = 0;
+
+    while (size > 0) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+
+        uint16_t space = SERIAL_TX_SIZE - (tx.reserved - tx.tail);
+
+        // Everything past the segment in flight can go, unless a preempted writer is still copying into it
+        if (space < size && tx.policy == SERIAL_OVERWRITE && tx.writers == 0) {
+            uint32_t keep = tx.tail + tx.sending;
+            tx.stats.overwritten += tx.reserved - keep;
+            tx.reserved = keep;
+            tx.head = keep;
+            space = SERIAL_TX_SIZE - tx.sending;
+
+            if (space < size) {
+                tx.stats.overwritten += size - space;
+                data += size - space;       // Newest bytes win
+                size = space;
+            }
+        }
+
+        uint16_t n = size < space ? size : space;
+        uint32_t at = SERIAL_reserve(n);
+
+        __set_PRIMASK(primask);
+
+        SERIAL_fill(at, data, n);
+        data += n;
+        size -= n;
+        queued += n;
+
+        if (size == 0) {
+            break;
+        }
+
+        // Waiting is only possible where the DMA interrupt can still run
+        if (tx.policy != SERIAL_BLOCK || primask != 0 || __get_IPSR() != 0) {
+            tx.stats.dropped += size;
+            break;
+        }
+        if (!waited) {
+            tx.stats.blocked++;
+            waited = 1;
+        }
+        WAIT_WHILE(SERIAL_TX_SPACE, tx.reserved - tx.tail == SERIAL_TX_SIZE);
+    }
+
+    return queued;
+}
+
+/**
+ * @brief  Queues as many bytes as fit, without applying the policy. For
+ *         producers that keep the remainder and offer it again later.
+ *
+ * @param  data Bytes to send
+ * @param  size Number of bytes
+ *
+ * @return Bytes queued
+ **/
+uint16_t SERIAL_offer(const uint8_t *data, uint16_t size) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    uint16_t space = SERIAL_TX_SIZE - (tx.reserved - tx.tail);
+    uint16_t n = size < space ? size : space;
+    uint32_t at = SERIAL_reserve(n);
+
+    __set_PRIMASK(primask);
+
+    SERIAL_fill(at, data, n);
+    return n;
+}
+
+/**
+ * @brief  Space left in the transmit ring
+ *
+ * @return Bytes that can be queued without waiting
+ **/
+uint16_t SERIAL_txFree(void) {
+    return SERIAL_TX_SIZE - (tx.reserved - tx.tail);
+}
+
+/**
+ * @brief  Waits until everything queued has left the DMA, e.g. before a
+ *         reset. The last byte may still be shifting out of the USART.
+ *
+ * @return @c NULL
+ **/
+void SERIAL_flush(void) {
+    WAIT_WHILE(SERIAL_FLUSH, tx.reserved != tx.tail);
+}
+
+/**
+ * @brief  Copies out the transmit counters
+ *
+ * @param  stats Filled in by this function
+ *
+ * @return @c NULL
+ **/
+void SERIAL_getStats(SERIAL_Stats *stats) {
+    *stats = tx.stats;
+}
+
+// Called from DMA1_Stream3_IRQHandler
+void SERIAL_txDmaIrq(void) {
+    uint32_t flags = DMA1->LISR & SERIAL_TX_FLAGS;
+    DMA1->LIFCR = flags;
+
+    if (flags & DMA_LISR_TEIF3) {
+        tx.stats.dmaErrors++;
+    }
+    if (flags & (DMA_LISR_TCIF3 | DMA_LISR_TEIF3)) {
+        // A failed segment is skipped rather than retried
+        tx.tail += tx.sending;
+        tx.sending = 0;
+        SERIAL_startTx();
+    }
+}
+
+// Brings rx.head up to the DMA position. Called from the RX interrupts only.
+static void SERIAL_rxUpdate(void) {
+    uint32_t pos = (SERIAL_RX_SIZE - SERIAL_RX_STREAM->NDTR) & SERIAL_RX_MASK;
+    uint32_t added = (pos - rx.head) & SERIAL_RX_MASK;
+
+    rx.head += added;
+    tx.stats.received += added;
+}
+
+/**
+ * @brief  Works out the BRR value for a baud rate. BRR holds USARTDIV as
+ *         12.4 fixed point with 16x oversampling, or 12.3 with 8x, and the
+ *         real rate is pclk / (USARTDIV * oversampling).
+ *
+ * @param  pclk     USART kernel clock, PCLK1 for USART3
+ * @param  baud     Wanted rate
+ * @param  over8    1 for 8x oversampling, which doubles the top rate
+ * @param  errorPpm Filled in with the real rate's error, may be NULL
+ *
+ * @return BRR value, 0 if the rate is out of range
+ **/
+uint16_t SERIAL_computeBrr(uint32_t pclk, uint32_t baud, uint8_t over8, int32_t *errorPpm) {
+    if (baud == 0) {
+        return 0;
+    }
+
+    // Clock periods per bit, in units of the fraction field
+    uint32_t div = (uint32_t)(((uint64_t)pclk + baud / 2) / baud);
+    uint32_t unit = over8 ? 8 : 16;
+    uint32_t mantissa = div / unit;
+
+    if (mantissa == 0 || mantissa > 0xFFF) {
+        return 0;
+    }
+
+    if (errorPpm != NULL) {
+        int64_t actual = (int64_t)pclk * 1000000 / div;
+        *errorPpm = (int32_t)((actual - (int64_t)baud * 1000000) / baud);
+    }
+    return (uint16_t)(mantissa << 4 | (div % unit));
+}
+
+static uint32_t SERIAL_pclk1(void) {
+    return SystemCoreClock >> APBPrescTable[(RCC->CFGR & RCC_CFGR_PPRE1) >> RCC_CFGR_PPRE1_Pos];
+}
+
+// 16x oversampling is kept unless 8x gets closer to the rate, as it tolerates more noise
+static uint16_t SERIAL_pickBrr(uint32_t baud, uint8_t *over8, int32_t *errorPpm) {
+    uint32_t pclk = SERIAL_pclk1();
+    int32_t err16 = 0, err8 = 0;
+    uint16_t brr16 = SERIAL_computeBrr(pclk, baud, 0, &err16);
+    uint16_t brr8 = SERIAL_computeBrr(pclk, baud, 1, &err8);
+
+    uint8_t use16 = brr16 != 0 && (brr8 == 0 || (err16 < 0 ? -err16 : err16) <= (err8 < 0 ? -err8 : err8));
+    uint16_t brr = use16 ? brr16 : brr8;
+    int32_t error = use16 ? err16 : err8;
+
+    if (brr == 0 || error > SERIAL_BAUD_TOLERANCE || error < -SERIAL_BAUD_TOLERANCE) {
+        return 0;
+    }
+    *over8 = !use16;
+    if (errorPpm != NULL) {
+        *errorPpm = error;
+    }
+    return brr;
+}
+
+/**
+ * @brief  Checks whether a rate can be reached, without changing anything
+ *
+ * @param  baud     Rate to check
+ * @param  errorPpm Filled in with the real rate's error, may be NULL
+ *
+ * @return 0 if reachable, -1 if no setting is within SERIAL_BAUD_TOLERANCE
+ **/
+int SERIAL_checkBaud(uint32_t baud, int32_t *errorPpm) {
+    uint8_t over8;
+    return SERIAL_pickBrr(baud, &over8, errorPpm) != 0 ? 0 : -1;
+}
+
+/**
+ * @brief  Changes the USART3 rate straight away, after queued output has
+ *         gone. Up to PCLK1 / 8, 5.25 Mbaud at 42 MHz.
+ *
+ * @param  baud     New rate
+ * @param  errorPpm Filled in with the real rate's error, may be NULL
+ *
+ * @return 0 on success, -1 if no setting is within SERIAL_BAUD_TOLERANCE
+ **/
+int SERIAL_setBaud(uint32_t baud, int32_t *errorPpm) {
+    uint8_t over8;
+    uint16_t brr = SERIAL_pickBrr(baud, &over8, errorPpm);
+
+    if (brr == 0) {
+        return -1;
+    }
+
+    SERIAL_flush();
+    WAIT_WHILE(SERIAL_FLUSH, (USART3->SR & USART_SR_TC) == 0);
+
+    // OVER8 and BRR may only change with the USART disabled
+    USART3->CR1 &= ~USART_CR1_UE;
+    if (over8) {
+        USART3->CR1 |= USART_CR1_OVER8;
+    }
+    else {
+        USART3->CR1 &= ~USART_CR1_OVER8;
+    }
+    USART3->BRR = brr;
+    USART3->CR1 |= USART_CR1_UE;
+
+    link.baud = baud;
+    return 0;
+}
+
+/**
+ * @brief  Current USART3 rate
+ *
+ * @return Rate in baud
+ **/
+uint32_t SERIAL_getBaud(void) {
+    return link.baud;
+}
+
+/**
+ * @brief  Negotiates a new rate with the host. The reply to the host's
+ *         request should already be queued at the old rate. The switch is
+ *         kept once any frame arrives at the new rate, otherwise
+ *         SERIAL_process() goes back to the old rate after
+ *         SERIAL_BAUD_CONFIRM_MS.
+ *
+ * @param  baud     Proposed rate
+ * @param  errorPpm Filled in with the real rate's error, may be NULL
+ *
+ * @return 0 if switched, -1 if the rate is out of reach
+ **/
+int SERIAL_proposeBaud(uint32_t baud, int32_t *errorPpm) {
+    uint32_t old = link.baud;
+
+    if (SERIAL_setBaud(baud, errorPpm) != 0) {
+        return -1;
+    }
+
+    link.fallback = old;
+    link.proposedAt = HAL_GetTick();
+    link.framesAt = tx.stats.frames;
+    link.proposed = 1;
+    return 0;
+}
+
+/**
+ * @brief  Sets the function SERIAL_process() hands frames to. Without one,
+ *         input stays in the ring for SERIAL_read().
+ *
+ * @param  handler Frame handler, or NULL
+ *
+ * @return @c NULL
+ **/
+void SERIAL_setRxHandler(SERIAL_RxHandler handler) {
+    rx.handler = handler;
+}
+
+// Drops input the DMA has already lapped
+static void SERIAL_rxCheckOverrun(void) {
+    uint32_t head = rx.head;
+    if (head - rx.tail > SERIAL_RX_SIZE) {
+        tx.stats.rxOverruns += head - SERIAL_RX_SIZE - rx.tail;
+        rx.tail = head - SERIAL_RX_SIZE;
+    }
+}
+
+/**
+ * @brief  Hands every complete frame to the RX handler, straight out of the
+ *         ring. Call from the main loop.
+ *
+ * @return @c NULL
+ **/
+void SERIAL_process(void) {
+    if (link.proposed) {
+        if (tx.stats.frames != link.framesAt) {
+            link.proposed = 0;          // Host is talking at the new rate
+        }
+        else if (HAL_GetTick() - link.proposedAt > SERIAL_BAUD_CONFIRM_MS) {
+            link.proposed = 0;
+            SERIAL_setBaud(link.fallback, NULL);
+        }
+    }
+
+    if (rx.handler == NULL) {
+        return;
+    }
+
+    while (rx.endTail != rx.endHead) {
+        uint32_t end = rx.ends[rx.endTail & (SERIAL_RX_FRAMES - 1)];
+        rx.endTail++;
+
+        SERIAL_rxCheckOverrun();
+        if ((int32_t)(end - rx.tail) <= 0) {
+            continue;                       // Frame was lost to an overrun
+        }
+
+        while (rx.tail != end) {
+            uint32_t start = rx.tail & SERIAL_RX_MASK;
+            uint32_t len = end - rx.tail;
+            if (len > SERIAL_RX_SIZE - start) {
+                len = SERIAL_RX_SIZE - start;
+            }
+
+            rx.tail += len;
+            rx.handler(&rxRing[start], (uint16_t)len, rx.tail == end);
+        }
+    }
+}
+
+/**
+ * @brief  Says when SERIAL_process() next has work. Call with interrupts
+ *         masked, so a frame ending after the check still wakes the core.
+ *
+ * @return Milliseconds until then, 0 if now, IDLE_NEVER if only on input
+ **/
+uint32_t SERIAL_nextPoll(void) {
+    if (rx.handler != NULL && rx.endTail != rx.endHead) {
+        return 0;
+    }
+    if (!link.proposed) {
+        return IDLE_NEVER;
+    }
+    if (tx.stats.frames != link.framesAt) {
+        return 0;
+    }
+    return IDLE_msLeft(HAL_GetTick(), link.proposedAt, SERIAL_BAUD_CONFIRM_MS + 1);
+}
+
+/**
+ * @brief  Copies out received bytes without waiting, ignoring frame
+ *         boundaries. Only for use without an RX handler.
+ *
+ * @param  data Destination
+ * @param  size Most bytes to copy
+ *
+ * @return Bytes copied
+ **/
+uint16_t SERIAL_read(uint8_t *data, uint16_t size) {
+    // Bytes still in flight at the last interrupt are picked up here too
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    SERIAL_rxUpdate();
+    __set_PRIMASK(primask);
+
+    SERIAL_rxCheckOverrun();
+
+    uint16_t n = 0;
+    while (n < size && rx.tail != rx.head) {
+        data[n++] = rxRing[rx.tail & SERIAL_RX_MASK];
+        rx.tail++;
+    }
+    rx.endTail = rx.endHead;                // Frame marks mean nothing to a byte reader
+    return n;
+}
+
+// Called from DMA1_Stream1_IRQHandler, every half ring
+void SERIAL_rxDmaIrq(void) {
+    DMA1->LIFCR = DMA1->LISR & SERIAL_RX_FLAGS;
+    SERIAL_rxUpdate();
+}
+
+// Called from USART3_IRQHandler
+void SERIAL_usartIrq(void) {
+    uint32_t sr = USART3->SR;
+
+    if (sr & (USART_SR_IDLE | USART_SR_ORE | USART_SR_NE | USART_SR_FE)) {
+        (void)USART3->DR;                   // SR then DR read clears these
+    }
+    if (sr & (USART_SR_ORE | USART_SR_NE | USART_SR_FE)) {
+        tx.stats.lineErrors++;
+    }
+
+    if (sr & USART_SR_IDLE) {
+        SERIAL_rxUpdate();
+
+        if (rx.head != rx.lastEnd) {
+            rx.lastEnd = rx.head;
+            if (rx.endHead - rx.endTail < SERIAL_RX_FRAMES) {
+                rx.ends[rx.endHead & (SERIAL_RX_FRAMES - 1)] = rx.head;
+                rx.endHead++;
+                tx.stats.frames++;
+            }
+            else {
+                tx.stats.frameOverruns++;
+            }
+        }
+    }
+}
+
+/**
+ * @brief  Strong override of the weak _read in syscalls.c. Waits for at
+ *         least one byte, then returns what has arrived.
+ **/
+int _read(int file, char *ptr, int len) {
+    (void)file;
+    uint16_t max = len > UINT16_MAX ? UINT16_MAX : (uint16_t)len;
+    uint16_t n;
+
+    // Masked between the check and WFI, so a byte landing in between still wakes it
+    __disable_irq();
+    while ((n = SERIAL_read((uint8_t *)ptr, max)) == 0) {
+        __WFI();
+        __enable_irq();
+        __disable_irq();
+    }
+    __enable_irq();
+    return n;
+}
+
+/**
+ * @brief  Strong override of the weak _write in syscalls.c, so printf and
+ *         friends go through the DMA ring
+ **/
+int _write(int file, char *ptr, int len) {
+    (void)file;
+
+    for (int done = 0; done < len; ) {
+        uint16_t n = len - done > UINT16_MAX ? UINT16_MAX : (uint16_t)(len - done);
+        SERIAL_write((const uint8_t *)ptr + done, n);
+        done += n;
+    }
+    return len;
+}
\ No newline at end of file
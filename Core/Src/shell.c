@@ -0,0 +1,722 @@
+/***********************************************************************************
+ * @file        shell.c                                                            *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  USART                                                              *
+ * @brief       Line-edited command shell for bus and storage diagnostics. Input   *
+ *              arrives between protocol frames, commands come from a static       *
+ *              table, and nothing is allocated. Long commands run a step at a     *
+ *              time from SHELL_process() so they never block the main loop.       *
+ ***********************************************************************************/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shell.h"
+#include "serial.h"
+#include "i2c.h"
+#include "eeprom.h"
+#include "persist.h"
+#include "rtc.h"
+#include "calendar.h"
+#include "timestamp.h"
+#include "prof.h"
+#include "wait.h"
+#include "netif.h"
+#include "net.h"
+#include "eenet.h"
+#include "ptp.h"
+#include "idle.h"
+#include "stm32f439xx.h"
+
+#define SHELL_I2C           I2C1
+#define SHELL_SCAN_FIRST    0x08        // 7-bit addresses outside the reserved ranges
+#define SHELL_SCAN_LAST     0x77
+#define SHELL_HEX_LINE      16
+#define SHELL_HEX_ROOM      80          // TX space wanted before printing a hex dump line
+#define SHELL_STACK_PAINT   0x5A5A5A5AU
+
+#define KEY_CTRL_C          0x03
+#define KEY_BACKSPACE       0x08
+#define KEY_CTRL_U          0x15
+#define KEY_CTRL_W          0x17
+#define KEY_ESC             0x1B
+#define KEY_DELETE          0x7F
+
+typedef enum {
+    SHELL_DONE      = 0,
+    SHELL_PENDING   = 1                 // Carries on from SHELL_process(), prompt comes after
+} SHELL_Result;
+
+typedef SHELL_Result (*SHELL_Handler)(uint8_t argc, char **argv);
+typedef SHELL_Result (*SHELL_Step)(void);
+
+typedef struct {
+    const char *name;
+    const char *usage;
+    SHELL_Handler handler;
+} SHELL_Command;
+
+// Escape sequences are swallowed, only up arrow does anything
+typedef enum {
+    SHELL_KEY_NORMAL    = 0,
+    SHELL_KEY_ESC       = 1,
+    SHELL_KEY_CSI       = 2
+} SHELL_KeyState;
+
+// Linker script symbols
+extern uint32_t _sdata, _ebss, _end, _estack, _sccmram, _eccmbss, _sethbuf, _eethbuf;
+void *_sbrk(ptrdiff_t incr);
+
+static struct {
+    char line[SHELL_LINE_SIZE];
+    uint8_t length;
+    char history[SHELL_LINE_SIZE];      // Last line run, recalled with up arrow
+    SHELL_KeyState key;
+    uint8_t lastCr;                     // Swallows the LF of a CR LF
+    SHELL_Step step;                    // Command still running, NULL at the prompt
+    uint8_t cancel;                     // Ctrl-C while a command runs
+} shell;
+
+// State of the running command, only one runs at a time
+static struct {
+    EEPROM_Request req;
+    uint8_t data[SHELL_EE_CHUNK];
+    uint16_t first;                     // ee bench start address
+    uint16_t addr;                      // Next EEPROM address
+    uint16_t end;
+    uint16_t shown;                     // Bytes of data printed so far
+    uint8_t device;                     // Next I2C address to probe
+    uint8_t found;
+    uint64_t started;                   // TIMESTAMP_us() when the request went in
+    uint64_t readUs;
+    uint64_t writeUs;
+} job;
+
+static char out[SHELL_OUT_SIZE];
+
+static void SHELL_write(const char *text) {
+    SERIAL_write((const uint8_t *)text, (uint16_t)strlen(text));
+}
+
+/**
+ * @brief  Formats into a fixed buffer and queues it for USART3. Never waits,
+ *         output that does not fit in the TX ring goes by SERIAL policy.
+ *
+ * @param  fmt printf format
+ *
+ * @return @c NULL
+ **/
+void SHELL_printf(const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(out, sizeof(out), fmt, args);
+    va_end(args);
+
+    if (len > 0) {
+        SERIAL_write((const uint8_t *)out, len < (int)sizeof(out) ? (uint16_t)len : sizeof(out) - 1);
+    }
+}
+
+static SHELL_Result SHELL_run(SHELL_Step step) {
+    shell.step = step;
+    shell.cancel = 0;
+    return SHELL_PENDING;
+}
+
+// Parses decimal, 0x hex or 0 octal, rejecting trailing junk
+static int SHELL_parse(const char *text, uint32_t *value) {
+    char *end;
+
+    if (*text == '\0') {
+        return -1;
+    }
+    *value = strtoul(text, &end, 0);
+    return *end == '\0' ? 0 : -1;
+}
+
+// Parses count decimal fields split by sep, such as 2025-10-17
+static int SHELL_parseFields(const char *text, char sep, uint32_t *values, uint8_t count) {
+    char *end;
+
+    for (uint8_t i = 0; i < count; i++) {
+        values[i] = strtoul(text, &end, 10);
+        if (end == text || *end != (i == count - 1 ? '\0' : sep)) {
+            return -1;
+        }
+        text = end + 1;
+    }
+    return 0;
+}
+
+static int SHELL_submit(EEPROM_Op op, uint16_t addr, uint16_t size) {
+    EEPROM_Request *batch[] = { &job.req };
+
+    job.req = (EEPROM_Request){ .op = op, .addr = addr, .data = job.data, .size = size };
+    job.started = TIMESTAMP_us();
+    return EEPROM_submit(batch, 1);
+}
+
+// Still waiting on the request, or it failed and the command is over
+static uint8_t SHELL_eeWaiting(SHELL_Result *result) {
+    EEPROM_Status status = EEPROM_poll(&job.req);
+
+    if (status == EEPROM_PENDING || status == EEPROM_BUSY) {
+        *result = SHELL_PENDING;
+        return 1;
+    }
+    if (status == EEPROM_ERROR) {
+        SHELL_printf("EEPROM not responding at 0x%04x\r\n", job.req.addr);
+        *result = SHELL_DONE;
+        return 1;
+    }
+    if (shell.cancel) {
+        *result = SHELL_DONE;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * help
+ */
+static SHELL_Result SHELL_help(uint8_t argc, char **argv);
+
+/*
+ * i2cscan
+ */
+static SHELL_Result SHELL_scanStep(void) {
+    if (shell.cancel) {
+        SHELL_write("\r\n");
+        return SHELL_DONE;
+    }
+    if (!EEPROM_isIdle()) {
+        return SHELL_PENDING;           // Don't cut into an EEPROM transfer
+    }
+
+    for (uint8_t n = 0; n < SHELL_SCAN_BATCH && job.device <= SHELL_SCAN_LAST; n++, job.device++) {
+        if (I2C_probe(SHELL_I2C, (uint8_t)(job.device << 1))) {
+            SHELL_printf(" 0x%02x", job.device);
+            job.found++;
+        }
+    }
+    if (job.device <= SHELL_SCAN_LAST) {
+        return SHELL_PENDING;
+    }
+
+    SHELL_printf("\r\n%u device(s)\r\n", job.found);
+    return SHELL_DONE;
+}
+
+static SHELL_Result SHELL_i2cscan(uint8_t argc, char **argv) {
+    job.device = SHELL_SCAN_FIRST;
+    job.found = 0;
+    SHELL_write("acked:");
+    return SHELL_run(SHELL_scanStep);
+}
+
+/*
+ * ee read | write | bench
+ */
+static SHELL_Result SHELL_eeReadStep(void) {
+    SHELL_Result result;
+
+    if (SHELL_eeWaiting(&result)) {
+        return result;
+    }
+
+    // A line at a time, as the TX ring makes room
+    while (job.shown < job.req.size && SERIAL_txFree() >= SHELL_HEX_ROOM) {
+        uint16_t len = job.req.size - job.shown;
+        char *p = out;
+
+        if (len > SHELL_HEX_LINE) {
+            len = SHELL_HEX_LINE;
+        }
+        p += sprintf(p, "%04x ", job.req.addr + job.shown);
+        for (uint16_t i = 0; i < len; i++) {
+            p += sprintf(p, " %02x", job.data[job.shown + i]);
+        }
+        p += sprintf(p, "%*s  ", (SHELL_HEX_LINE - len) * 3, "");
+        for (uint16_t i = 0; i < len; i++) {
+            uint8_t c = job.data[job.shown + i];
+            *p++ = c >= 0x20 && c < 0x7F ? (char)c : '.';
+        }
+        *p++ = '\r';
+        *p++ = '\n';
+        SERIAL_write((const uint8_t *)out, (uint16_t)(p - out));
+        job.shown += len;
+    }
+    return job.shown < job.req.size ? SHELL_PENDING : SHELL_DONE;
+}
+
+static SHELL_Result SHELL_eeWriteStep(void) {
+    SHELL_Result result;
+
+    if (SHELL_eeWaiting(&result)) {
+        return result;
+    }
+    SHELL_printf("%u bytes at 0x%04x\r\n", job.req.size, job.req.addr);
+    return SHELL_DONE;
+}
+
+// Reads each chunk and writes it straight back, timing both halves
+static SHELL_Result SHELL_eeBenchStep(void) {
+    SHELL_Result result;
+
+    if (SHELL_eeWaiting(&result)) {
+        return result;
+    }
+
+    uint64_t now = TIMESTAMP_us();
+    if (job.req.op == EEPROM_OP_READ) {
+        job.readUs += now - job.started;
+        if (SHELL_submit(EEPROM_OP_WRITE, job.req.addr, job.req.size) != 0) {
+            return SHELL_DONE;
+        }
+        return SHELL_PENDING;
+    }
+
+    job.writeUs += now - job.started;
+    job.addr += job.req.size;
+    if (job.addr < job.end) {
+        uint16_t size = job.end - job.addr < SHELL_EE_CHUNK ? job.end - job.addr : SHELL_EE_CHUNK;
+        SHELL_submit(EEPROM_OP_READ, job.addr, size);
+        return SHELL_PENDING;
+    }
+
+    uint32_t bytes = job.end - job.first;
+    SHELL_printf("read  %lu bytes in %lu us, %lu B/s\r\n", (unsigned long)bytes, (unsigned long)job.readUs,
+                 (unsigned long)(job.readUs ? bytes * 1000000ULL / job.readUs : 0));
+    SHELL_printf("write %lu bytes in %lu us, %lu B/s\r\n", (unsigned long)bytes, (unsigned long)job.writeUs,
+                 (unsigned long)(job.writeUs ? bytes * 1000000ULL / job.writeUs : 0));
+    return SHELL_DONE;
+}
+
+static SHELL_Result SHELL_ee(uint8_t argc, char **argv) {
+    uint32_t addr, len;
+
+    if (argc < 2) {
+        return SHELL_help(0, NULL);
+    }
+
+    if (strcmp(argv[1], "read") == 0 && argc >= 3 && argc <= 4) {
+        len = 64;
+        if (SHELL_parse(argv[2], &addr) != 0 || (argc == 4 && SHELL_parse(argv[3], &len) != 0) ||
+            len == 0 || len > SHELL_EE_CHUNK || addr + len > EEPROM_SIZE) {
+            SHELL_printf("ee read: addr + len within %u, len up to %u\r\n", EEPROM_SIZE, SHELL_EE_CHUNK);
+            return SHELL_DONE;
+        }
+        job.shown = 0;
+        SHELL_submit(EEPROM_OP_READ, (uint16_t)addr, (uint16_t)len);
+        return SHELL_run(SHELL_eeReadStep);
+    }
+
+    if (strcmp(argv[1], "write") == 0 && argc == 4) {
+        const char *hex = argv[3];
+        len = strlen(hex) / 2;
+        if (SHELL_parse(argv[2], &addr) != 0 || strlen(hex) % 2 != 0 || len == 0 || addr + len > EEPROM_SIZE) {
+            SHELL_printf("ee write: <addr> <hex bytes>, within %u\r\n", EEPROM_SIZE);
+            return SHELL_DONE;
+        }
+        for (uint32_t i = 0; i < len; i++) {
+            char byte[3] = { hex[2 * i], hex[2 * i + 1], '\0' };
+            char *end;
+            job.data[i] = (uint8_t)strtoul(byte, &end, 16);
+            if (*end != '\0') {
+                SHELL_printf("ee write: bad hex '%s'\r\n", byte);
+                return SHELL_DONE;
+            }
+        }
+        SHELL_submit(EEPROM_OP_WRITE, (uint16_t)addr, (uint16_t)len);
+        return SHELL_run(SHELL_eeWriteStep);
+    }
+
+    if (strcmp(argv[1], "bench") == 0 && argc <= 4) {
+        addr = 0;
+        len = PERSIST_EEPROM_BASE;
+        if ((argc >= 3 && SHELL_parse(argv[2], &addr) != 0) || (argc == 4 && SHELL_parse(argv[3], &len) != 0) ||
+            len == 0 || addr + len > PERSIST_EEPROM_BASE) {
+            // Rewriting the persist images could undo a spill made meanwhile
+            SHELL_printf("ee bench: addr + len within %u, below the persist images\r\n", PERSIST_EEPROM_BASE);
+            return SHELL_DONE;
+        }
+        job.first = (uint16_t)addr;
+        job.addr = (uint16_t)addr;
+        job.end = (uint16_t)(addr + len);
+        job.readUs = 0;
+        job.writeUs = 0;
+        SHELL_submit(EEPROM_OP_READ, job.addr, len < SHELL_EE_CHUNK ? (uint16_t)len : SHELL_EE_CHUNK);
+        return SHELL_run(SHELL_eeBenchStep);
+    }
+
+    return SHELL_help(0, NULL);
+}
+
+/*
+ * rtc [set YYYY-MM-DD HH:MM:SS], UTC
+ */
+static SHELL_Result SHELL_rtc(uint8_t argc, char **argv) {
+    static const char *const days[] = { "Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun" };
+    uint32_t date[3], time[3];
+    ts now;
+
+    if (argc == 4 && strcmp(argv[1], "set") == 0) {
+        if (SHELL_parseFields(argv[2], '-', date, 3) != 0 || SHELL_parseFields(argv[3], ':', time, 3) != 0 ||
+            date[0] < 2000 || date[0] > 2099 || date[1] < 1 || date[1] > 12 || date[2] < 1 || date[2] > 31 ||
+            time[0] > 23 || time[1] > 59 || time[2] > 59) {
+            SHELL_write("rtc set: YYYY-MM-DD HH:MM:SS\r\n");
+            return SHELL_DONE;
+        }
+
+        now = (ts){
+            .year = (uint16_t)date[0], .month = (uint8_t)date[1], .date = (uint8_t)date[2],
+            .hours = (uint8_t)time[0], .mins = (uint8_t)time[1], .secs = (uint8_t)time[2],
+            .isDst = 0
+        };
+        now.day = (uint8_t)((CAL_daysFromCivil(now.year, now.month, now.date) + 3) % 7);
+        RTC_setTime(&now);
+        TIMESTAMP_rebase();
+    }
+    else if (argc != 1) {
+        return SHELL_help(0, NULL);
+    }
+
+    RTC_getTime(&now);
+    SHELL_printf("%04u-%02u-%02u %02u:%02u:%02u + %u/%lu UTC %s\r\n", now.year, now.month, now.date, now.hours,
+                 now.mins, now.secs, now.subsecs,
+                 (unsigned long)(((RTC->PRER & RTC_PRER_PREDIV_S) >> RTC_PRER_PREDIV_S_Pos) + 1),
+                 now.day < 7 ? days[now.day] : "?");
+    return SHELL_DONE;
+}
+
+/*
+ * prof [reset]
+ */
+static SHELL_Result SHELL_prof(uint8_t argc, char **argv) {
+#ifdef PROFILE
+    if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        PROF_reset();
+        WAIT_reset();
+        return SHELL_DONE;
+    }
+    PROF_dump();
+    WAIT_dump(SHELL_WAIT_TOP);
+    fflush(stdout);
+#else
+    SHELL_write("built without PROFILE\r\n");
+#endif
+    return SHELL_DONE;
+}
+
+/*
+ * mem
+ */
+static SHELL_Result SHELL_mem(uint8_t argc, char **argv) {
+    uint32_t ram = (uint32_t)&_estack - (uint32_t)&_sdata;
+    uint32_t ethbuf = (uint32_t)&_eethbuf - (uint32_t)&_sethbuf;
+    uint32_t statics = (uint32_t)&_ebss - (uint32_t)&_sdata + ethbuf;
+    uint32_t heap = (uint32_t)_sbrk(0) - (uint32_t)&_end;
+    const uint32_t *p = (const uint32_t *)(((uint32_t)_sbrk(0) + 3U) & ~3U);
+
+    // The heap may have grown into the paint since SHELL_init, so start above it
+    while (p < &_estack && *p == SHELL_STACK_PAINT) {
+        p++;
+    }
+    uint32_t stack = (uint32_t)&_estack - (uint32_t)p;
+    uint32_t sp = (uint32_t)&_estack - __get_MSP();
+
+    SHELL_printf("ram    %lu static, %lu heap, %lu stack peak (%lu now), %lu free of %lu\r\n",
+                 (unsigned long)statics, (unsigned long)heap, (unsigned long)stack, (unsigned long)sp,
+                 (unsigned long)(ram - statics - heap - stack), (unsigned long)ram);
+    SHELL_printf("ccmram %lu of 65536\r\n", (unsigned long)((uint32_t)&_eccmbss - (uint32_t)&_sccmram));
+    SHELL_printf("ethbuf %lu at %08lx\r\n", (unsigned long)ethbuf, (unsigned long)(uint32_t)&_sethbuf);
+    SHELL_printf("serial %u of %u TX free\r\n", SERIAL_txFree(), SERIAL_TX_SIZE);
+    return SHELL_DONE;
+}
+
+/*
+ * eth
+ */
+static SHELL_Result SHELL_eth(uint8_t argc, char **argv) {
+    NETIF_Stats stats;
+    NETIF_getStats(&stats);
+    const uint8_t *mac = NETIF_macAddress();
+
+    SHELL_printf("mac  %02x:%02x:%02x:%02x:%02x:%02x, link %s",
+                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], stats.linkUp ? "up" : "down");
+    if (stats.linkUp) {
+        SHELL_printf(" %s %s", stats.speed100 ? "100M" : "10M", stats.fullDuplex ? "full" : "half");
+    }
+    SHELL_printf(", %lu changes\r\n", (unsigned long)stats.linkChanges);
+    SHELL_printf("rx   %lu frames %lu bytes, %lu errors %lu oversize %lu no buffer %lu dropped, %lu stamped\r\n",
+                 (unsigned long)stats.rxFrames, (unsigned long)stats.rxBytes, (unsigned long)stats.rxErrors,
+                 (unsigned long)stats.rxOversize, (unsigned long)stats.rxNoBuffer, (unsigned long)stats.rxDropped,
+                 (unsigned long)stats.rxStamped);
+    SHELL_printf("tx   %lu frames %lu bytes, %lu busy, %lu stamped\r\n",
+                 (unsigned long)stats.txFrames, (unsigned long)stats.txBytes, (unsigned long)stats.txBusy,
+                 (unsigned long)stats.txStamped);
+    SHELL_printf("dma  %lu errors\r\n", (unsigned long)stats.dmaErrors);
+
+    POOL_Stats pool;
+    POOL_getStats(&pool);
+    SHELL_printf("pool %u free %u low of %u, %lu allocs %lu frees %lu exhausted\r\n", pool.available, pool.low,
+                 POOL_BUF_COUNT, (unsigned long)pool.allocs, (unsigned long)pool.frees, (unsigned long)pool.exhausted);
+
+    NET_Stats net;
+    NET_getStats(&net);
+    uint32_t ip = NET_address();
+    SHELL_printf("ip   %lu.%lu.%lu.%lu, %lu in %lu out, %lu dropped %lu fragments\r\n",
+                 (unsigned long)(ip >> 24), (unsigned long)((ip >> 16) & 0xFFU), (unsigned long)((ip >> 8) & 0xFFU),
+                 (unsigned long)(ip & 0xFFU), (unsigned long)net.ipReceived, (unsigned long)net.ipSent,
+                 (unsigned long)net.ipDropped, (unsigned long)net.ipFragments);
+    SHELL_printf("arp  %lu requests %lu replies, %lu failed %lu displaced\r\n",
+                 (unsigned long)net.arpRequests, (unsigned long)net.arpReplies, (unsigned long)net.arpFailed,
+                 (unsigned long)net.arpDisplaced);
+    SHELL_printf("udp  %lu in %lu out, %lu no port, %lu echoes, %lu send failures\r\n",
+                 (unsigned long)net.udpReceived, (unsigned long)net.udpSent, (unsigned long)net.udpNoPort,
+                 (unsigned long)net.icmpEchoes, (unsigned long)net.sendFailed);
+
+    EENET_Stats ee;
+    EENET_getStats(&ee);
+    SHELL_printf("ee   %lu batches %lu ops, %lu refused %lu busy %lu no buffer, %lu mismatches %lu device errors\r\n",
+                 (unsigned long)ee.batches, (unsigned long)ee.ops, (unsigned long)ee.refused, (unsigned long)ee.busy,
+                 (unsigned long)ee.noBuffer, (unsigned long)ee.mismatches, (unsigned long)ee.deviceErrors);
+
+    static const char *const ptpStates[] = { "listening", "uncalibrated", "slave" };
+    PTP_Stats ptp;
+    PTP_getStats(&ptp);
+    SHELL_printf("ptp  %s", ptpStates[ptp.state]);
+    if (ptp.state != PTP_LISTENING) {
+        SHELL_printf(" to %02x%02x%02x.%02x%02x.%02x%02x%02x-%u", ptp.master[0], ptp.master[1], ptp.master[2],
+                     ptp.master[3], ptp.master[4], ptp.master[5], ptp.master[6], ptp.master[7],
+                     (unsigned)(ptp.master[8] << 8 | ptp.master[9]));
+    }
+    SHELL_printf(", offset %ld ns delay %ld ns, %ld ppb, utc %d\r\n", (long)ptp.offset, (long)ptp.delay,
+                 (long)ptp.ppb, ptp.utcOffset);
+    SHELL_printf("     %lu syncs %lu delay req %lu resp %lu announces, %lu master changes %lu timeouts %lu steps "
+                 "%lu unstamped\r\n", (unsigned long)ptp.syncs, (unsigned long)ptp.delayReqs,
+                 (unsigned long)ptp.delayResps, (unsigned long)ptp.announces, (unsigned long)ptp.masterChanges,
+                 (unsigned long)ptp.timeouts, (unsigned long)ptp.steps, (unsigned long)ptp.noStamp);
+    SHELL_printf("rtc  %ld ns from utc, %ld ppb, %lu sets %lu shifts\r\n", (long)ptp.rtcError, (long)ptp.rtcPpb,
+                 (unsigned long)ptp.rtcSets, (unsigned long)ptp.rtcShifts);
+    return SHELL_DONE;
+}
+
+static const SHELL_Command commands[] = {
+    { "help",       "",                                         SHELL_help },
+    { "i2cscan",    "",                                         SHELL_i2cscan },
+    { "ee",         "read <addr> [len] | write <addr> <hex> | bench [addr] [len]", SHELL_ee },
+    { "rtc",        "[set YYYY-MM-DD HH:MM:SS] (UTC)",          SHELL_rtc },
+    { "prof",       "[reset]",                                  SHELL_prof },
+    { "mem",        "",                                         SHELL_mem },
+    { "eth",        "",                                         SHELL_eth }
+};
+
+#define SHELL_COMMANDS  (sizeof(commands) / sizeof(commands[0]))
+
+static SHELL_Result SHELL_help(uint8_t argc, char **argv) {
+    for (uint8_t i = 0; i < SHELL_COMMANDS; i++) {
+        SHELL_printf("%-8s %s\r\n", commands[i].name, commands[i].usage);
+    }
+    return SHELL_DONE;
+}
+
+// Splits the line in place on spaces
+static uint8_t SHELL_split(char *line, char **argv) {
+    uint8_t argc = 0;
+
+    while (*line != '\0' && argc < SHELL_MAX_ARGS) {
+        while (*line == ' ') {
+            *line++ = '\0';
+        }
+        if (*line == '\0') {
+            break;
+        }
+        argv[argc++] = line;
+        while (*line != '\0' && *line != ' ') {
+            line++;
+        }
+    }
+    return argc;
+}
+
+static void SHELL_execute(void) {
+    char *argv[SHELL_MAX_ARGS];
+
+    shell.line[shell.length] = '\0';
+    if (shell.length > 0) {
+        memcpy(shell.history, shell.line, shell.length + 1);
+    }
+    shell.length = 0;
+
+    uint8_t argc = SHELL_split(shell.line, argv);
+    if (argc > 0) {
+        const SHELL_Command *cmd = NULL;
+        for (uint8_t i = 0; i < SHELL_COMMANDS; i++) {
+            if (strcmp(argv[0], commands[i].name) == 0) {
+                cmd = &commands[i];
+                break;
+            }
+        }
+
+        if (cmd == NULL) {
+            SHELL_printf("%s: unknown, try help\r\n", argv[0]);
+        }
+        else if (cmd->handler(argc, argv) == SHELL_PENDING) {
+            return;                     // Prompt once it finishes
+        }
+    }
+    SHELL_write(SHELL_PROMPT);
+}
+
+static void SHELL_erase(uint8_t count) {
+    while (count-- > 0) {
+        SHELL_write("\b \b");
+    }
+}
+
+static void SHELL_key(char c) {
+    if (shell.key == SHELL_KEY_ESC) {
+        shell.key = c == '[' ? SHELL_KEY_CSI : SHELL_KEY_NORMAL;
+        return;
+    }
+    if (shell.key == SHELL_KEY_CSI) {
+        if (c >= 0x40 && c <= 0x7E) {
+            shell.key = SHELL_KEY_NORMAL;
+            if (c == 'A' && shell.step == NULL) {
+                SHELL_erase(shell.length);
+                shell.length = (uint8_t)strlen(shell.history);
+                memcpy(shell.line, shell.history, shell.length);
+                SERIAL_write((const uint8_t *)shell.line, shell.length);
+            }
+        }
+        return;
+    }
+    if (c == KEY_ESC) {
+        shell.key = SHELL_KEY_ESC;
+        return;
+    }
+    if (c == '\n' && shell.lastCr) {
+        shell.lastCr = 0;
+        return;
+    }
+    shell.lastCr = c == '\r';
+
+    if (shell.step != NULL) {
+        if (c == KEY_CTRL_C) {
+            shell.cancel = 1;           // Other keys are dropped while a command runs
+        }
+        return;
+    }
+
+    switch (c) {
+        case '\r':
+        case '\n':
+            SHELL_write("\r\n");
+            SHELL_execute();
+            break;
+
+        case KEY_BACKSPACE:
+        case KEY_DELETE:
+            if (shell.length > 0) {
+                shell.length--;
+                SHELL_write("\b \b");
+            }
+            break;
+
+        case KEY_CTRL_U:
+            SHELL_erase(shell.length);
+            shell.length = 0;
+            break;
+
+        case KEY_CTRL_W: {
+            uint8_t keep = shell.length;
+            while (keep > 0 && shell.line[keep - 1] == ' ') {
+                keep--;
+            }
+            while (keep > 0 && shell.line[keep - 1] != ' ') {
+                keep--;
+            }
+            SHELL_erase(shell.length - keep);
+            shell.length = keep;
+            break;
+        }
+
+        case KEY_CTRL_C:
+            SHELL_write("^C\r\n" SHELL_PROMPT);
+            shell.length = 0;
+            break;
+
+        default:
+            if (c >= 0x20 && c < 0x7F && shell.length < SHELL_LINE_SIZE - 1) {
+                shell.line[shell.length++] = c;
+                SERIAL_write((const uint8_t *)&c, 1);
+            }
+            break;
+    }
+}
+
+/**
+ * @brief  Paints free stack for mem's high-water mark and prints the
+ *         prompt. Hook SHELL_input() to PROTO_init().
+ *
+ * @return @c NULL
+ **/
+void SHELL_init(void) {
+    memset(&shell, 0, sizeof(shell));
+
+    // Interrupts share the stack, keep them off it while painting below
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    uint32_t *p = (uint32_t *)(((uint32_t)_sbrk(0) + 3U) & ~3U);
+    uint32_t *top = (uint32_t *)(__get_MSP() & ~3U) - 16;
+    while (p < top) {
+        *p++ = SHELL_STACK_PAINT;
+    }
+
+    __set_PRIMASK(primask);
+
+    SHELL_write("\r\n" SHELL_PROMPT);
+}
+
+/**
+ * @brief  Takes keystrokes, echoing and editing the line. Backspace,
+ *         Ctrl-U, Ctrl-W, Ctrl-C and up arrow for the last line.
+ *
+ * @param  data Text received outside frames
+ * @param  size Number of bytes
+ *
+ * @return @c NULL
+ **/
+void SHELL_input(const uint8_t *data, uint16_t size) {
+    for (uint16_t i = 0; i < size; i++) {
+        SHELL_key((char)data[i]);
+    }
+}
+
+/**
+ * @brief  Runs the next step of a long command. Call from the main loop.
+ *
+ * @return @c NULL
+ **/
+void SHELL_process(void) {
+    if (shell.step != NULL && shell.step() == SHELL_DONE) {
+        shell.step = NULL;
+        shell.cancel = 0;
+        SHELL_write(SHELL_PROMPT);
+    }
+}
+
+/**
+ * @brief  Says whether a long command needs SHELL_process() again
+ *
+ * @return 0 while one runs, otherwise IDLE_NEVER
+ **/
+uint32_t SHELL_nextPoll(void) {
+    return shell.step != NULL ? 0 : IDLE_NEVER;
+}
\ No newline at end of file
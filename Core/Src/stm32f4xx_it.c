@@ -22,6 +22,10 @@
 #include "stm32f4xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "swtimer.h"
+#include "persist.h"
+#include "trace.h"
+#include "serial.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -57,6 +61,7 @@
 /* External variables --------------------------------------------------------*/
 
 /* USER CODE BEGIN EV */
+extern ETH_HandleTypeDef heth;
 
 /* USER CODE END EV */
 
@@ -200,4 +205,62 @@ void SysTick_Handler(void)
 
 /* USER CODE BEGIN 1 */
 
+/**
+  * @brief This function handles RTC wakeup interrupt through EXTI line 22.
+  */
+void RTC_WKUP_IRQHandler(void)
+{
+  TRACE_INSTANT(RTC_WAKEUP_IRQ, 0, 0);
+  TIMER_wakeupIrq();
+}
+
+/**
+  * @brief This function handles RTC alarms A and B interrupt through EXTI line 17.
+  */
+void RTC_Alarm_IRQHandler(void)
+{
+  TRACE_INSTANT(RTC_ALARM_IRQ, RTC->ISR, 0);
+  TIMER_alarmIrq();
+}
+
+/**
+  * @brief This function handles PVD interrupt through EXTI line 16.
+  */
+void PVD_IRQHandler(void)
+{
+  PERSIST_brownoutIrq();
+}
+
+/**
+  * @brief This function handles DMA1 stream3 global interrupt, USART3 TX.
+  */
+void DMA1_Stream3_IRQHandler(void)
+{
+  SERIAL_txDmaIrq();
+}
+
+/**
+  * @brief This function handles DMA1 stream1 global interrupt, USART3 RX.
+  */
+void DMA1_Stream1_IRQHandler(void)
+{
+  SERIAL_rxDmaIrq();
+}
+
+/**
+  * @brief This function handles USART3 global interrupt, idle line and errors.
+  */
+void USART3_IRQHandler(void)
+{
+  SERIAL_usartIrq();
+}
+
+/**
+  * @brief This function handles Ethernet global interrupt.
+  */
+void ETH_IRQHandler(void)
+{
+  HAL_ETH_IRQHandler(&heth);
+}
+
 /* USER CODE END 1 */
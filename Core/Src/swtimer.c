@@ -0,0 +1,319 @@
+/***********************************************************************************
+ * @file        swtimer.c                                                          *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  RTC                                                                *
+ * @brief       Hierarchical timer wheel driven by the RTC wakeup timer, plus      *
+ *              daily callbacks on RTC alarms A and B.                             *
+ ***********************************************************************************/
+
+#include <stddef.h>
+
+#include "swtimer.h"
+#include "irq.h"
+#include "trace.h"
+
+#define TIMER_MASK      (TIMER_SLOTS - 1)
+#define TIMER_RANGE     (1U << (TIMER_LEVEL_BITS * TIMER_LEVELS))
+
+/*
+ * Level n holds timers due within TIMER_SLOTS^(n+1) ticks, bucketed by bits
+ * [6n, 6n+6) of their expiry. Whenever the bits below a level wrap to zero,
+ * that level's current slot is cascaded down, so by the time a timer reaches
+ * level 0 its slot is exact. The interrupt only counts ticks; the wheel is
+ * turned and callbacks run from TIMER_process() in the main loop.
+ */
+static struct {
+    Timer *heads[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t occupied[TIMER_LEVELS];    // Bit per non-empty slot
+    uint32_t now;
+
+    volatile uint32_t pendingTicks;
+    volatile uint8_t pendingAlarms;
+    volatile uint8_t suspended;         // Wakeup timer is set for a long sleep, not counting ticks
+    void (*alarms[2])(void);
+} wheel;
+
+static void TIMER_link(Timer *timer) {
+    uint32_t delta = timer->expires - wheel.now;
+    uint32_t when = timer->expires;
+
+    // Too far out for the top level, park it at the end and re-file it when it cascades
+    if (delta >= TIMER_RANGE) {
+        delta = TIMER_RANGE - 1;
+        when = wheel.now + delta;
+    }
+
+    uint8_t level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= 1U << (TIMER_LEVEL_BITS * (level + 1))) {
+        level++;
+    }
+    uint8_t slot = (when >> (TIMER_LEVEL_BITS * level)) & TIMER_MASK;
+
+    Timer **head = &wheel.heads[level][slot];
+    timer->next = *head;
+    if (timer->next != NULL) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head = timer;
+
+    timer->level = level;
+    timer->slot = slot;
+    wheel.occupied[level] |= 1ULL << slot;
+}
+
+static void TIMER_unlink(Timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    if (wheel.heads[timer->level][timer->slot] == NULL) {
+        wheel.occupied[timer->level] &= ~(1ULL << timer->slot);
+    }
+    timer->pprev = NULL;
+}
+
+static void TIMER_cascade(uint8_t level, uint8_t slot) {
+    Timer *timer = wheel.heads[level][slot];
+
+    wheel.heads[level][slot] = NULL;
+    wheel.occupied[level] &= ~(1ULL << slot);
+
+    while (timer != NULL) {
+        Timer *next = timer->next;
+        TIMER_link(timer);
+        timer = next;
+    }
+}
+
+/**
+ * @brief  Clears the wheel and starts the RTC wakeup timer at TIMER_HZ. Call
+ *         after RTC_init(). The wheel itself needs no hardware, so host code
+ *         can skip this and drive it with TIMER_advance().
+ *
+ * @return @c NULL
+ **/
+void TIMER_init(void) {
+    for (uint32_t level = 0; level < TIMER_LEVELS; level++) {
+        for (uint32_t slot = 0; slot < TIMER_SLOTS; slot++) {
+            wheel.heads[level][slot] = NULL;
+        }
+        wheel.occupied[level] = 0;
+    }
+    wheel.now = 0;
+    wheel.pendingTicks = 0;
+    wheel.pendingAlarms = 0;
+    wheel.suspended = 0;
+
+    RTC_setWakeup(RTC_WAKEUP_HZ / TIMER_HZ - 1);
+}
+
+/**
+ * @brief  Starts or restarts a timer. O(1).
+ *
+ * @param  timer  Caller-owned timer with callback set
+ * @param  ticks  Ticks until the first expiry, at least 1
+ * @param  period Ticks between later expiries, 0 for one-shot
+ *
+ * @return @c NULL
+ **/
+void TIMER_start(Timer *timer, uint32_t ticks, uint32_t period) {
+    if (timer->pprev != NULL) {
+        TIMER_unlink(timer);
+    }
+
+    timer->expires = wheel.now + (ticks ? ticks : 1);
+    timer->period = period;
+    TIMER_link(timer);
+}
+
+/**
+ * @brief  Stops a timer if it is running. O(1).
+ *
+ * @param  timer Timer to stop
+ *
+ * @return @c NULL
+ **/
+void TIMER_stop(Timer *timer) {
+    if (timer->pprev != NULL) {
+        TIMER_unlink(timer);
+    }
+}
+
+uint8_t TIMER_isActive(const Timer *timer) {
+    return timer->pprev != NULL;
+}
+
+/**
+ * @brief  Current wheel time
+ *
+ * @return Ticks since TIMER_init()
+ **/
+uint32_t TIMER_now(void) {
+    return wheel.now;
+}
+
+// Slots from 'from' (cyclically) to the first occupied one, or TIMER_SLOTS if none
+static uint32_t TIMER_firstFrom(uint64_t occupied, uint32_t from) {
+    if (occupied == 0) {
+        return TIMER_SLOTS;
+    }
+    uint64_t rotated = from ? (occupied >> from) | (occupied << (TIMER_SLOTS - from)) : occupied;
+    return __builtin_ctzll(rotated);
+}
+
+/**
+ * @brief  Lower bound on the ticks until something on the wheel needs
+ *         attention: exact for timers due within TIMER_SLOTS ticks, otherwise
+ *         the next cascade of an occupied slot
+ *
+ * @return Ticks from now, 0 if ticks are waiting to be processed, or
+ *         TIMER_NEVER if no timer is running
+ **/
+uint32_t TIMER_nextExpiry(void) {
+    if (wheel.pendingTicks) {
+        return 0;
+    }
+
+    uint32_t best = TIMER_NEVER;
+
+    for (uint32_t level = 0; level < TIMER_LEVELS; level++) {
+        uint32_t shift = TIMER_LEVEL_BITS * level;
+        uint32_t current = (wheel.now >> shift) & TIMER_MASK;
+        uint32_t slots = TIMER_firstFrom(wheel.occupied[level], (current + 1) & TIMER_MASK) + 1;
+
+        if (slots > TIMER_SLOTS) {
+            continue;
+        }
+
+        // Level 0 slots are single ticks, higher slots are reached when the bits below wrap
+        uint32_t below = wheel.now & ((1U << shift) - 1);
+        uint32_t ticks = (slots << shift) - below;
+        if (ticks < best) {
+            best = ticks;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * @brief  Turns the wheel, running callbacks for every timer that expires.
+ *         Callbacks may start and stop any timer, including their own.
+ *
+ * @param  ticks Ticks to advance by
+ *
+ * @return @c NULL
+ **/
+void TIMER_advance(uint32_t ticks) {
+    while (ticks--) {
+        wheel.now++;
+
+        uint32_t slot = wheel.now & TIMER_MASK;
+        for (uint32_t level = 1; slot == 0 && level < TIMER_LEVELS; level++) {
+            slot = (wheel.now >> (TIMER_LEVEL_BITS * level)) & TIMER_MASK;
+            TIMER_cascade(level, slot);
+        }
+
+        Timer **head = &wheel.heads[0][wheel.now & TIMER_MASK];
+        while (*head != NULL) {
+            Timer *timer = *head;
+            TIMER_unlink(timer);
+
+            if (timer->period) {
+                timer->expires += timer->period;
+                TIMER_link(timer);
+            }
+            if (timer->callback) {
+                TRACE_BEGIN(TIMER_CALLBACK, (uint32_t)(uintptr_t)timer, wheel.now);
+                timer->callback(timer);
+                TRACE_END(TIMER_CALLBACK, (uint32_t)(uintptr_t)timer, 0);
+            }
+        }
+    }
+}
+
+/**
+ * @brief  Catches the wheel up with the wakeup interrupt and runs alarm
+ *         callbacks. Call from the main loop.
+ *
+ * @return @c NULL
+ **/
+void TIMER_process(void) {
+    uint32_t primask = IRQ_lock();
+    uint32_t ticks = wheel.pendingTicks;
+    uint8_t alarms = wheel.pendingAlarms;
+    wheel.pendingTicks = 0;
+    wheel.pendingAlarms = 0;
+    IRQ_unlock(primask);
+
+    TIMER_advance(ticks);
+
+    for (int alarm = RTC_ALARM_A; alarm <= RTC_ALARM_B; alarm++) {
+        if ((alarms & (1 << alarm)) && wheel.alarms[alarm]) {
+            wheel.alarms[alarm]();
+        }
+    }
+}
+
+/**
+ * @brief  Runs a callback every day at a time of day, using an RTC alarm
+ *
+ * @param  alarm    RTC_ALARM_A or RTC_ALARM_B
+ * @param  at       Time of day, only hours, mins and secs are used
+ * @param  callback Called from TIMER_process(), NULL disarms the alarm
+ *
+ * @return @c NULL
+ **/
+void TIMER_setAlarm(enum RTC_Alarm alarm, const ts *at, void (*callback)(void)) {
+    wheel.alarms[alarm] = callback;
+
+    if (callback) {
+        RTC_setAlarm(alarm, at->hours, at->mins, at->secs);
+    }
+    else {
+        RTC_stopAlarm(alarm);
+    }
+}
+
+/**
+ * @brief  Stretches the wakeup timer to a single interrupt after a number of
+ *         ticks, for tickless sleep. The wheel stops counting until
+ *         TIMER_resume().
+ *
+ * @param  ticks Ticks until the wakeup, at most 65536 / (RTC_WAKEUP_HZ / TIMER_HZ)
+ *
+ * @return @c NULL
+ **/
+void TIMER_suspend(uint32_t ticks) {
+    wheel.suspended = 1;
+    RTC_setWakeup(ticks * (RTC_WAKEUP_HZ / TIMER_HZ) - 1);
+}
+
+/**
+ * @brief  Goes back to one interrupt per tick after a tickless sleep
+ *
+ * @param  elapsed Ticks that passed while suspended, measured by the caller
+ *
+ * @return @c NULL
+ **/
+void TIMER_resume(uint32_t elapsed) {
+    RTC_setWakeup(RTC_WAKEUP_HZ / TIMER_HZ - 1);
+
+    uint32_t primask = IRQ_lock();
+    wheel.suspended = 0;
+    wheel.pendingTicks += elapsed;
+    IRQ_unlock(primask);
+}
+
+// Called from RTC_WKUP_IRQHandler
+void TIMER_wakeupIrq(void) {
+    if (RTC_clearWakeup() && !wheel.suspended) {
+        wheel.pendingTicks++;
+    }
+}
+
+// Called from RTC_Alarm_IRQHandler
+void TIMER_alarmIrq(void) {
+    wheel.pendingAlarms |= RTC_clearAlarms();
+}
\ No newline at end of file
@@ -0,0 +1,272 @@
+/***********************************************************************************
+ * @file        timestamp.c                                                        *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  RTC                                                                *
+ * @brief       Monotonic 64-bit cycle and microsecond timestamps from the DWT     *
+ *              cycle counter, rate and phase disciplined against the RTC.         *
+ ***********************************************************************************/
+
+#include "timestamp.h"
+#include "rtc.h"
+
+#define US_PER_SEC      1000000ULL
+#define US_PER_DAY      (86400ULL * US_PER_SEC)
+
+/*
+ * The us clock is anchorUs + (cycles - anchorCycles) * mul / 2^32. It is
+ * re-anchored at every discipline sample with the old rate, so it never jumps
+ * backwards; only mul changes. Reading it is a 32x32 multiply as long as the
+ * anchor is less than 2^32 cycles (~25 s at 168 MHz) old.
+ */
+static struct {
+    uint32_t hi;                        // Upper half of the extended cycle counter
+    uint32_t lastLo;
+    uint64_t stopped;                   // Cycles the counter was frozen in STOP mode
+
+    uint64_t anchorCycles;
+    uint64_t anchorUs;
+    uint32_t mul;                       // us per cycle, 0.32 fixed point
+
+    uint64_t refCycles;                 // Last RTC sample
+    uint64_t refUs;
+    uint64_t dayBase;                   // Unwraps the RTC time of day across midnight
+    uint64_t lastTod;
+    int64_t offset;                     // RTC steps absorbed by TIMESTAMP_rebase()
+
+    TIMESTAMP_Stats stats;
+} stamp;
+
+static uint64_t TIMESTAMP_extend(void) {
+    uint32_t lo = DWT->CYCCNT;
+    if (lo < stamp.lastLo) {
+        stamp.hi++;
+    }
+    stamp.lastLo = lo;
+    return (((uint64_t)stamp.hi << 32) | lo) + stamp.stopped;
+}
+
+static uint64_t TIMESTAMP_convert(uint64_t cycles) {
+    uint64_t delta = cycles - stamp.anchorCycles;
+
+    if (delta <= UINT32_MAX) {
+        return stamp.anchorUs + (((uint64_t)(uint32_t)delta * stamp.mul) >> 32);
+    }
+    return stamp.anchorUs + delta * US_PER_SEC / stamp.stats.hz;      // Slow path, discipline is overdue
+}
+
+static uint32_t TIMESTAMP_mul(uint32_t hz, int32_t slewPpm) {
+    return (uint32_t)(((US_PER_SEC + slewPpm) << 32) / hz);
+}
+
+// Reads the RTC's time of day in us together with the cycle count
+static uint64_t TIMESTAMP_sampleTod(uint64_t *cycles) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    RTC_Snapshot snap;
+    *cycles = TIMESTAMP_extend();
+    RTC_snapshot(&snap);
+
+    __set_PRIMASK(primask);
+
+    return RTC_microsOfDay(&snap);
+}
+
+// Reads the RTC as us since midnight, unwrapped and less any absorbed steps
+static uint64_t TIMESTAMP_sampleRtc(uint64_t *cycles) {
+    uint64_t tod = TIMESTAMP_sampleTod(cycles);
+
+    if (tod + US_PER_DAY / 2 < stamp.lastTod) {
+        stamp.dayBase += US_PER_DAY;
+    }
+    stamp.lastTod = tod;
+
+    return stamp.dayBase + tod + stamp.offset;
+}
+
+/**
+ * @brief  Starts the DWT cycle counter and aligns the us clock with the RTC.
+ *         Call after RTC_init().
+ *
+ * @return @c NULL
+ **/
+void TIMESTAMP_init(void) {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    stamp.hi = 0;
+    stamp.lastLo = 0;
+    stamp.stopped = 0;
+    stamp.dayBase = 0;
+    stamp.lastTod = 0;
+    stamp.offset = 0;
+
+    stamp.stats.hz = SystemCoreClock;
+    stamp.mul = TIMESTAMP_mul(stamp.stats.hz, 0);
+
+    stamp.refUs = TIMESTAMP_sampleRtc(&stamp.refCycles);
+    stamp.anchorCycles = stamp.refCycles;
+    stamp.anchorUs = stamp.refUs;
+}
+
+/**
+ * @brief  Returns the 64-bit cycle count. Safe to call from interrupts.
+ *
+ * @return Cycles since TIMESTAMP_init()
+ **/
+uint64_t TIMESTAMP_cycles(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    uint64_t cycles = TIMESTAMP_extend();
+
+    __set_PRIMASK(primask);
+    return cycles;
+}
+
+/**
+ * @brief  Returns microseconds since midnight of the day TIMESTAMP_init() ran,
+ *         following the RTC's rate and small corrections but never going
+ *         backwards. Steps reported to TIMESTAMP_rebase() are not followed.
+ *         Safe to call from interrupts.
+ *
+ * @return Monotonic time in us
+ **/
+uint64_t TIMESTAMP_us(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    uint64_t us = TIMESTAMP_convert(TIMESTAMP_extend());
+
+    __set_PRIMASK(primask);
+    return us;
+}
+
+/**
+ * @brief  Compares the us clock against the RTC and adjusts its rate. Call it
+ *         from the main loop; it only takes a sample once a second has passed
+ *         and must run at least every 25 s to keep the counter extended.
+ *
+ * @return @c NULL
+ **/
+void TIMESTAMP_discipline(void) {
+    uint64_t now = TIMESTAMP_cycles();
+    if (now - stamp.refCycles < stamp.stats.hz) {
+        return;
+    }
+
+    uint64_t cycles;
+    uint64_t rtcUs = TIMESTAMP_sampleRtc(&cycles);
+
+    uint32_t hz = stamp.stats.hz;
+    if (rtcUs > stamp.refUs) {
+        uint64_t measured = (cycles - stamp.refCycles) * US_PER_SEC / (rtcUs - stamp.refUs);
+        if (measured + TIMESTAMP_HZ_TOLERANCE >= SystemCoreClock &&
+            measured <= SystemCoreClock + TIMESTAMP_HZ_TOLERANCE) {
+            hz = (uint32_t)measured;
+        }
+        else {
+            stamp.stats.rejects++;      // RTC was set or stopped, keep the old rate
+        }
+    }
+    else {
+        stamp.stats.rejects++;
+    }
+
+    stamp.refCycles = cycles;
+    stamp.refUs = rtcUs;
+    stamp.stats.samples++;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    uint64_t us = TIMESTAMP_convert(cycles);
+    int64_t error = (int64_t)(rtcUs - us);
+    int32_t slew;
+
+    if (error > TIMESTAMP_STEP_US) {
+        us = rtcUs;                     // Forward steps keep the clock monotonic
+        slew = 0;
+        stamp.stats.steps++;
+    }
+    else if (error > TIMESTAMP_SLEW_MAX_PPM) {
+        slew = TIMESTAMP_SLEW_MAX_PPM;
+    }
+    else if (error < -TIMESTAMP_SLEW_MAX_PPM) {
+        slew = -TIMESTAMP_SLEW_MAX_PPM;
+    }
+    else {
+        slew = (int32_t)error;          // Close the remaining error over the next second
+    }
+
+    stamp.anchorCycles = cycles;
+    stamp.anchorUs = us;
+    stamp.stats.hz = hz;
+    stamp.mul = TIMESTAMP_mul(hz, slew);
+
+    __set_PRIMASK(primask);
+
+    stamp.stats.error = error > INT32_MAX ? INT32_MAX : error < INT32_MIN ? INT32_MIN : (int32_t)error;
+}
+
+/**
+ * @brief  Takes up a step in the RTC. Call straight after RTC_setTime() or
+ *         RTC_shift() has moved it. A step of over TIMESTAMP_STEP_US is
+ *         absorbed so the us clock runs on unbroken, a smaller one is
+ *         slewed out as usual. Either way the next rate sample starts here
+ *         rather than spanning the step.
+ *
+ * @return @c NULL
+ **/
+void TIMESTAMP_rebase(void) {
+    uint64_t cycles;
+    uint64_t tod = TIMESTAMP_sampleTod(&cycles);
+    uint64_t us = TIMESTAMP_convert(cycles);
+
+    // Take the reading on the day nearest the us clock
+    int64_t error = (int64_t)(stamp.dayBase + tod + stamp.offset - us);
+    if (error > (int64_t)(US_PER_DAY / 2) && stamp.dayBase >= US_PER_DAY) {
+        stamp.dayBase -= US_PER_DAY;
+        error -= US_PER_DAY;
+    }
+    else if (error <= -(int64_t)(US_PER_DAY / 2)) {
+        stamp.dayBase += US_PER_DAY;
+        error += US_PER_DAY;
+    }
+    if (error > TIMESTAMP_STEP_US || error < -TIMESTAMP_STEP_US) {
+        stamp.offset -= error;
+    }
+    stamp.lastTod = tod;
+
+    stamp.refCycles = cycles;
+    stamp.refUs = stamp.dayBase + tod + stamp.offset;
+}
+
+/**
+ * @brief  Accounts for time the cycle counter spent frozen in STOP mode, so
+ *         cycles and us keep following real time
+ *
+ * @param  us Time spent stopped
+ *
+ * @return @c NULL
+ **/
+void TIMESTAMP_addStopped(uint64_t us) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    stamp.stopped += us * stamp.stats.hz / US_PER_SEC;
+
+    __set_PRIMASK(primask);
+}
+
+/**
+ * @brief  Copies out the discipline state
+ *
+ * @param  stats Filled in by this function
+ *
+ * @return @c NULL
+ **/
+void TIMESTAMP_getStats(TIMESTAMP_Stats *stats) {
+    *stats = stamp.stats;
+}
\ No newline at end of file
@@ -0,0 +1,132 @@
+/***********************************************************************************
+ * @file        trace.c                                                            *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  PROF                                                               *
+ * @brief       Binary event trace. Records are reserved with LDREX/STREX so        *
+ *              interrupts can trace too, kept in a CCMRAM ring and drained a      *
+ *              few bytes at a time through a non-blocking sink.                   *
+ ***********************************************************************************/
+
+#include "trace.h"
+
+#ifdef TRACE_ENABLE
+
+#include <string.h>
+
+#include "stm32f439xx.h"
+
+#define TRACE_MASK          (TRACE_RECORDS - 1)
+#define TRACE_LAP(index)    ((uint8_t)((index) / TRACE_RECORDS + 1))    // Never 0, so zeroed slots read as empty
+
+// Not loaded from flash or cleared by the startup code, TRACE_init() clears it
+__attribute__((section(".ccmbss"))) static TRACE_Record ring[TRACE_RECORDS];
+
+static struct {
+    volatile uint32_t head;             // Next index to reserve
+    volatile uint32_t tail;             // Next index to drain
+    TRACE_Stats stats;
+} trace;
+
+/**
+ * @brief  Clears the ring and starts the cycle counter, if TIMESTAMP_init()
+ *         has not already
+ *
+ * @return @c NULL
+ **/
+void TRACE_init(void) {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    memset(ring, 0, sizeof(ring));
+    memset(&trace, 0, sizeof(trace));
+}
+
+/**
+ * @brief  Appends one record. Lock-free and safe from any interrupt priority.
+ *         The record is dropped if the ring is full.
+ *
+ * @param  event Event ID
+ * @param  phase How a timeline shows it
+ * @param  arg0  Event specific
+ * @param  arg1  Event specific
+ *
+ * @return @c NULL
+ **/
+void TRACE_record(TRACE_Event event, TRACE_Phase phase, uint32_t arg0, uint32_t arg1) {
+    uint32_t index;
+
+    do {
+        index = __LDREXW(&trace.head);
+        if (index - trace.tail >= TRACE_RECORDS) {
+            __CLREX();
+            __atomic_fetch_add(&trace.stats.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (__STREXW(index + 1, &trace.head) != 0);
+
+    TRACE_Record *rec = &ring[index & TRACE_MASK];
+    rec->cycles = DWT->CYCCNT;
+    rec->event = event;
+    rec->context = (uint8_t)__get_IPSR();
+    rec->phase = phase;
+    rec->arg0 = arg0;
+    rec->arg1 = arg1;
+
+    // The lap tag publishes the record to the drain, so it goes last
+    __DMB();
+    rec->lap = TRACE_LAP(index);
+    __atomic_fetch_add(&trace.stats.recorded, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief  Gives direct access to committed records at the head of the
+ *         drain, for senders that copy them out themselves. Stops at the
+ *         end of the ring.
+ *
+ * @param  records Set to the first record
+ * @param  max     Most records wanted
+ *
+ * @return Number of contiguous committed records, hand back with TRACE_release()
+ **/
+uint16_t TRACE_take(const TRACE_Record **records, uint16_t max) {
+    uint32_t first = trace.tail & TRACE_MASK;
+    uint16_t n = 0;
+
+    if (max > TRACE_RECORDS - first) {
+        max = TRACE_RECORDS - first;
+    }
+    while (n < max && ring[first + n].lap == TRACE_LAP(trace.tail + n)) {
+        n++;
+    }
+
+    __DMB();
+    *records = &ring[first];
+    return n;
+}
+
+/**
+ * @brief  Frees records obtained from TRACE_take() for producers to reuse
+ *
+ * @param  count Records sent
+ *
+ * @return @c NULL
+ **/
+void TRACE_release(uint16_t count) {
+    trace.tail += count;
+    trace.stats.drained += count;
+}
+
+/**
+ * @brief  Copies out the trace counters
+ *
+ * @param  stats Filled in by this function
+ *
+ * @return @c NULL
+ **/
+void TRACE_getStats(TRACE_Stats *stats) {
+    stats->recorded = __atomic_load_n(&trace.stats.recorded, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&trace.stats.dropped, __ATOMIC_RELAXED);
+    stats->drained = trace.stats.drained;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,131 @@
+/***********************************************************************************
+ * @file        wait.c                                                             *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  PROF                                                               *
+ * @brief       Busy-wait accounting. Totals the spins and cycles burnt in each    *
+ *              hardware poll loop and ranks the sites, to show which waits are    *
+ *              worth moving to interrupts or DMA.                                 *
+ ***********************************************************************************/
+
+#include "wait.h"
+
+#ifdef PROFILE
+
+#include <stdio.h>
+#include <string.h>
+
+#define WAIT_NAME(name)     #name,
+
+static const char *const names[WAIT_COUNT] = {
+    WAIT_SITES(WAIT_NAME)
+};
+
+static WAIT_Stats sites[WAIT_COUNT];
+
+#ifdef PROF_HOST
+#define WAIT_LOCK()         do { } while (0)
+#define WAIT_UNLOCK()       do { } while (0)
+#else
+#define WAIT_LOCK()         uint32_t primask = __get_PRIMASK(); __disable_irq()
+#define WAIT_UNLOCK()       __set_PRIMASK(primask)
+#endif
+
+/**
+ * @brief  Adds one completed wait to a site. Called by WAIT_WHILE().
+ *
+ * @param  site   Poll site
+ * @param  spins  Times the condition was re-read before it cleared
+ * @param  cycles Core cycles spent in the loop
+ *
+ * @return @c NULL
+ **/
+void WAIT_record(WAIT_Site site, uint32_t spins, uint32_t cycles) {
+    WAIT_Stats *stats = &sites[site];
+    WAIT_LOCK();
+
+    stats->calls++;
+    stats->spins += spins;
+    stats->cycles += cycles;
+    if (cycles > stats->maxCycles) {
+        stats->maxCycles = cycles;
+    }
+
+    WAIT_UNLOCK();
+}
+
+/**
+ * @brief  Clears every site
+ *
+ * @return @c NULL
+ **/
+void WAIT_reset(void) {
+    WAIT_LOCK();
+    memset(sites, 0, sizeof(sites));
+    WAIT_UNLOCK();
+}
+
+/**
+ * @brief  Gives read access to one site's totals
+ *
+ * @param  site Poll site
+ *
+ * @return Pointer into the table
+ **/
+const WAIT_Stats *WAIT_get(WAIT_Site site) {
+    return &sites[site];
+}
+
+/**
+ * @brief  Prints the sites with the most cycles burnt, highest first, with
+ *         each one's share of the total spent waiting
+ *
+ * @param  top Number of sites to print
+ *
+ * @return @c NULL
+ **/
+void WAIT_dump(uint8_t top) {
+    WAIT_Stats copy[WAIT_COUNT];
+    uint8_t order[WAIT_COUNT];
+    uint64_t total = 0;
+
+    WAIT_LOCK();
+    memcpy(copy, sites, sizeof(copy));
+    WAIT_UNLOCK();
+
+    for (uint32_t i = 0; i < WAIT_COUNT; i++) {
+        order[i] = i;
+        total += copy[i].cycles;
+    }
+
+    // Partial selection sort, only the first top places are needed
+    if (top > WAIT_COUNT) {
+        top = WAIT_COUNT;
+    }
+    for (uint32_t i = 0; i < top; i++) {
+        uint32_t best = i;
+        for (uint32_t j = i + 1; j < WAIT_COUNT; j++) {
+            if (copy[order[j]].cycles > copy[order[best]].cycles) {
+                best = j;
+            }
+        }
+        uint8_t swap = order[i];
+        order[i] = order[best];
+        order[best] = swap;
+    }
+
+    printf("site calls spins cycles max share%%\r\n");
+
+    for (uint32_t i = 0; i < top; i++) {
+        const WAIT_Stats *stats = &copy[order[i]];
+        if (stats->calls == 0) {
+            break;
+        }
+
+        // Counts are printed as 32 bits, nano printf has no %llu
+        printf("%s %lu %lu %lu %lu %lu\r\n", names[order[i]], (unsigned long)stats->calls,
+               (unsigned long)stats->spins, (unsigned long)stats->cycles, (unsigned long)stats->maxCycles,
+               (unsigned long)(total ? stats->cycles * 100 / total : 0));
+    }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,174 @@
+/***********************************************************************************
+ * @file        calendar_test.c                                                    *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  TEST                                                               *
+ * @brief       Exhaustive host test of the calendar conversions over 2000-2099    *
+ *              against glibc, and a conversions-per-second benchmark.             *
+ ***********************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "test.h"
+#include "calendar.h"
+
+#define EPOCH_2000      946684800U
+#define EPOCH_2100      4102444800U
+#define SECS_PER_DAY    86400U
+#define DST_STEP        900U            // Every quarter hour, which lands on every transition
+#define BENCH_CALLS     20000000U
+
+/*
+ * POSIX rules for CAL_zones, so glibc needs no tz database and applies the
+ * same current rules to every year.
+ */
+static const char *const posixZones[CAL_ZONE_COUNT] = {
+    [CAL_ZONE_UTC]        = "UTC0",
+    [CAL_ZONE_AU_EASTERN] = "AEST-10AEDT,M10.1.0,M4.1.0/3",
+    [CAL_ZONE_EU_CENTRAL] = "CET-1CEST,M3.5.0,M10.5.0/3",
+    [CAL_ZONE_US_EASTERN] = "EST5EDT,M3.2.0,M11.1.0",
+};
+
+static volatile uint32_t sink;
+
+// Every day, against a plain day count and glibc's civil date and weekday
+static void TEST_days(void) {
+    int32_t expect = (int32_t)(EPOCH_2000 / SECS_PER_DAY);
+
+    for (time_t t = EPOCH_2000; t < EPOCH_2100; t += SECS_PER_DAY, expect++) {
+        struct tm tm;
+        ts date;
+        gmtime_r(&t, &tm);
+
+        TEST_ASSERT_EQ(CAL_daysFromCivil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday), expect);
+
+        CAL_civilFromDays(expect, &date);
+        TEST_ASSERT_EQ(date.year, tm.tm_year + 1900);
+        TEST_ASSERT_EQ(date.month, tm.tm_mon + 1);
+        TEST_ASSERT_EQ(date.date, tm.tm_mday);
+        TEST_ASSERT_EQ(date.day, (tm.tm_wday + 6) % 7);     // enum DoW starts on Monday
+    }
+}
+
+static void TEST_utcSecond(time_t t) {
+    const CAL_Zone *utc = &CAL_zones[CAL_ZONE_UTC];
+    struct tm tm;
+    ts time;
+    gmtime_r(&t, &tm);
+
+    CAL_fromEpoch32((CAL_Epoch32)t, utc, &time, NULL);
+    TEST_ASSERT_EQ(time.year, tm.tm_year + 1900);
+    TEST_ASSERT_EQ(time.date, tm.tm_mday);
+    TEST_ASSERT_EQ(time.hours, tm.tm_hour);
+    TEST_ASSERT_EQ(time.mins, tm.tm_min);
+    TEST_ASSERT_EQ(time.secs, tm.tm_sec);
+    TEST_ASSERT_EQ(time.isDst, 0);
+    TEST_ASSERT_EQ(CAL_toEpoch32(&time, utc), t);
+}
+
+// Every second of a leap day, then one second of every day, moving through the day
+static void TEST_utc(void) {
+    const time_t leapDay = EPOCH_2000 + 59 * SECS_PER_DAY;
+
+    for (time_t t = leapDay; t < leapDay + SECS_PER_DAY; t++) {
+        TEST_utcSecond(t);
+    }
+    for (uint32_t day = 0; day < (EPOCH_2100 - EPOCH_2000) / SECS_PER_DAY; day++) {
+        TEST_utcSecond(EPOCH_2000 + day * SECS_PER_DAY + day * 7919U % SECS_PER_DAY);
+    }
+}
+
+static void TEST_zone(enum CAL_ZoneId id) {
+    const CAL_Zone *zone = &CAL_zones[id];
+    CAL_DstCache cache = { 0 };
+
+    setenv("TZ", posixZones[id], 1);
+    tzset();
+
+    for (time_t t = EPOCH_2000; t < EPOCH_2100; t += DST_STEP) {
+        struct tm tm;
+        ts time;
+        localtime_r(&t, &tm);
+
+        CAL_fromEpoch32((CAL_Epoch32)t, zone, &time, &cache);
+        TEST_ASSERT_EQ(time.isDst, tm.tm_isdst);
+        TEST_ASSERT_EQ(time.year, tm.tm_year + 1900);
+        TEST_ASSERT_EQ(time.month, tm.tm_mon + 1);
+        TEST_ASSERT_EQ(time.date, tm.tm_mday);
+        TEST_ASSERT_EQ(time.hours, tm.tm_hour);
+        TEST_ASSERT_EQ(time.mins, tm.tm_min);
+        TEST_ASSERT_EQ(CAL_isDst(zone, (CAL_Epoch32)t, NULL), tm.tm_isdst);
+
+        // isDst picks the right one of the repeated hour when DST ends
+        TEST_ASSERT_EQ(CAL_toEpoch32(&time, zone), t);
+    }
+}
+
+static void TEST_epoch64(void) {
+    ts time = { .secs = 30, .mins = 0, .hours = 12, .date = 1, .month = 7, .year = 2024, .subsecs = 128 };
+    CAL_Epoch64 e = CAL_toEpoch64(&time, &CAL_zones[CAL_ZONE_UTC], 256);
+
+    TEST_ASSERT_EQ(CAL_EPOCH64_SECS(e), 1719835230U);
+    TEST_ASSERT_EQ(CAL_EPOCH64_FRAC(e), 0x80000000U);
+}
+
+static double TEST_rate(uint64_t ns) {
+    return (double)BENCH_CALLS * 1e9 / (double)ns;
+}
+
+static void TEST_bench(void) {
+    const CAL_Zone *utc = &CAL_zones[CAL_ZONE_UTC];
+    const CAL_Zone *sydney = &CAL_zones[CAL_ZONE_AU_EASTERN];
+    CAL_DstCache cache = { 0 };
+    ts time;
+
+    // Stepping by an odd number of seconds keeps every field changing
+    uint64_t start = TEST_nowNs();
+    for (uint32_t i = 0; i < BENCH_CALLS; i++) {
+        CAL_fromEpoch32(EPOCH_2000 + i * 127U, utc, &time, NULL);
+        sink = time.secs;
+    }
+    uint64_t fromUtc = TEST_nowNs() - start;
+
+    start = TEST_nowNs();
+    for (uint32_t i = 0; i < BENCH_CALLS; i++) {
+        CAL_fromEpoch32(EPOCH_2000 + i * 127U, sydney, &time, &cache);
+        sink = time.secs;
+    }
+    uint64_t fromLocal = TEST_nowNs() - start;
+
+    start = TEST_nowNs();
+    for (uint32_t i = 0; i < BENCH_CALLS; i++) {
+        time.secs = i % 60;
+        time.date = 1 + i % 28;
+        sink = CAL_toEpoch32(&time, utc);
+    }
+    uint64_t toUtc = TEST_nowNs() - start;
+
+    start = TEST_nowNs();
+    for (uint32_t i = 0; i < BENCH_CALLS; i++) {
+        struct tm tm;
+        time_t t = EPOCH_2000 + i * 127U;
+        gmtime_r(&t, &tm);
+        sink = tm.tm_sec;
+    }
+    uint64_t glibc = TEST_nowNs() - start;
+
+    printf("CAL_fromEpoch32 UTC      %6.1f M/s\n", TEST_rate(fromUtc) / 1e6);
+    printf("CAL_fromEpoch32 Sydney   %6.1f M/s, DST cached\n", TEST_rate(fromLocal) / 1e6);
+    printf("CAL_toEpoch32 UTC        %6.1f M/s\n", TEST_rate(toUtc) / 1e6);
+    printf("glibc gmtime_r           %6.1f M/s\n", TEST_rate(glibc) / 1e6);
+}
+
+int main(void) {
+    TEST_days();
+    TEST_utc();
+    for (int id = CAL_ZONE_UTC; id < CAL_ZONE_COUNT; id++) {
+        TEST_zone(id);
+    }
+    TEST_epoch64();
+    TEST_bench();
+    return TEST_result("calendar_test");
+}
\ No newline at end of file
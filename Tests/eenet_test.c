@@ -0,0 +1,431 @@
+/***********************************************************************************
+ * @file        eenet_test.c                                                       *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  TEST                                                               *
+ * @brief       Host test of the EEPROM block service, over the simulated ETH of   *
+ *              netif_pcap.c and the simulated 24C32 of eeprom_image.c: batched    *
+ *              writes sharing a write cycle, verify mismatches, every refusal,    *
+ *              and a flash and dump round trip the way Tools/eenet.py does them.  *
+ ***********************************************************************************/
+
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "eenet.h"
+#include "eeprom.h"
+#include "eeprom_image.h"
+#include "net.h"
+#include "netif_pcap.h"
+#include "stm32f4xx_hal.h"      // ETH_RX_DESC_CNT
+
+#define IMAGE_PATH      "eenet_test.img"
+#define CLIENT_IP       NET_IP(192, 168, 1, 20)
+#define CLIENT_PORT     40000
+#define CLIENT_MAC      { 0x02, 0x00, 0x00, 0x00, 0x00, 0x20 }
+#define RUN_STEPS       200000      // Main-loop passes a batch may take before the test gives up
+#define READ_CHUNK      (NET_UDP_MAX - EENET_HEADER - 1)
+#define OPS_MAX         (EEPROM_SIZE / EEPROM_WRITE_PAGE * 2)
+
+static const uint8_t clientMac[6] = CLIENT_MAC;
+
+// One operation of a client transfer, and its result
+typedef struct {
+    uint8_t op;
+    uint16_t addr;
+    uint16_t len;
+    const uint8_t *data;                // EENET_WRITE and EENET_VERIFY
+    uint8_t *out;                       // EENET_READ
+    uint8_t status;
+} TEST_Op;
+
+static struct {
+    uint8_t data[NET_UDP_MAX];
+    uint16_t size;
+} request;
+
+static struct {
+    uint8_t data[NET_UDP_MAX];
+    uint16_t size;
+    uint32_t count;                     // Replies received
+} reply;
+
+static void TEST_put16(uint8_t *p, uint16_t value) {
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)value;
+}
+
+static void TEST_put32(uint8_t *p, uint32_t value) {
+    TEST_put16(p, (uint16_t)(value >> 16));
+    TEST_put16(p + 2, (uint16_t)value);
+}
+
+static uint16_t TEST_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+// Answers the board's ARP requests for the client and keeps each UDP reply
+static void TEST_peer(const uint8_t *frame, uint16_t length) {
+    TEST_ASSERT_EQ(NETIF_pcapVerify(frame, length), 0);
+
+    uint16_t type = (uint16_t)(frame[12] << 8 | frame[13]);
+    if (type == 0x0806 && frame[14 + 7] == 1) {
+        uint8_t answer[60] = { 0 };
+        memcpy(&answer[0], NETIF_macAddress(), 6);
+        memcpy(&answer[6], clientMac, 6);
+        TEST_put16(&answer[12], 0x0806);
+        uint8_t *arp = &answer[14];
+        TEST_put16(&arp[0], 1);
+        TEST_put16(&arp[2], 0x0800);
+        arp[4] = 6;
+        arp[5] = 4;
+        TEST_put16(&arp[6], 2);
+        memcpy(&arp[8], clientMac, 6);
+        TEST_put32(&arp[14], CLIENT_IP);
+        memcpy(&arp[18], NETIF_macAddress(), 6);
+        TEST_put32(&arp[24], NET_address());
+        TEST_ASSERT_EQ(NETIF_pcapInject(answer, sizeof(answer)), 0);
+    }
+    else if (type == 0x0800 && frame[14 + 9] == 17) {
+        reply.size = (uint16_t)(length - NET_UDP_OFFSET);
+        memcpy(reply.data, &frame[NET_UDP_OFFSET], reply.size);
+        reply.count++;
+    }
+}
+
+// One pass of the main loop
+static void TEST_step(void) {
+    EEPROM_process();
+    NETIF_process();
+    NET_process();
+    EENET_process();
+    NETIF_process();
+}
+
+static void TEST_begin(uint16_t tag) {
+    request.data[0] = (uint8_t)tag;
+    request.data[1] = (uint8_t)(tag >> 8);
+    request.size = 2;
+}
+
+static void TEST_add(uint8_t op, uint16_t addr, uint16_t len, const uint8_t *data) {
+    uint8_t *p = &request.data[request.size];
+    p[0] = op;
+    p[1] = (uint8_t)addr;
+    p[2] = (uint8_t)(addr >> 8);
+    p[3] = (uint8_t)len;
+    p[4] = (uint8_t)(len >> 8);
+    request.size += EENET_OP_HEADER;
+    if (data != NULL) {
+        memcpy(&request.data[request.size], data, len);
+        request.size += len;
+    }
+}
+
+static void TEST_send(void) {
+    uint8_t frame[NETIF_BUF_SIZE] = { 0 };
+    uint16_t length = (uint16_t)(NET_UDP_OFFSET + request.size);
+
+    memcpy(&frame[0], NETIF_macAddress(), 6);
+    memcpy(&frame[6], clientMac, 6);
+    TEST_put16(&frame[12], 0x0800);
+    uint8_t *ip = &frame[NET_ETH_HEADER];
+    ip[0] = 0x45;
+    TEST_put16(&ip[2], (uint16_t)(NET_IP_HEADER + NET_UDP_HEADER + request.size));
+    ip[8] = 64;
+    ip[9] = 17;
+    TEST_put32(&ip[12], CLIENT_IP);
+    TEST_put32(&ip[16], NET_address());
+    uint8_t *udp = &ip[NET_IP_HEADER];
+    TEST_put16(&udp[0], CLIENT_PORT);
+    TEST_put16(&udp[2], EENET_PORT_DEFAULT);
+    TEST_put16(&udp[4], (uint16_t)(NET_UDP_HEADER + request.size));
+    memcpy(&udp[NET_UDP_HEADER], request.data, request.size);
+
+    length = length < 60 ? 60 : length;
+    NETIF_pcapChecksum(frame, length);
+    TEST_ASSERT_EQ(NETIF_pcapInject(frame, length), 0);
+}
+
+// Sends the request and runs the main loop until it is answered
+static uint8_t TEST_run(void) {
+    uint32_t before = reply.count;
+
+    TEST_send();
+    for (uint32_t i = 0; i < RUN_STEPS && reply.count == before; i++) {
+        TEST_step();
+    }
+    TEST_ASSERT_EQ(reply.count, before + 1);
+    TEST_ASSERT_EQ(TEST_u16(reply.data), TEST_u16(request.data));
+    return reply.data[2];
+}
+
+// Sends the request and checks it is refused whole
+static void TEST_refused(EENET_Status status) {
+    TEST_ASSERT_EQ(TEST_run(), status);
+    TEST_ASSERT_EQ(reply.data[3], 0);
+    TEST_ASSERT_EQ(reply.size, EENET_HEADER);
+}
+
+/*
+ * Runs operations in as few batches as fit a datagram each way, as
+ * Tools/eenet.py does, filling in each one's status and read data
+ */
+static void TEST_execute(TEST_Op *ops, uint16_t count) {
+    static uint16_t tag = 0x100;
+    uint16_t first = 0;
+
+    while (first < count) {
+        uint16_t answer = EENET_HEADER;
+        uint16_t n = 0;
+
+        TEST_begin(++tag);
+        while (first + n < count && n < EENET_MAX_OPS) {
+            const TEST_Op *op = &ops[first + n];
+            uint16_t ask = EENET_OP_HEADER + (op->op == EENET_READ ? 0 : op->len);
+            uint16_t give = 1 + (op->op == EENET_READ ? op->len : 0);
+            if (request.size + ask > NET_UDP_MAX || answer + give > NET_UDP_MAX) {
+                break;
+            }
+            TEST_add(op->op, op->addr, op->len, op->op == EENET_READ ? NULL : op->data);
+            answer += give;
+            n++;
+        }
+
+        uint8_t status = TEST_run();
+        TEST_ASSERT_EQ(status, EENET_OK);
+        TEST_ASSERT_EQ(reply.data[3], n);
+        TEST_ASSERT_EQ(reply.size, answer);
+        if (status != EENET_OK || reply.data[3] != n || reply.size != answer) {
+            return;                             // Already failed, don't wait out every other batch
+        }
+        const uint8_t *at = &reply.data[EENET_HEADER];
+        for (uint16_t i = first; i < first + n; i++) {
+            ops[i].status = *at++;
+            if (ops[i].op == EENET_READ) {
+                memcpy(ops[i].out, at, ops[i].len);
+                at += ops[i].len;
+            }
+        }
+        first += n;
+    }
+}
+
+static void TEST_dump(uint8_t *image) {
+    TEST_Op ops[EEPROM_SIZE / READ_CHUNK + 1];
+    uint16_t count = 0;
+
+    for (uint32_t addr = 0; addr < EEPROM_SIZE; addr += READ_CHUNK, count++) {
+        uint32_t len = EEPROM_SIZE - addr < READ_CHUNK ? EEPROM_SIZE - addr : READ_CHUNK;
+        ops[count] = (TEST_Op){ .op = EENET_READ, .addr = (uint16_t)addr, .len = (uint16_t)len, .out = &image[addr] };
+    }
+    TEST_execute(ops, count);
+    for (uint16_t i = 0; i < count; i++) {
+        TEST_ASSERT_EQ(ops[i].status, EENET_OK);
+    }
+}
+
+// Writes the pages that differ and verifies them in the same batches, returning the pages written
+static uint16_t TEST_flash(const uint8_t *image) {
+    static uint8_t current[EEPROM_SIZE];
+    TEST_Op ops[OPS_MAX];
+    uint16_t pages = 0;
+
+    TEST_dump(current);
+    for (uint32_t addr = 0; addr < EEPROM_SIZE; addr += EEPROM_WRITE_PAGE) {
+        if (memcmp(&current[addr], &image[addr], EEPROM_WRITE_PAGE) != 0) {
+            ops[pages++] = (TEST_Op){ .op = EENET_WRITE, .addr = (uint16_t)addr, .len = EEPROM_WRITE_PAGE,
+                                      .data = &image[addr] };
+        }
+    }
+    for (uint16_t i = 0; i < pages; i++) {
+        ops[pages + i] = ops[i];
+        ops[pages + i].op = EENET_VERIFY;
+    }
+    TEST_execute(ops, (uint16_t)(pages * 2));
+    for (uint16_t i = 0; i < pages * 2; i++) {
+        TEST_ASSERT_EQ(ops[i].status, EENET_OK);
+    }
+    return pages;
+}
+
+/*
+ * Four writes scattered through one page, sent in reverse order, take a
+ * single write cycle, and the read and verifies behind them in the batch
+ * see the new data
+ */
+static void TEST_batch(void) {
+    uint8_t data[EEPROM_WRITE_PAGE];
+    uint8_t wrong[4] = { 1, 2, 3, 4 };
+    EEPROM_ImageStats before;
+    EEPROM_ImageStats after;
+    EENET_Stats stats;
+
+    for (uint8_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(0xA0 + i);
+    }
+
+    EEPROM_imageStats(&before);
+    TEST_begin(7);
+    for (int8_t i = 3; i >= 0; i--) {
+        TEST_add(EENET_WRITE, (uint16_t)(0x100 + 8 * i), 8, &data[8 * i]);
+    }
+    TEST_add(EENET_READ, 0x100, sizeof(data), NULL);
+    TEST_add(EENET_VERIFY, 0x104, 4, &data[4]);
+    TEST_add(EENET_VERIFY, 0x110, 4, wrong);
+    TEST_ASSERT_EQ(TEST_run(), EENET_OK);
+    EEPROM_imageStats(&after);
+
+    TEST_ASSERT_EQ(after.writeCycles - before.writeCycles, 1);
+    TEST_ASSERT_EQ(after.bytesWritten - before.bytesWritten, sizeof(data));
+    TEST_ASSERT(memcmp(EEPROM_imageData() + 0x100, data, sizeof(data)) == 0);
+
+    TEST_ASSERT_EQ(reply.data[3], 7);
+    TEST_ASSERT_EQ(reply.size, EENET_HEADER + 7 + sizeof(data));
+    const uint8_t *status = &reply.data[EENET_HEADER];
+    for (uint8_t i = 0; i < 5; i++) {
+        TEST_ASSERT_EQ(status[i], EENET_OK);
+    }
+    TEST_ASSERT(memcmp(&status[5], data, sizeof(data)) == 0);
+    TEST_ASSERT_EQ(status[5 + sizeof(data)], EENET_OK);
+    TEST_ASSERT_EQ(status[6 + sizeof(data)], EENET_MISMATCH);
+
+    EENET_getStats(&stats);
+    TEST_ASSERT_EQ(stats.batches, 1);
+    TEST_ASSERT_EQ(stats.ops, 7);
+    TEST_ASSERT_EQ(stats.mismatches, 1);
+    TEST_ASSERT_EQ(stats.deviceErrors, 0);
+}
+
+// Refused batches are answered with count 0 and never reach the bus
+static void TEST_refusals(void) {
+    uint8_t data[EEPROM_WRITE_PAGE] = { 0 };
+    EEPROM_ImageStats before;
+    EEPROM_ImageStats after;
+    EENET_Stats stats;
+
+    // A second batch while the first is running
+    TEST_begin(8);
+    TEST_add(EENET_WRITE, 0x200, sizeof(data), data);
+    TEST_send();
+    NETIF_process();
+    TEST_ASSERT(!EEPROM_isIdle());
+    uint32_t count = reply.count;
+    TEST_begin(9);
+    TEST_add(EENET_READ, 0, 4, NULL);
+    TEST_send();
+    NETIF_process();
+    NETIF_process();
+    TEST_ASSERT_EQ(reply.count, count + 1);
+    TEST_ASSERT_EQ(TEST_u16(reply.data), 9);
+    TEST_ASSERT_EQ(reply.data[2], EENET_ERR_BUSY);
+    TEST_ASSERT_EQ(reply.data[3], 0);
+    for (uint32_t i = 0; i < RUN_STEPS && reply.count == count + 1; i++) {
+        TEST_step();
+    }
+    TEST_ASSERT_EQ(TEST_u16(reply.data), 8);
+    TEST_ASSERT_EQ(reply.data[2], EENET_OK);
+
+    EEPROM_imageStats(&before);
+
+    TEST_begin(10);
+    TEST_add(EENET_READ, 0, 4, NULL);
+    TEST_add(EENET_READ, EEPROM_SIZE - 8, 16, NULL);
+    TEST_refused(EENET_ERR_RANGE);
+    TEST_begin(11);
+    TEST_add(EENET_READ, 0, 0, NULL);
+    TEST_refused(EENET_ERR_RANGE);
+    TEST_begin(12);
+    TEST_add(EENET_VERIFY + 1, 0, 4, NULL);
+    TEST_refused(EENET_ERR_RANGE);
+
+    TEST_begin(13);
+    TEST_add(EENET_WRITE, 0, 10, data);
+    request.size -= 3;                          // Data cut short
+    TEST_refused(EENET_ERR_LENGTH);
+    TEST_begin(14);
+    TEST_add(EENET_READ, 0, 4, NULL);
+    request.size -= 1;                          // Operation header cut short
+    TEST_refused(EENET_ERR_LENGTH);
+    TEST_begin(15);
+    for (uint8_t i = 0; i <= EENET_MAX_OPS; i++) {
+        TEST_add(EENET_READ, i, 1, NULL);
+    }
+    TEST_refused(EENET_ERR_LENGTH);
+    TEST_begin(16);
+    TEST_refused(EENET_ERR_LENGTH);
+
+    TEST_begin(17);
+    TEST_add(EENET_READ, 0, READ_CHUNK - 2, NULL);
+    TEST_add(EENET_READ, READ_CHUNK, 2, NULL);            // One byte too many
+    TEST_refused(EENET_ERR_SPACE);
+
+    EEPROM_imageStats(&after);
+    TEST_ASSERT_EQ(after.bytesRead, before.bytesRead);
+    TEST_ASSERT_EQ(after.writeCycles, before.writeCycles);
+
+    // The largest read that fits is not refused
+    TEST_begin(18);
+    TEST_add(EENET_READ, 0, READ_CHUNK, NULL);
+    TEST_ASSERT_EQ(TEST_run(), EENET_OK);
+    TEST_ASSERT_EQ(reply.size, NET_UDP_MAX);
+
+    EENET_getStats(&stats);
+    TEST_ASSERT_EQ(stats.busy, 1);
+    TEST_ASSERT_EQ(stats.refused, 8);
+}
+
+/*
+ * A random image flashed and dumped back comes out the same, and flashing
+ * it again writes nothing
+ */
+static void TEST_roundTrip(void) {
+    static uint8_t image[EEPROM_SIZE];
+    static uint8_t back[EEPROM_SIZE];
+    EEPROM_ImageStats before;
+    EEPROM_ImageStats after;
+    uint32_t seed = 12345;
+
+    for (uint32_t i = 0; i < EEPROM_SIZE; i++) {
+        seed = seed * 1103515245U + 12345U;
+        image[i] = (uint8_t)(seed >> 16);
+    }
+
+    EEPROM_imageStats(&before);
+    TEST_ASSERT_EQ(TEST_flash(image), EEPROM_SIZE / EEPROM_WRITE_PAGE);
+    EEPROM_imageStats(&after);
+    TEST_ASSERT_EQ(after.writeCycles - before.writeCycles, EEPROM_SIZE / EEPROM_WRITE_PAGE);
+
+    TEST_dump(back);
+    TEST_ASSERT(memcmp(back, image, sizeof(image)) == 0);
+    TEST_ASSERT(memcmp(EEPROM_imageData(), image, sizeof(image)) == 0);
+
+    TEST_ASSERT_EQ(TEST_flash(image), 0);
+    image[1000] ^= 0x5A;
+    TEST_ASSERT_EQ(TEST_flash(image), 1);
+    TEST_dump(back);
+    TEST_ASSERT(memcmp(back, image, sizeof(image)) == 0);
+}
+
+int main(void) {
+    unlink(IMAGE_PATH);
+    TEST_ASSERT_EQ(EEPROM_imageOpen(IMAGE_PATH, NULL), 0);
+    EEPROM_init(NULL);
+    NETIF_pcapSetPeer(TEST_peer);
+    NETIF_init(NULL);
+    NET_init(NET_IP_DEFAULT, NET_NETMASK_DEFAULT, NET_GATEWAY_DEFAULT);
+    TEST_ASSERT_EQ(EENET_init(EENET_PORT_DEFAULT), 0);
+    TEST_step();
+
+    TEST_batch();
+    TEST_refusals();
+    TEST_roundTrip();
+
+    POOL_Stats pool;
+    POOL_getStats(&pool);
+    TEST_ASSERT_EQ(pool.available, POOL_BUF_COUNT - ETH_RX_DESC_CNT);
+
+    EEPROM_imageClose();
+    unlink(IMAGE_PATH);
+    return TEST_result("eenet_test");
+}
\ No newline at end of file
@@ -0,0 +1,216 @@
+/***********************************************************************************
+ * @file        eeprom_test.c                                                      *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  TEST                                                               *
+ * @brief       Host test of the asynchronous EEPROM queue on the image simulator: *
+ *              the overlap-preserving sort, page splits, merged bursts, ACK       *
+ *              polling, and the failures from a write cycle that never ends and   *
+ *              a device that stops answering.                                     *
+ ***********************************************************************************/
+
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+#include "eeprom.h"
+#include "eeprom_image.h"
+
+#define IMAGE_PATH      "eeprom_test.img"
+
+static uint8_t order[8];
+static uint8_t completed;
+
+static void TEST_done(EEPROM_Request *req) {
+    order[completed++] = (uint8_t)(uintptr_t)req->context;
+}
+
+// A blank image and an idle driver
+static void TEST_open(const EEPROM_ImageTiming *timing) {
+    EEPROM_imageClose();
+    unlink(IMAGE_PATH);
+    TEST_ASSERT_EQ(EEPROM_imageOpen(IMAGE_PATH, timing), 0);
+    EEPROM_init(NULL);
+    completed = 0;
+}
+
+static void TEST_request(EEPROM_Request *req, EEPROM_Op op, uint16_t addr, uint8_t *data, uint16_t size,
+                         uint8_t id) {
+    *req = (EEPROM_Request){ .op = op, .addr = addr, .data = data, .size = size,
+                             .callback = TEST_done, .context = (void *)(uintptr_t)id };
+}
+
+static void TEST_drain(void) {
+    while (!EEPROM_isIdle()) {
+        EEPROM_process();
+    }
+}
+
+/*
+ * The batch is run in address order, except that the read of bytes a write
+ * in the same batch changes stays behind it and sees the new data
+ */
+static void TEST_sort(void) {
+    uint8_t high[4] = { 1, 2, 3, 4 };
+    uint8_t low[4] = { 5, 6, 7, 8 };
+    uint8_t readBack[4] = { 0 };
+    uint8_t readLow[4] = { 0 };
+    EEPROM_Request reqs[4];
+    EEPROM_Request *batch[4] = { &reqs[0], &reqs[1], &reqs[2], &reqs[3] };
+
+    TEST_open(NULL);
+    TEST_request(&reqs[0], EEPROM_OP_WRITE, 200, high, 4, 0);
+    TEST_request(&reqs[1], EEPROM_OP_READ, 198, readBack, 4, 1);     // Overlaps the write above
+    TEST_request(&reqs[2], EEPROM_OP_WRITE, 100, low, 4, 2);
+    TEST_request(&reqs[3], EEPROM_OP_READ, 100, readLow, 4, 3);      // Overlaps the write above
+    TEST_ASSERT_EQ(EEPROM_submit(batch, 4), 0);
+    TEST_ASSERT(batch[0] == &reqs[2] && batch[1] == &reqs[3]);
+    TEST_ASSERT(batch[2] == &reqs[0] && batch[3] == &reqs[1]);
+    TEST_ASSERT_EQ(EEPROM_poll(&reqs[0]), EEPROM_PENDING);
+
+    TEST_drain();
+    TEST_ASSERT_EQ(completed, 4);
+    TEST_ASSERT(order[0] == 2 && order[1] == 3 && order[2] == 0 && order[3] == 1);
+    TEST_ASSERT(memcmp(readLow, low, 4) == 0);
+    TEST_ASSERT(readBack[0] == 0xFF && readBack[1] == 0xFF && memcmp(&readBack[2], high, 2) == 0);
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_EQ(EEPROM_poll(&reqs[i]), EEPROM_DONE);
+    }
+
+    // Nothing is queued if any request in the batch is out of range
+    EEPROM_Request bad;
+    TEST_request(&reqs[0], EEPROM_OP_READ, 0, readBack, 4, 0);
+    TEST_request(&bad, EEPROM_OP_READ, EEPROM_SIZE - 2, readBack, 4, 1);
+    EEPROM_Request *invalid[2] = { &reqs[0], &bad };
+    TEST_ASSERT_EQ(EEPROM_submit(invalid, 2), -1);
+    TEST_ASSERT(EEPROM_isIdle());
+}
+
+// A write across page boundaries takes one write cycle per page it touches
+static void TEST_pageSplit(void) {
+    uint8_t data[70];
+    EEPROM_ImageStats stats;
+
+    for (uint32_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 3 + 1);
+    }
+
+    TEST_open(NULL);
+    TEST_ASSERT_EQ(EEPROM_write(20, data, sizeof(data)), 0);          // 12 + 32 + 26 bytes
+    EEPROM_imageStats(&stats);
+    TEST_ASSERT_EQ(stats.writeCycles, 3);
+    TEST_ASSERT_EQ(stats.bytesWritten, sizeof(data));
+    TEST_ASSERT(memcmp(EEPROM_imageData() + 20, data, sizeof(data)) == 0);
+    TEST_ASSERT_EQ(EEPROM_imageData()[19], 0xFF);
+    TEST_ASSERT_EQ(EEPROM_imageData()[20 + sizeof(data)], 0xFF);
+
+    uint8_t readBack[sizeof(data)] = { 0 };
+    TEST_ASSERT_EQ(EEPROM_read(20, readBack, sizeof(readBack)), 0);
+    TEST_ASSERT(memcmp(readBack, data, sizeof(data)) == 0);
+}
+
+/*
+ * Contiguous writes in one page share a write cycle and contiguous reads
+ * share a transfer, up to EEPROM_WRITE_PAGE and EEPROM_READ_BURST bytes
+ */
+static void TEST_merge(void) {
+    uint8_t data[4][8];
+    uint8_t readBack[4][16];
+    EEPROM_Request reqs[4];
+    EEPROM_Request *batch[4];
+    EEPROM_ImageStats stats;
+
+    TEST_open(NULL);
+    for (int i = 0; i < 4; i++) {
+        memset(data[i], 0x10 + i, sizeof(data[i]));
+        TEST_request(&reqs[i], EEPROM_OP_WRITE, (uint16_t)(64 + 8 * (3 - i)), data[i], 8, (uint8_t)i);
+        batch[i] = &reqs[i];
+    }
+    TEST_ASSERT_EQ(EEPROM_submit(batch, 4), 0);
+
+    EEPROM_process();                   // One page, all four
+    EEPROM_imageStats(&stats);
+    TEST_ASSERT_EQ(stats.writeCycles, 1);
+    TEST_ASSERT_EQ(stats.bytesWritten, 32);
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_EQ(EEPROM_poll(&reqs[i]), EEPROM_BUSY);
+    }
+    TEST_drain();
+    TEST_ASSERT_EQ(completed, 4);
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT(memcmp(EEPROM_imageData() + 64 + 8 * (3 - i), data[i], 8) == 0);
+    }
+
+    completed = 0;
+    for (int i = 0; i < 4; i++) {
+        TEST_request(&reqs[i], EEPROM_OP_READ, (uint16_t)(48 + 16 * i), readBack[i], 16, (uint8_t)i);
+        batch[i] = &reqs[i];
+    }
+    TEST_ASSERT_EQ(EEPROM_submit(batch, 4), 0);
+    EEPROM_process();                   // 48 to 111 in one burst
+    TEST_ASSERT_EQ(completed, 4);
+    TEST_ASSERT_EQ(readBack[0][0], 0xFF);
+    TEST_ASSERT(memcmp(readBack[1], data[3], 8) == 0);
+    TEST_ASSERT(memcmp(readBack[2] + 8, data[0], 8) == 0);
+}
+
+// The device is ACK polled at most once a millisecond until the write cycle ends
+static void TEST_ackPoll(void) {
+    const EEPROM_ImageTiming timing = { 400000, 4000, 4000, 0, 1000, 1 };
+    uint8_t data[4] = { 9, 9, 9, 9 };
+    EEPROM_ImageStats stats;
+
+    TEST_open(&timing);
+    TEST_ASSERT_EQ(EEPROM_write(0, data, sizeof(data)), 0);
+    EEPROM_imageStats(&stats);
+    TEST_ASSERT(stats.probes >= 4 && stats.probes <= 6);
+    TEST_ASSERT_EQ(stats.nacks, stats.probes - 1);
+    TEST_ASSERT(stats.timeNs >= 4000000);
+}
+
+/*
+ * A write cycle that outlasts EEPROM_TWR_MAX_MS fails the requests in that
+ * page, and a device that stops answering fails the request it NACKs
+ */
+static void TEST_errors(void) {
+    const EEPROM_ImageTiming slow = { 400000, 20000, 20000, 0, 1000, 1 };
+    uint8_t data[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    uint8_t readBack[8];
+    EEPROM_Request reqs[3];
+    EEPROM_Request *batch[3] = { &reqs[0], &reqs[1], &reqs[2] };
+
+    TEST_open(&slow);
+    TEST_request(&reqs[0], EEPROM_OP_WRITE, 0, data, 4, 0);
+    TEST_request(&reqs[1], EEPROM_OP_WRITE, 4, data + 4, 4, 1);
+    TEST_request(&reqs[2], EEPROM_OP_WRITE, 64, data, 4, 2);
+    TEST_ASSERT_EQ(EEPROM_submit(batch, 3), 0);
+    EEPROM_process();
+    TEST_drain();
+    TEST_ASSERT_EQ(EEPROM_poll(&reqs[0]), EEPROM_ERROR);
+    TEST_ASSERT_EQ(EEPROM_poll(&reqs[1]), EEPROM_ERROR);
+    TEST_ASSERT_EQ(EEPROM_poll(&reqs[2]), EEPROM_ERROR);         // Its page is NACKed after the timeout
+    TEST_ASSERT_EQ(completed, 3);
+
+    // Power is cut while committing, and the device NACKs until it is back
+    TEST_open(NULL);
+    EEPROM_imageInjectFailure(2, EEPROM_FAIL_TORN);
+    TEST_ASSERT_EQ(EEPROM_write(0, data, sizeof(data)), -1);
+    TEST_ASSERT(EEPROM_imagePowerLost());
+    TEST_ASSERT_EQ(EEPROM_read(0, readBack, sizeof(readBack)), -1);
+    TEST_ASSERT(EEPROM_isIdle());
+
+    EEPROM_imagePowerOn();
+    TEST_ASSERT_EQ(EEPROM_read(0, readBack, sizeof(readBack)), 0);
+    TEST_ASSERT(readBack[0] == 1 && readBack[1] == 2 && readBack[2] == 0xFF);
+    TEST_ASSERT_EQ(EEPROM_write(EEPROM_SIZE - 4, data, sizeof(data)), -1);
+}
+
+int main(void) {
+    TEST_sort();
+    TEST_pageSplit();
+    TEST_merge();
+    TEST_ackPoll();
+    TEST_errors();
+    EEPROM_imageClose();
+    unlink(IMAGE_PATH);
+    return TEST_result("eeprom_test");
+}
\ No newline at end of file
@@ -0,0 +1,484 @@
+/***********************************************************************************
+ * @file        net_test.c                                                         *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  TEST                                                               *
+ * @brief       Host test of the ARP, IPv4, ICMP and UDP layer on the virtual ETH  *
+ *              of netif_pcap.c: resolution holding one datagram, retries and      *
+ *              expiry, echo replies, socket dispatch, and the IPv4 packets it     *
+ *              must drop without leaking a buffer.                                *
+ ***********************************************************************************/
+
+#include <string.h>
+
+#include "test.h"
+#include "net.h"
+#include "netif_pcap.h"
+#include "idle.h"
+#include "stm32f4xx_hal.h"      // ETH_RX_DESC_CNT
+
+#define PEER_IP         NET_IP(192, 168, 1, 10)
+#define OTHER_IP        NET_IP(192, 168, 1, 30)     // On-link, answers ARP
+#define SILENT_IP       NET_IP(192, 168, 1, 40)     // On-link, never answers
+#define REMOTE_IP       NET_IP(10, 0, 0, 1)         // Off-link, through the gateway
+#define PEER_MAC        { 0x02, 0x00, 0x00, 0x00, 0x00, 0x10 }
+#define OTHER_MAC       { 0x02, 0x00, 0x00, 0x00, 0x00, 0x30 }
+#define PORT            5000
+#define SENT_MAX        8
+
+static const uint8_t peerMac[6] = PEER_MAC;
+static const uint8_t otherMac[6] = OTHER_MAC;
+static const uint8_t broadcastMac[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+// Frames the stack sent, as they left the MAC
+static struct {
+    uint8_t data[NETIF_BUF_SIZE];
+    uint16_t length;
+} sent[SENT_MAX];
+static uint8_t sentCount;
+
+// Last datagram delivered to the bound port
+static struct {
+    NET_Endpoint from;
+    uint16_t port;
+    uint8_t data[32];
+    uint16_t size;
+    uint8_t count;
+} received;
+
+static uint16_t TEST_get16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t TEST_get32(const uint8_t *p) {
+    return ((uint32_t)TEST_get16(p) << 16) | TEST_get16(p + 2);
+}
+
+static void TEST_put16(uint8_t *p, uint16_t value) {
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)value;
+}
+
+static void TEST_put32(uint8_t *p, uint32_t value) {
+    TEST_put16(p, (uint16_t)(value >> 16));
+    TEST_put16(p + 2, (uint16_t)value);
+}
+
+static void TEST_peer(const uint8_t *frame, uint16_t length) {
+    TEST_ASSERT_EQ(NETIF_pcapVerify(frame, length), 0);
+    TEST_ASSERT(sentCount < SENT_MAX);
+    if (sentCount < SENT_MAX) {
+        memcpy(sent[sentCount].data, frame, length);
+        sent[sentCount].length = length;
+        sentCount++;
+    }
+}
+
+static void TEST_handler(const NET_Endpoint *from, uint16_t port, const uint8_t *data, uint16_t size) {
+    received.from = *from;
+    received.port = port;
+    received.size = size;
+    memcpy(received.data, data, size < sizeof(received.data) ? size : sizeof(received.data));
+    received.count++;
+}
+
+// One pass of the main loop
+static void TEST_step(void) {
+    NETIF_process();
+    NET_process();
+    NETIF_process();
+}
+
+static void TEST_advance(uint32_t ms) {
+    NETIF_pcapAdvance(ms);
+    TEST_step();
+}
+
+// A fresh stack with the link-up announcement already sent and cleared
+static void TEST_start(void) {
+    NETIF_init(NULL);
+    NET_init(NET_IP_DEFAULT, NET_NETMASK_DEFAULT, NET_GATEWAY_DEFAULT);
+    memset(&received, 0, sizeof(received));
+    sentCount = 0;
+    TEST_step();
+    TEST_ASSERT_EQ(sentCount, 1);
+    TEST_ASSERT(memcmp(sent[0].data, broadcastMac, 6) == 0);
+    TEST_ASSERT_EQ(TEST_get32(&sent[0].data[14 + 24]), NET_IP_DEFAULT);
+    sentCount = 0;
+}
+
+// Every buffer is back in the pool or on an RX descriptor
+static void TEST_noLeak(void) {
+    POOL_Stats stats;
+    POOL_getStats(&stats);
+    TEST_ASSERT_EQ(stats.available, POOL_BUF_COUNT - ETH_RX_DESC_CNT);
+}
+
+static uint16_t TEST_arpFrame(uint8_t *frame, uint16_t op, const uint8_t *mac, uint32_t senderIp, uint32_t targetIp) {
+    memset(frame, 0, 60);
+    memcpy(&frame[0], op == 1 ? broadcastMac : NETIF_macAddress(), 6);
+    memcpy(&frame[6], mac, 6);
+    TEST_put16(&frame[12], 0x0806);
+
+    uint8_t *arp = &frame[14];
+    TEST_put16(&arp[0], 1);
+    TEST_put16(&arp[2], 0x0800);
+    arp[4] = 6;
+    arp[5] = 4;
+    TEST_put16(&arp[6], op);
+    memcpy(&arp[8], mac, 6);
+    TEST_put32(&arp[14], senderIp);
+    if (op == 2) {
+        memcpy(&arp[18], NETIF_macAddress(), 6);
+    }
+    TEST_put32(&arp[24], targetIp);
+    return 60;                                  // Padded to the minimum frame
+}
+
+// An IPv4 header from the peer, with the payload left to the caller
+static uint16_t TEST_ipFrame(uint8_t *frame, uint32_t dst, uint8_t proto, uint16_t payload) {
+    memset(frame, 0, 14 + 20 + payload);
+    memcpy(&frame[0], NETIF_macAddress(), 6);
+    memcpy(&frame[6], peerMac, 6);
+    TEST_put16(&frame[12], 0x0800);
+
+    uint8_t *ip = &frame[14];
+    ip[0] = 0x45;
+    TEST_put16(&ip[2], (uint16_t)(20 + payload));
+    ip[8] = 64;
+    ip[9] = proto;
+    TEST_put32(&ip[12], PEER_IP);
+    TEST_put32(&ip[16], dst);
+    return (uint16_t)(14 + 20 + payload);
+}
+
+static uint16_t TEST_udpFrame(uint8_t *frame, uint32_t dst, uint16_t port, const char *text) {
+    uint16_t size = (uint16_t)strlen(text);
+    uint16_t length = TEST_ipFrame(frame, dst, 17, (uint16_t)(8 + size));
+    uint8_t *udp = &frame[14 + 20];
+    TEST_put16(&udp[0], 4000);
+    TEST_put16(&udp[2], port);
+    TEST_put16(&udp[4], (uint16_t)(8 + size));
+    memcpy(&udp[8], text, size);
+    NETIF_pcapChecksum(frame, length);
+    return length;
+}
+
+static void TEST_inject(const uint8_t *frame, uint16_t length) {
+    TEST_ASSERT_EQ(NETIF_pcapInject(frame, length), 0);
+    TEST_step();
+}
+
+/*
+ * Requests for our address are answered and teach us the sender. An unknown
+ * next hop is ARPed once, holding only the newest datagram, which goes out
+ * to the MAC in the reply.
+ */
+static void TEST_arpResolve(void) {
+    uint8_t frame[64];
+    NET_Stats stats;
+    NET_Endpoint peer = { PEER_IP, 4000 };
+    NET_Endpoint other = { OTHER_IP, 4001 };
+
+    TEST_start();
+    TEST_inject(frame, TEST_arpFrame(frame, 1, peerMac, PEER_IP, NET_IP_DEFAULT));
+    TEST_ASSERT_EQ(sentCount, 1);
+    TEST_ASSERT(memcmp(&sent[0].data[0], peerMac, 6) == 0);
+    TEST_ASSERT_EQ(TEST_get16(&sent[0].data[14 + 6]), 2);
+    TEST_ASSERT(memcmp(&sent[0].data[14 + 8], NETIF_macAddress(), 6) == 0);
+    TEST_ASSERT_EQ(TEST_get32(&sent[0].data[14 + 14]), NET_IP_DEFAULT);
+    TEST_ASSERT_EQ(TEST_get32(&sent[0].data[14 + 24]), PEER_IP);
+
+    // Learned from its request, so no lookup
+    sentCount = 0;
+    TEST_ASSERT_EQ(NET_udpSendTo(PORT, &peer, "hi", 2), 0);
+    TEST_step();
+    TEST_ASSERT_EQ(sentCount, 1);
+    TEST_ASSERT(memcmp(&sent[0].data[0], peerMac, 6) == 0);
+
+    // A request for another host is not answered
+    sentCount = 0;
+    TEST_inject(frame, TEST_arpFrame(frame, 1, otherMac, OTHER_IP, SILENT_IP));
+    TEST_ASSERT_EQ(sentCount, 0);
+
+    TEST_ASSERT_EQ(NET_udpSendTo(PORT, &other, "first", 5), 0);
+    TEST_ASSERT_EQ(NET_udpSendTo(PORT, &other, "second", 6), 0);
+    TEST_step();
+    TEST_ASSERT_EQ(sentCount, 1);
+    TEST_ASSERT(memcmp(&sent[0].data[0], broadcastMac, 6) == 0);
+    TEST_ASSERT_EQ(TEST_get16(&sent[0].data[14 + 6]), 1);
+    TEST_ASSERT_EQ(TEST_get32(&sent[0].data[14 + 24]), OTHER_IP);
+    TEST_ASSERT_EQ(NET_nextPoll(), NET_ARP_RETRY_MS);
+
+    sentCount = 0;
+    TEST_inject(frame, TEST_arpFrame(frame, 2, otherMac, OTHER_IP, NET_IP_DEFAULT));
+    TEST_step();
+    TEST_ASSERT_EQ(sentCount, 1);
+    TEST_ASSERT(memcmp(&sent[0].data[0], otherMac, 6) == 0);
+    TEST_ASSERT_EQ(TEST_get32(&sent[0].data[14 + 16]), OTHER_IP);
+    TEST_ASSERT_EQ(TEST_get16(&sent[0].data[14 + 20 + 2]), 4001);
+    TEST_ASSERT(memcmp(&sent[0].data[14 + 20 + 8], "second", 6) == 0);
+
+    NET_getStats(&stats);
+    TEST_ASSERT_EQ(stats.arpRequests, 1);
+    TEST_ASSERT_EQ(stats.arpReplies, 1);
+    TEST_ASSERT_EQ(stats.arpDisplaced, 1);
+    TEST_ASSERT_EQ(stats.arpFailed, 0);
+    TEST_ASSERT_EQ(stats.udpSent, 3);
+    TEST_noLeak();
+}
+
+/*
+ * An unanswered lookup is retried every NET_ARP_RETRY_MS and given up after
+ * NET_ARP_TRIES requests, dropping what it held. Off-link destinations are
+ * looked up through the gateway, and resolved entries age out.
+ */
+static void TEST_arpExpire(void) {
+    uint8_t frame[64];
+    NET_Stats stats;
+    NET_Endpoint silent = { SILENT_IP, 4000 };
+    NET_Endpoint remote = { REMOTE_IP, 4000 };
+
+    TEST_start();
+    TEST_ASSERT_EQ(NET_nextPoll(), IDLE_NEVER);
+    TEST_ASSERT_EQ(NET_udpSendTo(PORT, &silent, "lost", 4), 0);
+    TEST_step();
+    TEST_ASSERT_EQ(sentCount, 1);
+
+    for (uint8_t tries = 1; tries < NET_ARP_TRIES; tries++) {
+        TEST_advance(NET_ARP_RETRY_MS - 1);
+        TEST_ASSERT_EQ(sentCount, tries);
+        TEST_ASSERT_EQ(NET_nextPoll(), 1);
+        TEST_advance(1);
+        TEST_ASSERT_EQ(sentCount, tries + 1);
+        TEST_ASSERT_EQ(TEST_get32(&sent[tries].data[14 + 24]), SILENT_IP);
+    }
+    TEST_advance(NET_ARP_RETRY_MS);
+    TEST_ASSERT_EQ(sentCount, NET_ARP_TRIES);
+    TEST_ASSERT_EQ(NET_nextPoll(), IDLE_NEVER);
+
+    NET_getStats(&stats);
+    TEST_ASSERT_EQ(stats.arpRequests, NET_ARP_TRIES);
+    TEST_ASSERT_EQ(stats.arpFailed, 1);
+    TEST_noLeak();
+
+    sentCount = 0;
+    TEST_ASSERT_EQ(NET_udpSendTo(PORT, &remote, "far", 3), 0);
+    TEST_step();
+    TEST_ASSERT_EQ(sentCount, 1);
+    TEST_ASSERT_EQ(TEST_get32(&sent[0].data[14 + 24]), NET_GATEWAY_DEFAULT);
+
+    sentCount = 0;
+    TEST_inject(frame, TEST_arpFrame(frame, 2, otherMac, NET_GATEWAY_DEFAULT, NET_IP_DEFAULT));
+    TEST_ASSERT_EQ(sentCount, 1);
+    TEST_ASSERT(memcmp(&sent[0].data[0], otherMac, 6) == 0);
+    TEST_ASSERT_EQ(TEST_get32(&sent[0].data[14 + 16]), REMOTE_IP);
+    sentCount = 0;
+    TEST_ASSERT_EQ(NET_udpSendTo(PORT, &remote, "near", 4), 0);
+    TEST_step();
+    TEST_ASSERT_EQ(sentCount, 1);
+    TEST_ASSERT(memcmp(&sent[0].data[0], otherMac, 6) == 0);
+
+    TEST_ASSERT_EQ(NET_nextPoll(), NET_ARP_TIMEOUT_MS);
+    TEST_advance(NET_ARP_TIMEOUT_MS - 1);
+    TEST_ASSERT_EQ(NET_nextPoll(), 1);
+    TEST_advance(1);
+    TEST_ASSERT_EQ(NET_nextPoll(), IDLE_NEVER);
+
+    sentCount = 0;
+    TEST_ASSERT_EQ(NET_udpSendTo(PORT, &remote, "far", 3), 0);
+    TEST_step();
+    TEST_ASSERT_EQ(sentCount, 1);
+    TEST_ASSERT(memcmp(&sent[0].data[0], broadcastMac, 6) == 0);
+    for (uint8_t tries = 0; tries < NET_ARP_TRIES; tries++) {
+        TEST_advance(NET_ARP_RETRY_MS);
+    }
+    NET_getStats(&stats);
+    TEST_ASSERT_EQ(stats.arpFailed, 2);
+    TEST_noLeak();
+}
+
+// Echo requests to us are answered in place, back to the sender's MAC
+static void TEST_icmp(void) {
+    uint8_t frame[128];
+    NET_Stats stats;
+
+    TEST_start();
+    uint16_t length = TEST_ipFrame(frame, NET_IP_DEFAULT, 1, 8 + 32);
+    uint8_t *icmp = &frame[14 + 20];
+    icmp[0] = 8;
+    TEST_put16(&icmp[4], 0x1234);
+    TEST_put16(&icmp[6], 7);
+    for (uint8_t i = 0; i < 32; i++) {
+        icmp[8 + i] = i;
+    }
+    NETIF_pcapChecksum(frame, length);
+    TEST_inject(frame, length);
+
+    TEST_ASSERT_EQ(sentCount, 1);
+    TEST_ASSERT_EQ(sent[0].length, length);
+    const uint8_t *reply = sent[0].data;
+    TEST_ASSERT(memcmp(&reply[0], peerMac, 6) == 0);
+    TEST_ASSERT(memcmp(&reply[6], NETIF_macAddress(), 6) == 0);
+    TEST_ASSERT_EQ(TEST_get32(&reply[14 + 12]), NET_IP_DEFAULT);
+    TEST_ASSERT_EQ(TEST_get32(&reply[14 + 16]), PEER_IP);
+    TEST_ASSERT_EQ(reply[14 + 20], 0);
+    TEST_ASSERT(memcmp(&reply[14 + 20 + 4], &icmp[4], 4 + 32) == 0);
+
+    // Broadcast pings and other ICMP are not answered
+    sentCount = 0;
+    length = TEST_ipFrame(frame, NET_IP(192, 168, 1, 255), 1, 8);
+    memset(frame, 0xFF, 6);
+    frame[14 + 20] = 8;
+    NETIF_pcapChecksum(frame, length);
+    TEST_inject(frame, length);
+    length = TEST_ipFrame(frame, NET_IP_DEFAULT, 1, 8);
+    frame[14 + 20] = 13;                        // Timestamp request
+    NETIF_pcapChecksum(frame, length);
+    TEST_inject(frame, length);
+    TEST_ASSERT_EQ(sentCount, 0);
+
+    NET_getStats(&stats);
+    TEST_ASSERT_EQ(stats.icmpEchoes, 1);
+    TEST_ASSERT_EQ(stats.ipReceived, 3);
+    TEST_ASSERT_EQ(stats.ipSent, 1);
+    TEST_noLeak();
+}
+
+/*
+ * Ports bind once each up to NET_SOCKETS, and datagrams reach their port's
+ * handler sized by the UDP length, or count as no port
+ */
+static void TEST_udp(void) {
+    uint8_t frame[128];
+    NET_Stats stats;
+
+    TEST_start();
+    TEST_ASSERT_EQ(NET_udpBind(PORT, TEST_handler), 0);
+    TEST_ASSERT_EQ(NET_udpBind(PORT, TEST_handler), -1);
+    TEST_ASSERT_EQ(NET_udpBind(0, TEST_handler), -1);
+    TEST_ASSERT_EQ(NET_udpBind(PORT + 1, NULL), -1);
+    for (uint16_t i = 1; i < NET_SOCKETS; i++) {
+        TEST_ASSERT_EQ(NET_udpBind((uint16_t)(PORT + i), TEST_handler), 0);
+    }
+    TEST_ASSERT_EQ(NET_udpBind(PORT + NET_SOCKETS, TEST_handler), -1);
+    for (uint16_t i = 1; i < NET_SOCKETS; i++) {
+        NET_udpUnbind((uint16_t)(PORT + i));
+    }
+
+    TEST_inject(frame, TEST_udpFrame(frame, NET_IP_DEFAULT, PORT, "hello"));
+    TEST_ASSERT_EQ(received.count, 1);
+    TEST_ASSERT_EQ(received.from.ip, PEER_IP);
+    TEST_ASSERT_EQ(received.from.port, 4000);
+    TEST_ASSERT_EQ(received.port, PORT);
+    TEST_ASSERT_EQ(received.size, 5);
+    TEST_ASSERT(memcmp(received.data, "hello", 5) == 0);
+
+    // Ethernet padding past the IP total length is not payload
+    uint16_t length = TEST_udpFrame(frame, NET_IP_DEFAULT, PORT, "pad");
+    memset(&frame[length], 0xEE, 60 - length);
+    TEST_inject(frame, 60);
+    TEST_ASSERT_EQ(received.count, 2);
+    TEST_ASSERT_EQ(received.size, 3);
+
+    // Nor is anything in the IP payload past the UDP length
+    length = TEST_udpFrame(frame, NET_IP_DEFAULT, PORT, "trailer");
+    TEST_put16(&frame[14 + 20 + 4], 8 + 4);
+    NETIF_pcapChecksum(frame, length);
+    TEST_inject(frame, length);
+    TEST_ASSERT_EQ(received.count, 3);
+    TEST_ASSERT_EQ(received.size, 4);
+
+    // Subnet broadcast is delivered too
+    length = TEST_udpFrame(frame, NET_IP(192, 168, 1, 255), PORT, "all");
+    memset(frame, 0xFF, 6);
+    TEST_inject(frame, length);
+    TEST_ASSERT_EQ(received.count, 4);
+
+    TEST_inject(frame, TEST_udpFrame(frame, NET_IP_DEFAULT, PORT + 1, "nobody"));
+    NET_udpUnbind(PORT);
+    TEST_inject(frame, TEST_udpFrame(frame, NET_IP_DEFAULT, PORT, "gone"));
+    TEST_ASSERT_EQ(received.count, 4);
+
+    // A UDP length beyond the IP payload is malformed
+    length = TEST_udpFrame(frame, NET_IP_DEFAULT, PORT, "short");
+    TEST_put16(&frame[14 + 20 + 4], 8 + 6);
+    TEST_put16(&frame[14 + 20 + 6], 0);
+    NETIF_pcapChecksum(frame, length);
+    TEST_inject(frame, length);
+
+    NET_getStats(&stats);
+    TEST_ASSERT_EQ(stats.ipReceived, 7);
+    TEST_ASSERT_EQ(stats.udpReceived, 6);
+    TEST_ASSERT_EQ(stats.udpNoPort, 2);
+    TEST_ASSERT_EQ(stats.ipDropped, 1);
+    TEST_ASSERT_EQ(sentCount, 0);
+    TEST_noLeak();
+}
+
+/*
+ * IPv4 packets that are truncated, malformed, fragmented or addressed to
+ * another host are dropped and counted, and never reach a socket
+ */
+static void TEST_drops(void) {
+    uint8_t frame[128];
+    NET_Stats stats;
+    uint16_t length;
+
+    TEST_start();
+    TEST_ASSERT_EQ(NET_udpBind(PORT, TEST_handler), 0);
+
+    length = TEST_udpFrame(frame, NET_IP_DEFAULT, PORT, "v6");
+    frame[14] = 0x65;
+    TEST_inject(frame, length);
+
+    length = TEST_udpFrame(frame, NET_IP_DEFAULT, PORT, "ihl");
+    frame[14] = 0x44;
+    TEST_inject(frame, length);
+
+    length = TEST_udpFrame(frame, NET_IP_DEFAULT, PORT, "long");
+    TEST_put16(&frame[14 + 2], (uint16_t)(length - 14 + 1));
+    TEST_inject(frame, length);
+
+    TEST_inject(frame, 14 + 19);                // Shorter than an IPv4 header
+
+    // Our MAC, someone else's address
+    TEST_inject(frame, TEST_udpFrame(frame, NET_IP(192, 168, 1, 99), PORT, "other"));
+
+    length = TEST_udpFrame(frame, NET_IP_DEFAULT, PORT, "more");
+    TEST_put16(&frame[14 + 6], 0x2000);         // More fragments
+    NETIF_pcapChecksum(frame, length);
+    TEST_inject(frame, length);
+
+    length = TEST_udpFrame(frame, NET_IP_DEFAULT, PORT, "last");
+    TEST_put16(&frame[14 + 6], 185);            // Offset 1480, the final fragment
+    NETIF_pcapChecksum(frame, length);
+    TEST_inject(frame, length);
+
+    // The MAC drops a bad header checksum before the stack sees it
+    length = TEST_udpFrame(frame, NET_IP_DEFAULT, PORT, "sum");
+    frame[14 + 8]--;
+    TEST_ASSERT_EQ(NETIF_pcapInject(frame, length), -1);
+
+    NET_getStats(&stats);
+    TEST_ASSERT_EQ(received.count, 0);
+    TEST_ASSERT_EQ(stats.ipDropped, 5);
+    TEST_ASSERT_EQ(stats.ipFragments, 2);
+    TEST_ASSERT_EQ(stats.ipReceived, 0);
+    TEST_ASSERT_EQ(stats.udpReceived, 0);
+    TEST_ASSERT_EQ(sentCount, 0);
+
+    // Still working after all of that
+    TEST_inject(frame, TEST_udpFrame(frame, NET_IP_DEFAULT, PORT, "ok"));
+    TEST_ASSERT_EQ(received.count, 1);
+    TEST_noLeak();
+}
+
+int main(void) {
+    NETIF_pcapSetPeer(TEST_peer);
+    TEST_arpResolve();
+    TEST_arpExpire();
+    TEST_icmp();
+    TEST_udp();
+    TEST_drops();
+    return TEST_result("net_test");
+}
\ No newline at end of file
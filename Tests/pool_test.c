@@ -0,0 +1,147 @@
+/***********************************************************************************
+ * @file        pool_test.c                                                        *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  TEST                                                               *
+ * @brief       Host test of the packet buffer pool: reference counting on one    *
+ *              thread, then a pthread stress run where threads stand in for       *
+ *              interrupts allocating, sharing and releasing at once. Every        *
+ *              allocation must be freed and every buffer must come back.          *
+ ***********************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "pool.h"
+
+#define STRESS_THREADS  8
+#define STRESS_ITERS    1000000
+#define STRESS_HELD     3               // Buffers each thread holds at most, so the pool runs dry
+#define STRESS_BYTES    64
+
+static uint32_t corrupted;              // A held buffer changed under its owner
+static uint32_t threadAllocs[STRESS_THREADS];
+static POOL_Buffer *shared[STRESS_THREADS];  // Handed from each thread to the next
+
+static void TEST_refs(void) {
+    POOL_Stats stats;
+
+    POOL_init();
+    POOL_Buffer *buffer = POOL_alloc();
+    TEST_ASSERT(buffer != NULL);
+    TEST_ASSERT_EQ(buffer->refs, 1);
+    TEST_ASSERT(POOL_fromData(buffer->data) == buffer);
+    TEST_ASSERT_EQ((uintptr_t)buffer->data % POOL_ALIGN, 0);
+
+    POOL_ref(buffer);
+    POOL_release(buffer);
+    POOL_getStats(&stats);
+    TEST_ASSERT_EQ(stats.frees, 0);                 // One reference left
+    TEST_ASSERT_EQ(stats.available, POOL_BUF_COUNT - 1);
+
+    POOL_release(buffer);
+    POOL_getStats(&stats);
+    TEST_ASSERT_EQ(stats.allocs, 1);
+    TEST_ASSERT_EQ(stats.frees, 1);
+    TEST_ASSERT_EQ(stats.available, POOL_BUF_COUNT);
+    TEST_ASSERT_EQ(stats.low, POOL_BUF_COUNT - 1);
+}
+
+static void *TEST_worker(void *arg) {
+    uint32_t id = (uint32_t)(uintptr_t)arg;
+    unsigned seed = id * 7 + 1;
+    POOL_Buffer *held[STRESS_HELD];
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < STRESS_ITERS; i++) {
+        if (count < STRESS_HELD && (rand_r(&seed) & 1)) {
+            POOL_Buffer *buffer = POOL_alloc();
+            if (buffer != NULL) {
+                threadAllocs[id]++;
+                memset(buffer->data, (int)id, STRESS_BYTES);
+                held[count++] = buffer;
+
+                // Sometimes also pass it on, the next thread drops that reference
+                if ((rand_r(&seed) & 7) == 0) {
+                    POOL_ref(buffer);
+                    POOL_Buffer *old = __atomic_exchange_n(&shared[id], buffer, __ATOMIC_ACQ_REL);
+                    if (old != NULL) {
+                        POOL_release(old);
+                    }
+                }
+            }
+        }
+        else if (count > 0) {
+            POOL_Buffer *buffer = held[--count];
+            for (uint32_t k = 0; k < STRESS_BYTES; k++) {
+                if (buffer->data[k] != (uint8_t)id) {
+                    __atomic_fetch_add(&corrupted, 1, __ATOMIC_RELAXED);
+                    break;
+                }
+            }
+            POOL_release(buffer);
+        }
+
+        POOL_Buffer *passed = __atomic_exchange_n(&shared[(id + 1) % STRESS_THREADS], NULL, __ATOMIC_ACQ_REL);
+        if (passed != NULL) {
+            POOL_release(passed);
+        }
+    }
+
+    while (count > 0) {
+        POOL_release(held[--count]);
+    }
+    return NULL;
+}
+
+static void TEST_stress(void) {
+    pthread_t threads[STRESS_THREADS];
+    POOL_Stats stats;
+
+    POOL_init();
+    for (uint32_t i = 0; i < STRESS_THREADS; i++) {
+        pthread_create(&threads[i], NULL, TEST_worker, (void *)(uintptr_t)i);
+    }
+    for (uint32_t i = 0; i < STRESS_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (uint32_t i = 0; i < STRESS_THREADS; i++) {
+        if (shared[i] != NULL) {
+            POOL_release(shared[i]);
+        }
+    }
+
+    uint32_t allocs = 0;
+    for (uint32_t i = 0; i < STRESS_THREADS; i++) {
+        allocs += threadAllocs[i];
+    }
+
+    POOL_getStats(&stats);
+    TEST_ASSERT_EQ(corrupted, 0);
+    TEST_ASSERT_EQ(stats.allocs, allocs);
+    TEST_ASSERT_EQ(stats.frees, stats.allocs);
+    TEST_ASSERT_EQ(stats.available, POOL_BUF_COUNT);
+    TEST_ASSERT(stats.exhausted > 0);               // The run did drain the pool
+    TEST_ASSERT_EQ(stats.low, 0);
+
+    // Every buffer is back on the free stack, once
+    POOL_Buffer *back[POOL_BUF_COUNT];
+    for (uint32_t i = 0; i < POOL_BUF_COUNT; i++) {
+        back[i] = POOL_alloc();
+        TEST_ASSERT(back[i] != NULL);
+        for (uint32_t j = 0; j < i; j++) {
+            TEST_ASSERT(back[j] != back[i]);
+        }
+    }
+    TEST_ASSERT(POOL_alloc() == NULL);
+
+    printf("%u allocations over %u threads, pool empty %u times\n",
+           (unsigned)stats.allocs, STRESS_THREADS, (unsigned)stats.exhausted);
+}
+
+int main(void) {
+    TEST_refs();
+    TEST_stress();
+    return TEST_result("pool_test");
+}
\ No newline at end of file
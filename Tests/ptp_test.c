@@ -0,0 +1,433 @@
+/***********************************************************************************
+ * @file        ptp_test.c                                                         *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  TEST                                                               *
+ * @brief       Host test of the PTP slave against a simulated master on the       *
+ *              virtual ETH of netif_pcap.c: the clock steps once, then must stay  *
+ *              locked through path jitter with its oscillator off by 40 ppm, keep *
+ *              the RTC on UTC without breaking the us timestamps, and hold its    *
+ *              rate while the master goes quiet.                                  *
+ ***********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "stm32f439xx.h"
+
+// ptp.c reads the prescaler and calibration from this register block instead of the peripheral
+static RTC_TypeDef rtcRegs;
+#undef RTC
+#define RTC (&rtcRegs)
+
+// timestamp.c counts cycles here, which TEST_step() drives from the virtual clock
+static DWT_Type dwtRegs;
+static CoreDebug_Type coreDebugRegs;
+static uint32_t corePrimask;
+#undef DWT
+#define DWT                 (&dwtRegs)
+#undef CoreDebug
+#define CoreDebug           (&coreDebugRegs)
+#define __get_PRIMASK()     (corePrimask)
+#define __set_PRIMASK(v)    (corePrimask = (v))
+#define __disable_irq()     (corePrimask = 1)
+
+#define CORE_HZ             168000000U
+uint32_t SystemCoreClock = CORE_HZ;
+
+#include "ptp.c"
+#include "timestamp.c"
+#include "netif_pcap.h"
+
+#define MASTER_EPOCH_NS     (1760000000LL * NETIF_NS_PER_SEC)   // Master's TAI when the run starts
+#define MASTER_MAC          { 0x02, 0x00, 0x00, 0x00, 0x00, 0x10 }
+#define MASTER_IP           NET_IP(192, 168, 1, 10)
+#define PATH_DELAY_NS       50000
+#define PATH_JITTER_NS      200         // Each event message is late or early by up to this
+#define OSC_PPB             40000       // The board's ETH clock runs fast by this
+#define RTC_TICKS           8192        // RTC sub-second ticks, PREDIV_S + 1
+#define RTC_DRIFT_PPB       (-15000)    // The LSE runs slow by this
+#define RTC_START_ERROR_NS  (46800LL * NETIF_NS_PER_SEC + 123456789)     // Set back over half a day
+#define HZ_PPM              150         // One RTC tick in a second's rate sample, and some drift
+#define LOCK_SECS           1200
+#define QUIET_SECS          10
+#define EVENTS              64
+
+static const uint8_t masterMac[6] = MASTER_MAC;
+static const uint8_t masterIdentity[8] = { 0x02, 0x00, 0x00, 0xFF, 0xFE, 0x00, 0x00, 0x10 };
+
+/*
+ * Simulated RTC in ns of UTC, drifting by RTC_DRIFT_PPB less whatever
+ * RTC_calibrate() has applied, quantised the way CALR is
+ */
+static struct {
+    int64_t base;                       // Reading at baseAt
+    uint64_t baseAt;                    // Virtual time of the last rebase
+    int32_t calibration;                // ppb actually applied
+    int64_t snapshot;
+} rtc;
+
+static int64_t TEST_rtcNow(void) {
+    int64_t elapsed = (int64_t)(NETIF_pcapTime() - rtc.baseAt);
+    return rtc.base + elapsed + elapsed * (RTC_DRIFT_PPB + rtc.calibration) / NETIF_NS_PER_SEC;
+}
+
+static void TEST_rtcRebase(void) {
+    rtc.base = TEST_rtcNow();
+    rtc.baseAt = NETIF_pcapTime();
+}
+
+void RTC_snapshot(RTC_Snapshot *snap) {
+    rtc.snapshot = TEST_rtcNow();
+}
+
+uint64_t RTC_microsOfDay(const RTC_Snapshot *snap) {
+    int64_t ns = rtc.snapshot % (86400LL * NETIF_NS_PER_SEC);
+    int64_t ticks = ns % NETIF_NS_PER_SEC * RTC_TICKS / NETIF_NS_PER_SEC;
+    return (uint64_t)(ns / NETIF_NS_PER_SEC * 1000000 + ticks * 1000000 / RTC_TICKS);
+}
+
+void RTC_decode(const RTC_Snapshot *snap, ts *ts) {
+    CAL_fromEpoch32((CAL_Epoch32)(rtc.snapshot / NETIF_NS_PER_SEC), &CAL_zones[CAL_ZONE_UTC], ts, NULL);
+    ts->subsecs = (uint16_t)(rtc.snapshot % NETIF_NS_PER_SEC * RTC_TICKS / NETIF_NS_PER_SEC);
+}
+
+// Initialisation mode restarts the second, the sub-seconds are not loaded
+void RTC_setTime(ts *ts) {
+    CAL_Epoch64 epoch = CAL_toEpoch64(ts, &CAL_zones[CAL_ZONE_UTC], RTC_TICKS);
+    rtc.base = (int64_t)CAL_EPOCH64_SECS(epoch) * NETIF_NS_PER_SEC;
+    rtc.baseAt = NETIF_pcapTime();
+}
+
+void RTC_shift(int32_t ticks) {
+    TEST_rtcRebase();
+    rtc.base += (int64_t)ticks * NETIF_NS_PER_SEC / RTC_TICKS;
+}
+
+void RTC_calibrate(int32_t ppb) {
+    int32_t pulses = (int32_t)(((int64_t)ppb << 20) / NETIF_NS_PER_SEC);
+    TEST_rtcRebase();
+    rtc.calibration = (int32_t)((int64_t)pulses * NETIF_NS_PER_SEC / (1 << 20));
+}
+
+// Frames on their way to the board, each due at a virtual time
+static struct {
+    uint64_t at;
+    uint16_t length;
+    uint8_t frame[128];
+} events[EVENTS];
+static uint32_t eventCount;
+
+static uint16_t syncSequence;
+static uint16_t announceSequence;
+static uint32_t delayReqsSeen;
+
+static int64_t TEST_masterNow(uint64_t at) {
+    return MASTER_EPOCH_NS + (int64_t)at;
+}
+
+static int32_t TEST_jitter(void) {
+    return rand() % (2 * PATH_JITTER_NS + 1) - PATH_JITTER_NS;
+}
+
+static void TEST_put16(uint8_t *p, uint16_t value) {
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)value;
+}
+
+static void TEST_put32(uint8_t *p, uint32_t value) {
+    TEST_put16(p, (uint16_t)(value >> 16));
+    TEST_put16(p + 2, (uint16_t)value);
+}
+
+static void TEST_putTimestamp(uint8_t *p, int64_t ns) {
+    int64_t secs = ns / NETIF_NS_PER_SEC;
+    TEST_put16(p, (uint16_t)(secs >> 32));
+    TEST_put32(p + 2, (uint32_t)secs);
+    TEST_put32(p + 6, (uint32_t)(ns % NETIF_NS_PER_SEC));
+}
+
+// Wraps a PTP message in Ethernet, IPv4 and UDP from the master and queues it for at
+static void TEST_queue(uint64_t at, uint16_t port, const uint8_t *message, uint16_t size) {
+    TEST_ASSERT(eventCount < EVENTS);
+    uint8_t *frame = events[eventCount].frame;
+    memset(frame, 0, sizeof(events[eventCount].frame));
+    events[eventCount].at = at;
+    events[eventCount].length = (uint16_t)(14 + 20 + 8 + size);
+
+    static const uint8_t groupMac[6] = { 0x01, 0x00, 0x5E, 0x00, 0x01, 0x81 };
+    memcpy(&frame[0], groupMac, 6);
+    memcpy(&frame[6], masterMac, 6);
+    TEST_put16(&frame[12], 0x0800);
+
+    uint8_t *ip = &frame[14];
+    ip[0] = 0x45;
+    TEST_put16(&ip[2], (uint16_t)(20 + 8 + size));
+    ip[8] = 1;
+    ip[9] = 17;
+    TEST_put32(&ip[12], MASTER_IP);
+    TEST_put32(&ip[16], PTP_GROUP);
+
+    uint8_t *udp = ip + 20;
+    TEST_put16(&udp[0], port);
+    TEST_put16(&udp[2], port);
+    TEST_put16(&udp[4], (uint16_t)(8 + size));
+    memcpy(udp + 8, message, size);
+
+    NETIF_pcapChecksum(frame, events[eventCount].length);
+    eventCount++;
+}
+
+static void TEST_header(uint8_t *message, uint8_t type, uint16_t size, uint16_t sequence, uint16_t flags) {
+    memset(message, 0, size);
+    message[PTP_TYPE] = type;
+    message[PTP_VERSION_FIELD] = PTP_VERSION;
+    TEST_put16(&message[PTP_LENGTH], size);
+    TEST_put16(&message[PTP_FLAGS], flags);
+    memcpy(&message[PTP_SOURCE], masterIdentity, sizeof(masterIdentity));
+    message[PTP_SOURCE + 9] = 1;
+    TEST_put16(&message[PTP_SEQUENCE], sequence);
+}
+
+// Two-step Sync, the Follow_Up carrying when it left
+static void TEST_masterSync(void) {
+    uint64_t now = NETIF_pcapTime();
+    uint8_t message[PTP_SYNC_SIZE];
+
+    TEST_header(message, PTP_SYNC, PTP_SYNC_SIZE, ++syncSequence, 0x0200);
+    TEST_queue(now + PATH_DELAY_NS + TEST_jitter(), PTP_EVENT_PORT, message, PTP_SYNC_SIZE);
+    TEST_header(message, PTP_FOLLOW_UP, PTP_SYNC_SIZE, syncSequence, 0);
+    TEST_putTimestamp(&message[PTP_HEADER], TEST_masterNow(now));
+    TEST_queue(now + PATH_DELAY_NS + 100000, PTP_GENERAL_PORT, message, PTP_SYNC_SIZE);
+}
+
+// Grandmaster on GPS, PTP timescale, UTC offset 37 s valid
+static void TEST_masterAnnounce(void) {
+    uint8_t message[PTP_ANNOUNCE_SIZE];
+
+    TEST_header(message, PTP_ANNOUNCE, PTP_ANNOUNCE_SIZE, ++announceSequence, 0x000C);
+    TEST_put16(&message[44], PTP_UTC_OFFSET_DEFAULT);
+    message[47] = 128;
+    message[48] = 6;
+    message[49] = 0x21;
+    TEST_put16(&message[50], 0x4E5D);
+    message[52] = 128;
+    memcpy(&message[53], masterIdentity, sizeof(masterIdentity));
+    message[63] = 0x20;
+    TEST_queue(NETIF_pcapTime() + PATH_DELAY_NS, PTP_GENERAL_PORT, message, PTP_ANNOUNCE_SIZE);
+}
+
+// The master's side of the link: answers each Delay_Req with when it arrived
+static void TEST_masterPeer(const uint8_t *frame, uint16_t length) {
+    if (length < 14 + 20 + 8 + PTP_SYNC_SIZE || frame[12] != 0x08 || frame[14 + 9] != 17) {
+        return;
+    }
+    const uint8_t *udp = frame + 14 + 20;
+    const uint8_t *request = udp + 8;
+    if ((udp[2] << 8 | udp[3]) != PTP_EVENT_PORT || (request[PTP_TYPE] & 0xF) != PTP_DELAY_REQ) {
+        return;
+    }
+    delayReqsSeen++;
+
+    uint64_t arrived = NETIF_pcapTime() + PATH_DELAY_NS + TEST_jitter();
+    uint8_t message[PTP_DELAY_RESP_SIZE];
+    TEST_header(message, PTP_DELAY_RESP, PTP_DELAY_RESP_SIZE,
+                (uint16_t)(request[PTP_SEQUENCE] << 8 | request[PTP_SEQUENCE + 1]), 0);
+    TEST_putTimestamp(&message[PTP_HEADER], TEST_masterNow(arrived));
+    memcpy(&message[PTP_REQUESTER], &request[PTP_SOURCE], PTP_PORT_IDENTITY);
+    TEST_queue(arrived + 50000, PTP_GENERAL_PORT, message, PTP_DELAY_RESP_SIZE);
+}
+
+static uint32_t usBackwards;           // TIMESTAMP_us() readings earlier than the one before
+
+// One pass of the main loop
+static void TEST_step(void) {
+    static uint64_t lastUs;
+
+    dwtRegs.CYCCNT = (uint32_t)(NETIF_pcapTime() * (CORE_HZ / 1000000) / 1000);
+    NETIF_process();
+    NET_process();
+    PTP_process();
+    NETIF_process();
+    TIMESTAMP_discipline();
+
+    uint64_t us = TIMESTAMP_us();
+    usBackwards += us < lastUs;
+    lastUs = us;
+}
+
+// Injects every frame due by until in order, moving the virtual clock to each
+static void TEST_deliver(uint64_t until) {
+    for (;;) {
+        int32_t next = -1;
+        for (uint32_t i = 0; i < eventCount; i++) {
+            if (events[i].at <= until && (next < 0 || events[i].at < events[next].at)) {
+                next = (int32_t)i;
+            }
+        }
+        if (next < 0) {
+            break;
+        }
+        if (events[next].at > NETIF_pcapTime()) {
+            NETIF_pcapAdvanceNs((uint32_t)(events[next].at - NETIF_pcapTime()));
+        }
+        uint8_t frame[sizeof(events[next].frame)];
+        uint16_t length = events[next].length;
+        memcpy(frame, events[next].frame, length);
+        events[next] = events[--eventCount];
+        NETIF_pcapInject(frame, length);
+        TEST_step();
+    }
+    if (until > NETIF_pcapTime()) {
+        NETIF_pcapAdvanceNs((uint32_t)(until - NETIF_pcapTime()));
+    }
+}
+
+// Board clock minus the master's, ns
+static int64_t TEST_offset(void) {
+    return NETIF_clockNow() - TEST_masterNow(NETIF_pcapTime());
+}
+
+// RTC minus UTC, ns
+static int64_t TEST_rtcError(void) {
+    return TEST_rtcNow() - (TEST_masterNow(NETIF_pcapTime()) - PTP_UTC_OFFSET_DEFAULT * NETIF_NS_PER_SEC);
+}
+
+static int64_t TEST_abs(int64_t value) {
+    return value < 0 ? -value : value;
+}
+
+typedef struct {
+    int64_t worstOffset;                // Checked once a second
+    int64_t worstRtc;
+    int64_t worstHz;                    // Core clock as the timestamps measured it against the RTC
+} TEST_Worst;
+
+/*
+ * Runs the main loop a millisecond at a time for secs seconds, the master
+ * sending a Sync each second and an Announce half way between while talking.
+ * Worst errors are kept from second from on.
+ */
+static void TEST_run(uint32_t secs, uint8_t talking, uint32_t from, TEST_Worst *worst) {
+    for (uint32_t ms = 0; ms < secs * 1000; ms++) {
+        if (talking && ms % 1000 == 0) {
+            TEST_masterSync();
+        }
+        if (talking && ms % 1000 == 500) {
+            TEST_masterAnnounce();
+        }
+        TEST_deliver(NETIF_pcapTime() + 1000000);
+        TEST_step();
+
+        if (ms % 1000 == 999 && ms / 1000 >= from) {
+            int64_t offset = TEST_abs(TEST_offset());
+            int64_t rtcError = TEST_abs(TEST_rtcError());
+            worst->worstOffset = offset > worst->worstOffset ? offset : worst->worstOffset;
+            worst->worstRtc = rtcError > worst->worstRtc ? rtcError : worst->worstRtc;
+
+            TIMESTAMP_Stats stampStats;
+            TIMESTAMP_getStats(&stampStats);
+            int64_t hzError = TEST_abs((int64_t)stampStats.hz - CORE_HZ);
+            worst->worstHz = hzError > worst->worstHz ? hzError : worst->worstHz;
+        }
+    }
+}
+
+/*
+ * From hours out, the clock steps once and then slews: for the second half
+ * of the run it stays within PTP_LOCKED_NS with the rate correction cancelling
+ * the oscillator, and the RTC stays within its shift threshold of UTC.
+ */
+static void TEST_lock(void) {
+    TEST_Worst worst = { 0 };
+    PTP_Stats stats;
+    NETIF_Stats netifStats;
+    TIMESTAMP_Stats stampStats;
+    uint64_t startUs = TIMESTAMP_us();
+    uint64_t startNs = NETIF_pcapTime();
+
+    TEST_run(LOCK_SECS, 1, LOCK_SECS / 2, &worst);
+    PTP_getStats(&stats);
+    NETIF_getStats(&netifStats);
+    TIMESTAMP_getStats(&stampStats);
+
+    TEST_ASSERT_EQ(stats.state, PTP_SLAVE);
+    TEST_ASSERT(memcmp(stats.master, masterIdentity, sizeof(masterIdentity)) == 0);
+    TEST_ASSERT_EQ(stats.utcOffset, PTP_UTC_OFFSET_DEFAULT);
+    TEST_ASSERT_EQ(stats.steps, 1);
+    TEST_ASSERT(worst.worstOffset < PTP_LOCKED_NS);
+    TEST_ASSERT(TEST_abs(stats.ppb + OSC_PPB) < 500);
+    TEST_ASSERT(TEST_abs(stats.delay - PATH_DELAY_NS) < PATH_JITTER_NS);
+
+    TEST_ASSERT_EQ(stats.syncs, LOCK_SECS - 1);         // The last Follow_Up is still on its way
+    TEST_ASSERT_EQ(stats.noStamp, 0);
+    TEST_ASSERT(stats.delayReqs >= LOCK_SECS * 1000 / PTP_DELAY_REQ_MS - 1);
+    TEST_ASSERT_EQ(stats.delayReqs, delayReqsSeen);
+    TEST_ASSERT(stats.delayResps + 1 >= stats.delayReqs);
+    TEST_ASSERT_EQ(netifStats.txStamped, stats.delayReqs);
+
+    // One set from hours out, shifts for the rest, and the calibration cancels the LSE
+    TEST_ASSERT_EQ(stats.rtcSets, 1);
+    TEST_ASSERT(stats.rtcShifts > 0);
+    TEST_ASSERT(worst.worstRtc <= (PTP_RTC_SHIFT_TICKS + 1) * NETIF_NS_PER_SEC / RTC_TICKS);
+    TEST_ASSERT(TEST_abs(stats.rtcPpb + RTC_DRIFT_PPB) < 2000);
+
+    // The us clock runs on through the RTC being set back, and follows the shifts after
+    int64_t stampError = (int64_t)(TIMESTAMP_us() - startUs) - (int64_t)(NETIF_pcapTime() - startNs) / 1000;
+    TEST_ASSERT_EQ(usBackwards, 0);
+    TEST_ASSERT_EQ(stampStats.steps, 0);
+    TEST_ASSERT_EQ(stampStats.rejects, 0);
+    TEST_ASSERT(TEST_abs(stampError) < 2000);
+    TEST_ASSERT(worst.worstHz < CORE_HZ / 1000000 * HZ_PPM);
+
+    printf("locked: worst offset %lld ns, delay %lld ns, %d ppb; RTC worst %lld ns, %d ppb, %u shifts; "
+           "us clock %lld us out, rate %lld Hz out\n", (long long)worst.worstOffset, (long long)stats.delay,
+           (int)stats.ppb, (long long)worst.worstRtc, (int)stats.rtcPpb, (unsigned)stats.rtcShifts,
+           (long long)stampError, (long long)worst.worstHz);
+}
+
+/*
+ * A master that goes quiet is dropped after PTP_ANNOUNCE_TIMEOUT_MS, the
+ * clock coasting on its last rate, and taken up again without a step
+ */
+static void TEST_holdover(void) {
+    TEST_Worst worst = { 0 };
+    PTP_Stats stats;
+
+    TEST_run(QUIET_SECS, 0, 0, &worst);
+    PTP_getStats(&stats);
+    TEST_ASSERT_EQ(stats.state, PTP_LISTENING);
+    TEST_ASSERT_EQ(stats.timeouts, 1);
+    TEST_ASSERT(TEST_abs(stats.ppb + OSC_PPB) < 500);
+    TEST_ASSERT(worst.worstOffset < 10 * PTP_LOCKED_NS);
+    TEST_ASSERT_EQ(PTP_nextPoll(), IDLE_NEVER);
+
+    uint32_t syncs = stats.syncs;
+    worst = (TEST_Worst){ 0 };
+    TEST_run(60, 1, 30, &worst);
+    PTP_getStats(&stats);
+    TEST_ASSERT_EQ(stats.state, PTP_SLAVE);
+    TEST_ASSERT_EQ(stats.steps, 1);
+    TEST_ASSERT_EQ(stats.masterChanges, 2);
+    TEST_ASSERT(stats.syncs > syncs);
+    TEST_ASSERT(worst.worstOffset < PTP_LOCKED_NS);
+
+    printf("holdover: %u s quiet, worst offset after %lld ns\n", QUIET_SECS, (long long)worst.worstOffset);
+}
+
+int main(void) {
+    srand(1);
+    rtcRegs.PRER = 3U << RTC_PRER_PREDIV_A_Pos | (RTC_TICKS - 1);
+    rtc.base = MASTER_EPOCH_NS - PTP_UTC_OFFSET_DEFAULT * NETIF_NS_PER_SEC + RTC_START_ERROR_NS;
+
+    TIMESTAMP_init();
+    NETIF_init(NULL);
+    NET_init(NET_IP_DEFAULT, NET_NETMASK_DEFAULT, NET_GATEWAY_DEFAULT);
+    NETIF_pcapSetDrift(OSC_PPB);
+    NETIF_pcapSetPeer(TEST_masterPeer);
+    TEST_ASSERT_EQ(PTP_init(), 0);
+
+    TEST_lock();
+    TEST_holdover();
+    return TEST_result("ptp_test");
+}
\ No newline at end of file
@@ -0,0 +1,226 @@
+/***********************************************************************************
+ * @file        rtc_test.c                                                         *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  TEST                                                               *
+ * @brief       Host test of the RTC snapshot decode against every time of day     *
+ *              and date the calendar holds, the prescaler solver against a brute  *
+ *              force search, and a benchmark of RTC_getTime() against the         *
+ *              six-TR-read path it replaced.                                      *
+ ***********************************************************************************/
+
+#include "test.h"
+#include "stm32f439xx.h"
+
+// rtc.c runs against this register block instead of the peripheral
+static RTC_TypeDef rtcRegs;
+#undef RTC
+#define RTC (&rtcRegs)
+
+#include "rtc.c"
+
+#define BENCH_CALLS     10000000U
+#define PRESCALER_HZ    200000U         // Every RTCCLK up to this is solved
+
+static uint32_t TEST_bcd(uint32_t value) {
+    return (value / 10) << 4 | (value % 10);
+}
+
+static uint32_t TEST_tr(uint32_t hours, uint32_t mins, uint32_t secs) {
+    return TEST_bcd(hours) << RTC_TR_HU_Pos | TEST_bcd(mins) << RTC_TR_MNU_Pos | TEST_bcd(secs);
+}
+
+static uint32_t TEST_dr(uint32_t year, uint32_t month, uint32_t date, uint32_t weekday) {
+    return TEST_bcd(year % 100) << RTC_DR_YU_Pos | (weekday + 1) << RTC_DR_WDU_Pos
+         | TEST_bcd(month) << RTC_DR_MU_Pos | TEST_bcd(date);
+}
+
+// RTC_getTime() before the snapshot: six TR reads, RSF spin, DR read only to unlock
+static void TEST_oldGetTime(ts *ts) {
+    while ((RTC->ISR & RTC_ISR_RSF) == 0);
+
+    uint8_t ht = (RTC->TR & RTC_TR_HT) >> RTC_TR_HT_Pos;
+    uint8_t hu = (RTC->TR & RTC_TR_HU) >> RTC_TR_HU_Pos;
+    uint8_t mnt = (RTC->TR & RTC_TR_MNT) >> RTC_TR_MNT_Pos;
+    uint8_t mnu = (RTC->TR & RTC_TR_MNU) >> RTC_TR_MNU_Pos;
+    uint8_t st = (RTC->TR & RTC_TR_ST) >> RTC_TR_ST_Pos;
+    uint8_t su = (RTC->TR & RTC_TR_SU) >> RTC_TR_SU_Pos;
+
+    ts->hours = ht * 10 + hu;
+    ts->mins = mnt * 10 + mnu;
+    ts->secs = st * 10 + su;
+
+    (void)(RTC->DR);
+}
+
+static void TEST_timesOfDay(void) {
+    RTC_Snapshot snap = { .ssr = 0, .dr = TEST_dr(24, 1, 1, Monday) };
+
+    for (uint32_t secs = 0; secs < 86400; secs++) {
+        ts time;
+        snap.tr = TEST_tr(secs / 3600, secs / 60 % 60, secs % 60);
+        RTC_decode(&snap, &time);
+        TEST_ASSERT_EQ(time.hours, secs / 3600);
+        TEST_ASSERT_EQ(time.mins, secs / 60 % 60);
+        TEST_ASSERT_EQ(time.secs, secs % 60);
+    }
+}
+
+static void TEST_dates(void) {
+    static const uint8_t monthDays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    RTC_Snapshot snap = { .ssr = 0, .tr = TEST_tr(23, 59, 59) };
+    uint32_t weekday = Saturday;        // 2000-01-01
+
+    for (uint32_t year = 2000; year < 2100; year++) {
+        for (uint32_t month = 1; month <= 12; month++) {
+            uint32_t days = monthDays[month - 1] + (month == 2 && year % 4 == 0);
+            for (uint32_t date = 1; date <= days; date++) {
+                ts time;
+                snap.dr = TEST_dr(year, month, date, weekday);
+                RTC_decode(&snap, &time);
+                TEST_ASSERT_EQ(time.year, year);
+                TEST_ASSERT_EQ(time.month, month);
+                TEST_ASSERT_EQ(time.date, date);
+                TEST_ASSERT_EQ(time.day, weekday);
+                weekday = (weekday + 1) % 7;
+            }
+        }
+    }
+}
+
+static void TEST_subsecs(void) {
+    RTC_Snapshot snap = { .tr = 0, .dr = TEST_dr(24, 1, 1, Monday) };
+    ts time;
+
+    rtcRegs.PRER = 127U << RTC_PRER_PREDIV_A_Pos | 255U;
+    for (uint32_t ssr = 0; ssr <= 255; ssr++) {
+        snap.ssr = ssr;
+        RTC_decode(&snap, &time);
+        TEST_ASSERT_EQ(time.subsecs, 255 - ssr);
+    }
+
+    // After a negative shift SSR sits above PREDIV_S until the next second
+    snap.ssr = 300;
+    RTC_decode(&snap, &time);
+    TEST_ASSERT_EQ(time.subsecs, 0);
+}
+
+static void TEST_packed(void) {
+    rtcRegs.ISR = RTC_ISR_RSF;
+    rtcRegs.CR = 0;
+    rtcRegs.TR = TEST_tr(13, 37, 42);
+    rtcRegs.DR = TEST_dr(2063, 12, 31, Monday);
+
+    uint32_t packed = RTC_getPacked();
+    TEST_ASSERT_EQ(packed >> RTC_PACKED_YEAR_Pos, 63);
+    TEST_ASSERT_EQ(packed >> RTC_PACKED_MONTH_Pos & 0xF, 12);
+    TEST_ASSERT_EQ(packed >> RTC_PACKED_DATE_Pos & 0x1F, 31);
+    TEST_ASSERT_EQ(packed >> RTC_PACKED_HOURS_Pos & 0x1F, 13);
+    TEST_ASSERT_EQ(packed >> RTC_PACKED_MINS_Pos & 0x3F, 37);
+    TEST_ASSERT_EQ(packed >> RTC_PACKED_SECS_Pos & 0x3F, 42);
+}
+
+/*
+ * The pair with the largest async divider whose tick is no coarser than
+ * maxTickNs, else the finest tick, found by trying every divider
+ */
+static int TEST_bestPrescaler(uint32_t lseHz, uint32_t maxTickNs, RTC_Prescaler *pre) {
+    int found = -1;
+
+    for (uint32_t a = 1; a <= 128; a++) {
+        uint32_t s = lseHz / a;
+        if (s * a != lseHz || s > 32768) {
+            continue;
+        }
+        if (found != 0 || (double)a * 1e9 / lseHz <= (double)maxTickNs) {
+            pre->asyncDiv = (uint8_t)(a - 1);
+            pre->syncDiv = (uint16_t)(s - 1);
+            found = 0;
+        }
+    }
+    return found;
+}
+
+static void TEST_prescaler(void) {
+    static const uint32_t ticksNs[] = { 0, 30517, 30518, 31250, 125000, 1000000, 3906250, UINT32_MAX };
+
+    for (uint32_t hz = 1; hz <= PRESCALER_HZ; hz++) {
+        for (uint32_t i = 0; i < sizeof(ticksNs) / sizeof(ticksNs[0]); i++) {
+            RTC_Prescaler got = { 0 };
+            RTC_Prescaler want = { 0 };
+            int found = RTC_solvePrescaler(hz, ticksNs[i], &got);
+
+            TEST_ASSERT_EQ(found, TEST_bestPrescaler(hz, ticksNs[i], &want));
+            if (found == 0) {
+                TEST_ASSERT_EQ(got.asyncDiv, want.asyncDiv);
+                TEST_ASSERT_EQ(got.syncDiv, want.syncDiv);
+            }
+        }
+    }
+
+    // The 32.768 kHz crystal: 1/32768 s at the finest, 1/8192 s within RTC_TICK_NS, 1/256 s at the coarsest
+    RTC_Prescaler pre = { 0 };
+    TEST_ASSERT_EQ(RTC_solvePrescaler(RTC_LSE_HZ, 0, &pre), 0);
+    TEST_ASSERT_EQ(pre.asyncDiv, 0);
+    TEST_ASSERT_EQ(pre.syncDiv, 32767);
+    TEST_ASSERT_EQ(RTC_solvePrescaler(RTC_LSE_HZ, RTC_TICK_NS, &pre), 0);
+    TEST_ASSERT_EQ(pre.asyncDiv, 3);
+    TEST_ASSERT_EQ(pre.syncDiv, 8191);
+    TEST_ASSERT_EQ(RTC_solvePrescaler(RTC_LSE_HZ, UINT32_MAX, &pre), 0);
+    TEST_ASSERT_EQ(pre.asyncDiv, 127);
+    TEST_ASSERT_EQ(pre.syncDiv, 255);
+
+    // A prime above 32768 has no 1 Hz division
+    TEST_ASSERT_EQ(RTC_solvePrescaler(32771, 0, &pre), -1);
+
+    RTC_writePrescaler(&(RTC_Prescaler){ .asyncDiv = 31, .syncDiv = 1023 });
+    TEST_ASSERT_EQ(rtcRegs.PRER, 31U << RTC_PRER_PREDIV_A_Pos | 1023U);
+}
+
+/*
+ * On the host a register read is a cache hit, so this measures only the
+ * decode: the new path does more of it, for date and sub-seconds the old one
+ * never produced. On the target every read is an APB1 access with wait
+ * states and the old path's extra TR reads dominate; the "prof" shell
+ * command shows RTC_GET_TIME cycles there.
+ */
+static void TEST_bench(void) {
+    ts oldTime = { 0 };
+    ts newTime = { 0 };
+
+    rtcRegs.ISR = RTC_ISR_RSF;
+    rtcRegs.CR = 0;
+    rtcRegs.PRER = 127U << RTC_PRER_PREDIV_A_Pos | 255U;
+    rtcRegs.TR = TEST_tr(21, 15, 9);
+    rtcRegs.DR = TEST_dr(2025, 10, 17, Friday);
+
+    uint64_t start = TEST_nowNs();
+    for (uint32_t i = 0; i < BENCH_CALLS; i++) {
+        TEST_oldGetTime(&oldTime);
+    }
+    uint64_t oldNs = TEST_nowNs() - start;
+
+    start = TEST_nowNs();
+    for (uint32_t i = 0; i < BENCH_CALLS; i++) {
+        RTC_getTime(&newTime);
+    }
+    uint64_t newNs = TEST_nowNs() - start;
+
+    TEST_ASSERT_EQ(oldTime.hours, newTime.hours);
+    TEST_ASSERT_EQ(oldTime.mins, newTime.mins);
+    TEST_ASSERT_EQ(oldTime.secs, newTime.secs);
+    TEST_ASSERT_EQ(newTime.year, 2025);
+
+    printf("old RTC_getTime  %6.2f ns/call, 8 register reads, time only\n", (double)oldNs / BENCH_CALLS);
+    printf("RTC_getTime      %6.2f ns/call, 6 register reads, time, date and subsecs\n",
+           (double)newNs / BENCH_CALLS);
+}
+
+int main(void) {
+    TEST_timesOfDay();
+    TEST_dates();
+    TEST_subsecs();
+    TEST_packed();
+    TEST_prescaler();
+    TEST_bench();
+    return TEST_result("rtc_test");
+}
\ No newline at end of file
@@ -0,0 +1,216 @@
+/***********************************************************************************
+ * @file        serial_test.c                                                      *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  TEST                                                               *
+ * @brief       Host test of the USART3 baud rate maths: SERIAL_computeBrr() at    *
+ *              every standard rate with both oversamplings, and the setting       *
+ *              SERIAL_setBaud() picks and programs at the board's PCLK1. Also     *
+ *              the transmit ring's reservations with a preempting writer.         *
+ ***********************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "stm32f439xx.h"
+
+// serial.c runs against these register blocks instead of the peripherals
+static USART_TypeDef usart3;
+static DMA_TypeDef dma1;
+static DMA_Stream_TypeDef dmaStream1;
+static DMA_Stream_TypeDef dmaStream3;
+static RCC_TypeDef rcc;
+#undef USART3
+#undef DMA1
+#undef DMA1_Stream1
+#undef DMA1_Stream3
+#undef RCC
+#define USART3          (&usart3)
+#define DMA1            (&dma1)
+#define DMA1_Stream1    (&dmaStream1)
+#define DMA1_Stream3    (&dmaStream3)
+#define RCC             (&rcc)
+
+// Thread mode with a PRIMASK the masking can flip, the core intrinsics don't exist here
+static uint32_t primask;
+#define __get_PRIMASK()     (primask)
+#define __set_PRIMASK(v)    (primask = (v))
+#define __disable_irq()     (primask = 1)
+#define __enable_irq()      (primask = 0)
+#define __get_IPSR()        (0U)
+#undef __WFI
+#define __WFI()
+
+#include "serial.c"
+
+#define PCLK1_HZ        42000000U       // 168 MHz HCLK over APB1 /4, as SystemClock_Config() sets
+
+uint32_t SystemCoreClock = 168000000U;
+const uint8_t APBPrescTable[8] = { 0, 0, 0, 0, 1, 2, 3, 4 };
+
+uint32_t HAL_GetTick(void) {
+    return 0;
+}
+
+static const uint32_t rates[] = {
+    300, 600, 1200, 2400, 4800, 9600, 14400, 19200, 38400, 57600, 115200, 230400, 460800, 921600,
+    1000000, 1500000, 2000000, 2625000, 3000000, 4000000, 5250000, 6000000
+};
+
+// Size of the rate error in ppm of a BRR value, decoded the way the reference manual does
+static double TEST_errorPpm(uint32_t pclk, uint32_t baud, uint16_t brr, uint8_t over8) {
+    double unit = over8 ? 8.0 : 16.0;
+    double usartdiv = (brr >> 4) + (brr & 0xF) / unit;
+    double actual = pclk / (unit * usartdiv);
+    double ppm = (actual - baud) / baud * 1e6;
+    return ppm < 0 ? -ppm : ppm;
+}
+
+/*
+ * Every rate the divider can reach comes back as the nearest BRR, with its
+ * error reported to within rounding; the rest come back as 0
+ */
+static void TEST_computeBrr(void) {
+    for (uint32_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        for (uint8_t over8 = 0; over8 <= 1; over8++) {
+            uint32_t unit = over8 ? 8 : 16;
+            uint32_t units = (uint32_t)(((double)PCLK1_HZ / rates[i]) + 0.5);
+            int32_t error = INT32_MIN;
+            uint16_t brr = SERIAL_computeBrr(PCLK1_HZ, rates[i], over8, &error);
+
+            if (units / unit == 0 || units / unit > 0xFFF) {
+                TEST_ASSERT_EQ(brr, 0);
+                TEST_ASSERT_EQ(error, INT32_MIN);
+                continue;
+            }
+
+            TEST_ASSERT_EQ(brr >> 4, units / unit);
+            TEST_ASSERT_EQ(brr & 0xF, units % unit);
+            TEST_ASSERT(!over8 || (brr & 0x8) == 0);        // Bit 3 must stay clear with OVER8
+            TEST_ASSERT(abs(abs(error) - (int32_t)TEST_errorPpm(PCLK1_HZ, rates[i], brr, over8)) <= 1);
+
+            // Neither neighbouring divider gets closer
+            double best = TEST_errorPpm(PCLK1_HZ, rates[i], brr, over8);
+            uint16_t below = (uint16_t)((units - 1) / unit << 4 | (units - 1) % unit);
+            uint16_t above = (uint16_t)((units + 1) / unit << 4 | (units + 1) % unit);
+            TEST_ASSERT(units - 1 < unit || best <= TEST_errorPpm(PCLK1_HZ, rates[i], below, over8));
+            TEST_ASSERT(best <= TEST_errorPpm(PCLK1_HZ, rates[i], above, over8));
+        }
+    }
+
+    TEST_ASSERT_EQ(SERIAL_computeBrr(PCLK1_HZ, 0, 0, NULL), 0);
+    TEST_ASSERT_EQ(SERIAL_computeBrr(PCLK1_HZ, 115200, 0, NULL), 0x16D);     // 22.8125, RM0090's table
+}
+
+/*
+ * At 42 MHz everything from 1200 baud to 3 Mbaud is within tolerance, and
+ * 5.25 Mbaud with 8x oversampling. 300 and 600 need a divider past 12 bits,
+ * 4 Mbaud lands 4.5% off and 6 Mbaud is beyond PCLK1 / 8.
+ */
+static void TEST_setBaud(void) {
+    rcc.CFGR = RCC_CFGR_PPRE1_DIV4;
+    usart3.SR = USART_SR_TC;
+
+    for (uint32_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        uint32_t baud = rates[i];
+        uint8_t reachable = (baud >= 1200 && baud <= 3000000) || baud == 5250000;
+        int32_t error = 0;
+
+        TEST_ASSERT_EQ(SERIAL_checkBaud(baud, NULL), reachable ? 0 : -1);
+        if (!reachable) {
+            TEST_ASSERT_EQ(SERIAL_setBaud(baud, NULL), -1);
+            continue;
+        }
+
+        TEST_ASSERT_EQ(SERIAL_setBaud(baud, &error), 0);
+        TEST_ASSERT_EQ(SERIAL_getBaud(), baud);
+        TEST_ASSERT(abs(error) <= SERIAL_BAUD_TOLERANCE);
+        TEST_ASSERT(usart3.CR1 & USART_CR1_UE);
+
+        // 16x is kept unless 8x gets strictly closer
+        uint8_t over8 = (usart3.CR1 & USART_CR1_OVER8) != 0;
+        int32_t err16 = 0, err8 = 0;
+        uint16_t brr16 = SERIAL_computeBrr(PCLK1_HZ, baud, 0, &err16);
+        uint16_t brr8 = SERIAL_computeBrr(PCLK1_HZ, baud, 1, &err8);
+        uint8_t want8 = brr16 == 0 || (brr8 != 0 && abs(err8) < abs(err16));
+        TEST_ASSERT_EQ(over8, want8);
+        TEST_ASSERT_EQ(usart3.BRR, want8 ? brr8 : brr16);
+        TEST_ASSERT_EQ(error, want8 ? err8 : err16);
+    }
+
+    // A failed switch leaves the rate alone
+    TEST_ASSERT_EQ(SERIAL_setBaud(115200, NULL), 0);
+    TEST_ASSERT_EQ(SERIAL_setBaud(4000000, NULL), -1);
+    TEST_ASSERT_EQ(SERIAL_getBaud(), 115200);
+    TEST_ASSERT_EQ(usart3.BRR, 0x16D);
+}
+
+// Transfer complete on the TX stream
+static void TEST_txComplete(void) {
+    dma1.LISR = DMA_LISR_TCIF3;
+    SERIAL_txDmaIrq();
+    dma1.LISR = 0;
+}
+
+/*
+ * A write from an interrupt that lands while a thread write is copying goes
+ * in after it, and neither reaches the DMA until both copies are done
+ */
+static void TEST_writers(void) {
+    memset(&tx, 0, sizeof(tx));
+    tx.policy = SERIAL_DROP;
+
+    uint32_t at = SERIAL_reserve(5);
+    TEST_ASSERT_EQ(primask, 0);                             // Copies run unmasked
+    TEST_ASSERT_EQ(SERIAL_write((const uint8_t *)"irq", 3), 3);
+    TEST_ASSERT_EQ(tx.head, 0);
+    TEST_ASSERT_EQ(tx.sending, 0);
+    TEST_ASSERT_EQ(SERIAL_txFree(), SERIAL_TX_SIZE - 8);
+
+    SERIAL_fill(at, (const uint8_t *)"hello", 5);
+    TEST_ASSERT_EQ(tx.head, 8);
+    TEST_ASSERT_EQ(tx.sending, 8);
+    TEST_ASSERT_EQ(dmaStream3.NDTR, 8);
+    TEST_ASSERT(memcmp(txRing, "helloirq", 8) == 0);
+    TEST_ASSERT_EQ(tx.stats.written, 8);
+
+    TEST_txComplete();
+    TEST_ASSERT_EQ(tx.tail, 8);
+    TEST_ASSERT_EQ(tx.sending, 0);
+
+    // Filling the ring wraps the copy, and the DMA sends up to the end first
+    static uint8_t fill[SERIAL_TX_SIZE];
+    for (uint32_t i = 0; i < SERIAL_TX_SIZE; i++) {
+        fill[i] = (uint8_t)i;
+    }
+    TEST_ASSERT_EQ(SERIAL_offer(fill, SERIAL_TX_SIZE), SERIAL_TX_SIZE);
+    TEST_ASSERT_EQ(SERIAL_txFree(), 0);
+    TEST_ASSERT_EQ(SERIAL_write(fill, 1), 0);
+    TEST_ASSERT_EQ(tx.stats.dropped, 1);
+    TEST_ASSERT_EQ(tx.sending, SERIAL_TX_SIZE - 8);
+    TEST_ASSERT_EQ(txRing[7], (uint8_t)(SERIAL_TX_SIZE - 1));
+    TEST_ASSERT_EQ(txRing[8], 0);
+
+    TEST_txComplete();
+    TEST_ASSERT_EQ(tx.sending, 8);
+    TEST_txComplete();
+    TEST_ASSERT_EQ(tx.tail, tx.reserved);
+
+    // OVERWRITE drops queued bytes for the newest, but not from under a copy in progress
+    tx.policy = SERIAL_OVERWRITE;
+    TEST_ASSERT_EQ(SERIAL_offer(fill, 100), 100);           // In flight
+    TEST_ASSERT_EQ(SERIAL_offer(fill, SERIAL_TX_SIZE - 100), SERIAL_TX_SIZE - 100);
+    at = SERIAL_reserve(0);
+    TEST_ASSERT_EQ(SERIAL_write(fill, 10), 0);
+    SERIAL_fill(at, fill, 0);
+    TEST_ASSERT_EQ(SERIAL_write(fill, 10), 10);
+    TEST_ASSERT_EQ(tx.stats.overwritten, SERIAL_TX_SIZE - 100);
+    TEST_ASSERT_EQ(tx.reserved - tx.tail, 110);
+}
+
+int main(void) {
+    TEST_computeBrr();
+    TEST_setBaud();
+    TEST_writers();
+    return TEST_result("serial_test");
+}
\ No newline at end of file
@@ -0,0 +1,261 @@
+/***********************************************************************************
+ * @file        swtimer_test.c                                                     *
+ * @author      Lachie Keane                                                       *
+ * @addtogroup  TEST                                                               *
+ * @brief       Host test of the timer wheel on a simulated RTC: random timer      *
+ *              churn checked tick by tick, the wakeup interrupt path, tickless    *
+ *              suspend and resume, and the daily alarms.                          *
+ ***********************************************************************************/
+
+#include <stdlib.h>
+
+#include "test.h"
+#include "swtimer.h"
+
+#define CHURN_TIMERS    200
+#define CHURN_TICKS     400000U
+
+/*
+ * Simulated RTC. The wakeup reload is recorded so suspend and resume can be
+ * checked; a pending flag stands in for WUTF.
+ */
+static struct {
+    uint32_t reload;
+    uint8_t wakeupFlag;
+    uint8_t alarmFlags;
+    uint8_t alarmArmed[2];
+} rtc;
+
+void RTC_setWakeup(uint16_t reload) {
+    rtc.reload = reload;
+}
+
+void RTC_stopWakeup(void) {
+}
+
+uint8_t RTC_clearWakeup(void) {
+    uint8_t fired = rtc.wakeupFlag;
+    rtc.wakeupFlag = 0;
+    return fired;
+}
+
+void RTC_setAlarm(enum RTC_Alarm alarm, uint8_t hours, uint8_t mins, uint8_t secs) {
+    rtc.alarmArmed[alarm] = 1;
+}
+
+void RTC_stopAlarm(enum RTC_Alarm alarm) {
+    rtc.alarmArmed[alarm] = 0;
+}
+
+uint8_t RTC_clearAlarms(void) {
+    uint8_t fired = rtc.alarmFlags;
+    rtc.alarmFlags = 0;
+    return fired;
+}
+
+// One simulated wakeup interrupt
+static void TEST_tick(void) {
+    rtc.wakeupFlag = 1;
+    TIMER_wakeupIrq();
+}
+
+static Timer timers[CHURN_TIMERS];
+static uint32_t due[CHURN_TIMERS];
+static uint32_t fired;
+static uint32_t late;
+
+static uint32_t TEST_delay(void) {
+    switch (rand() % 4) {
+    case 0:
+        return 1 + rand() % TIMER_SLOTS;                // Level 0
+    case 1:
+        return 1 + rand() % 5000;                       // Levels 1 and 2
+    case 2:
+        return 1 + rand() % 300000;                     // Level 3
+    default:
+        return (1U << 24) + rand() % 100000;            // Beyond the wheel, parked and re-filed
+    }
+}
+
+static void TEST_churnCallback(Timer *timer) {
+    uint32_t i = (uint32_t)(timer - timers);
+
+    if (TIMER_now() != due[i]) {
+        late++;
+    }
+    fired++;
+
+    if (timer->period) {
+        due[i] += timer->period;
+    }
+    else if (rand() % 2) {
+        uint32_t delay = 1 + rand() % 200;
+        due[i] = TIMER_now() + delay;
+        TIMER_start(timer, delay, 0);
+    }
+}
+
+/*
+ * Every expiry must land on its exact tick, and TIMER_nextExpiry() must never
+ * promise more quiet ticks than the nearest running timer leaves.
+ */
+static void TEST_churn(void) {
+    uint32_t early = 0;
+
+    srand(3);
+    TIMER_init();
+    for (uint32_t i = 0; i < CHURN_TIMERS; i++) {
+        uint32_t delay = TEST_delay();
+        uint32_t period = i % 5 == 0 ? 1 + rand() % 10000 : 0;
+
+        timers[i].callback = TEST_churnCallback;
+        due[i] = delay;
+        TIMER_start(&timers[i], delay, period);
+    }
+
+    for (uint32_t tick = 0; tick < CHURN_TICKS; tick++) {
+        uint32_t next = TIMER_nextExpiry();
+        for (uint32_t i = 0; i < CHURN_TIMERS; i++) {
+            if (TIMER_isActive(&timers[i]) && due[i] - TIMER_now() < next) {
+                early++;
+            }
+        }
+
+        TEST_tick();
+        TIMER_process();
+
+        if (tick % 1000 == 0 && rand() % 10 == 0) {
+            TIMER_stop(&timers[rand() % CHURN_TIMERS]);
+        }
+    }
+
+    TEST_ASSERT_EQ(late, 0);
+    TEST_ASSERT_EQ(early, 0);
+    TEST_ASSERT(fired > CHURN_TIMERS);
+    for (uint32_t i = 0; i < CHURN_TIMERS; i++) {
+        TEST_ASSERT(!TIMER_isActive(&timers[i]) || (int32_t)(due[i] - TIMER_now()) > 0);
+    }
+}
+
+static uint32_t countFired;
+
+static void TEST_countCallback(Timer *timer) {
+    countFired++;
+}
+
+// Ticks counted in the interrupt are only applied, in order, by TIMER_process()
+static void TEST_irqPath(void) {
+    Timer timer = { .callback = TEST_countCallback };
+
+    TIMER_init();
+    TEST_ASSERT_EQ(rtc.reload, RTC_WAKEUP_HZ / TIMER_HZ - 1);
+
+    countFired = 0;
+    TIMER_start(&timer, 10, 10);
+    for (int i = 0; i < 35; i++) {
+        TEST_tick();
+    }
+    TEST_ASSERT_EQ(TIMER_now(), 0);
+    TEST_ASSERT_EQ(TIMER_nextExpiry(), 0);          // Work is waiting
+
+    TIMER_process();
+    TEST_ASSERT_EQ(TIMER_now(), 35);
+    TEST_ASSERT_EQ(countFired, 3);
+    TEST_ASSERT_EQ(TIMER_nextExpiry(), 5);
+
+    // A wakeup that is not ours counts nothing
+    TIMER_wakeupIrq();
+    TIMER_process();
+    TEST_ASSERT_EQ(TIMER_now(), 35);
+    TIMER_stop(&timer);
+}
+
+// Timers past the top level are parked at its end and re-filed until they are due
+static void TEST_longTimers(void) {
+    static const uint32_t delays[] = { (1U << 24) - 1, 1U << 24, (1U << 24) + 12345, (1U << 25) + 7 };
+    Timer longTimers[sizeof(delays) / sizeof(delays[0])];
+
+    TIMER_init();
+    countFired = 0;
+    for (uint32_t i = 0; i < sizeof(delays) / sizeof(delays[0]); i++) {
+        longTimers[i] = (Timer){ .callback = TEST_countCallback };
+        TIMER_start(&longTimers[i], delays[i], 0);
+    }
+
+    uint32_t now = 0;
+    for (uint32_t i = 0; i < sizeof(delays) / sizeof(delays[0]); i++) {
+        TIMER_advance(delays[i] - 1 - now);
+        TEST_ASSERT_EQ(countFired, i);
+        TEST_ASSERT(TIMER_nextExpiry() >= 1);
+        TIMER_advance(1);
+        TEST_ASSERT_EQ(countFired, i + 1);
+        now = delays[i];
+    }
+}
+
+static void TEST_suspend(void) {
+    Timer timer = { .callback = TEST_countCallback };
+
+    TIMER_init();
+    countFired = 0;
+    TIMER_start(&timer, 100, 0);
+
+    // Sleep through to each point the wheel needs attention, as the idle loop does
+    while (countFired == 0 && TIMER_now() < 100) {
+        uint32_t sleep = TIMER_nextExpiry();
+        TIMER_suspend(sleep);
+        TEST_ASSERT_EQ(rtc.reload, sleep * (RTC_WAKEUP_HZ / TIMER_HZ) - 1);
+
+        // The one long wakeup is not a tick; the sleeper reports what passed
+        TEST_tick();
+        TIMER_resume(sleep);
+        TEST_ASSERT_EQ(rtc.reload, RTC_WAKEUP_HZ / TIMER_HZ - 1);
+        TIMER_process();
+    }
+    TEST_ASSERT_EQ(TIMER_now(), 100);
+    TEST_ASSERT_EQ(countFired, 1);
+    TEST_ASSERT(!TIMER_isActive(&timer));
+    TEST_ASSERT_EQ(TIMER_nextExpiry(), TIMER_NEVER);
+}
+
+static uint32_t alarmFired[2];
+
+static void TEST_alarmA(void) {
+    alarmFired[RTC_ALARM_A]++;
+}
+
+static void TEST_alarmB(void) {
+    alarmFired[RTC_ALARM_B]++;
+}
+
+static void TEST_alarms(void) {
+    ts at = { .hours = 3, .mins = 0, .secs = 0 };
+
+    TIMER_init();
+    TIMER_setAlarm(RTC_ALARM_A, &at, TEST_alarmA);
+    TIMER_setAlarm(RTC_ALARM_B, &at, TEST_alarmB);
+    TEST_ASSERT(rtc.alarmArmed[RTC_ALARM_A] && rtc.alarmArmed[RTC_ALARM_B]);
+
+    rtc.alarmFlags = 1 << RTC_ALARM_B;
+    TIMER_alarmIrq();
+    TIMER_process();
+    TEST_ASSERT_EQ(alarmFired[RTC_ALARM_A], 0);
+    TEST_ASSERT_EQ(alarmFired[RTC_ALARM_B], 1);
+
+    TIMER_setAlarm(RTC_ALARM_B, &at, NULL);
+    TEST_ASSERT(!rtc.alarmArmed[RTC_ALARM_B]);
+    rtc.alarmFlags = 1 << RTC_ALARM_A | 1 << RTC_ALARM_B;
+    TIMER_alarmIrq();
+    TIMER_process();
+    TEST_ASSERT_EQ(alarmFired[RTC_ALARM_A], 1);
+    TEST_ASSERT_EQ(alarmFired[RTC_ALARM_B], 1);
+}
+
+int main(void) {
+    TEST_churn();
+    TEST_irqPath();
+    TEST_longTimers();
+    TEST_suspend();
+    TEST_alarms();
+    return TEST_result("swtimer_test");
+}
\ No newline at end of file
@@ -0,0 +1,51 @@
+#ifndef TEST
+#define TEST
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Minimal host test support. TEST_ASSERT() reports and counts a failure
+ * without stopping, so one run shows every broken case; main() returns
+ * TEST_result() for ctest. Each test is a single translation unit, so the
+ * counter can live here.
+ */
+static unsigned testFailures;
+
+#define TEST_ASSERT(cond)                                                       \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            testFailures++;                                                     \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);          \
+        }                                                                       \
+    } while (0)
+
+#define TEST_ASSERT_EQ(a, b)                                                    \
+    do {                                                                        \
+        long long test_a = (long long)(a);                                      \
+        long long test_b = (long long)(b);                                      \
+        if (test_a != test_b) {                                                 \
+            testFailures++;                                                     \
+            fprintf(stderr, "%s:%d: %s == %s (%lld != %lld)\n",                 \
+                    __FILE__, __LINE__, #a, #b, test_a, test_b);                \
+        }                                                                       \
+    } while (0)
+
+// Monotonic host time for the benchmarks
+static inline uint64_t TEST_nowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static inline int TEST_result(const char *name) {
+    if (testFailures > 0) {
+        printf("%s: %u failed\n", name, testFailures);
+        return 1;
+    }
+    printf("%s: passed\n", name);
+    return 0;
+}
+
+#endif
\ No newline at end of file
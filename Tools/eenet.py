@@ -0,0 +1,270 @@
+#!/usr/bin/env python3
+"""
+Host side of the EEPROM block service on UDP (see Core/Inc/eenet.h).
+
+    Tools/eenet.py 192.168.1.50 read 0x100 64
+    Tools/eenet.py 192.168.1.50 write 0x100 deadbeef
+    Tools/eenet.py 192.168.1.50 verify 0x100 @expected.bin
+    Tools/eenet.py 192.168.1.50 dump -o image.bin
+    Tools/eenet.py 192.168.1.50 flash image.bin
+
+Each datagram carries a batch of operations, which the board runs in one
+pass over the bus. flash reads the board's image first and only writes the
+32-byte pages that differ, many to a datagram, then verifies them.
+"""
+
+import argparse
+import socket
+import struct
+import sys
+import time
+
+PORT = 5050                             # EENET_PORT_DEFAULT
+READ = 1
+WRITE = 2
+VERIFY = 3
+
+OK = 0
+ERR_BUSY = 4
+MISMATCH = 6
+STATUS = {1: "malformed batch", 2: "out of range", 3: "reply too big", 4: "busy", 5: "device error",
+          6: "mismatch"}
+
+UDP_MAX = 1472                          # NET_UDP_MAX
+MAX_OPS = 32                            # EENET_MAX_OPS
+OP_HEADER = 5
+HEADER = 4
+EEPROM_SIZE = 4096
+PAGE = 32                               # EEPROM_WRITE_PAGE
+READ_CHUNK = UDP_MAX - HEADER - 1       # Largest read that fits a reply on its own
+WRITE_CHUNK = UDP_MAX - 2 - OP_HEADER   # Largest write or verify that fits a request on its own
+
+
+class EenetError(Exception):
+    pass
+
+
+def batches(ops):
+    """Splits (op, addr, len or data) tuples into batches that fit a request and its reply."""
+    batch, request, reply = [], 2, HEADER
+    for op in ops:
+        kind, _, arg = op
+        ask = OP_HEADER + (0 if kind == READ else len(arg))
+        answer = 1 + (arg if kind == READ else 0)
+        if batch and (len(batch) == MAX_OPS or request + ask > UDP_MAX or reply + answer > UDP_MAX):
+            yield batch
+            batch, request, reply = [], 2, HEADER
+        batch.append(op)
+        request += ask
+        reply += answer
+    if batch:
+        yield batch
+
+
+def split(addr, size, chunk):
+    """Yields (addr, len) pieces of a range, none crossing a multiple of chunk."""
+    end = addr + size
+    while addr < end:
+        n = min(chunk - addr % chunk, end - addr)
+        yield addr, n
+        addr += n
+
+
+class Board:
+    def __init__(self, host, port=PORT, timeout=0.5, retries=5):
+        self.addr = (host, port)
+        self.timeout = timeout
+        self.retries = retries
+        self.tag = int(time.monotonic() * 1000) & 0xFFFF
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+
+    def close(self):
+        self.sock.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def run(self, ops):
+        """Runs one batch, returns a (status, data) pair per operation in order."""
+        self.tag = (self.tag + 1) & 0xFFFF
+        request = struct.pack("<H", self.tag)
+        for kind, addr, arg in ops:
+            if kind == READ:
+                request += struct.pack("<BHH", kind, addr, arg)
+            else:
+                request += struct.pack("<BHH", kind, addr, len(arg)) + bytes(arg)
+
+        for attempt in range(self.retries):
+            self.sock.sendto(request, self.addr)
+            reply = self._reply()
+            if reply is None:
+                continue
+            tag, status, count = struct.unpack_from("<HBB", reply)
+            if status == ERR_BUSY:
+                time.sleep(0.01 * (attempt + 1))
+                continue
+            if count == 0:
+                raise EenetError(STATUS.get(status, "status %d" % status))
+            return self._results(ops, reply)
+        raise EenetError("no reply from %s:%d" % self.addr)
+
+    def _reply(self):
+        deadline = time.monotonic() + self.timeout
+        while True:
+            left = deadline - time.monotonic()
+            if left <= 0:
+                return None
+            self.sock.settimeout(left)
+            try:
+                reply, _ = self.sock.recvfrom(2048)
+            except socket.timeout:
+                return None
+            if len(reply) >= HEADER and struct.unpack_from("<H", reply)[0] == self.tag:
+                return reply                # Anything else answers an earlier retry
+
+    @staticmethod
+    def _results(ops, reply):
+        results, pos = [], HEADER
+        for kind, _, arg in ops:
+            status = reply[pos]
+            pos += 1
+            data = b""
+            if kind == READ and status == OK:
+                data = reply[pos:pos + arg]
+                pos += arg
+            results.append((status, data))
+        return results
+
+    def execute(self, ops, progress=None):
+        results = []
+        for batch in batches(ops):
+            results += self.run(batch)
+            if progress:
+                progress(len(results), len(ops))
+        return results
+
+    def read(self, addr, size, progress=None):
+        ops = [(READ, a, n) for a, n in split(addr, size, READ_CHUNK)]
+        data = b""
+        for (kind, a, n), (status, chunk) in zip(ops, self.execute(ops, progress)):
+            if status != OK:
+                raise EenetError("read 0x%04x: %s" % (a, STATUS.get(status)))
+            data += chunk
+        return data
+
+    def verify(self, pieces, progress=None, writes=()):
+        """Verifies (addr, data) pieces, after any writes. Returns the addresses that did not verify."""
+        ops = list(writes) + [(VERIFY, a, d) for a, d in pieces]
+        results = self.execute(ops, progress)
+        for (kind, a, _), (status, _) in zip(ops, results):
+            if status not in (OK, MISMATCH):
+                raise EenetError("%s 0x%04x: %s" % ("write" if kind == WRITE else "verify", a, STATUS.get(status)))
+        return [a for (kind, a, _), (status, _) in zip(ops, results) if kind == VERIFY and status == MISMATCH]
+
+    def write(self, pieces, progress=None):
+        """Writes (addr, data) pieces and verifies them, sharing batches."""
+        return self.verify(pieces, progress, [(WRITE, a, d) for a, d in pieces])
+
+
+def show_progress(done, total):
+    sys.stderr.write("\r%d/%d" % (done, total))
+    if done == total:
+        sys.stderr.write("\n")
+
+
+def hexdump(data, base):
+    for pos in range(0, len(data), 16):
+        row = data[pos:pos + 16]
+        text = "".join(chr(b) if 32 <= b < 127 else "." for b in row)
+        print("%04x  %-48s %s" % (base + pos, " ".join("%02x" % b for b in row), text))
+
+
+def load(arg):
+    if arg.startswith("@"):
+        with open(arg[1:], "rb") as f:
+            return f.read()
+    return bytes.fromhex(arg)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("host", help="board address")
+    parser.add_argument("--port", type=int, default=PORT)
+    parser.add_argument("--timeout", type=float, default=0.5, help="seconds to wait for each reply")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    read = sub.add_parser("read")
+    read.add_argument("addr", type=lambda s: int(s, 0))
+    read.add_argument("size", type=lambda s: int(s, 0))
+    read.add_argument("-o", "--output", help="write raw bytes here instead of a hex dump")
+
+    write = sub.add_parser("write")
+    write.add_argument("addr", type=lambda s: int(s, 0))
+    write.add_argument("data", help="hex bytes, or @file")
+
+    verify = sub.add_parser("verify")
+    verify.add_argument("addr", type=lambda s: int(s, 0))
+    verify.add_argument("data", help="hex bytes, or @file")
+
+    dump = sub.add_parser("dump", help="read the EEPROM image")
+    dump.add_argument("-o", "--output", required=True)
+
+    flash = sub.add_parser("flash", help="write the pages of an image that differ")
+    flash.add_argument("image")
+    flash.add_argument("--addr", type=lambda s: int(s, 0), default=0)
+
+    args = parser.parse_args()
+
+    try:
+        with Board(args.host, args.port, args.timeout) as board:
+            if args.cmd == "read":
+                data = board.read(args.addr, args.size)
+                if args.output:
+                    with open(args.output, "wb") as f:
+                        f.write(data)
+                else:
+                    hexdump(data, args.addr)
+
+            elif args.cmd in ("write", "verify"):
+                data = load(args.data)
+                pieces = [(a, data[a - args.addr:a - args.addr + n])
+                          for a, n in split(args.addr, len(data), WRITE_CHUNK)]
+                bad = board.write(pieces) if args.cmd == "write" else board.verify(pieces)
+                if bad:
+                    sys.exit("%s: differs at %s" % (args.cmd, ", ".join("0x%04x" % a for a in bad)))
+                print("%d bytes at 0x%04x" % (len(data), args.addr))
+
+            elif args.cmd == "dump":
+                start = time.monotonic()
+                image = board.read(0, EEPROM_SIZE, show_progress)
+                with open(args.output, "wb") as f:
+                    f.write(image)
+                print("%d bytes, %.0f B/s" % (len(image), len(image) / (time.monotonic() - start)))
+
+            elif args.cmd == "flash":
+                with open(args.image, "rb") as f:
+                    image = f.read()
+                if args.addr + len(image) > EEPROM_SIZE:
+                    sys.exit("flash: image runs past the end of the EEPROM")
+                start = time.monotonic()
+                current = board.read(args.addr, len(image))
+                pieces = []
+                for a, n in split(args.addr, len(image), PAGE):
+                    want = image[a - args.addr:a - args.addr + n]
+                    if current[a - args.addr:a - args.addr + n] != want:
+                        pieces.append((a, want))
+                bad = board.write(pieces, show_progress) if pieces else []
+                if bad:
+                    sys.exit("flash: differs at %s" % ", ".join("0x%04x" % a for a in bad))
+                print("%d bytes, %d pages written, %.2f s" % (len(image), len(pieces), time.monotonic() - start))
+    except EenetError as err:
+        sys.exit(str(err))
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
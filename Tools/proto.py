@@ -0,0 +1,536 @@
+#!/usr/bin/env python3
+"""
+Host side of the COBS framed protocol on USART3 (see Core/Inc/proto.h).
+Works on a serial port or on the pty printed by Tools/proto_sim.py.
+
+    Tools/proto.py /dev/ttyACM0 ping
+    Tools/proto.py /dev/ttyACM0 ee-read 0x100 64
+    Tools/proto.py /dev/ttyACM0 ee-write 0x100 deadbeef
+    Tools/proto.py /dev/ttyACM0 dump -o image.bin
+    Tools/proto.py /dev/ttyACM0 flash image.bin
+    Tools/proto.py /dev/ttyACM0 rtc-get
+    Tools/proto.py /dev/ttyACM0 rtc-set now
+    Tools/proto.py /dev/ttyACM0 counters
+    Tools/proto.py /dev/ttyACM0 baud 921600
+    Tools/proto.py /dev/ttyACM0 trace -o trace.bin && Tools/trace_decode.py trace.bin
+"""
+
+import argparse
+import datetime
+import os
+import select
+import struct
+import sys
+import termios
+import time
+import tty
+
+PING = 0x01
+EE_READ = 0x02
+EE_WRITE = 0x03
+TRACE_DRAIN = 0x04
+COUNTERS = 0x05
+RTC_GET = 0x06
+RTC_SET = 0x07
+BAUD = 0x08
+EE_CRC = 0x09
+ERROR = 0x7F
+REPLY = 0x80
+
+MAX_PAYLOAD = 512
+EE_CHUNK = MAX_PAYLOAD - 2
+EEPROM_SIZE = 4096
+EE_WINDOW = 4                           # PROTO_EE_WINDOW
+DUMP_CHUNK = 480                        # Big reads, the serial link is the slower end
+FLASH_CHUNK = 256                       # Whole 32-byte write pages, the write cycles are the slower end
+ERR_BUSY = 4
+
+ERRORS = {1: "unknown type", 2: "bad length", 3: "out of range", 4: "busy", 5: "device error"}
+
+TIME = struct.Struct("<HBBBBBBHH")      # year, month, date, hours, mins, secs, day, subsecs, ticksPerSec
+
+# Counter sections, raw little-endian structs
+SECTIONS = {
+    1: ("serial", "<6IH2x5I", ["written", "dropped", "overwritten", "blocked", "transfers", "dmaErrors",
+                               "highWater", "received", "frames", "rxOverruns", "frameOverruns",
+                               "lineErrors"]),
+    2: ("idle", "<4Q6I", ["runCycles", "pollCycles", "sleepUs", "stopUs", "polls", "sleeps", "stops",
+                          "earlyWakes", "wakeCycles", "wakeCyclesMax"]),
+    3: ("persist", "<6I", ["source", "sequence", "writes", "spills", "brownouts", "spillErrors"]),
+    4: ("trace", "<3I", ["recorded", "dropped", "drained"]),
+    5: ("proto", "<5I", ["frames", "crcErrors", "overflows", "sent", "unsent"]),
+}
+
+TRACE_RECORD = 16
+SYNC = struct.Struct("<IBBBBII")
+SYNC_EVENT = 0xFF
+SYNC_MAGIC = 0x31435254
+
+BAUDS = {rate: getattr(termios, "B%d" % rate) for rate in
+         (9600, 19200, 38400, 57600, 115200, 230400, 460800, 500000, 576000, 921600,
+          1000000, 1152000, 1500000, 2000000, 2500000, 3000000, 3500000, 4000000)
+         if hasattr(termios, "B%d" % rate)}
+
+
+class ProtoError(Exception):
+    pass
+
+
+def crc16(data, crc=0xFFFF):
+    """CRC16-CCITT-FALSE, as crc.c."""
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = (crc << 1) ^ 0x1021 if crc & 0x8000 else crc << 1
+        crc &= 0xFFFF
+    return crc
+
+
+def cobs_encode(data):
+    out = bytearray()
+    pos = 0
+    while True:
+        end = pos
+        while end < len(data) and end - pos < 254 and data[end] != 0:
+            end += 1
+        out.append(end - pos + 1)
+        out += data[pos:end]
+        if end < len(data) and data[end] == 0:
+            pos = end + 1
+        elif end - pos == 254:
+            pos = end
+        else:
+            return bytes(out)
+
+
+def cobs_decode(data):
+    out = bytearray()
+    pos = 0
+    while pos < len(data):
+        code = data[pos]
+        if code == 0 or pos + code > len(data):
+            raise ProtoError("bad COBS block")
+        out += data[pos + 1:pos + code]
+        pos += code
+        if code != 0xFF and pos < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def encode_frame(msg_type, seq, payload=b""):
+    body = bytes([msg_type, seq]) + bytes(payload)
+    crc = crc16(body)
+    return b"\x00" + cobs_encode(body + bytes([crc >> 8, crc & 0xFF])) + b"\x00"
+
+
+def decode_frame(encoded):
+    """Returns (type, seq, payload) or raises ProtoError."""
+    body = cobs_decode(encoded)
+    if len(body) < 4:
+        raise ProtoError("short frame")
+    if crc16(body[:-2]) != (body[-2] << 8 | body[-1]):
+        raise ProtoError("CRC mismatch")
+    return body[0], body[1], body[2:-2]
+
+
+class Demux:
+    """Splits a byte stream into text and frames, like PROTO_rx()."""
+
+    def __init__(self):
+        self.in_frame = False
+        self.buf = bytearray()
+
+    def feed(self, data):
+        """Yields ("text", bytes) and ("frame", encoded bytes)."""
+        while data:
+            idx = data.find(b"\x00")
+            chunk = data if idx < 0 else data[:idx]
+            if self.in_frame:
+                self.buf += chunk
+            elif chunk:
+                yield "text", bytes(chunk)
+            if idx < 0:
+                return
+            data = data[idx + 1:]
+
+            if not self.in_frame:
+                self.in_frame = True
+            elif self.buf:
+                yield "frame", bytes(self.buf)
+                self.buf.clear()
+                self.in_frame = False
+
+
+class Link:
+    """Requests over a tty, one at a time or pipelined. Text the board prints goes to on_text."""
+
+    def __init__(self, path, baud=115200, timeout=1.0, on_text=None):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        self.timeout = timeout
+        self.on_text = on_text if on_text is not None else lambda text: None
+        self.demux = Demux()
+        self.pending = []
+        self.seq = 0
+        self.baud = None
+        self.bad_frames = 0
+        if os.isatty(self.fd):
+            tty.setraw(self.fd)
+            self._set_line(baud)
+
+    def close(self):
+        os.close(self.fd)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def _set_line(self, baud):
+        if baud not in BAUDS:
+            raise ProtoError("host has no termios rate for %d" % baud)
+        attrs = termios.tcgetattr(self.fd)
+        attrs[4] = attrs[5] = BAUDS[baud]
+        termios.tcsetattr(self.fd, termios.TCSADRAIN, attrs)
+        self.baud = baud
+
+    def send(self, msg_type, payload=b""):
+        self.seq = (self.seq + 1) & 0xFF
+        os.write(self.fd, encode_frame(msg_type, self.seq, payload))
+        return self.seq
+
+    def _next_frame(self, deadline):
+        """Returns the next decoded frame, or None once the deadline passes."""
+        while not self.pending:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                return None
+            ready, _, _ = select.select([self.fd], [], [], remaining)
+            if not ready:
+                return None
+            for kind, data in self.demux.feed(os.read(self.fd, 4096)):
+                if kind == "text":
+                    self.on_text(data)
+                    continue
+                try:
+                    self.pending.append(decode_frame(data))
+                except ProtoError:
+                    self.bad_frames += 1
+        return self.pending.pop(0)
+
+    def _frames(self, deadline):
+        """Yields decoded frames until the deadline passes."""
+        while True:
+            frame = self._next_frame(deadline)
+            if frame is None:
+                return
+            yield frame
+
+    def request(self, msg_type, payload=b""):
+        """Sends a request and returns the payload of its reply."""
+        seq = self.send(msg_type, payload)
+        return self.wait_reply(msg_type, seq)
+
+    def wait_reply(self, msg_type, seq, timeout=None):
+        deadline = time.monotonic() + (self.timeout if timeout is None else timeout)
+        for reply_type, reply_seq, payload in self._frames(deadline):
+            if reply_seq != seq:
+                continue                # Late reply to an earlier request
+            if reply_type == ERROR | REPLY:
+                raise ProtoError("%s: %s" % (type_name(payload[0]), ERRORS.get(payload[1], payload[1])))
+            if reply_type == msg_type | REPLY:
+                return payload
+        raise ProtoError("%s: no reply" % type_name(msg_type))
+
+    def pipeline(self, requests, window=EE_WINDOW, progress=None):
+        """
+        Sends (type, payload) requests keeping up to window of them in flight,
+        so each crosses the link while the board works on the ones before.
+        Returns the reply payloads in request order. Requests the board turns
+        away as busy go again once a slot frees up.
+        """
+        requests = list(requests)
+        replies = [None] * len(requests)
+        queue = list(range(len(requests)))
+        in_flight = {}
+        done = 0
+
+        while queue or in_flight:
+            while queue and len(in_flight) < window:
+                index = queue.pop(0)
+                in_flight[self.send(*requests[index])] = index
+
+            frame = self._next_frame(time.monotonic() + self.timeout)
+            if frame is None:
+                raise ProtoError("%s: no reply with %d in flight" % (type_name(requests[0][0]), len(in_flight)))
+            reply_type, seq, payload = frame
+            index = in_flight.pop(seq, None)
+            if index is None:
+                continue                # Late reply to an earlier request
+
+            if reply_type == ERROR | REPLY:
+                if payload[1] == ERR_BUSY:
+                    queue.insert(0, index)
+                    window = max(1, len(in_flight))     # The board has fewer slots than asked for
+                    continue
+                raise ProtoError("%s: %s" % (type_name(payload[0]), ERRORS.get(payload[1], payload[1])))
+            replies[index] = payload
+            done += 1
+            if progress is not None:
+                progress(done, len(requests))
+        return replies
+
+    def ee_crc(self, addr, size):
+        return struct.unpack("<H", self.request(EE_CRC, struct.pack("<HH", addr, size)))[0]
+
+    def dump(self, addr=0, size=EEPROM_SIZE, window=EE_WINDOW, chunk=DUMP_CHUNK, progress=None):
+        """Reads a range in pipelined chunks, then checks it against the board's own CRC."""
+        chunk = min(chunk, EE_CHUNK)
+        starts = range(addr, addr + size, chunk)
+        requests = [(EE_READ, struct.pack("<HH", start, min(chunk, addr + size - start))) for start in starts]
+        image = b"".join(reply[2:] for reply in self.pipeline(requests, window, progress))
+        if self.ee_crc(addr, size) != crc16(image):
+            raise ProtoError("dump: CRC differs from the EEPROM's")
+        return image
+
+    def flash(self, addr, image, window=EE_WINDOW, chunk=FLASH_CHUNK, progress=None):
+        """Writes an image in pipelined chunks, then checks the EEPROM's CRC against it."""
+        chunk = min(chunk, EE_CHUNK)
+        requests = [(EE_WRITE, struct.pack("<H", addr + pos) + image[pos:pos + chunk])
+                    for pos in range(0, len(image), chunk)]
+        self.pipeline(requests, window, progress)
+        if self.ee_crc(addr, len(image)) != crc16(image):
+            raise ProtoError("flash: CRC of the EEPROM differs from the image")
+
+    def ping(self, payload=b"ping"):
+        start = time.monotonic()
+        if self.request(PING, payload) != payload:
+            raise ProtoError("ping: echo mismatch")
+        return time.monotonic() - start
+
+    def ee_read(self, addr, size):
+        data = bytearray()
+        while size > 0:
+            chunk = min(size, EE_CHUNK)
+            reply = self.request(EE_READ, struct.pack("<HH", addr, chunk))
+            if struct.unpack_from("<H", reply)[0] != addr or len(reply) != chunk + 2:
+                raise ProtoError("ee-read: reply for the wrong range")
+            data += reply[2:]
+            addr += chunk
+            size -= chunk
+        return bytes(data)
+
+    def ee_write(self, addr, data):
+        for pos in range(0, len(data), EE_CHUNK):
+            chunk = data[pos:pos + EE_CHUNK]
+            self.request(EE_WRITE, struct.pack("<H", addr + pos) + chunk)
+
+    def rtc_get(self):
+        """Returns (UTC datetime, sub-second ticks, ticks per second)."""
+        year, month, date, hours, mins, secs, day, subsecs, per_sec = TIME.unpack(self.request(RTC_GET))
+        return datetime.datetime(year, month, date, hours, mins, secs, tzinfo=datetime.timezone.utc), subsecs, per_sec
+
+    def rtc_set(self, when):
+        """Sets the RTC, which keeps UTC. A naive datetime is taken as UTC."""
+        if when.tzinfo is not None:
+            when = when.astimezone(datetime.timezone.utc)
+        self.request(RTC_SET, TIME.pack(when.year, when.month, when.day, when.hour, when.minute,
+                                        when.second, when.weekday(), 0, 0))
+
+    def counters(self):
+        reply = self.request(COUNTERS)
+        result = {}
+        pos = 0
+        while pos + 2 <= len(reply):
+            section, size = reply[pos], reply[pos + 1]
+            raw = reply[pos + 2:pos + 2 + size]
+            pos += 2 + size
+            if section not in SECTIONS or struct.calcsize(SECTIONS[section][1]) != size:
+                result["section%d" % section] = raw.hex()
+                continue
+            name, fmt, fields = SECTIONS[section]
+            result[name] = dict(zip(fields, struct.unpack(fmt, raw)))
+        return result
+
+    def set_baud(self, baud):
+        """Switches both ends, then confirms with a ping before the board reverts."""
+        error_ppm = struct.unpack("<i", self.request(BAUD, struct.pack("<I", baud)))[0]
+        time.sleep(0.05)                # Let the board finish its own switch
+        self._set_line(baud)
+        self.ping()
+        return error_ppm
+
+    def trace(self, batch=0, timeout=None):
+        """Drains the trace ring once, returning raw records."""
+        seq = self.send(TRACE_DRAIN, struct.pack("<H", batch))
+        records = bytearray()
+        while True:
+            chunk = self.wait_reply(TRACE_DRAIN, seq, timeout)
+            if not chunk:
+                return bytes(records)
+            records += chunk
+
+
+def type_name(msg_type):
+    names = {PING: "ping", EE_READ: "ee-read", EE_WRITE: "ee-write", TRACE_DRAIN: "trace",
+             COUNTERS: "counters", RTC_GET: "rtc-get", RTC_SET: "rtc-set", BAUD: "baud", EE_CRC: "ee-crc"}
+    return names.get(msg_type & ~REPLY, "type 0x%02x" % msg_type)
+
+
+def with_sync(records, hz):
+    """Prefixes a sync record so Tools/trace_decode.py locks on at the start."""
+    if not records:
+        return records
+    first = struct.unpack_from("<I", records)[0]
+    return SYNC.pack(first, SYNC_EVENT, 0, ord("M"), 0, SYNC_MAGIC, hz) + records
+
+
+def show_progress(done, total):
+    sys.stderr.write("\r%d/%d" % (done, total))
+    if done == total:
+        sys.stderr.write("\n")
+
+
+def hexdump(data, base):
+    for pos in range(0, len(data), 16):
+        row = data[pos:pos + 16]
+        text = "".join(chr(b) if 32 <= b < 127 else "." for b in row)
+        print("%04x  %-48s %s" % (base + pos, " ".join("%02x" % b for b in row), text))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("port", help="serial device or simulator pty")
+    parser.add_argument("--baud", type=int, default=115200, help="current line rate")
+    parser.add_argument("--timeout", type=float, default=1.0, help="seconds to wait for each reply")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    ping = sub.add_parser("ping")
+    ping.add_argument("-n", "--count", type=int, default=1)
+    ping.add_argument("-s", "--size", type=int, default=32, help="payload bytes, up to %d" % MAX_PAYLOAD)
+
+    read = sub.add_parser("ee-read")
+    read.add_argument("addr", type=lambda s: int(s, 0))
+    read.add_argument("size", type=lambda s: int(s, 0))
+    read.add_argument("-o", "--output", help="write raw bytes here instead of a hex dump")
+
+    write = sub.add_parser("ee-write")
+    write.add_argument("addr", type=lambda s: int(s, 0))
+    write.add_argument("data", help="hex bytes, or @file")
+
+    dump = sub.add_parser("dump", help="read the EEPROM image")
+    dump.add_argument("-o", "--output", required=True)
+    dump.add_argument("--addr", type=lambda s: int(s, 0), default=0)
+    dump.add_argument("--size", type=lambda s: int(s, 0), default=EEPROM_SIZE)
+    dump.add_argument("--window", type=int, default=EE_WINDOW, help="requests in flight")
+    dump.add_argument("--chunk", type=int, default=DUMP_CHUNK, help="bytes per request, up to %d" % EE_CHUNK)
+
+    flash = sub.add_parser("flash", help="write an EEPROM image")
+    flash.add_argument("image")
+    flash.add_argument("--addr", type=lambda s: int(s, 0), default=0)
+    flash.add_argument("--window", type=int, default=EE_WINDOW, help="requests in flight")
+    flash.add_argument("--chunk", type=int, default=FLASH_CHUNK, help="bytes per request, up to %d" % EE_CHUNK)
+
+    sub.add_parser("rtc-get")
+    rtc_set = sub.add_parser("rtc-set")
+    rtc_set.add_argument("when", help="now, or YYYY-MM-DDTHH:MM:SS in UTC unless it has an offset")
+
+    sub.add_parser("counters")
+
+    baud = sub.add_parser("baud")
+    baud.add_argument("rate", type=int)
+
+    trace = sub.add_parser("trace")
+    trace.add_argument("-o", "--output", required=True, help="raw records, for Tools/trace_decode.py")
+    trace.add_argument("--batch", type=int, default=0, help="records per frame, 0 for the board's default")
+    trace.add_argument("--hz", type=int, default=168000000, help="core clock, for the sync record")
+    trace.add_argument("--follow", action="store_true", help="keep draining until interrupted")
+
+    args = parser.parse_args()
+    echo = lambda text: sys.stdout.write(text.decode(errors="replace"))
+
+    try:
+        with Link(args.port, args.baud, args.timeout, echo) as link:
+            if args.cmd == "ping":
+                payload = bytes((i * 7 + 1) & 0xFF for i in range(args.size))
+                for _ in range(args.count):
+                    print("%d bytes: %.2f ms" % (args.size, link.ping(payload) * 1e3))
+
+            elif args.cmd == "ee-read":
+                data = link.ee_read(args.addr, args.size)
+                if args.output:
+                    with open(args.output, "wb") as f:
+                        f.write(data)
+                else:
+                    hexdump(data, args.addr)
+
+            elif args.cmd == "ee-write":
+                if args.data.startswith("@"):
+                    with open(args.data[1:], "rb") as f:
+                        data = f.read()
+                else:
+                    data = bytes.fromhex(args.data)
+                link.ee_write(args.addr, data)
+                if link.ee_read(args.addr, len(data)) != data:
+                    sys.exit("ee-write: read back differs")
+                print("%d bytes at 0x%04x" % (len(data), args.addr))
+
+            elif args.cmd == "dump":
+                start = time.monotonic()
+                image = link.dump(args.addr, args.size, args.window, args.chunk, show_progress)
+                with open(args.output, "wb") as f:
+                    f.write(image)
+                elapsed = time.monotonic() - start
+                print("%d bytes, CRC %04x, %.0f B/s" % (len(image), crc16(image), len(image) / elapsed))
+
+            elif args.cmd == "flash":
+                with open(args.image, "rb") as f:
+                    image = f.read()
+                if args.addr + len(image) > EEPROM_SIZE:
+                    sys.exit("flash: image runs past the end of the EEPROM")
+                start = time.monotonic()
+                link.flash(args.addr, image, args.window, args.chunk, show_progress)
+                elapsed = time.monotonic() - start
+                print("%d bytes, CRC %04x verified, %.0f B/s" % (len(image), crc16(image), len(image) / elapsed))
+
+            elif args.cmd == "rtc-get":
+                when, subsecs, per_sec = link.rtc_get()
+                print("%s + %d/%d s" % (when.isoformat(), subsecs, per_sec))
+
+            elif args.cmd == "rtc-set":
+                when = (datetime.datetime.now(datetime.timezone.utc) if args.when == "now"
+                        else datetime.datetime.fromisoformat(args.when))
+                link.rtc_set(when)
+                print(link.rtc_get()[0].isoformat())
+
+            elif args.cmd == "counters":
+                for name, fields in link.counters().items():
+                    print(name)
+                    for field, value in (fields.items() if isinstance(fields, dict) else [("raw", fields)]):
+                        print("  %-16s %s" % (field, value))
+
+            elif args.cmd == "baud":
+                print("%d baud, %+d ppm" % (args.rate, link.set_baud(args.rate)))
+
+            elif args.cmd == "trace":
+                total = 0
+                with open(args.output, "wb") as f:
+                    first = True
+                    while True:
+                        records = link.trace(args.batch)
+                        f.write(with_sync(records, args.hz) if first and records else records)
+                        first = first and not records
+                        total += len(records) // TRACE_RECORD
+                        if not args.follow:
+                            break
+                        if not records:
+                            time.sleep(0.1)
+                print("%d records" % total, file=sys.stderr)
+    except ProtoError as err:
+        sys.exit(str(err))
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+"""
+Simulates the board's side of the USART3 protocol on a pty, for working on
+host tools without hardware. Prints the pty path to hand to Tools/proto.py.
+
+    Tools/proto_sim.py &
+    Tools/proto.py /dev/pts/5 counters
+"""
+
+import argparse
+import datetime
+import os
+import pty
+import select
+import struct
+import sys
+import time
+import tty
+
+from proto import (BAUD, COUNTERS, EE_CRC, EE_READ, EE_WRITE, EEPROM_SIZE, ERROR, MAX_PAYLOAD, PING, REPLY,
+                   RTC_GET, RTC_SET, SECTIONS, TIME, TRACE_DRAIN, TRACE_RECORD, Demux, ProtoError, crc16,
+                   decode_frame, encode_frame)
+
+TICKS_PER_SEC = 8192
+TRACE_BATCH = 32
+TRACE_RECORDS = 2048
+HZ = 168000000
+
+ERR_TYPE, ERR_LENGTH, ERR_RANGE, ERR_BUSY, ERR_DEVICE = range(1, 6)
+
+RECORD = struct.Struct("<IBBBBII")
+
+
+class Board:
+    def __init__(self, fd, text_echo):
+        self.fd = fd
+        self.text_echo = text_echo
+        self.demux = Demux()
+        self.eeprom = bytearray(b"\xff" * EEPROM_SIZE)
+        self.rtc_offset = datetime.timedelta()
+        self.start = time.monotonic()
+        self.trace = []
+        self.trace_head = 0
+        self.stats = {name: [0] * len(fields) for name, _, fields in SECTIONS.values()}
+
+    def cycles(self):
+        return int((time.monotonic() - self.start) * HZ) & 0xFFFFFFFF
+
+    def record(self, event, phase, arg0=0, arg1=0):
+        if len(self.trace) < TRACE_RECORDS:
+            self.trace.append(RECORD.pack(self.cycles(), event, 0, ord(phase),
+                                          self.trace_head // TRACE_RECORDS + 1, arg0, arg1))
+            self.trace_head += 1
+            self.stats["trace"][0] += 1
+        else:
+            self.stats["trace"][1] += 1
+
+    def send(self, msg_type, seq, payload=b""):
+        os.write(self.fd, encode_frame(msg_type, seq, payload))
+        self.stats["proto"][3] += 1
+
+    def error(self, msg_type, seq, code):
+        self.send(ERROR | REPLY, seq, bytes([msg_type, code]))
+
+    def handle(self, msg_type, seq, payload):
+        self.record(0, "B")             # MAIN_LOOP, as the firmware's loop would
+        if msg_type == PING:
+            self.send(PING | REPLY, seq, payload)
+
+        elif msg_type in (EE_READ, EE_WRITE, EE_CRC):
+            if (msg_type != EE_WRITE and len(payload) != 4) or (msg_type == EE_WRITE and len(payload) < 3):
+                return self.error(msg_type, seq, ERR_LENGTH)
+            addr = struct.unpack_from("<H", payload)[0]
+            size = struct.unpack_from("<H", payload, 2)[0] if msg_type != EE_WRITE else len(payload) - 2
+            if size == 0 or (msg_type != EE_CRC and size > MAX_PAYLOAD - 2) or addr + size > EEPROM_SIZE:
+                return self.error(msg_type, seq, ERR_RANGE)
+            self.record(2, "B", addr, size)         # EEPROM_PAGE
+            if msg_type == EE_READ:
+                self.send(EE_READ | REPLY, seq, struct.pack("<H", addr) + self.eeprom[addr:addr + size])
+            elif msg_type == EE_CRC:
+                self.send(EE_CRC | REPLY, seq, struct.pack("<H", crc16(self.eeprom[addr:addr + size])))
+            else:
+                self.eeprom[addr:addr + size] = payload[2:]
+                self.send(EE_WRITE | REPLY, seq)
+            self.record(2, "E", addr, size)
+
+        elif msg_type == TRACE_DRAIN:
+            if len(payload) != 2:
+                return self.error(msg_type, seq, ERR_LENGTH)
+            batch = struct.unpack("<H", payload)[0]
+            if batch == 0 or batch > MAX_PAYLOAD // TRACE_RECORD:
+                batch = TRACE_BATCH
+            while self.trace:
+                chunk, self.trace = self.trace[:batch], self.trace[batch:]
+                self.send(TRACE_DRAIN | REPLY, seq, b"".join(chunk))
+                self.stats["trace"][2] += len(chunk)
+            self.send(TRACE_DRAIN | REPLY, seq)
+
+        elif msg_type == COUNTERS:
+            out = bytearray()
+            for section, (name, fmt, _) in SECTIONS.items():
+                raw = struct.pack(fmt, *self.stats[name])
+                out += bytes([section, len(raw)]) + raw
+            self.send(COUNTERS | REPLY, seq, out)
+
+        elif msg_type == RTC_GET:
+            now = datetime.datetime.now() + self.rtc_offset
+            self.send(RTC_GET | REPLY, seq, TIME.pack(now.year, now.month, now.day, now.hour, now.minute,
+                                                      now.second, now.weekday(),
+                                                      now.microsecond * TICKS_PER_SEC // 1000000,
+                                                      TICKS_PER_SEC))
+
+        elif msg_type == RTC_SET:
+            if len(payload) != TIME.size:
+                return self.error(msg_type, seq, ERR_LENGTH)
+            year, month, date, hours, mins, secs, day, _, _ = TIME.unpack(payload)
+            try:
+                when = datetime.datetime(year, month, date, hours, mins, secs)
+            except ValueError:
+                return self.error(msg_type, seq, ERR_RANGE)
+            self.rtc_offset = when - datetime.datetime.now()
+            self.send(RTC_SET | REPLY, seq)
+
+        elif msg_type == BAUD:
+            if len(payload) != 4:
+                return self.error(msg_type, seq, ERR_LENGTH)
+            baud = struct.unpack("<I", payload)[0]
+            if not 1200 <= baud <= 5250000:
+                return self.error(msg_type, seq, ERR_RANGE)
+            self.send(BAUD | REPLY, seq, struct.pack("<i", 0))    # A pty has no rate to get wrong
+
+        else:
+            self.error(msg_type, seq, ERR_TYPE)
+        self.record(0, "E")
+
+    def feed(self, data):
+        self.stats["serial"][7] += len(data)
+        for kind, chunk in self.demux.feed(data):
+            if kind == "text":
+                if self.text_echo:
+                    os.write(self.fd, chunk)
+                continue
+            try:
+                msg_type, seq, payload = decode_frame(chunk)
+            except ProtoError:
+                self.stats["proto"][1] += 1
+                continue
+            self.stats["proto"][0] += 1
+            self.stats["serial"][8] += 1
+            self.handle(msg_type, seq, payload)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--eeprom", help="image file to load, and save back on exit")
+    parser.add_argument("--echo", action="store_true", help="echo text typed outside frames")
+    args = parser.parse_args()
+
+    master, slave = pty.openpty()
+    tty.setraw(slave)
+    board = Board(master, args.echo)
+    if args.eeprom and os.path.exists(args.eeprom):
+        with open(args.eeprom, "rb") as f:
+            image = f.read(EEPROM_SIZE)
+        board.eeprom[:len(image)] = image
+    print(os.ttyname(slave), flush=True)
+
+    try:
+        while True:
+            ready, _, _ = select.select([master], [], [], 0.5)
+            if ready:
+                try:
+                    board.feed(os.read(master, 4096))
+                except OSError:
+                    time.sleep(0.1)     # No client has the pty open
+            else:
+                board.record(1, "i")    # IDLE, keeps the trace moving
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if args.eeprom:
+            with open(args.eeprom, "wb") as f:
+                f.write(board.eeprom)
+
+
+if __name__ == "__main__":
+    main()
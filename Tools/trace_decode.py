@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+"""
+Decodes the binary event trace drained from the board (see Core/Inc/trace.h)
+into Chrome trace JSON, viewable in chrome://tracing or ui.perfetto.dev. The
+ring leaves the board in COBS frames, Tools/proto.py unwraps them:
+
+    Tools/proto.py /dev/ttyACM0 trace -o trace.bin
+    Tools/trace_decode.py trace.bin -o trace.json
+"""
+
+import argparse
+import json
+import os
+import re
+import struct
+import sys
+
+RECORD = struct.Struct("<IBBBBII")      # cycles, event, context, phase, lap, arg0, arg1
+SYNC_EVENT = 0xFF
+SYNC_MAGIC = 0x31435254
+DEFAULT_HEADER = os.path.join(os.path.dirname(__file__), "..", "Core", "Inc", "trace.h")
+
+
+def load_events(header):
+    """Event names in enum order, read from the TRACE_EVENTS X-macro."""
+    with open(header) as f:
+        text = f.read()
+    block = re.search(r"#define\s+TRACE_EVENTS\(X\)(.*?)\n\s*\n", text, re.S)
+    if block is None:
+        sys.exit("TRACE_EVENTS not found in " + header)
+    return re.findall(r"X\((\w+)\)", block.group(1))
+
+
+def is_sync(data, offset):
+    cycles, event, context, phase, lap, arg0, arg1 = RECORD.unpack_from(data, offset)
+    return event == SYNC_EVENT and arg0 == SYNC_MAGIC and arg1 != 0
+
+
+def records(data, event_count):
+    """Yields (record tuple, is_sync), resynchronising on sync records after garbage."""
+    offset = 0
+    synced = False
+    while offset + RECORD.size <= len(data):
+        if not synced:
+            if is_sync(data, offset):
+                synced = True
+            else:
+                offset += 1
+                continue
+
+        rec = RECORD.unpack_from(data, offset)
+        event, phase = rec[1], rec[3]
+        if rec[1] == SYNC_EVENT:
+            if not is_sync(data, offset):
+                synced = False
+                continue
+            yield rec, True
+        elif event < event_count and chr(phase) in "BEiC":
+            yield rec, False
+        else:
+            # Lost bytes on the link, skip ahead to the next sync record
+            synced = False
+            offset += 1
+            continue
+        offset += RECORD.size
+
+
+def context_name(context):
+    return "thread" if context == 0 else "exception %d (IRQ %d)" % (context, context - 16)
+
+
+def decode(data, names, default_hz):
+    events = []
+    hz = default_hz
+    last = None
+    cycles64 = 0
+    contexts = set()
+
+    for (cycles, event, context, phase, lap, arg0, arg1), sync in records(data, len(names)):
+        # Unwrap the 32-bit counter. Deltas are signed, since an interrupt can
+        # commit a record stamped just before the one it preempted.
+        if last is not None:
+            delta = (cycles - last) & 0xFFFFFFFF
+            if delta >= 1 << 31:
+                delta -= 1 << 32
+            cycles64 += delta
+        last = cycles
+
+        if sync:
+            hz = arg1
+            continue
+
+        ts = cycles64 * 1e6 / hz
+        name = names[event]
+        ph = chr(phase)
+        contexts.add(context)
+
+        entry = {"name": name, "ph": ph, "ts": ts, "pid": 1, "tid": context}
+        if ph == "C":
+            entry["args"] = {name: arg0}
+        else:
+            entry["args"] = {"arg0": arg0, "arg1": arg1}
+            if ph == "i":
+                entry["s"] = "t"
+        events.append(entry)
+
+    for context in sorted(contexts):
+        events.append({"name": "thread_name", "ph": "M", "pid": 1, "tid": context,
+                       "args": {"name": context_name(context)}})
+
+    # Begin/end pairs must be in time order per thread for the viewers
+    events.sort(key=lambda e: e.get("ts", -1))
+    return {"traceEvents": events, "displayTimeUnit": "ns"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("input", help="captured trace bytes, - for stdin")
+    parser.add_argument("-o", "--output", help="JSON output file, default stdout")
+    parser.add_argument("--header", default=DEFAULT_HEADER, help="trace.h to read event names from")
+    parser.add_argument("--hz", type=int, default=168000000, help="core clock until the first sync record")
+    args = parser.parse_args()
+
+    names = load_events(args.header)
+    if args.input == "-":
+        data = sys.stdin.buffer.read()
+    else:
+        with open(args.input, "rb") as f:
+            data = f.read()
+
+    trace = decode(data, names, args.hz)
+    out = open(args.output, "w") if args.output else sys.stdout
+    json.dump(trace, out, indent=1)
+    out.write("\n")
+    if args.output:
+        out.close()
+    print("%d events" % sum(1 for e in trace["traceEvents"] if e["ph"] != "M"), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()